@@ -33,6 +33,7 @@
 /* Xenomai task variables */
 #define STACK_SIZE 8192
 #define MS_PRIO 5
+#define LEDS_PRIO 1
 
 #include "gpio.h"
 #include "platform_io.h"
@@ -51,12 +52,17 @@ int lcd_pipe;
 
 void blink( uint8_t val, long int time)
 {
-    // Blinking to show the user the Buttons that should press
-    pio_write_ledspos(val);    
-    __usleep(time); 
-    pio_write_ledspos(0x00);    
-    __usleep(time); 
-    pio_write_ledspos(val);    
+    // Blinking to show the user the Buttons that should press: on, off and on again. The LED engine does the timing
+    pio_led_set_mask(~(val << GENERAL_OUTPUTS_LEDPOS_SHIFT) & GENERAL_OUTPUTS_LEDPOS_MASK, PIO_LED_OFF);
+    pio_led_set_mask_once(val << GENERAL_OUTPUTS_LEDPOS_SHIFT, PIO_LED_PATTERN(0x5, 3, time / 1000));
+}
+
+void leds_off()
+{
+    // Stopped first: a tick still running would overwrite the write
+    pio_leds_stop();
+    pio_led_set_mask(GENERAL_OUTPUTS_LEDPOS_MASK, PIO_LED_NONE);
+    pio_write_ledspos(0x00);
 }
 
 void main_task(void* cookie)
@@ -77,6 +83,11 @@ void main_task(void* cookie)
 	util_pdbg(DBG_CRIT, "GPIO devices could not be correctly initialized\n");	    
 	exit(err);
     }
+
+    if( (err = pio_leds_start(LEDS_PRIO)) < 0 ) {
+	util_pdbg(DBG_CRIT, "LED engine could not be started\n");	    
+	exit(err);
+    }
     
     write(lcd_pipe, "Select mode:    Press left/right", 32);
 
@@ -90,20 +101,24 @@ void main_task(void* cookie)
 	pio_read_buttons(&but);
         switch(but) {
             case 0x02: // right
-		write(lcd_pipe, "Pres center!    Dev mode ON     ", 32);
-                sel_flag = 1;
-		blink(0x01, 125000);
+		if( sel_flag != 1 ){
+		    write(lcd_pipe, "Pres center!    Dev mode ON     ", 32);
+		    sel_flag = 1;
+		    blink(0x01, 125000);
+		}
                 break;
 
             case 0x08: // left 
-		write(lcd_pipe, "Pres center!    Exec mode ON    ", 32);
-                sel_flag = 2;
-		blink(0x01, 125000);
+		if( sel_flag != 2 ){
+		    write(lcd_pipe, "Pres center!    Exec mode ON    ", 32);
+		    sel_flag = 2;
+		    blink(0x01, 125000);
+		}
                 break;
 
             case 0x01:
                 if(sel_flag){
-                    pio_write_ledspos(0x00);
+                    leds_off();
 		    write(lcd_pipe, "Mode Selected  ", 16);
                     printf("Mode flag %d selected.\n",sel_flag);
                     exit(sel_flag);
@@ -115,7 +130,7 @@ void main_task(void* cookie)
 	__msleep(10);
     }
 
-    pio_write_ledspos(0x00);
+    leds_off();
     exit(-1);
 }
 
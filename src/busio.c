@@ -38,7 +38,14 @@
 #include <unistd.h>
 #include <sys/mman.h>
 #include <errno.h> 
+#include <pthread.h>
+//Xenomai
+#include <native/task.h>
+#include <native/timer.h>
+//--
  
+#include "busio.h"
+#include "busio_sim.h"
 #include "util.h"
 
 #ifdef __PPC__
@@ -54,18 +61,74 @@ extern inline void out_8(volatile unsigned char *addr, unsigned val)
 }
 #endif
 
+/* Bus windows. Peripherals falling inside one of these are served from a single mapping */
+static const unsigned long busio_windows[][2] = {
+    { BUSIO_WINDOW_GPIO_BASE, BUSIO_WINDOW_GPIO_END },
+};
+
+static BUSIO_REGION busio_regions[BUSIO_MAX_REGIONS]; ///< Region registry. Empty slots have refcount == 0
+static pthread_mutex_t busio_lock = PTHREAD_MUTEX_INITIALIZER; ///< Protects the registry and the backend selection
+static int busio_mem_fd = -1; ///< Shared file descriptor for /dev/mem
+static const BUSIO_BACKEND* busio_backend = NULL; ///< Active backend. Chosen on the first mapping if not set
+static int busio_backend_opened = 0; ///< Backend open() has been called
+
+int busio_hooked = 0;
+
 /**
-* @brief Remaps a physical address into the virtual memory
+* @brief Opens /dev/mem if it is not opened yet
 *
-* @param physaddr Physical base address of the peripheral mappable from the system bus
+* @return 0 on success. Otherwise error.
+*
+* The descriptor is shared by every mapping and only closed when the last region is released.
+*
+*/
+
+static int busio_mem_open()
+{
+    /*
+     * Don't forget O_SYNC, esp. if address is in RAM region.
+     * Note: if you do know you'll access in Read Only mode,
+     *    pass O_RDONLY to open, and PROT_READ only to mmap
+     */
+    if (busio_mem_fd == -1) {
+        busio_mem_fd = open("/dev/mem", O_RDWR|O_SYNC);
+        if (busio_mem_fd < 0) {
+                util_pdbg(DBG_WARN, "ioremap: can't open /dev/mem\n");
+                return -ENODEV;
+        }
+    }
+
+    return 0;
+}
+
+/**
+* @brief Closes /dev/mem 
+*
+*/
+
+static void busio_mem_close()
+{
+    if( busio_mem_fd >= 0 ){
+	close(busio_mem_fd);
+	busio_mem_fd = -1;
+    }
+}
+
+/**
+* @brief Maps a physical range from a memory file descriptor
+*
+* @param fd File descriptor ( /dev/mem or a simulated memory file )
+* @param physaddr Physical base address, used as offset into fd
 * @param size Addresable memory size
-* @return Pointer to the virtual memory address
+* @return Pointer to the virtual memory address or NULL on error
+*
 */
-volatile void* ioremap(unsigned long physaddr, unsigned size)
+
+volatile void* busio_mmap(int fd, unsigned long physaddr, unsigned size)
 {
-    static int axs_mem_fd = -1;
     unsigned long page_addr, ofs_addr, reg, pgmask;
     void* reg_mem = NULL;
+    int flags = MAP_SHARED;
 
     /*
      * looks like mmap wants aligned addresses?
@@ -74,32 +137,22 @@ volatile void* ioremap(unsigned long physaddr, unsigned size)
     page_addr = physaddr & ~pgmask;
     ofs_addr  = physaddr & pgmask;
 
-    /*
-     * Don't forget O_SYNC, esp. if address is in RAM region.
-     * Note: if you do know you'll access in Read Only mode,
-     *    pass O_RDONLY to open, and PROT_READ only to mmap
-     */
-    if (axs_mem_fd == -1) {
-        axs_mem_fd = open("/dev/mem", O_RDWR|O_SYNC);
-        if (axs_mem_fd < 0) {
-                util_pdbg(DBG_WARN, "ioremap: can't open /dev/mem\n");
-                return NULL;
-        }
-    }
+    #ifdef MAP_POPULATE
+    flags |= MAP_POPULATE; /* pre-fault the page tables, no TLB misses on the first accesses */
+    #endif
 
     /* memory map */
     reg_mem = mmap(
         (caddr_t)reg_mem,
         size+ofs_addr,
         PROT_READ|PROT_WRITE,
-        MAP_SHARED,
-        axs_mem_fd,
+        flags,
+        fd,
         page_addr
     );
     
     if (reg_mem == MAP_FAILED) {
 	util_pdbg(DBG_WARN, "ioremap: mmap error\n");        
-        close(axs_mem_fd);
         return NULL;
     }
 
@@ -107,6 +160,24 @@ volatile void* ioremap(unsigned long physaddr, unsigned size)
     return (volatile void *)reg;
 }
 
+/**
+* @brief Remaps a physical address into the virtual memory
+*
+* @param physaddr Physical base address of the peripheral mappable from the system bus
+* @param size Addresable memory size
+* @return Pointer to the virtual memory address
+*
+* @note Raw mapping of /dev/mem, not accounted in the region registry. Drivers should use mapio_region()
+*/
+
+volatile void* ioremap(unsigned long physaddr, unsigned size)
+{
+    if( busio_mem_open() < 0 )
+	return NULL;
+
+    return busio_mmap(busio_mem_fd, physaddr, size);
+}
+
 /**
 * @brief Unmaps the virtual address 
 *
@@ -124,6 +195,201 @@ int iounmap(volatile void *start, size_t length)
     return munmap((void*)start-ofs_addr, length+ofs_addr);
 }
 
+const BUSIO_BACKEND busio_backend_devmem = {
+    .name = "devmem",
+    .open = busio_mem_open,
+    .close = busio_mem_close,
+    .map = ioremap,
+    .unmap = iounmap,
+    .read = NULL,
+    .write = NULL,
+};
+
+/**
+* @brief Selects the register access backend
+*
+* @param backend Backend to use ( e.g. busio_backend_devmem, busio_backend_sim )
+* @return 0 on success. 
+* @return -EBUSY if there are regions already mapped through another backend
+*
+* If no backend is selected, the first mapping picks busio_backend_sim when the ROBOTLIB_SIMMEM environment variable 
+* is set and busio_backend_devmem otherwise.
+*
+* @note This function is \b thread-safe.
+*/
+
+int busio_set_backend(const BUSIO_BACKEND* backend)
+{
+    int err = 0; 
+
+    pthread_mutex_lock(&busio_lock);
+
+    if( busio_backend_opened )
+	err = -EBUSY;
+    else {
+	busio_backend = backend;
+	busio_hooked = (backend->read != NULL || backend->write != NULL);
+    }
+
+    pthread_mutex_unlock(&busio_lock);
+
+    if( err < 0 )
+	util_pdbg(DBG_WARN, "BUSIO: Cannot change backend to %s while regions are mapped\n", backend->name);
+
+    return err;
+}
+
+/**
+* @brief Returns the active backend ( NULL if none has been selected yet )
+*/
+
+const BUSIO_BACKEND* busio_get_backend()
+{
+    return busio_backend;
+}
+
+/**
+* @brief Opens the active backend, choosing the default one if needed
+*
+* @return 0 on success. Otherwise error.
+*
+* @note Must be called with busio_lock held
+*/
+
+static int busio_backend_open()
+{
+    int err;
+
+    if( busio_backend_opened )
+	return 0;
+
+    if( busio_backend == NULL ){
+	busio_backend = getenv("ROBOTLIB_SIMMEM") != NULL ? &busio_backend_sim : &busio_backend_devmem;
+	busio_hooked = (busio_backend->read != NULL || busio_backend->write != NULL);
+    }
+
+    if( (err = busio_backend->open()) < 0 )
+	return err;
+
+    util_pdbg(DBG_INFO, "BUSIO: Using %s backend\n", busio_backend->name);
+    busio_backend_opened = 1; 
+
+    return 0;
+}
+
+/**
+* @brief Gets a view over a physical range from the region registry
+*
+* @param baseadd Physical base address of the peripheral
+* @param endadd Physical end address of the peripheral
+* @return Virtual address for baseadd or NULL if it cannot be mapped
+*
+* If the range is already covered by a mapped region its reference count is increased and a pointer inside it is
+* returned. Otherwise the whole bus window holding the range (or just the range if it is not inside any window) is mapped.
+*
+* @note Must be called with busio_lock held
+*/
+
+static volatile void* busio_region_get(unsigned long baseadd, unsigned long endadd)
+{
+    unsigned long pgmask = getpagesize()-1;
+    unsigned long base = baseadd & ~pgmask;
+    unsigned long end = endadd | pgmask;
+    BUSIO_REGION* free_slot = NULL;
+    volatile void* vadd;
+    int i, used = 0;
+
+    for( i = 0 ; i < BUSIO_MAX_REGIONS ; i++ ){
+	if( busio_regions[i].refcount == 0 ){
+	    if( free_slot == NULL ) 
+		free_slot = &busio_regions[i];
+	    continue;
+	}
+	used++;
+
+	if( busio_regions[i].base <= base && end <= busio_regions[i].end ){
+	    busio_regions[i].refcount++;
+	    return busio_regions[i].vadd + (baseadd - busio_regions[i].base);
+	}
+    }
+
+    if( free_slot == NULL ){
+	util_pdbg(DBG_WARN, "BUSIO: No free slots in the region registry\n");
+	return NULL;
+    }
+
+    // Not mapped yet. Widen to the bus window if there is one
+    for( i = 0 ; i < ARRAY_SIZE(busio_windows) ; i++ ){
+	if( busio_windows[i][0] <= base && end <= busio_windows[i][1] ){
+	    base = busio_windows[i][0] & ~pgmask;
+	    end = busio_windows[i][1] | pgmask;
+	    break;
+	}
+    }
+
+    if( busio_backend_open() < 0 )
+	return NULL;
+
+    if( (vadd = busio_backend->map(base, end - base + 1)) == NULL ){
+	// First mapping: do not keep /dev/mem open for nothing
+	if( used == 0 ){
+	    busio_backend->close();
+	    busio_backend_opened = 0;
+	}
+	return NULL;
+    }
+
+    free_slot->base = base;
+    free_slot->end = end;
+    free_slot->vadd = (volatile char*)vadd;
+    free_slot->refcount = 1;
+
+    util_pdbg(DBG_DEBG, "BUSIO: New region phy:0x%x-0x%x vrt=0x%x\n", (unsigned)base, (unsigned)end, (unsigned)(unsigned long)vadd);
+
+    return free_slot->vadd + (baseadd - base);
+}
+
+/**
+* @brief Releases a view obtained through busio_region_get()
+*
+* @param vadd Virtual address of the view
+* @return 0 on success. 
+* @return -ENXIO if the address does not belong to any region or cannot be unmapped
+*
+* The region is unmapped when its last view is released, and the backend is closed together with the last region.
+*
+* @note Must be called with busio_lock held
+*/
+
+static int busio_region_put(volatile void* vadd)
+{
+    volatile char* p = (volatile char*)vadd;
+    int i, used = 0;
+    int err = -ENXIO;
+
+    for( i = 0 ; i < BUSIO_MAX_REGIONS ; i++ ){
+	if( busio_regions[i].refcount == 0 )
+	    continue;
+
+	if( err == -ENXIO && busio_regions[i].vadd <= p && p <= busio_regions[i].vadd + (busio_regions[i].end - busio_regions[i].base) ){
+	    err = 0;
+	    if( --busio_regions[i].refcount == 0 ){
+		if( busio_backend->unmap(busio_regions[i].vadd, busio_regions[i].end - busio_regions[i].base + 1) < 0 )
+		    err = -ENXIO;
+		continue;
+	    }
+	}
+	used++;
+    }
+
+    if( used == 0 && busio_backend_opened ){
+	busio_backend->close();
+	busio_backend_opened = 0;
+    }
+
+    return err;
+}
+
 /**
 * @brief Wrapper function for ioremap() with error checking
 *
@@ -134,6 +400,11 @@ int iounmap(volatile void *start, size_t length)
 * @return 0 on success. 
 * @return -EADDRNOTAVAIL if address fails to be mapped
 * @return -EINVAL if address sanity check fails
+*
+* Mappings are shared: peripherals inside the same bus window or page get refcounted views of a single 
+* mapping instead of one mmap() each.
+*
+* @note This function is \b thread-safe.
 */
 
 int mapio_region(volatile int** basep, long unsigned int baseadd, long unsigned int endadd)
@@ -144,7 +415,11 @@ int mapio_region(volatile int** basep, long unsigned int baseadd, long unsigned
             return -EINVAL;
     }
 
-    if( (*basep = (volatile int*) ioremap(baseadd, endadd - baseadd)) == NULL )
+    pthread_mutex_lock(&busio_lock);
+    *basep = (volatile int*) busio_region_get(baseadd, endadd);
+    pthread_mutex_unlock(&busio_lock);
+
+    if( *basep == NULL )
     {
 	util_pdbg(DBG_WARN, "Cannot allocate memory at phy:0x%x-0x%x\n", (unsigned)baseadd, (unsigned)endadd);
 	return -EADDRNOTAVAIL;		
@@ -164,17 +439,334 @@ int mapio_region(volatile int** basep, long unsigned int baseadd, long unsigned
 * @param endadd Physical base address of the peripheral
 * @return 0 on success. 
 * @return -ENXIO if virtual address cannot be unmapped
+*
+* @note This function is \b thread-safe.
 */
 
 int unmapio_region(volatile int** basep, long unsigned int baseadd, long unsigned int endadd)
 {
+    int err;
 
-    if( (iounmap(*basep, endadd - baseadd)) < 0 )
+    pthread_mutex_lock(&busio_lock);
+    err = busio_region_put(*basep);
+    pthread_mutex_unlock(&busio_lock);
+
+    if( err < 0 )
     {
 	util_pdbg(DBG_WARN, "Cannot unmap memory at phy:0x%x-0x%x\n", (unsigned)baseadd, (unsigned)endadd); 
 	return -ENXIO;		
     }
 
+    *basep = NULL;
+
     return 0; 
 }
 
+/**
+* @brief Finds the region holding a virtual address
+*
+* @param addr Virtual address
+* @param physaddr Returns the physical address for addr
+* @return 0 on success. -ENXIO if addr is not mapped
+*
+* @note Lock-free. Regions are only added/removed during driver init/clean
+*/
+
+static int busio_virt2phys(volatile int* addr, unsigned long* physaddr)
+{
+    volatile char* p = (volatile char*)addr;
+    int i;
+
+    for( i = 0 ; i < BUSIO_MAX_REGIONS ; i++ ){
+	if( busio_regions[i].refcount != 0 && busio_regions[i].vadd <= p && 
+	    p <= busio_regions[i].vadd + (busio_regions[i].end - busio_regions[i].base) ){
+	    *physaddr = busio_regions[i].base + (p - busio_regions[i].vadd);
+	    return 0;
+	}
+    }
+
+    return -ENXIO;
+}
+
+/**
+* @brief Register read through the backend hook
+*
+* @param addr Virtual address of the register
+* @return Register value
+*
+* @see busio_read()
+*/
+
+int busio_hooked_read(volatile int* addr)
+{
+    unsigned long physaddr; 
+
+    if( busio_backend->read == NULL || busio_virt2phys(addr, &physaddr) < 0 )
+	return *addr;
+
+    return busio_backend->read(addr, physaddr);
+}
+
+/**
+* @brief Register write through the backend hook
+*
+* @param addr Virtual address of the register
+* @param value Value to write
+*
+* @see busio_write()
+*/
+
+void busio_hooked_write(volatile int* addr, int value)
+{
+    unsigned long physaddr; 
+
+    if( busio_backend->write == NULL || busio_virt2phys(addr, &physaddr) < 0 ){
+	*addr = value;
+	return;
+    }
+
+    busio_backend->write(addr, physaddr, value);
+}
+
+/* --- Register access trace --- */
+
+#ifdef BUSIO_TRACE
+
+/*! Slot of the trace ring */
+typedef struct{
+    volatile uint32_t seq; ///< Index+1 of the access stored. 0 while the slot is being written
+    uint32_t flags; ///< BUSIO_TRACE_READ / BUSIO_TRACE_WRITE
+    volatile int* base; ///< Mapped base of the peripheral, resolved to physical when drained
+    uint32_t offset; ///< Register offset ( in words )
+    uint32_t value; ///< Value read/written
+    unsigned long task; ///< Calling Xenomai task ( RT_TASK descriptor ). 0 for plain Linux threads
+    RTIME tsc; ///< Timestamp in TSC ticks
+} BUSIO_TRACE_ENTRY;
+
+int busio_trace_enabled = 0;
+
+static BUSIO_TRACE_ENTRY busio_trace_ring[BUSIO_TRACE_ENTRIES]; ///< Preallocated ring, overwritten when full
+static volatile uint32_t busio_trace_head = 0; ///< Next index to be claimed by a producer
+static uint32_t busio_trace_tail = 0; ///< Next index to be drained
+static unsigned busio_trace_recorded = 0; ///< Records written to file
+static unsigned busio_trace_lost = 0; ///< Records overwritten before being drained
+static FILE* busio_trace_file = NULL; ///< Output file
+static pthread_t busio_trace_thread; ///< Drain thread (non-RT)
+static volatile int busio_trace_running = 0; ///< Drain thread keeps running while set
+
+/**
+* @brief Records one register access in the trace ring
+*
+* @param base Mapped base of the peripheral
+* @param off Register offset ( in words )
+* @param value Value read/written
+* @param flags BUSIO_TRACE_READ / BUSIO_TRACE_WRITE
+*
+* Producers claim a slot with an atomic increment and never wait: if the drain thread lags behind, the oldest records
+* are overwritten and accounted as lost.
+*
+* @note This function is \b thread-safe and \b lock-free. It can be called from any task.
+*/
+
+void busio_trace_record(volatile int* base, unsigned off, int value, unsigned flags)
+{
+    uint32_t idx = __sync_fetch_and_add(&busio_trace_head, 1);
+    BUSIO_TRACE_ENTRY* e = &busio_trace_ring[idx & (BUSIO_TRACE_ENTRIES - 1)];
+
+    e->seq = 0;
+    util_wmb();
+
+    e->tsc = rt_timer_tsc();
+    e->base = base;
+    e->offset = off;
+    e->value = value;
+    e->flags = flags;
+    e->task = (unsigned long)rt_task_self();
+
+    util_wmb();
+    e->seq = idx + 1;
+}
+
+/**
+* @brief Drains the trace ring into the trace file
+*
+* @note Only called from the drain thread 
+*/
+
+static void busio_trace_drain()
+{
+    BUSIO_TRACE_ENTRY* e;
+    BUSIO_TRACE_RECORD r;
+    unsigned long physaddr;
+    uint32_t head, seq;
+
+    for(;;){
+	head = busio_trace_head;
+	util_rmb();
+
+	if( head == busio_trace_tail )
+	    break;
+
+	// Overrun: skip what has already been overwritten
+	if( (int32_t)(head - busio_trace_tail) > BUSIO_TRACE_ENTRIES ){
+	    busio_trace_lost += head - busio_trace_tail - BUSIO_TRACE_ENTRIES;
+	    busio_trace_tail = head - BUSIO_TRACE_ENTRIES;
+	}
+
+	e = &busio_trace_ring[busio_trace_tail & (BUSIO_TRACE_ENTRIES - 1)];
+	seq = e->seq;
+	util_rmb();
+
+	if( seq != busio_trace_tail + 1 ){
+	    if( (int32_t)(seq - (busio_trace_tail + 1)) > 0 ){
+		// Overwritten by a newer access
+		busio_trace_lost++;
+		busio_trace_tail++;
+		continue;
+	    }
+	    break; // Still being written. Retry on next period
+	}
+
+	r.time_ns = rt_timer_tsc2ns(e->tsc);
+	r.physaddr = busio_virt2phys(e->base, &physaddr) < 0 ? 0 : physaddr;
+	r.offset = e->offset;
+	r.value = e->value;
+	r.flags = e->flags;
+	r.task = e->task;
+
+	util_rmb();
+	if( e->seq != seq ){
+	    // Overwritten while copying
+	    busio_trace_lost++;
+	    busio_trace_tail++;
+	    continue;
+	}
+
+	fwrite(&r, sizeof(r), 1, busio_trace_file);
+	busio_trace_recorded++;
+	busio_trace_tail++;
+    }
+
+    fflush(busio_trace_file);
+}
+
+/**
+* @brief Drain thread
+*/
+
+static void* busio_trace_thread_fn(void* cookie)
+{
+    while( busio_trace_running ){
+	busio_trace_drain();
+	__msleep(BUSIO_TRACE_DRAIN_PERIOD_MS);
+    }
+
+    busio_trace_drain();
+
+    return NULL;
+}
+
+/**
+* @brief Starts tracing register accesses into a binary file
+*
+* @param filename Output file. Starts with a BUSIO_TRACE_HEADER followed by BUSIO_TRACE_RECORDs
+* @return 0 on success. Otherwise error. 
+* @return -ENOSYS if the library was compiled without BUSIO_TRACE
+*
+* Spawns a non-RT thread that drains the trace ring every BUSIO_TRACE_DRAIN_PERIOD_MS.
+*
+* @note This function is \b NOT thread-safe. The user should guarantee somewhere else that is not called in several instances
+*       for the same resource. 
+*/
+
+int busio_trace_start(const char* filename)
+{
+    BUSIO_TRACE_HEADER h = { BUSIO_TRACE_MAGIC, sizeof(BUSIO_TRACE_RECORD) };
+
+    if( busio_trace_running )
+	return -EBUSY;
+
+    if( (busio_trace_file = fopen(filename, "wb")) == NULL ){
+	util_pdbg(DBG_WARN, "BUSIO: Can't open trace file %s\n", filename);
+	return -ENOENT;
+    }
+
+    fwrite(&h, sizeof(h), 1, busio_trace_file);
+
+    busio_trace_tail = busio_trace_head;
+    busio_trace_recorded = 0;
+    busio_trace_lost = 0;
+    busio_trace_running = 1;
+
+    if( pthread_create(&busio_trace_thread, NULL, busio_trace_thread_fn, NULL) != 0 ){
+	util_pdbg(DBG_WARN, "BUSIO: Can't create trace drain thread\n");
+	busio_trace_running = 0;
+	fclose(busio_trace_file);
+	return -EAGAIN;
+    }
+
+    util_wmb();
+    busio_trace_enabled = 1;
+
+    return 0;
+}
+
+/**
+* @brief Stops tracing and flushes the remaining records
+*
+* @return 0 on success. Otherwise error. 
+*
+* @note This function is \b NOT thread-safe. The user should guarantee somewhere else that is not called in several instances
+*       for the same resource. 
+*/
+
+int busio_trace_stop()
+{
+    if( !busio_trace_running )
+	return -EINVAL;
+
+    busio_trace_enabled = 0;
+    busio_trace_running = 0;
+    pthread_join(busio_trace_thread, NULL);
+
+    fclose(busio_trace_file);
+    busio_trace_file = NULL;
+
+    util_pdbg(DBG_INFO, "BUSIO: Trace stopped. %u records, %u lost\n", busio_trace_recorded, busio_trace_lost);
+
+    return 0;
+}
+
+/**
+* @brief Trace counters
+*
+* @param recorded Records written to file
+* @param lost Records overwritten before they could be drained
+*/
+
+void busio_trace_stats(unsigned* recorded, unsigned* lost)
+{
+    *recorded = busio_trace_recorded;
+    *lost = busio_trace_lost;
+}
+
+#else
+
+int busio_trace_start(const char* filename)
+{
+    util_pdbg(DBG_WARN, "BUSIO: Compiled without BUSIO_TRACE\n");
+    return -ENOSYS;
+}
+
+int busio_trace_stop()
+{
+    return -ENOSYS;
+}
+
+void busio_trace_stats(unsigned* recorded, unsigned* lost)
+{
+    *recorded = 0;
+    *lost = 0;
+}
+
+#endif
@@ -1,17 +1,73 @@
 /**
     @file busio.h
-    
-    @section DESCRIPTION    
-    
-    Robotics library for the Autonomous Robotics Development Platform  
-    
-    @brief [HEADER] Low-level Direct-IO allocations    
-    
+
+    @section DESCRIPTION
+
+    Robotics library for the Autonomous Robotics Development Platform
+
+    @brief [HEADER] Low-level Direct-IO allocations
+
 */
 
 #ifndef __BUSIO_H__
 #define __BUSIO_H__
 
+#include <stddef.h>
+#include <stdint.h>
+
+#define BUSIO_MAX_REGIONS 16 /*! Maximum number of simultaneously mapped regions */
+
+/* Register access tracing. Compiled in with -DBUSIO_TRACE */
+#define BUSIO_TRACE_ENTRIES 4096 /*! Trace ring size. Must be a power of 2 */
+#define BUSIO_TRACE_READ  0x01 /*! Register read */
+#define BUSIO_TRACE_WRITE 0x02 /*! Register write */
+#define BUSIO_TRACE_MAGIC 0x524c5452 /*! "RLTR" File header magic */
+#define BUSIO_TRACE_DRAIN_PERIOD_MS 10 /*! Period of the drain thread */
+
+typedef struct{
+    unsigned long base; ///< Physical base address of the mapping (page aligned)
+    unsigned long end; ///< Physical end address of the mapping (last byte, inclusive)
+    volatile char* vadd; ///< Virtual address where the region is mapped
+    unsigned refcount; ///< Number of views handed out over this region
+} BUSIO_REGION;
+
+/*! Register access backend. Every mapping made through mapio_region() is served by the active backend */
+typedef struct{
+    const char* name; ///< Backend name (debugging)
+    int (*open)(void); ///< Called before the first region is mapped
+    void (*close)(void); ///< Called once the last region is released
+    volatile void* (*map)(unsigned long physaddr, unsigned size); ///< Maps a physical range
+    int (*unmap)(volatile void* start, size_t length); ///< Unmaps a range returned by map()
+    int (*read)(volatile int* addr, unsigned long physaddr); ///< Register read hook. NULL for direct access
+    void (*write)(volatile int* addr, unsigned long physaddr, int value); ///< Register write hook. NULL for direct access
+} BUSIO_BACKEND;
+
+/*! One traced register access as stored in the trace file */
+typedef struct{
+    uint64_t time_ns; ///< Timestamp in ns
+    uint32_t physaddr; ///< Physical base address of the mapped peripheral
+    uint32_t offset; ///< Register offset ( in words )
+    uint32_t value; ///< Value read/written
+    uint32_t flags; ///< BUSIO_TRACE_READ / BUSIO_TRACE_WRITE
+    uint64_t task; ///< Calling Xenomai task ( address of its RT_TASK descriptor ). 0 for plain Linux threads
+} BUSIO_TRACE_RECORD;
+
+/*! Trace file header */
+typedef struct{
+    uint32_t magic; ///< BUSIO_TRACE_MAGIC
+    uint32_t record_size; ///< sizeof(BUSIO_TRACE_RECORD)
+} BUSIO_TRACE_HEADER;
+
+extern const BUSIO_BACKEND busio_backend_devmem; ///< Real hardware through /dev/mem
+
+extern int busio_hooked; ///< Set when the active backend traps register accesses
+
+int busio_set_backend(const BUSIO_BACKEND* backend);
+
+const BUSIO_BACKEND* busio_get_backend();
+
+volatile void* busio_mmap(int fd, unsigned long physaddr, unsigned size);
+
 volatile void * ioremap(unsigned long physaddr, unsigned size);
 
 int iounmap(volatile void *start, size_t length);
@@ -20,4 +76,56 @@ int mapio_region(volatile int** basep, long unsigned int base, long unsigned int
 
 int unmapio_region(volatile int** basep, long unsigned int base, long unsigned int end );
 
+/* Register access trace */
+
+#ifdef BUSIO_TRACE
+extern int busio_trace_enabled; ///< Runtime switch for the trace
+
+void busio_trace_record(volatile int* base, unsigned off, int value, unsigned flags);
+#endif
+
+int busio_trace_start(const char* filename);
+
+int busio_trace_stop();
+
+void busio_trace_stats(unsigned* recorded, unsigned* lost);
+
+/* Register accessors. Drivers access mapped registers only through these */
+
+int busio_hooked_read(volatile int* addr);
+
+void busio_hooked_write(volatile int* addr, int value);
+
+/*! Reads the register at word offset 'off' from a mapped base */
+static inline int busio_read(volatile int* base, unsigned off)
+{
+    int value;
+
+    if( busio_hooked )
+	value = busio_hooked_read(base + off);
+    else
+	value = *(base + off);
+
+    #ifdef BUSIO_TRACE
+    if( busio_trace_enabled )
+	busio_trace_record(base, off, value, BUSIO_TRACE_READ);
+    #endif
+
+    return value;
+}
+
+/*! Writes the register at word offset 'off' from a mapped base */
+static inline void busio_write(volatile int* base, unsigned off, int value)
+{
+    #ifdef BUSIO_TRACE
+    if( busio_trace_enabled )
+	busio_trace_record(base, off, value, BUSIO_TRACE_WRITE);
+    #endif
+
+    if( busio_hooked )
+	busio_hooked_write(base + off, value);
+    else
+	*(base + off) = value;
+}
+
 #endif
@@ -0,0 +1,624 @@
+/**
+    @file busio_sim.c
+    
+    @section DESCRIPTION    
+    
+    Robotics library for the Autonomous Robotics Development Platform  
+    
+    @brief Simulated /dev/mem backend and peripheral models for running the drivers off-board
+    
+    @author Jorge Sánchez de Nova jssdn (mail)_(at) kth.se
+ 
+    @section LICENSE 
+    
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+    
+    @version 0.4-Xenomai
+
+    @note The physical address space is backed by a (sparse) shared memory file where the physical address is the 
+	  file offset, so other processes (test harnesses, GUIs) can map it too and poke at the registers. 
+	  The backend is selected with busio_sim_init() or by setting ROBOTLIB_SIMMEM=<file> (and optionally 
+	  ROBOTLIB_SIMLAT=<ns per access>) in the environment.
+    @note Interrupts are not simulated.
+ */
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "busio.h"
+#include "busio_sim.h"
+#include "util.h"
+
+#define SIM_PATH_LENGTH 80
+
+static char sim_path[SIM_PATH_LENGTH] = ""; ///< Backing file. Empty to take it from the environment
+static int sim_fd = -1; ///< Backing file descriptor
+static unsigned sim_latency_ns = 0; ///< Emulated latency per register access
+static BUSIO_MODEL* sim_models = NULL; ///< Attached peripheral models
+static pthread_mutex_t sim_lock = PTHREAD_MUTEX_INITIALIZER; ///< Serializes model callbacks
+
+/**
+* @brief Monotonic time in ns 
+*/
+
+static uint64_t sim_now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000llu + ts.tv_nsec;
+}
+
+/**
+* @brief Busy waits the configured access latency
+*/
+
+static void sim_delay()
+{
+    uint64_t until;
+
+    if( sim_latency_ns == 0 )
+	return;
+
+    until = sim_now_ns() + sim_latency_ns; 
+    while( sim_now_ns() < until ) 
+	;
+}
+
+/**
+* @brief Finds the model covering a physical address
+*
+* @note Must be called with sim_lock held
+*/
+
+static BUSIO_MODEL* sim_find_model(unsigned long physaddr)
+{
+    BUSIO_MODEL* m;
+
+    for( m = sim_models ; m != NULL ; m = m->next )
+	if( m->base <= physaddr && physaddr <= m->end )
+	    return m;
+
+    return NULL;
+}
+
+/**
+* @brief Backend open: opens (and creates) the backing file
+*/
+
+static int sim_open()
+{
+    const char* env;
+
+    if( sim_path[0] == '\0' ){
+	env = getenv("ROBOTLIB_SIMMEM");
+	strncpy(sim_path, env != NULL ? env : BUSIO_SIM_DEFAULT_FILE, SIM_PATH_LENGTH - 1);
+	
+	if( (env = getenv("ROBOTLIB_SIMLAT")) != NULL )
+	    sim_latency_ns = strtoul(env, NULL, 0);
+    }
+
+    if( (sim_fd = open(sim_path, O_RDWR | O_CREAT, 0666)) < 0 ){
+	util_pdbg(DBG_WARN, "BUSIO_SIM: Can't open %s\n", sim_path);
+	return -ENODEV;
+    }
+
+    util_pdbg(DBG_INFO, "BUSIO_SIM: Simulated bus in %s, %u ns per access\n", sim_path, sim_latency_ns);
+
+    return 0;
+}
+
+/**
+* @brief Backend close
+*/
+
+static void sim_close()
+{
+    if( sim_fd >= 0 ){
+	close(sim_fd);
+	sim_fd = -1;
+    }
+}
+
+/**
+* @brief Backend map: grows the backing file to cover the range and maps it
+*/
+
+static volatile void* sim_map(unsigned long physaddr, unsigned size)
+{
+    struct stat st;
+    off_t needed = (off_t)physaddr + size; 
+
+    if( fstat(sim_fd, &st) < 0 )
+	return NULL;
+
+    if( st.st_size < needed && ftruncate(sim_fd, needed) < 0 ){
+	util_pdbg(DBG_WARN, "BUSIO_SIM: Can't grow %s\n", sim_path);
+	return NULL;
+    }
+
+    return busio_mmap(sim_fd, physaddr, size);
+}
+
+/**
+* @brief Backend read hook: latency + model update
+*/
+
+static int sim_read(volatile int* addr, unsigned long physaddr)
+{
+    BUSIO_MODEL* m;
+    int value;
+
+    sim_delay();
+
+    pthread_mutex_lock(&sim_lock);
+    if( (m = sim_find_model(physaddr)) != NULL && m->read != NULL )
+	m->read(m, (physaddr - m->base) >> 2, addr);
+    value = *addr;
+    pthread_mutex_unlock(&sim_lock);
+
+    return value;
+}
+
+/**
+* @brief Backend write hook: latency + model update
+*/
+
+static void sim_write(volatile int* addr, unsigned long physaddr, int value)
+{
+    BUSIO_MODEL* m;
+
+    sim_delay();
+
+    pthread_mutex_lock(&sim_lock);
+    if( (m = sim_find_model(physaddr)) != NULL && m->write != NULL )
+	m->write(m, (physaddr - m->base) >> 2, addr, value);
+    else 
+	*addr = value;
+    pthread_mutex_unlock(&sim_lock);
+}
+
+const BUSIO_BACKEND busio_backend_sim = {
+    .name = "sim",
+    .open = sim_open,
+    .close = sim_close,
+    .map = sim_map,
+    .unmap = iounmap,
+    .read = sim_read,
+    .write = sim_write,
+};
+
+/**
+* @brief Selects the simulated backend
+*
+* @param path Backing file for the simulated physical memory. NULL for BUSIO_SIM_DEFAULT_FILE
+* @param latency_ns Busy-waited latency added to every register access (0 for none)
+* @return 0 on success. Otherwise error. 
+*
+* Must be called before any driver is initialized. 
+*
+* @note This function is \b NOT thread-safe. The user should guarantee somewhere else that is not called in several instances
+*       for the same resource. 
+*
+*/
+
+int busio_sim_init(const char* path, unsigned latency_ns)
+{
+    if( path == NULL )
+	path = BUSIO_SIM_DEFAULT_FILE;
+
+    if( strlen(path) >= SIM_PATH_LENGTH )
+	return -ENAMETOOLONG;
+
+    strncpy(sim_path, path, SIM_PATH_LENGTH);
+    sim_latency_ns = latency_ns;
+
+    return busio_set_backend(&busio_backend_sim);
+}
+
+/**
+* @brief Attaches a peripheral model to the simulated bus
+*
+* @param model Model to attach. Must stay allocated until it is removed
+* @return 0 on success. Otherwise error. 
+*
+* @note This function is \b thread-safe.
+*/
+
+int busio_sim_add_model(BUSIO_MODEL* model)
+{
+    if( model == NULL || model->base >= model->end )
+	return -EINVAL;
+
+    pthread_mutex_lock(&sim_lock);
+    model->next = sim_models;
+    sim_models = model;
+    pthread_mutex_unlock(&sim_lock);
+
+    util_pdbg(DBG_DEBG, "BUSIO_SIM: Model %s at phy:0x%x-0x%x\n", model->name, (unsigned)model->base, (unsigned)model->end);
+
+    return 0;
+}
+
+/**
+* @brief Detaches a peripheral model from the simulated bus
+*
+* @param model Model to detach
+* @return 0 on success. -ENOENT if the model was not attached 
+*
+* @note This function is \b thread-safe.
+*/
+
+int busio_sim_del_model(BUSIO_MODEL* model)
+{
+    BUSIO_MODEL** m;
+    int err = -ENOENT;
+
+    pthread_mutex_lock(&sim_lock);
+    for( m = &sim_models ; *m != NULL ; m = &((*m)->next) ){
+	if( *m == model ){
+	    *m = model->next;
+	    err = 0;
+	    break;
+	}
+    }
+    pthread_mutex_unlock(&sim_lock);
+
+    return err;
+}
+
+/* --- DC motors model --- */
+
+#define SIM_PID_PERIOD_NS (1000000000llu / PID_CORE_RATE_HZ)
+
+/**
+* @brief Any loop of the PID core enabled
+*/
+
+static int sim_pid_active(BUSIO_SIM_MOTORS* sim)
+{
+    unsigned i; 
+
+    for( i = 0 ; i < sim->num_of_pids ; i++ )
+	if( sim->pid_reg[i][PID_REG_CTRL] & PID_CTRL_ENABLE )
+	    return 1;
+
+    return 0;
+}
+
+/**
+* @brief One period of the PID core
+*
+* Same law as the software engine: P on the error, D on the measurement ( unfiltered ), conditional integration.
+* The speed comes from the exact model position, without the quantization of the real counters.
+*/
+
+static void sim_pid_period(BUSIO_SIM_MOTORS* sim)
+{
+    const int64_t max = (int64_t)MOTORS_MAX_SPEED << 16;
+    int* reg;
+    int meas, error;
+    int64_t p, d, i, out;
+    unsigned n; 
+
+    for( n = 0 ; n < sim->num_of_pids ; n++ ){
+	reg = sim->pid_reg[n];
+	if( !(reg[PID_REG_CTRL] & PID_CTRL_ENABLE) )
+	    continue;
+
+	meas = (int)(((sim->pos[n] - sim->pid_prev_pos[n]) * PID_CORE_RATE_HZ) >> 16);
+	sim->pid_prev_pos[n] = sim->pos[n];
+
+	if( sim->pid_fresh[n] ){
+	    sim->pid_integ[n] = 0;
+	    sim->pid_prev_speed[n] = meas;
+	    sim->pid_fresh[n] = 0;
+	}
+
+	error = reg[PID_REG_SETPOINT] - meas;
+	p = (int64_t)reg[PID_REG_KP] * error;
+	d = (int64_t)reg[PID_REG_KD] * (sim->pid_prev_speed[n] - meas);
+	sim->pid_prev_speed[n] = meas;
+
+	out = p + sim->pid_integ[n] + d;
+	if( !((out > max && error > 0) || (out < -max && error < 0)) ){
+	    i = sim->pid_integ[n] + (int64_t)reg[PID_REG_KI] * error;
+	    sim->pid_integ[n] = i > max ? max : (i < -max ? -max : i);
+	}
+
+	out = p + sim->pid_integ[n] + d;
+	out = out > max ? max : (out < -max ? -max : out);
+
+	reg[PID_REG_SPEED] = meas;
+	reg[PID_REG_OUTPUT] = (int)(out >> 16);
+	sim->speed[n] = reg[PID_REG_OUTPUT];
+    }
+}
+
+/**
+* @brief Integrates the encoder positions up to now
+*
+* With a loop of the PID core enabled, time advances period by period of the core.
+*/
+
+static void sim_motors_advance(BUSIO_SIM_MOTORS* sim)
+{
+    uint64_t now = sim_now_ns();
+    uint64_t dt;
+    int64_t rate; 
+    unsigned i; 
+    int pid = sim_pid_active(sim);
+
+    while( now > sim->last_ns ){
+	// Chunks of 100 ms keep the products in 64 bits
+	dt = now - sim->last_ns > 100000000llu ? 100000000llu : now - sim->last_ns;
+	if( pid && dt > sim->pid_next_ns - sim->last_ns )
+	    dt = sim->pid_next_ns - sim->last_ns;
+	sim->last_ns += dt;
+
+	for( i = 0 ; i < sim->num_of ; i++ ){
+	    rate = (int64_t)sim->speed[i] * sim->ticks_per_sec * 65536 / MOTORS_MAX_SPEED; // ticks/s, Q16.16
+	    sim->pos[i] += rate * (int64_t)(dt / 1000) / 1000000;
+	}
+
+	if( pid && sim->last_ns == sim->pid_next_ns ){
+	    sim_pid_period(sim);
+	    sim->pid_next_ns += SIM_PID_PERIOD_NS;
+	}
+    }
+}
+
+/* PWM: even registers are duty cycles, odd registers are frequency dividers */
+static void sim_motors_pwm_write(BUSIO_MODEL* model, unsigned off, volatile int* reg, int value)
+{
+    BUSIO_SIM_MOTORS* sim = (BUSIO_SIM_MOTORS*)model->priv;
+
+    if( (off & 1) == 0 && (off >> 1) < sim->num_of ){
+	sim_motors_advance(sim);
+	if( (off >> 1) < sim->num_of_pids && (sim->pid_reg[off >> 1][PID_REG_CTRL] & PID_CTRL_ENABLE) ){
+	    *reg = value; // the core owns the duty cycle
+	    return;
+	}
+	// 11 bits signed, extended on the unsigned value
+	sim->speed[off >> 1] = (int)((unsigned)value & 0x7ff) - (int)(((unsigned)value & 0x400) << 1);
+    }
+
+    *reg = value;
+}
+
+/* QENC: one counter per register, a write of 1 resets it */
+static void sim_motors_qenc_read(BUSIO_MODEL* model, unsigned off, volatile int* reg)
+{
+    BUSIO_SIM_MOTORS* sim = (BUSIO_SIM_MOTORS*)model->priv;
+
+    if( off >= sim->num_of )
+	return;
+
+    sim_motors_advance(sim);
+    *reg = (int)(sim->pos[off] >> 16);
+}
+
+static void sim_motors_qenc_write(BUSIO_MODEL* model, unsigned off, volatile int* reg, int value)
+{
+    BUSIO_SIM_MOTORS* sim = (BUSIO_SIM_MOTORS*)model->priv;
+
+    if( off < sim->num_of && value != 0 ){
+	sim_motors_advance(sim);
+	sim->pos[off] = 0;
+    }
+
+    *reg = value;
+}
+
+/**
+* @brief Attaches a DC motors model: encoder counters advance according to the PWM duty cycles 
+*
+* @param sim Model structure. Must stay allocated while attached
+* @param pwm_base Base address of the PWM core
+* @param pwm_end End address of the PWM core
+* @param qenc_base Base address of the QENC core
+* @param qenc_end End address of the QENC core
+* @param num_of Number of motors/encoders
+* @param ticks_per_sec Encoder ticks per second at full duty cycle
+* @return 0 on success. Otherwise error. 
+*
+* @note This function is \b thread-safe.
+*/
+
+int busio_sim_model_motors(BUSIO_SIM_MOTORS* sim,
+			   unsigned long pwm_base, unsigned long pwm_end,
+			   unsigned long qenc_base, unsigned long qenc_end,
+			   unsigned num_of, int ticks_per_sec)
+{
+    int err; 
+
+    if( num_of > MOTORS_MAX_NUM_OF_CORES )
+	return -ECHRNG;
+
+    memset(sim, 0, sizeof(BUSIO_SIM_MOTORS));
+    sim->num_of = num_of;
+    sim->ticks_per_sec = ticks_per_sec;
+    sim->last_ns = sim_now_ns();
+
+    sim->pwm.name = "PWM";
+    sim->pwm.base = pwm_base;
+    sim->pwm.end = pwm_end;
+    sim->pwm.write = sim_motors_pwm_write;
+    sim->pwm.priv = sim;
+
+    sim->qenc.name = "QENC";
+    sim->qenc.base = qenc_base;
+    sim->qenc.end = qenc_end;
+    sim->qenc.read = sim_motors_qenc_read;
+    sim->qenc.write = sim_motors_qenc_write;
+    sim->qenc.priv = sim;
+
+    if( (err = busio_sim_add_model(&sim->pwm)) < 0 )
+	return err;
+
+    return busio_sim_add_model(&sim->qenc);
+}
+
+/* PID core: PID_REG_STRIDE registers per loop */
+static void sim_pid_read(BUSIO_MODEL* model, unsigned off, volatile int* reg)
+{
+    BUSIO_SIM_MOTORS* sim = (BUSIO_SIM_MOTORS*)model->priv;
+
+    if( off / PID_REG_STRIDE >= sim->num_of_pids )
+	return;
+
+    sim_motors_advance(sim);
+    *reg = sim->pid_reg[off / PID_REG_STRIDE][off % PID_REG_STRIDE];
+}
+
+static void sim_pid_write(BUSIO_MODEL* model, unsigned off, volatile int* reg, int value)
+{
+    BUSIO_SIM_MOTORS* sim = (BUSIO_SIM_MOTORS*)model->priv;
+    unsigned n = off / PID_REG_STRIDE, r = off % PID_REG_STRIDE;
+
+    *reg = value;
+
+    if( n >= sim->num_of_pids || r == PID_REG_SPEED || r == PID_REG_OUTPUT )
+	return;
+
+    sim_motors_advance(sim);
+
+    if( r == PID_REG_CTRL ){
+	if( !sim_pid_active(sim) ) // first loop on: periods start now
+	    sim->pid_next_ns = sim->last_ns + SIM_PID_PERIOD_NS;
+	if( (value & PID_CTRL_RESET) || !(sim->pid_reg[n][PID_REG_CTRL] & PID_CTRL_ENABLE) ){
+	    sim->pid_fresh[n] = 1;
+	    sim->pid_prev_pos[n] = sim->pos[n];
+	}
+	value &= ~PID_CTRL_RESET;
+    }
+
+    sim->pid_reg[n][r] = value;
+}
+
+/**
+* @brief Attaches a PID core model to a DC motors model
+*
+* @param sim DC motors model, already attached with busio_sim_model_motors()
+* @param base Base address of the PID core
+* @param end End address of the PID core
+* @param num_of Number of loops. Loop n drives PWM n from encoder n
+* @return 0 on success. Otherwise error. 
+*
+* The loops run at PID_CORE_RATE_HZ of simulated time, caught up whenever the motors, encoders or the core 
+* are accessed.
+*
+* @note This function is \b thread-safe.
+*/
+
+int busio_sim_model_pid(BUSIO_SIM_MOTORS* sim, unsigned long base, unsigned long end, unsigned num_of)
+{
+    if( num_of > sim->num_of )
+	return -ECHRNG;
+
+    pthread_mutex_lock(&sim_lock);
+    memset(sim->pid_reg, 0, sizeof(sim->pid_reg));
+    sim->num_of_pids = num_of;
+    pthread_mutex_unlock(&sim_lock);
+
+    sim->pid.name = "PID";
+    sim->pid.base = base;
+    sim->pid.end = end;
+    sim->pid.read = sim_pid_read;
+    sim->pid.write = sim_pid_write;
+    sim->pid.priv = sim;
+
+    return busio_sim_add_model(&sim->pid);
+}
+
+/* --- GPIO input script model --- */
+
+/* Data register of channel 1 follows the script */
+static void sim_gpio_script_read(BUSIO_MODEL* model, unsigned off, volatile int* reg)
+{
+    BUSIO_SIM_GPIO* sim = (BUSIO_SIM_GPIO*)model->priv;
+    uint64_t t = sim_now_ns() - sim->start_ns;
+    int i; 
+
+    if( off != 0 )
+	return;
+
+    for( i = sim->steps - 1 ; i >= 0 ; i-- ){
+	if( sim->time_ns[i] <= t ){
+	    *reg = sim->value[i];
+	    return;
+	}
+    }
+}
+
+/**
+* @brief Attaches a GPIO model whose input data register is driven by a script
+*
+* @param sim Model structure. Must stay allocated while attached
+* @param base Base address of the GPIO core
+* @param end End address of the GPIO core
+* @param script Script file. One step per line: "<time in ms> <value in hex>". Lines starting with # are ignored
+* @return 0 on success. Otherwise error. 
+*
+* Steps must be sorted by time. The last value is held once the script finishes. 
+*
+* @note This function is \b thread-safe.
+*/
+
+int busio_sim_model_gpio_script(BUSIO_SIM_GPIO* sim, unsigned long base, unsigned long end, const char* script)
+{
+    FILE* f;
+    char line[DBG_MSG_LENGTH];
+    unsigned long ms, value; 
+
+    if( (f = fopen(script, "r")) == NULL ){
+	util_pdbg(DBG_WARN, "BUSIO_SIM: Can't open script %s\n", script);
+	return -ENOENT;
+    }
+
+    memset(sim, 0, sizeof(BUSIO_SIM_GPIO));
+
+    while( fgets(line, sizeof(line), f) != NULL && sim->steps < BUSIO_SIM_SCRIPT_MAX ){
+	if( line[0] == '#' || sscanf(line, "%lu %lx", &ms, &value) != 2 )
+	    continue;
+
+	sim->time_ns[sim->steps] = (uint64_t)ms * 1000000llu;
+	sim->value[sim->steps] = value;
+	sim->steps++;
+    }
+
+    fclose(f);
+
+    sim->start_ns = sim_now_ns();
+    sim->gpio.name = "GPIO script";
+    sim->gpio.base = base;
+    sim->gpio.end = end;
+    sim->gpio.read = sim_gpio_script_read;
+    sim->gpio.priv = sim;
+
+    return busio_sim_add_model(&sim->gpio);
+}
@@ -0,0 +1,80 @@
+/**
+    @file busio_sim.h
+
+    @section DESCRIPTION
+
+    Robotics library for the Autonomous Robotics Development Platform
+
+    @brief [HEADER] Simulated /dev/mem backend and peripheral models for running the drivers off-board
+
+*/
+
+#ifndef __BUSIO_SIM_H__
+#define __BUSIO_SIM_H__
+
+#include <stdint.h>
+#include "busio.h"
+#include "dev_mmaps_parms.h"
+
+#define BUSIO_SIM_DEFAULT_FILE "/dev/shm/robotlib_mem" /*! Default backing file for the simulated bus */
+#define BUSIO_SIM_SCRIPT_MAX 64 /*! Maximum number of steps in a GPIO input script */
+
+extern const BUSIO_BACKEND busio_backend_sim; ///< Simulated bus backed by a shared memory file
+
+/*! Peripheral model attached to a physical range of the simulated bus */
+typedef struct busio_model{
+    const char* name; ///< Model name (debugging)
+    unsigned long base; ///< Physical base address of the modelled peripheral
+    unsigned long end; ///< Physical end address of the modelled peripheral
+    void (*read)(struct busio_model* model, unsigned off, volatile int* reg); ///< Called before a register is read. NULL if not needed
+    void (*write)(struct busio_model* model, unsigned off, volatile int* reg, int value); ///< Called instead of a register write. NULL for plain store
+    void* priv; ///< Model private data
+    struct busio_model* next; ///< Next model in the list
+} BUSIO_MODEL;
+
+/*! DC motors model: PWM core driving the counters of a QENC core, optionally closed by a PID core */
+typedef struct{
+    BUSIO_MODEL pwm; ///< Model over the PWM registers
+    BUSIO_MODEL qenc; ///< Model over the QENC registers
+    unsigned num_of; ///< Number of motors
+    int ticks_per_sec; ///< Encoder ticks per second at MOTORS_MAX_SPEED
+    int speed[MOTORS_MAX_NUM_OF_CORES]; ///< Latched duty cycles
+    int64_t pos[MOTORS_MAX_NUM_OF_CORES]; ///< Encoder position in ticks << 16
+    uint64_t last_ns; ///< Time of the last position update
+    /* PID core ( busio_sim_model_pid() ) */
+    BUSIO_MODEL pid; ///< Model over the PID core registers
+    unsigned num_of_pids; ///< Emulated loops. 0 without PID core
+    uint64_t pid_next_ns; ///< Time of the next period of the core
+    int pid_reg[MOTORS_MAX_NUM_OF_CORES][PID_REG_STRIDE]; ///< Core registers
+    int pid_fresh[MOTORS_MAX_NUM_OF_CORES]; ///< The next period starts without history
+    int64_t pid_integ[MOTORS_MAX_NUM_OF_CORES]; ///< Integrator in Q16.16 duty cycle
+    int64_t pid_prev_pos[MOTORS_MAX_NUM_OF_CORES]; ///< Position at the previous period, ticks << 16
+    int pid_prev_speed[MOTORS_MAX_NUM_OF_CORES]; ///< Speed measured at the previous period
+} BUSIO_SIM_MOTORS;
+
+/*! GPIO input model replaying a script of timed values */
+typedef struct{
+    BUSIO_MODEL gpio; ///< Model over the GPIO registers
+    unsigned steps; ///< Number of steps in the script
+    uint64_t time_ns[BUSIO_SIM_SCRIPT_MAX]; ///< Time of each step since the model was attached
+    unsigned value[BUSIO_SIM_SCRIPT_MAX]; ///< Data register value from that time on
+    uint64_t start_ns; ///< Time the model was attached
+} BUSIO_SIM_GPIO;
+
+int busio_sim_init(const char* path, unsigned latency_ns);
+
+int busio_sim_add_model(BUSIO_MODEL* model);
+
+int busio_sim_del_model(BUSIO_MODEL* model);
+
+/* Built-in models */
+int busio_sim_model_motors(BUSIO_SIM_MOTORS* sim,
+			   unsigned long pwm_base, unsigned long pwm_end,
+			   unsigned long qenc_base, unsigned long qenc_end,
+			   unsigned num_of, int ticks_per_sec);
+
+int busio_sim_model_pid(BUSIO_SIM_MOTORS* sim, unsigned long base, unsigned long end, unsigned num_of);
+
+int busio_sim_model_gpio_script(BUSIO_SIM_GPIO* sim, unsigned long base, unsigned long end, const char* script);
+
+#endif
@@ -33,23 +33,15 @@
 #ifndef __GPIOMAPS_H__
 #define __GPIOMAPS_H__
 
-// TODO: Get them in an automated manner
-  
+/* Addresses, channels, masks and shifts of the peripherals are generated from platform.map */
+#include "platform_map.h"
+
 /** GPIOs **/
 
 /* GPIO for General Outputs */
 /* Several devices are attached(muxed) to the following outputs -
    4 LEDs (4bit), 5 Position LEDS (5bit) and a USB_RESET_SIGNAL(1bit) */
 
-#define GENERAL_OUTPUTS_BASE        0x814a0000
-#define GENERAL_OUTPUTS_END         0x814affff
-#define GENERAL_OUTPUTS_NUM_OF_CHAN 1
-#define GENERAL_OUTPUTS_NUM_OF_GPIO 17
-
-#define GENERAL_OUTPUTS_LED4_MASK    0x0000f
-#define GENERAL_OUTPUTS_LED4_SHIFT   0
-#define GENERAL_OUTPUTS_LEDPOS_MASK  0x001f0
-#define GENERAL_OUTPUTS_LEDPOS_SHIFT 4
 //#define GENERAL_USB_RESET_MASK    0x00200 /* Not for use */
 
 /* GPIO for General Inputs */
@@ -57,78 +49,55 @@
 /* Several devices are attached(muxed) to the following inputs - 
    Directional buttons (5bit), Bumpers(4bits), an Accelerator interrupt line (1bit) and an ADC End Of Conversion signal (1bit) */
 
-#define GENERAL_INPUTS_BASE         0x81420000
-#define GENERAL_INPUTS_END          0x8142ffff
-#define GENERAL_INPUTS_NUM_OF_CHAN  1
-#define GENERAL_INPUTS_NUM_OF_GPIO  10
-#define GENERAL_INPUTS_PUSHBUT_MASK 0x0001f
-#define GENERAL_INPUTS_PUSHBUT_SHIFT 0
-#define GENERAL_INPUTS_BUMPERS_MASK 0x001E0
-#define GENERAL_INPUTS_BUMPERS_SHIFT 5
-// #define GENERAL_INPUTS_ACC_RDY_MASK 0x00200
-// #define GENERAL_INPUTS_ACC_RDY_SHIFT 9
-// #define GENERAL_INPUTS_ADC_EOC_MASK 0x00400
-// #define GENERAL_INPUTS_ADC_EOC_SHIFT 10
-
-#define GENERAL_INPUTS_IRQ_NO 	7  
+#define GENERAL_INPUTS_DEBOUNCE_NS  5000000 /* Buttons and bumpers. ACC_RDY and ADC_EOC are not debounced */
 #define GENERAL_INPUTS_IRQ_PRIO 1	  
 
-/* Output IO for LCD 16x2 */
-#define LCD16X2_BASE        0x81460000
-#define LCD16X2_END         0x8146ffff
-#define LCD16X2_NUM_OF_CHAN 1
-#define LCD16X2_NUM_OF_GPIO 7
-#define LCD16X2_LCD_MASK    0x0007f
-
 /* 8 Bit GPIO */
-#define FPGA_GPIO8_BASE        0x81480000
-#define FPGA_GPIO8_END         0x8148ffff
-#define FPGA_GPIO8_NUM_OF_CHAN 1
-#define FPGA_GPIO8_NUM_OF_GPIO 8
-#define FPGA_GPIO8_MASK	       0x00ff
-#define FPGA_GPIO8_IRQ_NO      8
+#define FPGA_GPIO8_MASK	       FPGA_GPIO8_DATA_MASK
 #define FPGA_GPIO8_IRQ_PRIO    1
 
 /** Motor devices **/
 
 /* PWM module */
-#define MOTORS_BASE 0xca400000
-#define MOTORS_END  0xca40ffff
 #define MOTORS_MAX_NUM_OF_CORES 16
 
-#define MOTORS_NUM_OF 4
 #define MOTORS_MAX_SPEED 1023   /* 11 bits signed  - PWM Duty Cycle */
 #define MOTORS_MAX_FREQ_DIV 255 /* 8 bits unsigned - Frequency divider over BUS Frequency */
 
 /* Quadrature decoders */
-#define QENC_BASE 0xc4600000
-#define QENC_END  0xc460ffff
 #define QENC_MAX_NUM_OF_CORES 16
-
-#define QENC_NUM_OF 4
-
-/* PID Core address */
-//TODO: Yet to be implemented
-//#define PID_BASE 0x75020000
-//#define PID_END  0x7502ffff
+#define QENC_COUNTER_BITS 32 /* Width of the hardware counters. Extended to 64 bits in software */
+
+/* PID Core. One block of registers per motor. PID n drives PWM n from QENC n while enabled
+   PLACEHOLDER: the core has no published specification yet. Rate, stride, register offsets and control bits below
+   are assumed values, matched by the busio_sim model, and must be checked against the core before running on hardware */
+#define PIDS_MAX_NUM_OF_CORES 16
+#define PID_CORE_RATE_HZ 20000 /* Control rate of the core. KI and KD apply once per period */
+
+#define PID_REG_STRIDE   8 /* Words per PID */
+#define PID_REG_CTRL     0 /* PID_CTRL_* */
+#define PID_REG_KP       1 /* Q16.16 duty cycle per tick/s of error */
+#define PID_REG_KI       2 /* Q16.16, once per period */
+#define PID_REG_KD       3 /* Q16.16, once per period */
+#define PID_REG_SETPOINT 4 /* Target speed in ticks/s */
+#define PID_REG_SPEED    5 /* Measured speed in ticks/s. Read only */
+#define PID_REG_OUTPUT   6 /* Duty cycle applied to the PWM. Read only */
+
+#define PID_CTRL_ENABLE  0x1 /* Closed loop: the core owns the PWM duty cycle. Bus writes to it are ignored */
+#define PID_CTRL_RESET   0x2 /* Clears the integrator and the derivative history. Self clearing */
 
 /** Servos **/
-#define HWSERVOS_BASE 0xc5600000
-#define HWSERVOS_END  0xc560FFFF
-#define HWSERVOS_NUM_OF 4
 #define HWSERVOS_MAX_NUM_OF 8
+#define HWSERVOS_FRAME_RATE_HZ 50 /* Pulse frame of standard servos. Extended cores refresh faster */
 
 /* Standard values */
 #define HWSERVOS_TIME_MAX_ANGLE 2000 /* 2 ms to reach the maximum aperture (typ 2-2.2ms) */
 #define HWSERVOS_TIME_MIN_ANGLE 1000 /* 1 ms to reach the minimum aperture (typ 0.8-1ms) */
 #define HWSERVOS_TIME_MID_ANGLE 1500 /* 1.5 ms to reach the minimum aperture (typ 0.8-1ms) */
 
-/* Values for servos with extended control */
-// #define HWSERVOS_TIME_MAX_ANGLE 2200 /* 2 ms to reach the maximum aperture (typ 2-2.2ms) */
-// #define HWSERVOS_TIME_MIN_ANGLE 800 /* 1 ms to reach the minimum aperture (typ 0.8-1ms) */
-// #define HWSERVOS_TIME_MID_ANGLE 1500 /* 1.5 ms to reach the minimum aperture (typ 0.8-1ms) */
-
-#define HWSERVOS_EN_MASK 0x80000000 
+/* Values for servos with extended control. Hard limits of any calibration ( hwservos_set_calib() ) */
+#define HWSERVOS_EXT_TIME_MAX_ANGLE 2200 /* 2.2 ms to reach the maximum aperture */
+#define HWSERVOS_EXT_TIME_MIN_ANGLE 800 /* 0.8 ms to reach the minimum aperture */
 
 /** I2C and devices attached to I2C **/
 
@@ -0,0 +1,259 @@
+/** ******************************************************************************
+
+    Project: Robotics library for the Autonomous Robotics Development Platform
+    Author: Jorge Sánchez de Nova jssdn (mail)_(at) kth.se
+    Code: ADC path benchmark. Latency and throughput of the MAX1231 reads over SPI
+
+    License: Licensed under GPL2.0
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+    Usage: adcbench [iterations] [device] [stream_hz]
+    After the on-demand reads, streams 'iterations' scans of the temperature and channels 0-15 at stream_hz and 
+    reports the period jitter from the frame timestamps and the frames lost by a polling reader.
+    Set ROBOTLIB_SPISIM to run it against the simulated MAX1231 instead of the board, ROBOTLIB_SPIREC=<file> to
+    record the traffic and ROBOTLIB_SPIREPLAY=<file> to replay a record.
+
+* ******************************************************************************* **/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+//Xenomai
+#include <native/task.h>
+#include <native/timer.h>
+//--
+
+#include "xspidev.h"
+#include "xspidev_sim.h"
+#include "max1231adc.h"
+#include "util.h"
+
+#define STACK_SIZE 8192
+#define BENCH_PRIO 50
+#define BENCH_DEFAULT_ITER 10000
+#define BENCH_DEFAULT_DEVICE "/dev/spi0"
+#define BENCH_DEFAULT_STREAM_HZ 1000
+#define BENCH_READER_POLL_NS 10000000llu /*! Reader poll period, well under MAX1231_STREAM_RING frames */
+
+XSPIDEV spi;
+MAX1231 adc;
+SPI_SIM_MAX1231 model;
+unsigned iterations = BENCH_DEFAULT_ITER;
+unsigned stream_hz = BENCH_DEFAULT_STREAM_HZ;
+
+typedef struct{
+    const char* name;
+    int (*fn)(void);
+    unsigned samples; ///< Conversion results per call
+    RTIME min, max, total; ///< Latency of one call
+    unsigned errors;
+} BENCH_ARG;
+
+/* One channel */
+int bench_one(void)
+{
+    int value;
+
+    return adc_read_one_once(&adc, 3, &value);
+}
+
+/* Full scan, 0 to 15 */
+int bench_scan(void)
+{
+    uint8_t dest[2 * 16 + 2];
+
+    return adc_read_scan_0_N(&adc, dest, 15);
+}
+
+/* Temperature */
+int bench_temp(void)
+{
+    fix16_t temp;
+
+    return adc_get_temperature_fix16(&adc, &temp);
+}
+
+void bench_task(void* cookie)
+{
+    BENCH_ARG* arg = (BENCH_ARG*)cookie;
+    RTIME start, t;
+    unsigned i;
+
+    arg->min = ~0ull;
+    arg->max = 0;
+    arg->total = 0;
+    arg->errors = 0;
+
+    for( i = 0 ; i < iterations ; i++ ){
+	start = rt_timer_tsc();
+	if( arg->fn() < 0 )
+	    arg->errors++;
+	t = rt_timer_tsc() - start;
+
+	arg->total += t;
+	if( t < arg->min )
+	    arg->min = t;
+	if( t > arg->max )
+	    arg->max = t;
+    }
+}
+
+void bench_run(BENCH_ARG* arg)
+{
+    RT_TASK task;
+    uint64_t bus = model.dev.bus_ns;
+    unsigned long long mean;
+    int err;
+
+    if( (err = rt_task_spawn(&task, NULL, STACK_SIZE, BENCH_PRIO, T_JOINABLE, &bench_task, arg)) < 0 ){
+	util_pdbg(DBG_CRIT, "BENCH: Cannot spawn task. err = %d\n", err);
+	exit(err);
+    }
+
+    rt_task_join(&task);
+
+    mean = (unsigned long long)rt_timer_tsc2ns(arg->total) / iterations;
+
+    printf("%-28s %8llu ns/call ( min %8llu max %8llu ) %8llu samples/s, %u errors\n", arg->name, mean,
+	   (unsigned long long)rt_timer_tsc2ns(arg->min), (unsigned long long)rt_timer_tsc2ns(arg->max),
+	   mean ? 1000000000llu * arg->samples / mean : 0, arg->errors);
+
+    if( spi.transport == &spi_transport_sim )
+	printf("%-28s %8llu ns/call of simulated bus time\n", "",
+	       (unsigned long long)(model.dev.bus_ns - bus) / iterations);
+}
+
+/* Every frame through a reader, plus the cost of a latest frame read */
+void stream_task(void* cookie)
+{
+    MAX1231_PLAN plan = { MAX1231_CONV_AIN15 | MAX1231_CONV_SCAN_T_00_N, MAX1231_AVERAGE_1, stream_hz };
+    MAX1231_READER reader;
+    MAX1231_FRAME frame;
+    RTIME prev = 0, period = 1000000000llu / stream_hz, d, jmin = ~0ull, jmax = 0, lat = 0, start;
+    unsigned long frames = 0, latest = 0, prev_seq = 0;
+    int err;
+
+    max1231_stream_reader_init(&adc, &reader);
+
+    if( (err = max1231_stream_start(&adc, &plan, BENCH_PRIO + 1)) < 0 ){
+	printf("Stream: cannot start at %u Hz. err = %d\n", stream_hz, err);
+	return;
+    }
+
+    while( frames < iterations ){
+	rt_task_sleep(rt_timer_ns2ticks(BENCH_READER_POLL_NS));
+
+	start = rt_timer_tsc();
+	if( max1231_stream_latest(&adc, &frame) == 0 ){
+	    lat += rt_timer_tsc() - start;
+	    latest++;
+	}
+
+	while( frames < iterations && max1231_stream_next(&adc, &reader, &frame) == 0 ){
+	    // Consecutive frames only
+	    if( prev != 0 && frame.seq == prev_seq + 1 ){
+		d = frame.time_ns - prev;
+		if( d < jmin )
+		    jmin = d;
+		if( d > jmax )
+		    jmax = d;
+	    }
+	    prev = frame.time_ns;
+	    prev_seq = frame.seq;
+	    frames++;
+	}
+    }
+
+    max1231_stream_stop(&adc);
+
+    printf("%-28s %8u Hz, %lu frames of %u results, %lu lost, %lu errors, %lu overruns\n", "max1231_stream", stream_hz, 
+	   frames, adc.stream_results, reader.lost, adc.stream_errors, adc.stream_overruns);
+    if( jmax != 0 )
+	printf("%-28s %8lld ns to %8lld ns period error\n", "", (long long)jmin - (long long)period, 
+	       (long long)jmax - (long long)period);
+    if( latest != 0 )
+	printf("%-28s %8llu ns/call\n", "max1231_stream_latest", (unsigned long long)rt_timer_tsc2ns(lat) / latest);
+}
+
+int main( int argc, char** argv )
+{
+    BENCH_ARG benches[] = {
+	{ .name = "adc_read_one_once", .fn = bench_one, .samples = 1 },
+	{ .name = "adc_read_scan_0_N (0-15)", .fn = bench_scan, .samples = 16 },
+	{ .name = "adc_get_temperature_fix16", .fn = bench_temp, .samples = 1 },
+    };
+    const char* device = BENCH_DEFAULT_DEVICE;
+    RT_TASK task;
+    unsigned i;
+    int err;
+
+    if( argc > 1 )
+	iterations = atoi(argv[1]);
+    if( argc > 2 )
+	device = argv[2];
+    if( argc > 3 )
+	stream_hz = atoi(argv[3]);
+
+    if( ( err = mlockall(MCL_CURRENT | MCL_FUTURE)) < 0 ) {
+	util_pdbg(DBG_CRIT, "BENCH: Memory could not be locked. Exiting...\n");
+	exit(-1);
+    }
+
+    // The model must be there before the device is opened
+    if( getenv("ROBOTLIB_SPISIM") != NULL ){
+	if( (err = spi_sim_model_max1231(&model, device)) < 0 ){
+	    util_pdbg(DBG_CRIT, "BENCH: Cannot attach the MAX1231 model. err = %d\n", err);
+	    exit(err);
+	}
+	for( i = 0 ; i < SPI_SIM_MAX1231_CHANNELS ; i++ )
+	    model.ain[i] = i * 256;
+	model.noise = 8;
+    }
+
+    if( (err = spi_init(&spi, device, 0, 0, 0, 0, 0, 0, 0, 0, 0)) < 0 ){
+	util_pdbg(DBG_CRIT, "BENCH: Cannot init SPI. err = %d\n", err);
+	exit(err);
+    }
+
+    if( (err = max1231_init(&adc, &spi)) < 0 ){
+	util_pdbg(DBG_CRIT, "BENCH: Cannot init the MAX1231. err = %d\n", err);
+	exit(err);
+    }
+
+    adc_reset(&adc);
+    adc_config_all_uni_single(&adc);
+
+    printf("ADC benchmark: %u iterations, %s transport, %s\n", iterations, spi.transport->name, device);
+
+    for( i = 0 ; i < ARRAY_SIZE(benches) ; i++ )
+	bench_run(&benches[i]);
+
+    if( (err = rt_task_spawn(&task, NULL, STACK_SIZE, BENCH_PRIO, T_JOINABLE, &stream_task, NULL)) < 0 ){
+	util_pdbg(DBG_CRIT, "BENCH: Cannot spawn task. err = %d\n", err);
+	exit(err);
+    }
+    rt_task_join(&task);
+
+    if( spi.transport == &spi_transport_sim )
+	printf("Model: %lu conversions, %lu bytes clocked out early\n", model.conversions, model.early);
+
+    max1231_clean(&adc);
+    spi_clean(&spi);
+
+    return 0;
+}
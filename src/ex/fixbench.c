@@ -0,0 +1,174 @@
+/** ******************************************************************************
+
+    Project: Robotics library for the Autonomous Robotics Development Platform
+    Author: Jorge Sánchez de Nova jssdn (mail)_(at) kth.se
+    Code: Fixed point benchmark. Q16.16 ( fixedpt.h ) vs the soft-float emulation of the PPC405
+
+    License: Licensed under GPL2.0
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+    Usage: fixbench [iterations]
+    Prints the cost of each operation and the worst error of the fixed point result against float.
+
+* ******************************************************************************* **/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <sys/mman.h>
+
+//Xenomai
+#include <native/task.h>
+#include <native/timer.h>
+//--
+
+#include "fixedpt.h"
+#include "lis3lv02dl.h"
+#include "max1231adc.h"
+#include "util.h"
+
+#define STACK_SIZE 8192
+#define BENCH_PRIO 50
+#define BENCH_DEFAULT_ITER 100000
+#define BENCH_INPUTS 256 /* Inputs cycled through, so nothing folds at compile time. Power of 2 */
+
+unsigned iterations = BENCH_DEFAULT_ITER;
+
+/* Same inputs in both formats */
+float fa[BENCH_INPUTS], fb[BENCH_INPUTS];
+fix16_t xa[BENCH_INPUTS], xb[BENCH_INPUTS];
+int raw[BENCH_INPUTS];
+
+volatile float fsink;
+volatile fix16_t xsink;
+
+#define BENCH_LOOP(EXPR, SINK) do{ \
+	RTIME start = rt_timer_tsc(); \
+	unsigned i, k; \
+	for( i = 0 ; i < iterations ; i++ ){ \
+	    k = i & (BENCH_INPUTS - 1); \
+	    SINK = (EXPR); \
+	} \
+	elapsed = rt_timer_tsc() - start; \
+    }while(0)
+
+typedef struct{
+    const char* name;
+    RTIME fl; ///< Soft-float loop
+    RTIME fx; ///< Fixed point loop
+    double err; ///< Worst absolute error of the fixed point result
+} BENCH_RESULT;
+
+enum{ B_MUL, B_DIV, B_SQRT, B_SIN, B_ATAN2, B_ACC, B_TEMP, B_VOLTS, B_NUM_OF };
+
+BENCH_RESULT res[B_NUM_OF] = {
+    [B_MUL] = { .name = "mul" }, [B_DIV] = { .name = "div" }, [B_SQRT] = { .name = "sqrt" },
+    [B_SIN] = { .name = "sin" }, [B_ATAN2] = { .name = "atan2" }, [B_ACC] = { .name = "acc counts -> g" },
+    [B_TEMP] = { .name = "adc temperature" }, [B_VOLTS] = { .name = "adc counts -> V" }
+};
+
+void bench_task(void* cookie)
+{
+    RTIME elapsed;
+
+    BENCH_LOOP(fa[k] * fb[k], fsink);				res[B_MUL].fl = elapsed;
+    BENCH_LOOP(fix16_mul(xa[k], xb[k]), xsink);			res[B_MUL].fx = elapsed;
+    BENCH_LOOP(fa[k] / fb[k], fsink);				res[B_DIV].fl = elapsed;
+    BENCH_LOOP(fix16_div(xa[k], xb[k]), xsink);			res[B_DIV].fx = elapsed;
+    BENCH_LOOP(sqrtf(fb[k]), fsink);				res[B_SQRT].fl = elapsed;
+    BENCH_LOOP(fix16_sqrt(xb[k]), xsink);			res[B_SQRT].fx = elapsed;
+    BENCH_LOOP(sinf(fa[k]), fsink);				res[B_SIN].fl = elapsed;
+    BENCH_LOOP(fix16_sin(fix16_rad_to_brad(xa[k])), xsink);	res[B_SIN].fx = elapsed;
+    BENCH_LOOP(atan2f(fa[k], fb[k]), fsink);			res[B_ATAN2].fl = elapsed;
+    BENCH_LOOP((fix16_t)fix16_atan2(xa[k], xb[k]), xsink);	res[B_ATAN2].fx = elapsed;
+    BENCH_LOOP((float)raw[k] / SCALE_FACTOR_6G_16bit, fsink);	res[B_ACC].fl = elapsed;
+    BENCH_LOOP(fix16_sat(((int64_t)raw[k] * LIS3_G_PER_COUNT_6G_16bit) >> 16), xsink); res[B_ACC].fx = elapsed;
+    BENCH_LOOP((float)(raw[k] & 0xfff) / 8, fsink);		res[B_TEMP].fl = elapsed;
+    BENCH_LOOP((raw[k] & 0xfff) << (16 - MAX1231_TEMP_FRAC_BITS), xsink); res[B_TEMP].fx = elapsed;
+    BENCH_LOOP((float)(raw[k] & 0xfff) * 2.5f / 4096, fsink);	res[B_VOLTS].fl = elapsed;
+    BENCH_LOOP(adc_raw_to_volts(raw[k], FIX16(2.5)), xsink);	res[B_VOLTS].fx = elapsed;
+}
+
+/* Worst error of each fixed point operation over the inputs. Outside the timed loops */
+void bench_check()
+{
+    double e[B_NUM_OF] = { 0 };
+    double v;
+    int k, b;
+
+    for( k = 0 ; k < BENCH_INPUTS ; k++ ){
+	v = fix16_atan2(xa[k], xb[k]) / 4294967296.0 * 2 * M_PI;
+	v -= atan2(fa[k], fb[k]);
+	v = fabs(remainder(v, 2 * M_PI));
+
+	e[B_MUL] = fmax(e[B_MUL], fabs(fix16_mul(xa[k], xb[k]) / 65536.0 - (double)fa[k] * fb[k]));
+	e[B_DIV] = fmax(e[B_DIV], fabs(fix16_div(xa[k], xb[k]) / 65536.0 - (double)fa[k] / fb[k]));
+	e[B_SQRT] = fmax(e[B_SQRT], fabs(fix16_sqrt(xb[k]) / 65536.0 - sqrt(fb[k])));
+	e[B_SIN] = fmax(e[B_SIN], fabs(fix16_sin(fix16_rad_to_brad(xa[k])) / 65536.0 - sin(fa[k])));
+	e[B_ATAN2] = fmax(e[B_ATAN2], v);
+	e[B_ACC] = fmax(e[B_ACC], fabs(fix16_sat(((int64_t)raw[k] * LIS3_G_PER_COUNT_6G_16bit) >> 16) / 65536.0 
+				       - raw[k] / SCALE_FACTOR_6G_16bit));
+	e[B_VOLTS] = fmax(e[B_VOLTS], fabs(adc_raw_to_volts(raw[k], FIX16(2.5)) / 65536.0 - (raw[k] & 0xfff) * 2.5 / 4096));
+    }
+
+    for( b = 0 ; b < B_NUM_OF ; b++ )
+	res[b].err = e[b];
+}
+
+int main( int argc, char** argv )
+{
+    RT_TASK task;
+    unsigned seed = 1;
+    int err, k, b;
+
+    if( argc > 1 )
+	iterations = atoi(argv[1]);
+
+    if( ( err = mlockall(MCL_CURRENT | MCL_FUTURE)) < 0 ) {
+	util_pdbg(DBG_CRIT, "BENCH: Memory could not be locked. Exiting...\n");
+	exit(-1);
+    }
+
+    // a in [-100, 100), b in (0, 100): exact in both formats
+    for( k = 0 ; k < BENCH_INPUTS ; k++ ){
+	seed = seed * 1103515245 + 12345;
+	xa[k] = (fix16_t)((seed >> 8) % (200 << 16)) - (100 << 16);
+	seed = seed * 1103515245 + 12345;
+	xb[k] = (fix16_t)((seed >> 8) % (100 << 16)) + 1;
+	fa[k] = xa[k] / 65536.0f;
+	fb[k] = xb[k] / 65536.0f;
+	raw[k] = (int16_t)(seed >> 12);
+    }
+
+    if( (err = rt_task_spawn(&task, NULL, STACK_SIZE, BENCH_PRIO, T_JOINABLE, &bench_task, NULL)) < 0 ){
+	util_pdbg(DBG_CRIT, "BENCH: Cannot spawn task. err = %d\n", err);
+	exit(err);
+    }
+
+    rt_task_join(&task);
+
+    bench_check();
+
+    printf("Fixed point benchmark: %u iterations\n", iterations);
+    printf("%-18s %12s %12s %12s\n", "", "float ns/op", "fix16 ns/op", "max error");
+
+    for( b = 0 ; b < B_NUM_OF ; b++ )
+	printf("%-18s %12llu %12llu %12.6f\n", res[b].name,
+	       (unsigned long long)rt_timer_tsc2ns(res[b].fl) / iterations,
+	       (unsigned long long)rt_timer_tsc2ns(res[b].fx) / iterations, res[b].err);
+
+    return 0;
+}
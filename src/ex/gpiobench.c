@@ -0,0 +1,152 @@
+/** ******************************************************************************
+
+    Project: Robotics library for the Autonomous Robotics Development Platform
+    Author: Jorge Sánchez de Nova jssdn (mail)_(at) kth.se
+    Code: GPIO access benchmark. Mutex vs lock-free paths, with and without contention
+
+    License: Licensed under GPL2.0
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+    Usage: gpiobench [iterations]
+    Set ROBOTLIB_SIMMEM to run it against the simulated bus instead of the board.
+
+* ******************************************************************************* **/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+//Xenomai
+#include <native/task.h>
+#include <native/timer.h>
+//--
+
+#include "gpio.h"
+#include "dev_mmaps_parms.h"
+#include "util.h"
+
+#define STACK_SIZE 8192
+#define BENCH_PRIO 50
+#define BENCH_TASKS 2 /* Contending tasks. One per muxed field of the General Outputs */
+#define BENCH_DEFAULT_ITER 100000
+
+GPIO outputs;
+GPIO inputs;
+unsigned iterations = BENCH_DEFAULT_ITER;
+
+typedef struct{
+    const char* name;
+    int (*fn)(GPIO* gpio, unsigned mask, unsigned shift, unsigned offset, unsigned value);
+    unsigned mask;
+    unsigned shift;
+    RTIME elapsed;
+} BENCH_ARG;
+
+/* Adapters so reads and writes share the same loop */
+
+int bench_read(GPIO* gpio, unsigned mask, unsigned shift, unsigned offset, unsigned value)
+{
+    return gpio_read(gpio, mask, shift, offset, &value);
+}
+
+int bench_read_locked(GPIO* gpio, unsigned mask, unsigned shift, unsigned offset, unsigned value)
+{
+    return gpio_read_locked(gpio, mask, shift, offset, &value);
+}
+
+void bench_task(void* cookie)
+{
+    BENCH_ARG* arg = (BENCH_ARG*)cookie;
+    GPIO* gpio = (arg->fn == bench_read || arg->fn == bench_read_locked) ? &inputs : &outputs;
+    RTIME start;
+    unsigned i;
+
+    start = rt_timer_tsc();
+
+    for( i = 0 ; i < iterations ; i++ )
+	arg->fn(gpio, arg->mask, arg->shift, GPIO_DATA_OFFSET, i);
+
+    arg->elapsed = rt_timer_tsc() - start;
+}
+
+/* Runs 'ntasks' copies of the loop at once and prints the mean cost of an access */
+void bench_run(const char* name, int (*fn)(GPIO*, unsigned, unsigned, unsigned, unsigned), int ntasks)
+{
+    static const unsigned masks[BENCH_TASKS] = { GENERAL_OUTPUTS_LED4_MASK, GENERAL_OUTPUTS_LEDPOS_MASK };
+    static const unsigned shifts[BENCH_TASKS] = { GENERAL_OUTPUTS_LED4_SHIFT, GENERAL_OUTPUTS_LEDPOS_SHIFT };
+    RT_TASK tasks[BENCH_TASKS];
+    BENCH_ARG args[BENCH_TASKS];
+    RTIME total = 0;
+    int i, err;
+
+    for( i = 0 ; i < ntasks ; i++ ){
+	args[i].name = name;
+	args[i].fn = fn;
+	args[i].mask = masks[i];
+	args[i].shift = shifts[i];
+	args[i].elapsed = 0;
+
+	if( (err = rt_task_spawn(&tasks[i], NULL, STACK_SIZE, BENCH_PRIO, T_JOINABLE, &bench_task, &args[i])) < 0 ){
+	    util_pdbg(DBG_CRIT, "BENCH: Cannot spawn task. err = %d\n", err);
+	    exit(err);
+	}
+    }
+
+    for( i = 0 ; i < ntasks ; i++ ){
+	rt_task_join(&tasks[i]);
+	total += args[i].elapsed;
+    }
+
+    printf("%-22s %d task(s): %8llu ns/access\n", name, ntasks,
+	   (unsigned long long)rt_timer_tsc2ns(total) / ((unsigned long long)iterations * ntasks));
+}
+
+int main( int argc, char** argv )
+{
+    int err, n;
+
+    if( argc > 1 )
+	iterations = atoi(argv[1]);
+
+    if( ( err = mlockall(MCL_CURRENT | MCL_FUTURE)) < 0 ) {
+	util_pdbg(DBG_CRIT, "BENCH: Memory could not be locked. Exiting...\n");
+	exit(-1);
+    }
+
+    if( (err = gpio_init(&outputs, GENERAL_OUTPUTS_BASE, GENERAL_OUTPUTS_END, GENERAL_OUTPUTS_NUM_OF_CHAN, GPIO_FLAGS_OUTPUT, 0, NULL, 0)) < 0 ){
+	util_pdbg(DBG_CRIT, "BENCH: Cannot init General Outputs. err = %d\n", err);
+	exit(err);
+    }
+
+    if( (err = gpio_init(&inputs, GENERAL_INPUTS_BASE, GENERAL_INPUTS_END, GENERAL_INPUTS_NUM_OF_CHAN, GPIO_FLAGS_INPUT, 0, NULL, 0)) < 0 ){
+	util_pdbg(DBG_CRIT, "BENCH: Cannot init General Inputs. err = %d\n", err);
+	exit(err);
+    }
+
+    printf("GPIO benchmark: %u iterations per task\n", iterations);
+
+    for( n = 1 ; n <= BENCH_TASKS ; n++ ){
+	bench_run("gpio_read_locked", bench_read_locked, n);
+	bench_run("gpio_read", bench_read, n);
+	bench_run("gpio_write_locked", gpio_write_locked, n);
+	bench_run("gpio_write", gpio_write, n);
+    }
+
+    gpio_clean(&inputs);
+    gpio_clean(&outputs);
+
+    return 0;
+}
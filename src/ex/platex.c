@@ -44,6 +44,8 @@
 #include "platform_io.h"     /* High-level functions for GPIO devices */
 #include "util.h"	     /* Some commonly used functions all across the library */
 #include "motors.h"	     /* DC Motors and Encoders */
+#include "trajectory.h"	     /* Motion profiles */
+#include "fixedpt.h"	     /* Q16.16 arithmetic */
 #include "hwservos.h"        /* RC Servos controller */
 #include "i2ctools.h"	     /* I2C */
 #include "xspidev.h"	     /* SPI */
@@ -58,6 +60,7 @@
 #define MAX_PRIO 1
 #define ADC_PRIO 3
 #define STD_PRIO 25
+#define LEDS_PRIO 2
 
 /* Global variables */
 int irq_counter = 0; 
@@ -90,6 +93,7 @@ RT_TASK clean_ptr;
 RTIME watchdog_period_ns =  		 0750000000llu;
 RTIME hwservos_period_ns =  		 1000000000llu;
 RTIME motors_period_ns =  		 2500000000llu;
+#define MOTORS_RATE_HZ 100 /* Profile ticks. Speeds change every motors_period_ns */
 RTIME adc_period_ns =  			 1000000000llu;
 RTIME acc_period_ns =  			 3000000000llu;
 RTIME sonar_period_ns = 		 1500000000llu;
@@ -111,11 +115,16 @@ void gpio_isr(void* cookie)
     }
 }
 
+/* Input events: latch the buttons in the position leds as soon as they change */
+void buttons_handler(GPIO* gpio, const GPIO_EVENT* ev, void* arg)
+{
+    pio_write_ledspos((ev->value & GENERAL_INPUTS_PUSHBUT_MASK) >> GENERAL_INPUTS_PUSHBUT_SHIFT);
+}
+
 /* Example of a Watchdog task */
 void watchdog(void *cookie) {
     int err;
     unsigned but; 
-    int i = 0; 
     unsigned long overrun;
         
     if ((err = rt_task_set_periodic(NULL, TM_NOW, rt_timer_ns2ticks(watchdog_period_ns))) < 0) {
@@ -130,21 +139,10 @@ void watchdog(void *cookie) {
 	    return;
 	}
 	
-	/* We latch the buttons in the leds */
-	pio_read_buttons(&but);	
-	pio_write_ledspos(but);
-	
-	/* A simple binary counter here to illustrate */
-//  	pio_write_leds4(i);
-
+	/* The buttons are latched in the position leds by buttons_handler(). The led bar counts in the LED engine */
 	pio_read_gi_all(&but,0);
 	
 	printf("WATCHDOG: Bumpers:%d\n",but); 
-	
-// 	if(i == 0xf)
-// 	    i = 0;
-// 	else
-// 	    i++;
     }
 }
 
@@ -154,7 +152,7 @@ void hwservos_task(void* cookie)
     int err,i; 
     unsigned long overrun;
     
-    unsigned angle = HWSERVOS_TIME_MIN_ANGLE;       
+    unsigned angle[HWSERVOS_MAX_NUM_OF];       
 	    
     if ((err = rt_task_set_periodic(NULL, TM_NOW, rt_timer_ns2ticks(hwservos_period_ns))) < 0) {
 	util_pdbg(DBG_WARN, "HWSERVOS_TASK: - Error while set periodic, code %d\n",err);
@@ -169,13 +167,11 @@ void hwservos_task(void* cookie)
 	    return;
 	}
 	
-	if( angle > HWSERVOS_TIME_MAX_ANGLE )
- 	    angle = HWSERVOS_TIME_MIN_ANGLE;	    
-	else 
-	    angle = (angle + 100);
-	
+	/* Sweep all the servos together, end to end, smoothly */
 	for( i = 0 ; i < HWSERVOS_NUM_OF ; i++)    
-	    hwservos_set_pos(&servos, i, angle);        	
+	    angle[i] = ( servos.values[i] == HWSERVOS_TIME_MIN_ANGLE ) ? HWSERVOS_TIME_MAX_ANGLE : HWSERVOS_TIME_MIN_ANGLE;
+	
+	hwservos_move_group(&servos, (1 << HWSERVOS_NUM_OF) - 1, angle, 800, HWSERVOS_EASE_MINJERK);
     }
 }
 
@@ -187,9 +183,22 @@ void motors_task(void* cookie)
     
     unsigned speed = 0;            
     int enc,enc_prev; 
+    unsigned tick = 0;
+    TRAJ traj; 
+
+    /* Speeds in duty cycle units: full scale in 1s, S-curve over 250ms */
+    if( (err = traj_init(&traj, MOTORS_NUM_OF, MOTORS_RATE_HZ, TRAJ_PROFILE_SCURVE, 
+			 MOTORS_MAX_SPEED, MOTORS_MAX_SPEED, 4*MOTORS_MAX_SPEED)) < 0 ){
+	util_pdbg(DBG_WARN, "MOTORS_TASK: - Error while traj_init, code %d\n",err);
+	return;
+    }
+
+    for ( i = 0 ; i < MOTORS_NUM_OF ; i++)
+	traj_set_output(&traj, i, TRAJ_OUT_PWM, FIX16_ONE);
 	    
-    if ((err = rt_task_set_periodic(NULL, TM_NOW, rt_timer_ns2ticks(motors_period_ns))) < 0) {
+    if ((err = rt_task_set_periodic(NULL, TM_NOW, rt_timer_ns2ticks(1000000000llu / MOTORS_RATE_HZ))) < 0) {
 	util_pdbg(DBG_WARN, "MOTORS_TASK: - Error while set periodic, code %d\n",err);
+	traj_clean(&traj);
 	return;
     }
     
@@ -210,13 +219,20 @@ void motors_task(void* cookie)
 	
 	if (err) {
 	    util_pdbg(DBG_CRIT,"MOTORS_TASK: Error while rt_task_wait_period %d\n",err);
-	    return;
+	    break;
 	}
 	
+	traj_step(&traj);
+	traj_feed(&traj, &motors);
+
+	if( ++tick < motors_period_ns / (1000000000llu / MOTORS_RATE_HZ) )
+	    continue;
+	tick = 0;
+
 	speed = (speed + 100)%MOTORS_MAX_SPEED;			
 	
 	for ( i = 0 ; i < MOTORS_NUM_OF ; i++){	    
-	    motors_pwm_set_speed(&motors, i, speed);	
+	    traj_move_velocity(&traj, i, speed);	
 	    printf("MOTORS_TASK: - Motor %d speed %d/1023\n",i, speed);
 	}
 	
@@ -226,7 +242,8 @@ void motors_task(void* cookie)
 	}
 	
     }
-    
+
+    traj_clean(&traj);
 }
 
 /* Task that samples the ADC and give readings from channels */
@@ -234,7 +251,8 @@ void adc_task(void* cookie)
 {
     int err,i,j,k; 
     unsigned long overrun;
-    int ret; 
+    fix16_t temp; 
+    char buf[FIX16_STR_LEN];
     
     uint8_t dest[32];    
         
@@ -269,8 +287,8 @@ void adc_task(void* cookie)
 	    printf("\n");
 	}
 	
-	adc_get_temperature(&adc, &ret);
-	printf("ADC_TASK: Temp:%.2f\n",(float)ret/8);
+	adc_get_temperature_fix16(&adc, &temp);
+	printf("ADC_TASK: Temp:%s\n", fix16_to_str(temp, buf, 2));
 	adc_reset_fifo(&adc); // TODO:needed?
     }       
 }
@@ -280,7 +298,8 @@ void acc_task(void* cookie)
 {
     int err; 
     unsigned long overrun;
-    float x,y,z;
+    fix16_t x,y,z;
+    char bx[FIX16_STR_LEN], by[FIX16_STR_LEN], bz[FIX16_STR_LEN];
     	    
     if ((err = rt_task_set_periodic(NULL, TM_NOW, rt_timer_ns2ticks(motors_period_ns))) < 0) {
 	util_pdbg(DBG_WARN, "ACC_TASK: - Error while set periodic, code %d\n",err);
@@ -302,11 +321,9 @@ void acc_task(void* cookie)
 	//ACC actions	
 	lis3lv02dl_read(&acc);
 	
-        x = (float)(acc.xacc - acc.xcal)/(SCALE_FACTOR_6G_16bit); 
-        y = (float)(acc.yacc - acc.ycal)/(SCALE_FACTOR_6G_16bit); 
-        z = (float)(acc.zacc - acc.zcal)/(SCALE_FACTOR_6G_16bit); 
+        lis3lv02dl_get_g(&acc, LIS3_G_PER_COUNT_6G_16bit, &x, &y, &z);
 
-        printf("ACC_TASK: X = %f\tY = %f\tZ = %f\n", x,y,z);
+        printf("ACC_TASK: X = %s\tY = %s\tZ = %s\n", fix16_to_str(x, bx, 4), fix16_to_str(y, by, 4), fix16_to_str(z, bz, 4));
     }
 }
 
@@ -344,12 +361,24 @@ void main_task(void* cookie)
     
     util_pdbg(DBG_INFO, "Initializing GPIOs\n");
     		      
-//     if( (err = pio_init_all(gpio_isr, NULL)) < 0 ) {
-    if( (err = pio_init_all(NULL, NULL)) < 0 ) {
+    if( (err = pio_init_all(gpio_dispatch_isr, NULL)) < 0 ) {
 	util_pdbg(DBG_CRIT, "GPIO devices could not be correctly initialized\n");	    
 	perror(NULL);
 	exit(err);
     }    
+
+    if( (err = pio_subscribe_inputs(GENERAL_INPUTS_PUSHBUT_MASK, GPIO_EDGE_BOTH, buttons_handler, NULL)) < 0 ) {
+	util_pdbg(DBG_CRIT, "Buttons handler could not be subscribed\n");	    
+	exit(err);
+    }    
+
+    // A simple binary counter in the led bar, one count per watchdog period
+    pio_leds_counter(watchdog_period_ns / 1000000);
+
+    if( (err = pio_leds_start(LEDS_PRIO)) < 0 ) {
+	util_pdbg(DBG_CRIT, "LED engine could not be started\n");	    
+	exit(err);
+    }    
     
     if( (err = rt_task_spawn(&watchdog_ptr, "Watchdog", STACK_SIZE, WATCHDOG_PRIO, 0, &watchdog, NULL)) < 0){
 	util_pdbg(DBG_CRIT, "MAIN: Watchdog could not be correctly initialized\n");
@@ -364,6 +393,11 @@ void main_task(void* cookie)
 	exit(err);
     }
 
+    if( (err = hwservos_engine_start(&servos, HWSERVOS_FRAME_RATE_HZ, STD_PRIO + 1)) < 0 ) {
+	util_pdbg(DBG_CRIT, "HWSERVOS interpolation engine could not be started\n");	    
+	exit(err);
+    }
+
     if( (err = rt_task_spawn(&hwservos_ptr, "HWServos", STACK_SIZE, STD_PRIO, 0, &hwservos_task, NULL)) < 0){
 	perror(NULL);
 	util_pdbg(DBG_CRIT, "HWServos periodic task could not be correctly initialized\n");
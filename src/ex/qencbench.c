@@ -0,0 +1,142 @@
+/** ******************************************************************************
+
+    Project: Robotics library for the Autonomous Robotics Development Platform
+    Author: Jorge Sánchez de Nova jssdn (mail)_(at) kth.se
+    Code: Encoder read benchmark. Per-encoder reads vs motors_qenc_read_all() snapshot
+
+    License: Licensed under GPL2.0
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+    Usage: qencbench [iterations]
+    Set ROBOTLIB_SIMMEM to run it against the simulated bus instead of the board.
+
+* ******************************************************************************* **/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+//Xenomai
+#include <native/task.h>
+#include <native/timer.h>
+//--
+
+#include "motors.h"
+#include "dev_mmaps_parms.h"
+#include "util.h"
+
+#define STACK_SIZE 8192
+#define BENCH_PRIO 50
+#define BENCH_DEFAULT_ITER 100000
+
+MOTOR motors;
+unsigned iterations = BENCH_DEFAULT_ITER;
+
+typedef struct{
+    RTIME elapsed; ///< Total time of the loop
+    RTIME skew; ///< Worst time between the first and the last counter of one update
+} BENCH_RESULT;
+
+BENCH_RESULT res_single, res_all;
+
+/* One odometry update as it was done before: one mutex round trip per encoder */
+void bench_single(void* cookie)
+{
+    int value[QENC_MAX_NUM_OF_CORES], prev[QENC_MAX_NUM_OF_CORES];
+    RTIME start, first, skew;
+    unsigned i, e;
+
+    start = rt_timer_tsc();
+
+    for( i = 0 ; i < iterations ; i++ ){
+	first = rt_timer_tsc();
+	for( e = 0 ; e < motors.num_of_encs ; e++ )
+	    motors_qenc_read_enc(&motors, e, &value[e], &prev[e]);
+	if( (skew = rt_timer_tsc() - first) > res_single.skew )
+	    res_single.skew = skew;
+    }
+
+    res_single.elapsed = rt_timer_tsc() - start;
+}
+
+/* Same update with a single snapshot */
+void bench_all(void* cookie)
+{
+    QENC_SNAPSHOT snap;
+    RTIME start, first, skew;
+    unsigned i;
+
+    memset(&snap, 0, sizeof(snap));
+
+    start = rt_timer_tsc();
+
+    for( i = 0 ; i < iterations ; i++ ){
+	first = rt_timer_tsc();
+	motors_qenc_read_all(&motors, &snap);
+	if( (skew = rt_timer_tsc() - first) > res_all.skew )
+	    res_all.skew = skew;
+    }
+
+    res_all.elapsed = rt_timer_tsc() - start;
+}
+
+void bench_run(const char* name, void (*fn)(void*), BENCH_RESULT* res)
+{
+    RT_TASK task;
+    int err;
+
+    if( (err = rt_task_spawn(&task, NULL, STACK_SIZE, BENCH_PRIO, T_JOINABLE, fn, NULL)) < 0 ){
+	util_pdbg(DBG_CRIT, "BENCH: Cannot spawn task. err = %d\n", err);
+	exit(err);
+    }
+
+    rt_task_join(&task);
+
+    printf("%-22s %8llu ns/update, worst spread between counters %8llu ns\n", name,
+	   (unsigned long long)rt_timer_tsc2ns(res->elapsed) / iterations,
+	   (unsigned long long)rt_timer_tsc2ns(res->skew));
+}
+
+int main( int argc, char** argv )
+{
+    int err;
+
+    if( argc > 1 )
+	iterations = atoi(argv[1]);
+
+    if( ( err = mlockall(MCL_CURRENT | MCL_FUTURE)) < 0 ) {
+	util_pdbg(DBG_CRIT, "BENCH: Memory could not be locked. Exiting...\n");
+	exit(-1);
+    }
+
+    if( (err = motors_init_motor(&motors, 
+				 MOTORS_BASE, MOTORS_END, MOTORS_NUM_OF,
+				 QENC_BASE, QENC_END, QENC_NUM_OF,
+				 0, 0, 0)) < 0 ){
+	util_pdbg(DBG_CRIT, "BENCH: Cannot init motors. err = %d\n", err);
+	exit(err);
+    }
+
+    printf("Encoder benchmark: %u encoders, %u iterations\n", motors.num_of_encs, iterations);
+
+    bench_run("motors_qenc_read_enc", bench_single, &res_single);
+    bench_run("motors_qenc_read_all", bench_all, &res_all);
+
+    motors_clean_motor(&motors);
+
+    return 0;
+}
@@ -0,0 +1,331 @@
+/**
+    @file fixedpt.c
+    
+    @section DESCRIPTION    
+    
+    Robotics library for the Autonomous Robotics Development Platform  
+    
+    @brief Q16.16 fixed point arithmetic, trigonometry and unit conversions for the FPU-less PPC405
+    
+    @author Jorge Sánchez de Nova jssdn (mail)_(at) kth.se
+ 
+    @section LICENSE 
+    
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+    
+    @note The PPC405 has no FPU: every float operation is a call into the soft-float emulation. Values are Q16.16 
+          in 32 bits ( fix16_t ), intermediates are 64 bits and results saturate instead of wrapping. Angles are 
+          binary ( 2^32 per turn ) so the tables index them directly
+
+    @version 0.4-Xenomai       
+    
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "fixedpt.h"
+
+/* sin() over the first quadrant in 256 steps */
+static const fix16_t fix16_sin_table[257] = {
+        0,   402,   804,  1206,  1608,  2010,  2412,  2814,
+     3216,  3617,  4019,  4420,  4821,  5222,  5623,  6023,
+     6424,  6824,  7224,  7623,  8022,  8421,  8820,  9218,
+     9616, 10014, 10411, 10808, 11204, 11600, 11996, 12391,
+    12785, 13180, 13573, 13966, 14359, 14751, 15143, 15534,
+    15924, 16314, 16703, 17091, 17479, 17867, 18253, 18639,
+    19024, 19409, 19792, 20175, 20557, 20939, 21320, 21699,
+    22078, 22457, 22834, 23210, 23586, 23961, 24335, 24708,
+    25080, 25451, 25821, 26190, 26558, 26925, 27291, 27656,
+    28020, 28383, 28745, 29106, 29466, 29824, 30182, 30538,
+    30893, 31248, 31600, 31952, 32303, 32652, 33000, 33347,
+    33692, 34037, 34380, 34721, 35062, 35401, 35738, 36075,
+    36410, 36744, 37076, 37407, 37736, 38064, 38391, 38716,
+    39040, 39362, 39683, 40002, 40320, 40636, 40951, 41264,
+    41576, 41886, 42194, 42501, 42806, 43110, 43412, 43713,
+    44011, 44308, 44604, 44898, 45190, 45480, 45769, 46056,
+    46341, 46624, 46906, 47186, 47464, 47741, 48015, 48288,
+    48559, 48828, 49095, 49361, 49624, 49886, 50146, 50404,
+    50660, 50914, 51166, 51417, 51665, 51911, 52156, 52398,
+    52639, 52878, 53114, 53349, 53581, 53812, 54040, 54267,
+    54491, 54714, 54934, 55152, 55368, 55582, 55794, 56004,
+    56212, 56418, 56621, 56823, 57022, 57219, 57414, 57607,
+    57798, 57986, 58172, 58356, 58538, 58718, 58896, 59071,
+    59244, 59415, 59583, 59750, 59914, 60075, 60235, 60392,
+    60547, 60700, 60851, 60999, 61145, 61288, 61429, 61568,
+    61705, 61839, 61971, 62101, 62228, 62353, 62476, 62596,
+    62714, 62830, 62943, 63054, 63162, 63268, 63372, 63473,
+    63572, 63668, 63763, 63854, 63944, 64031, 64115, 64197,
+    64277, 64354, 64429, 64501, 64571, 64639, 64704, 64766,
+    64827, 64884, 64940, 64993, 65043, 65091, 65137, 65180,
+    65220, 65259, 65294, 65328, 65358, 65387, 65413, 65436,
+    65457, 65476, 65492, 65505, 65516, 65525, 65531, 65535,
+    65536
+};
+
+/* atan(i / 256) as a binary angle */
+static const uint32_t fix16_atan_table[257] = {
+            0,   2670163,   5340245,   8010164,  10679838,  13349187,
+     16018129,  18686582,  21354465,  24021698,  26688200,  29353889,
+     32018685,  34682507,  37345276,  40006910,  42667331,  45326458,
+     47984212,  50640513,  53295284,  55948444,  58599915,  61249621,
+     63897482,  66543421,  69187361,  71829226,  74468939,  77106424,
+     79741605,  82374407,  85004756,  87632577,  90257796,  92880340,
+     95500135,  98117110, 100731191, 103342309, 105950391, 108555367,
+    111157167, 113755721, 116350962, 118942819, 121531227, 124116117,
+    126697423, 129275078, 131849018, 134419178, 136985493, 139547900,
+    142106335, 144660738, 147211045, 149757197, 152299132, 154836791,
+    157370116, 159899047, 162423527, 164943499, 167458907, 169969696,
+    172475810, 174977196, 177473799, 179965568, 182452450, 184934394,
+    187411349, 189883266, 192350096, 194811789, 197268300, 199719579,
+    202165583, 204606264, 207041579, 209471483, 211895933, 214314887,
+    216728303, 219136141, 221538359, 223934919, 226325781, 228710908,
+    231090262, 233463808, 235831508, 238193329, 240549235, 242899194,
+    245243172, 247581137, 249913059, 252238905, 254558647, 256872255,
+    259179700, 261480955, 263775993, 266064788, 268347313, 270623543,
+    272893455, 275157025, 277414230, 279665048, 281909457, 284147437,
+    286378966, 288604026, 290822599, 293034664, 295240206, 297439207,
+    299631651, 301817523, 303996806, 306169488, 308335554, 310494991,
+    312647786, 314793928, 316933406, 319066208, 321192324, 323311746,
+    325424463, 327530468, 329629752, 331722309, 333808132, 335887214,
+    337959550, 340025134, 342083962, 344136031, 346181336, 348219874,
+    350251643, 352276640, 354294865, 356306316, 358310992, 360308894,
+    362300021, 364284375, 366261957, 368232767, 370196809, 372154086,
+    374104599, 376048352, 377985350, 379915596, 381839095, 383755852,
+    385665872, 387569162, 389465727, 391355574, 393238710, 395115141,
+    396984877, 398847924, 400704291, 402553986, 404397019, 406233399,
+    408063135, 409886237, 411702716, 413512582, 415315845, 417112518,
+    418902610, 420686135, 422463104, 424233528, 425997422, 427754796,
+    429505665, 431250041, 432987938, 434719370, 436444350, 438162893,
+    439875013, 441580724, 443280042, 444972981, 446659557, 448339785,
+    450013680, 451681259, 453342536, 454997530, 456646255, 458288728,
+    459924966, 461554985, 463178803, 464796437, 466407904, 468013221,
+    469612406, 471205476, 472792449, 474373344, 475948178, 477516969,
+    479079736, 480636498, 482187271, 483732076, 485270931, 486803855,
+    488330866, 489851983, 491367227, 492876615, 494380167, 495877903,
+    497369841, 498856002, 500336404, 501811068, 503280012, 504743258,
+    506200824, 507652730, 509098996, 510539643, 511974689, 513404156,
+    514828063, 516246430, 517659277, 519066625, 520468494, 521864904,
+    523255875, 524641427, 526021581, 527396357, 528765775, 530129856,
+    531488619, 532842087, 534190278, 535533213, 536870912
+};
+
+/**
+* @brief Saturating division
+*
+* @param a Dividend
+* @param b Divisor
+* @return a / b, truncated. FIX16_MAX or FIX16_MIN ( by the sign of a ) if b is 0
+*/
+
+fix16_t fix16_div(fix16_t a, fix16_t b)
+{
+    if( b == 0 )
+	return ( a < 0 ) ? FIX16_MIN : FIX16_MAX;
+
+    return fix16_sat((int64_t)a * FIX16_ONE / b);
+}
+
+/**
+* @brief Q16.16 from an integer fraction
+*
+* @param num Numerator
+* @param den Denominator
+* @return num / den, saturated. See fix16_div()
+*/
+
+fix16_t fix16_from_ratio(int num, int den)
+{
+    if( den == 0 )
+	return ( num < 0 ) ? FIX16_MIN : FIX16_MAX;
+
+    return fix16_sat((int64_t)num * FIX16_ONE / den);
+}
+
+/**
+* @brief Square root
+*
+* @param a Radicand
+* @return sqrt(a), rounded down. 0 for a <= 0
+*
+* Bit by bit integer square root of a << 16: 24 iterations of shifts and adds, no multiply.
+*/
+
+fix16_t fix16_sqrt(fix16_t a)
+{
+    uint64_t v, res = 0, bit = 1ull << 46;
+
+    if( a <= 0 )
+	return 0;
+
+    v = (uint64_t)a << 16;
+
+    while( bit > v )
+	bit >>= 2;
+
+    while( bit ){
+	if( v >= res + bit ){
+	    v -= res + bit;
+	    res = (res >> 1) + bit;
+	}else
+	    res >>= 1;
+	bit >>= 2;
+    }
+
+    return (fix16_t)res;
+}
+
+/**
+* @brief Sine of a binary angle
+*
+* @param angle Angle, 2^32 = one turn
+* @return Sine
+*
+* Quarter wave table with linear interpolation. Error below 3e-5.
+*/
+
+fix16_t fix16_sin(uint32_t angle)
+{
+    unsigned idx = (angle >> 22) & 0xff;
+    int frac = (angle >> 6) & 0xffff;
+    int a, b;
+
+    if( angle & 0x40000000 ){ // 2nd and 4th quadrants run the table backwards
+	a = fix16_sin_table[256 - idx];
+	b = fix16_sin_table[255 - idx];
+    }else{
+	a = fix16_sin_table[idx];
+	b = fix16_sin_table[idx + 1];
+    }
+
+    a += (int)(((int64_t)(b - a) * frac) >> 16);
+
+    return ( angle & 0x80000000 ) ? -a : a;
+}
+
+/**
+* @brief Cosine of a binary angle
+*
+* @param angle Angle, 2^32 = one turn
+* @return Cosine
+*/
+
+fix16_t fix16_cos(uint32_t angle)
+{
+    return fix16_sin(angle + 0x40000000);
+}
+
+/**
+* @brief Four quadrant arc tangent
+*
+* @param y Y coordinate
+* @param x X coordinate
+* @return Angle of ( x, y ) as a binary angle. Cast to int32_t for the ( -pi, pi ] range. 0 for ( 0, 0 )
+*
+* The ratio of the smaller to the larger coordinate indexes an octant table, linearly interpolated. Error below 
+* 2e-6 rad.
+*/
+
+uint32_t fix16_atan2(fix16_t y, fix16_t x)
+{
+    uint64_t ax = ( x < 0 ) ? -(int64_t)x : x;
+    uint64_t ay = ( y < 0 ) ? -(int64_t)y : y;
+    uint32_t ratio, idx, frac, angle;
+
+    if( ax == 0 && ay == 0 )
+	return 0;
+
+    // Ratio in Q16 ( 0 to 1.0 ): top 8 bits index the table, the low 8 interpolate
+    if( ay <= ax )
+	ratio = (uint32_t)((ay << 16) / ax);
+    else
+	ratio = (uint32_t)((ax << 16) / ay);
+
+    idx = ratio >> 8;
+    frac = ratio & 0xff;
+    angle = fix16_atan_table[idx];
+    if( frac )
+	angle += (uint32_t)(((uint64_t)(fix16_atan_table[idx + 1] - angle) * frac) >> 8);
+
+    if( ay > ax )
+	angle = 0x40000000 - angle;
+    if( x < 0 )
+	angle = 0x80000000 - angle;
+    if( y < 0 )
+	angle = -angle;
+
+    return angle;
+}
+
+/**
+* @brief Binary angle from radians
+*
+* @param rad Angle in radians, any range
+* @return Binary angle, 2^32 = one turn
+*/
+
+uint32_t fix16_rad_to_brad(fix16_t rad)
+{
+    // 2^32 / 2pi = 683565275.58 per radian, rad in Q16
+    return (uint32_t)(((int64_t)rad * 683565276ll) >> 16);
+}
+
+/**
+* @brief Radians from a binary angle
+*
+* @param angle Binary angle
+* @return Angle in radians, ( -pi, pi ]
+*/
+
+fix16_t fix16_brad_to_rad(uint32_t angle)
+{
+    return (fix16_t)(((int64_t)(int32_t)angle * FIX16_2PI) >> 32);
+}
+
+/**
+* @brief Formats a Q16.16 value for printing
+*
+* @param a Value
+* @param buf Destination of at least FIX16_STR_LEN bytes
+* @param decimals Decimal digits, up to 5
+* @return buf
+*
+* printf("%f") pulls in the soft-float emulation: use printf("%s", fix16_to_str(v, buf, 2)) instead.
+*/
+
+char* fix16_to_str(fix16_t a, char* buf, int decimals)
+{
+    static const unsigned scale[6] = { 1, 10, 100, 1000, 10000, 100000 };
+    uint64_t v = ( a < 0 ) ? -(int64_t)a : a;
+    unsigned ip, fp;
+
+    if( decimals < 0 )
+	decimals = 0;
+    if( decimals > 5 )
+	decimals = 5;
+
+    // Round to the requested digits, then split
+    v = (v * scale[decimals] + (1 << 15)) >> 16;
+    ip = (unsigned)(v / scale[decimals]);
+    fp = (unsigned)(v % scale[decimals]);
+
+    if( decimals )
+	snprintf(buf, FIX16_STR_LEN, "%s%u.%0*u", ( a < 0 && v ) ? "-" : "", ip, decimals, fp);
+    else
+	snprintf(buf, FIX16_STR_LEN, "%s%u", ( a < 0 && v ) ? "-" : "", ip);
+
+    return buf;
+}
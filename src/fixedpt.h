@@ -0,0 +1,98 @@
+/**
+    @file fixedpt.h
+    
+    @section DESCRIPTION    
+    
+    Robotics library for the Autonomous Robotics Development Platform  
+    
+    @brief [HEADER] Q16.16 fixed point arithmetic, trigonometry and unit conversions for the FPU-less PPC405
+    
+*/
+
+#ifndef __FIXEDPT_H__
+#define __FIXEDPT_H__
+
+#include <stdint.h>
+
+typedef int32_t fix16_t; ///< Q16.16: 16 integer bits ( sign included ) and 16 fractional bits
+
+#define FIX16_ONE (1 << 16) /*! 1.0 */
+#define FIX16_MAX INT32_MAX /*! 32767.99998 */
+#define FIX16_MIN INT32_MIN /*! -32768.0 */
+#define FIX16_PI 205887 /*! pi */
+#define FIX16_2PI 411775 /*! 2 pi */
+#define FIX16_PI_2 102944 /*! pi / 2 */
+
+/*! Q16.16 from a constant, rounded. Folded by the compiler, no FPU at run time */
+#define FIX16(x) ((fix16_t)((x) * 65536.0 + ((x) >= 0 ? 0.5 : -0.5)))
+/*! Q16.16 from an integer, not saturated */
+#define FIX16_FROM_INT(i) ((fix16_t)((i) * FIX16_ONE))
+
+/* Angles are binary: the full turn is 2^32, so they wrap by themselves */
+#define FIX16_BRAD_DEG(d) ((uint32_t)((int64_t)(d) * 0x100000000ll / 360)) /*! Binary angle from integer degrees */
+
+/* Conversions */
+#define FIX16_STR_LEN 16 /*! Buffer size for fix16_to_str() */
+
+/*! Clamps a 64-bit intermediate to the Q16.16 range */
+static inline fix16_t fix16_sat(int64_t v)
+{
+    if( v > FIX16_MAX )
+	return FIX16_MAX;
+    if( v < FIX16_MIN )
+	return FIX16_MIN;
+
+    return (fix16_t)v;
+}
+
+/*! Saturating a + b */
+static inline fix16_t fix16_add(fix16_t a, fix16_t b)
+{
+    return fix16_sat((int64_t)a + b);
+}
+
+/*! Saturating a - b */
+static inline fix16_t fix16_sub(fix16_t a, fix16_t b)
+{
+    return fix16_sat((int64_t)a - b);
+}
+
+/*! Saturating a * b, rounded to nearest */
+static inline fix16_t fix16_mul(fix16_t a, fix16_t b)
+{
+    return fix16_sat(((int64_t)a * b + (1 << 15)) >> 16);
+}
+
+/*! Saturating Q16.16 from an integer */
+static inline fix16_t fix16_from_int(int i)
+{
+    return fix16_sat((int64_t)i * FIX16_ONE);
+}
+
+/*! Integer part, rounded to nearest */
+static inline int fix16_to_int(fix16_t a)
+{
+    return (int)(((int64_t)a + (1 << 15)) >> 16);
+}
+
+fix16_t fix16_div(fix16_t a, fix16_t b);
+
+fix16_t fix16_from_ratio(int num, int den);
+
+fix16_t fix16_sqrt(fix16_t a);
+
+/* Trigonometry over binary angles */
+fix16_t fix16_sin(uint32_t angle);
+
+fix16_t fix16_cos(uint32_t angle);
+
+uint32_t fix16_atan2(fix16_t y, fix16_t x);
+
+uint32_t fix16_rad_to_brad(fix16_t rad);
+
+fix16_t fix16_brad_to_rad(uint32_t angle);
+
+/* Text */
+char* fix16_to_str(fix16_t a, char* buf, int decimals);
+
+#endif
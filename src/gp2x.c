@@ -51,7 +51,7 @@ int gp2dx_d120_v2cm(int dvolts)
     int tmp = 0;
 
     // Starts from the end to avoid going into the non-singular parts of the funcition
-    for ( i = GP2D120_LUT_Y ; i > 0 ; i-- ) 
+    for ( i = GP2D120_LUT_Y - 1 ; i > 0 ; i-- ) 
     {
         tmp = gp2d120_lut[i][1]; 
         if ( tmp >= dvolts){
@@ -61,3 +61,38 @@ int gp2dx_d120_v2cm(int dvolts)
 
     return gp2d120_lut[i][0] ; 
 }
+
+/**
+* @brief Distance measured by a GP2D120 in fixed point
+*
+* @param volts Sensor output in volts, Q16.16 ( adc_raw_to_volts() )
+* @return Distance in cm, Q16.16
+*
+* Linear interpolation between the entries of the LUT, over its monotonic part. Readings past the far end of the 
+* table return its last distance, readings above the peak return the distance of the peak.
+*/
+
+fix16_t gp2dx_d120_v2cm_fix16(fix16_t volts)
+{
+    int64_t dv = (int64_t)volts * 10; // deciVolts, Q16.16
+    int i, hi, lo;
+
+    if( dv <= ((int64_t)gp2d120_lut[GP2D120_LUT_Y - 1][1] << 16) )
+	return FIX16_FROM_INT(gp2d120_lut[GP2D120_LUT_Y - 1][0]);
+
+    // Decreasing from the peak at GP2D120_NON_SINGULAR_UNTIL + 1 on. Walk from the far end
+    for( i = GP2D120_LUT_Y - 1 ; i > GP2D120_NON_SINGULAR_UNTIL + 1 ; i-- ){
+	hi = gp2d120_lut[i - 1][1];
+	lo = gp2d120_lut[i][1];
+
+	if( dv <= ((int64_t)hi << 16) ){
+	    if( hi == lo )
+		return FIX16_FROM_INT(gp2d120_lut[i][0]);
+
+	    return FIX16_FROM_INT(gp2d120_lut[i][0]) - 
+		(fix16_t)(( dv - ((int64_t)lo << 16) ) / (hi - lo)) * (gp2d120_lut[i][0] - gp2d120_lut[i - 1][0]);
+	}
+    }
+
+    return FIX16_FROM_INT(gp2d120_lut[GP2D120_NON_SINGULAR_UNTIL + 1][0]);
+}
@@ -20,13 +20,14 @@
 #include <linux/types.h>
 
 #include "max1231adc.h"
+#include "fixedpt.h"
 
 // GP2D120 
 
 // Not singular values from 0 until X
 #define GP2D120_NON_SINGULAR_UNTIL 2
 #define GP2D120_LUT_X 2
-#define GP2D120_LUT_Y 42
+#define GP2D120_LUT_Y 41
 static int gp2d120_lut[GP2D120_LUT_Y][GP2D120_LUT_X] = {  { 0 , 0  }, 
                                 { 1 , 19 },
                                 { 2 , 22 },
@@ -72,4 +73,7 @@ static int gp2d120_lut[GP2D120_LUT_Y][GP2D120_LUT_X] = {  { 0 , 0  },
 //TODO: LUTs for the other gp2 sensors
 int gp2dx_d120_v2cm(int volts);
 
+/* Interpolated distance in cm from volts, both Q16.16 */
+fix16_t gp2dx_d120_v2cm_fix16(fix16_t volts);
+
 #endif
@@ -40,9 +40,11 @@
 #include <sys/mman.h>
 #include <linux/types.h>
 #include <errno.h>
+#include <string.h>
 
 //Xenomai
 #include <native/task.h>
+#include <native/timer.h>
 #include <native/mutex.h>
 #include <native/intr.h>
 //--
@@ -53,7 +55,63 @@
 #include "util.h"
 
 
-//TODO: Non-blocking write functions
+/**
+* @brief Returns the shadow register kept for a data/tri-state offset
+* 
+* @param gpio Initialized GPIO device 
+* @param offset Offset over the base address
+* @return Pointer to the shadow or NULL if the register is not shadowed (GIE/IER/ISR)
+*/
+
+static unsigned* gpio_shadow(GPIO* gpio, unsigned offset)
+{
+    switch(offset){
+	case GPIO_CHANNEL1 + GPIO_DATA_OFFSET:
+	    return &(gpio->value[0]);
+	case GPIO_CHANNEL1 + GPIO_TRISTATE_OFFSET:
+	    return &(gpio->tristate[0]);
+	case GPIO_CHANNEL2 + GPIO_DATA_OFFSET:
+	    return gpio->num_of_channels == 2 ? &(gpio->value[1]) : NULL;
+	case GPIO_CHANNEL2 + GPIO_TRISTATE_OFFSET:
+	    return gpio->num_of_channels == 2 ? &(gpio->tristate[1]) : NULL;
+    }
+
+    return NULL;
+}
+
+#ifdef GPIO_LOCKFREE
+/**
+* @brief Pushes a committed shadow value to the device
+* 
+* @param gpio Initialized GPIO device 
+* @param offset Offset over the base address
+* @param shadow Shadow of the register at offset
+* @param value Value this writer swapped into the shadow
+*
+* Only values that were published in the shadow by a successful compare-and-swap reach the register. Two
+* writers can update the shadow in one order and reach the bus in the other, so after the store the writer
+* checks the shadow again and stores the newer value if another writer committed meanwhile.
+*
+* @note The pins are eventually consistent: a writer preempted between its compare-and-swap and its store
+*       can drive a superseded value until it re-checks the shadow. The latest committed value always ends
+*       on the pins once every writer has returned. Build with GPIO_NO_LOCKFREE if no stale value is acceptable
+*/
+
+static void gpio_shadow_commit(GPIO* gpio, unsigned offset, unsigned* shadow, unsigned value)
+{
+    unsigned cur;
+
+    for(;;){
+	busio_write(gpio->vadd, offset, value);
+	util_mb();
+
+	cur = *(volatile unsigned*)shadow;
+	if( cur == value )
+	    break;
+	value = cur;
+    }
+}
+#endif
 
 /**
 * @brief Writes to GPIO device overwritting any existing value
@@ -67,16 +125,28 @@
 * In addition no masked/shifting is performed. Useful when IOs are not muxed.
 *
 * @note This function is \b thread-safe and prevents multiple simultaneous access
-* @note This function is \b blocking
+* @note This function is \b non-blocking for data/tri-state registers when built with GPIO_LOCKFREE
 */
 
 int gpio_fast_write(GPIO* gpio, unsigned offset, unsigned value)
 {
     int err; 
+    unsigned* shadow = gpio_shadow(gpio, offset);
+
+    #ifdef GPIO_LOCKFREE
+    if( shadow != NULL ){
+	__sync_lock_test_and_set(shadow, value);
+	gpio_shadow_commit(gpio, offset, shadow, value);
+	return 0;
+    }
+    #endif
 
     UTIL_MUTEX_ACQUIRE("GPIO",&(gpio->mutex), TM_INFINITE);
  
-    *(gpio->vadd + offset) = value; 
+    busio_write(gpio->vadd, offset, value); 
+
+    if( shadow != NULL )
+	*shadow = value;
 
     UTIL_MUTEX_RELEASE("GPIO",&(gpio->mutex));
  
@@ -93,25 +163,87 @@ int gpio_fast_write(GPIO* gpio, unsigned offset, unsigned value)
 *
 * By doing a fast read there is no need to do any shifting/masking as in muxed GPIOs, resulting in a faster process. 
 *
-* @note This function is \b thread-safe and prevents multiple simultaneous access
-* @note This function is \b blocking
+* @note This function is \b thread-safe. A register read is a single bus access and needs no lock
+* @note This function is \b non-blocking when built with GPIO_LOCKFREE
 */
 
 int gpio_fast_read(GPIO* gpio, unsigned offset, unsigned* ret)
 {
-    int err; 
+    #ifdef GPIO_LOCKFREE
+    *ret = busio_read(gpio->vadd, offset); 
+    return 0;
+    #else
+    return gpio_read_locked(gpio, ~0x0, 0, offset, ret);
+    #endif
+}
 
-    UTIL_MUTEX_ACQUIRE("GPIO",&(gpio->mutex), TM_INFINITE);
+/**
+* @brief Writes GPIO device
+* 
+* @param gpio Initialized GPIO device 
+* @param mask Mask to select only bits of interest (muxed GPIOs)
+* @param shift Shift applied to bits of interest (muxed GPIOs)
+* @param offset Offset over the base address. Typically 0 - Data 1 - Tri-state
+* @param value Data value 
+* @return 0 on success. Otherwise error. 
+*
+* Data and tri-state registers are updated with a compare-and-swap on their shadow registers so writers to 
+* different bits of a muxed GPIO never wait on each other. Other registers go through gpio_write_locked().
+*
+* @note This function is \b thread-safe and prevents multiple simultaneous access
+* @note This function is \b non-blocking for data/tri-state registers when built with GPIO_LOCKFREE
+*
+*/
 
-    *ret = *(gpio->vadd + offset); 
+int gpio_write(GPIO* gpio, unsigned mask, unsigned shift, unsigned offset, unsigned value)
+{
+    #ifdef GPIO_LOCKFREE
+    unsigned* shadow = gpio_shadow(gpio, offset);
+    unsigned old, new;
+
+    if( shadow != NULL ){
+	do{
+	    old = *(volatile unsigned*)shadow;
+	    new = (old & ~mask) | ((value << shift) & mask);
+	}while( __sync_val_compare_and_swap(shadow, old, new) != old );
+
+	gpio_shadow_commit(gpio, offset, shadow, new);
+	return 0;
+    }
+    #endif
 
-    UTIL_MUTEX_RELEASE("GPIO",&(gpio->mutex));
+    return gpio_write_locked(gpio, mask, shift, offset, value);
+}
 
-    return 0; 
+/**
+* @brief Reads GPIO device
+* 
+* @param gpio Initialized GPIO device 
+* @param mask Mask to select only bits of interest (muxed GPIOs)
+* @param shift Shift applied to bits of interest (muxed GPIOs)
+* @param offset Offset over the base address. Typically 0 - Data 1 - Tri-state
+* @param ret Read value 
+* @return 0 on success. Otherwise error. 
+*
+* Reads from GPIO a selected set of bits
+*
+* @note This function is \b thread-safe. A register read is a single bus access and needs no lock
+* @note This function is \b non-blocking when built with GPIO_LOCKFREE
+*
+*/
+
+int gpio_read(GPIO* gpio, unsigned mask, unsigned shift, unsigned offset, unsigned* ret)
+{
+    #ifdef GPIO_LOCKFREE
+    *ret = (busio_read(gpio->vadd, offset) & mask) >> shift; 
+    return 0;
+    #else
+    return gpio_read_locked(gpio, mask, shift, offset, ret);
+    #endif
 }
 
 /**
-* @brief Writes GPIO device
+* @brief Writes GPIO device under the device mutex
 * 
 * @param gpio Initialized GPIO device 
 * @param mask Mask to select only bits of interest (muxed GPIOs)
@@ -120,20 +252,26 @@ int gpio_fast_read(GPIO* gpio, unsigned offset, unsigned* ret)
 * @param value Data value 
 * @return 0 on success. Otherwise error. 
 *
-* By doing a fast read there is no need to do any shifting/masking as in muxed GPIOs, resulting in a faster process. 
+* Read-modify-write of the register. Used for the registers without shadow and when GPIO_LOCKFREE is not set.
 *
 * @note This function is \b thread-safe and prevents multiple simultaneous access
 * @note This function is \b blocking
 *
 */
 
-int gpio_write(GPIO* gpio, unsigned mask, unsigned shift, unsigned offset, unsigned value)
+int gpio_write_locked(GPIO* gpio, unsigned mask, unsigned shift, unsigned offset, unsigned value)
 {
     int err; 
+    unsigned* shadow = gpio_shadow(gpio, offset);
+    unsigned new;
 
     UTIL_MUTEX_ACQUIRE("GPIO",&(gpio->mutex), TM_INFINITE);
      
-    *(gpio->vadd + offset) = (*(gpio->vadd + offset) & ~mask ) | ((value << shift) & mask); 
+    new = (busio_read(gpio->vadd, offset) & ~mask ) | ((value << shift) & mask);
+    busio_write(gpio->vadd, offset, new); 
+
+    if( shadow != NULL )
+	*shadow = new;
  
     UTIL_MUTEX_RELEASE("GPIO",&(gpio->mutex));
  
@@ -141,7 +279,7 @@ int gpio_write(GPIO* gpio, unsigned mask, unsigned shift, unsigned offset, unsig
 }
 
 /**
-* @brief Reads GPIO device
+* @brief Reads GPIO device under the device mutex
 * 
 * @param gpio Initialized GPIO device 
 * @param mask Mask to select only bits of interest (muxed GPIOs)
@@ -150,26 +288,157 @@ int gpio_write(GPIO* gpio, unsigned mask, unsigned shift, unsigned offset, unsig
 * @param ret Read value 
 * @return 0 on success. Otherwise error. 
 *
-* Reads from GPIO a selected set of bits
+* @note This function is \b thread-safe and prevents multiple simultaneous access
+* @note This function is \b blocking
+*
+*/
+
+int gpio_read_locked(GPIO* gpio, unsigned mask, unsigned shift, unsigned offset, unsigned* ret)
+{
+    int err; 
+
+    UTIL_MUTEX_ACQUIRE("GPIO",&(gpio->mutex), TM_INFINITE);
+
+    *ret = (busio_read(gpio->vadd, offset) & mask) >> shift; 
+
+    UTIL_MUTEX_RELEASE("GPIO",&(gpio->mutex));
+
+    return 0; 
+}
+
+
+/**
+* @brief Writes both channels of a dual channel GPIO
+* 
+* @param gpio Initialized GPIO device with two channels
+* @param mask Bits of interest. Channel 1 in the low word, channel 2 in the high word
+* @param value Data value. Channel 1 in the low word, channel 2 in the high word
+* @return 0 on success. Otherwise error. 
+*
+* Both channels are updated under one mutex acquisition, so gpio_read_both() never sees half of it. 
+* Single channel writers may still interleave between the two registers.
 *
 * @note This function is \b thread-safe and prevents multiple simultaneous access
 * @note This function is \b blocking
 *
 */
 
-int gpio_read(GPIO* gpio, unsigned mask, unsigned shift, unsigned offset, unsigned* ret)
+int gpio_write_both(GPIO* gpio, uint64_t mask, uint64_t value)
+{
+    int err; 
+    unsigned ch, m, v;
+
+    if( gpio->num_of_channels != 2 )
+	return -EINVAL;
+
+    UTIL_MUTEX_ACQUIRE("GPIO",&(gpio->mutex), TM_INFINITE);
+
+    for( ch = 1 ; ch <= 2 ; ch++ ){
+	m = (unsigned)(ch == 1 ? mask : mask >> 32);
+	v = (unsigned)(ch == 1 ? value : value >> 32);
+
+	if( m == 0 )
+	    continue;
+
+	// the mutex is recursive: gpio_write() serializes with the single channel writers in both modes
+	if( (err = gpio_write(gpio, m, 0, GPIO_DATA(ch), v)) < 0 ){
+	    rt_mutex_release(&(gpio->mutex));
+	    return err;
+	}
+    }
+
+    UTIL_MUTEX_RELEASE("GPIO",&(gpio->mutex));
+
+    return 0; 
+}
+
+/**
+* @brief Reads both channels of a dual channel GPIO
+* 
+* @param gpio Initialized GPIO device with two channels
+* @param ret Read value. Channel 1 in the low word, channel 2 in the high word
+* @return 0 on success. Otherwise error. 
+*
+* @note This function is \b thread-safe and prevents multiple simultaneous access
+* @note This function is \b blocking
+*
+*/
+
+int gpio_read_both(GPIO* gpio, uint64_t* ret)
 {
     int err; 
+    unsigned ch1, ch2;
+
+    if( gpio->num_of_channels != 2 )
+	return -EINVAL;
 
     UTIL_MUTEX_ACQUIRE("GPIO",&(gpio->mutex), TM_INFINITE);
 
-    *ret = (*(gpio->vadd + offset) & mask) >> shift; 
+    ch1 = busio_read(gpio->vadd, GPIO_DATA(1));
+    ch2 = busio_read(gpio->vadd, GPIO_DATA(2));
 
     UTIL_MUTEX_RELEASE("GPIO",&(gpio->mutex));
 
+    *ret = ((uint64_t)ch2 << 32) | ch1;
+
     return 0; 
 }
 
+/**
+* @brief Starts a transaction over one GPIO register
+* 
+* @param txn Transaction to initialize
+* @param gpio Initialized GPIO device 
+* @param offset Offset over the base address. Typically 0 - Data 1 - Tri-state
+*
+* @note The transaction belongs to the caller. Nothing touches the device until gpio_txn_commit()
+*/
+
+void gpio_txn_begin(GPIO_TXN* txn, GPIO* gpio, unsigned offset)
+{
+    txn->gpio = gpio;
+    txn->offset = offset;
+    txn->mask = 0;
+    txn->value = 0;
+}
+
+/**
+* @brief Adds a field update to a transaction
+* 
+* @param txn Started transaction
+* @param mask Mask to select only bits of interest (muxed GPIOs)
+* @param shift Shift applied to bits of interest (muxed GPIOs)
+* @param value Field value 
+*
+* Fields are given as in gpio_write(). If two fields overlap the last one added wins.
+*/
+
+void gpio_txn_add(GPIO_TXN* txn, unsigned mask, unsigned shift, unsigned value)
+{
+    txn->value = (txn->value & ~mask) | ((value << shift) & mask);
+    txn->mask |= mask;
+}
+
+/**
+* @brief Commits all the fields of a transaction in a single register write
+* 
+* @param txn Started transaction
+* @return 0 on success. Otherwise error. 
+*
+* The register goes from its previous value to the one with every field applied, with no intermediate state 
+* visible on the pins. Bits outside the added masks are preserved. The transaction can be committed again. 
+*
+* @note This function is \b thread-safe and prevents multiple simultaneous access
+* @note This function is \b non-blocking for data/tri-state registers when built with GPIO_LOCKFREE
+*/
+
+int gpio_txn_commit(GPIO_TXN* txn)
+{
+    if( txn->mask == 0 )
+	return 0;
+
+    return gpio_write(txn->gpio, txn->mask, 0, txn->offset, txn->value);
+}
 
 /**
 * @brief Enable Global Interrupts
@@ -201,6 +470,25 @@ int gpio_irq_disable_global(GPIO* gpio)
     return gpio_write(gpio, ~0x0, 0, GPIO_GIE_OFFSET , 0x0);
 }
 
+/**
+* @brief Interrupt mask of a channel
+*
+* @param gpio Initialized GPIO device 
+* @param n Channel number (1,2)
+* @return IER/ISR mask of the channel. 0 if the device has no such channel
+*/
+
+static unsigned gpio_irq_channel_mask(GPIO* gpio, int n)
+{
+    if( n == 1 )
+	return GPIO_IER_CHANNEL1_MASK;
+
+    if( n == 2 && gpio->num_of_channels == 2 )
+	return GPIO_IER_CHANNEL2_MASK;
+
+    return 0;
+}
+
 /**
 * @brief Enable Interrupt on channel 
 *
@@ -210,23 +498,18 @@ int gpio_irq_disable_global(GPIO* gpio)
 *
 * Quick functions for IRQ handling inside the device
 *
-* @note Currently it assumes n = 1 until support for two channel GPIO is added
+* @note The other channel is left untouched. The update is a single locked read-modify-write
 *
 */
 
 int gpio_irq_enable_channel(GPIO* gpio,int n)
 {
-    int err; 
-    unsigned ret;
-    
-    if( (err = gpio_read(gpio, ~0x0, 0, GPIO_IER_OFFSET , &ret)) < 0 )
-	return err; 
+    unsigned mask = gpio_irq_channel_mask(gpio, n);
 
-    if( (n == 2) && (gpio->num_of_channels == 2 )){
-	return gpio_write(gpio, ~0x0, 0, GPIO_IER_OFFSET , ret | GPIO_IER_CHANNEL2_MASK);
-    }
-	
-    return gpio_write(gpio, ~0x0, 0, GPIO_IER_OFFSET , ret | GPIO_IER_CHANNEL1_MASK);
+    if( mask == 0 )
+	return -EINVAL;
+
+    return gpio_write(gpio, mask, 0, GPIO_IER_OFFSET , ~0x0);
 }
 
 /**
@@ -238,23 +521,18 @@ int gpio_irq_enable_channel(GPIO* gpio,int n)
 *
 * Quick functions for IRQ handling inside the device
 *
-* @note Currently it assumes n = 1 until support for two channel GPIO is added
+* @note The other channel is left untouched. The update is a single locked read-modify-write
 *
 */
 
 int gpio_irq_disble_channel(GPIO* gpio,int n)
 {
-    int err; 
-    unsigned ret;
+    unsigned mask = gpio_irq_channel_mask(gpio, n);
 
-    if( (err = gpio_read(gpio, ~0x0, 0, GPIO_IER_OFFSET , &ret)) < 0 )
-	return err; 
+    if( mask == 0 )
+	return -EINVAL;
 
-    if( n == 2 && gpio->num_of_channels == 2 ){
-	return gpio_write(gpio, ~0x0, 0, GPIO_IER_OFFSET , ret & GPIO_IER_CHANNEL1_MASK);
-    }
-	
-    return gpio_write(gpio, ~0x0, 0, GPIO_IER_OFFSET , ret & GPIO_IER_CHANNEL2_MASK);
+    return gpio_write(gpio, mask, 0, GPIO_IER_OFFSET , 0x0);
 }
 
 /**
@@ -262,22 +540,262 @@ int gpio_irq_disble_channel(GPIO* gpio,int n)
 *
 * @param gpio Initialized GPIO device 
 * @param n Channel number (1,2)
+* @param ret Status of the channel before the acknowledge
 * @return 0 on success. Otherwise error. 
 *
 * Quick functions for IRQ handling inside the device
 *
-* @note Toggling is performed by writing 1 into the ISR
+* @note Toggling is performed by writing 1 into the ISR. Only the bit of channel n is acknowledged
 *
 */
 
 int gpio_irq_isr_checkandtoggle_channel(GPIO* gpio,int n, unsigned* ret )
 {
     int err; 
+    unsigned mask = gpio_irq_channel_mask(gpio, n);
+
+    if( mask == 0 )
+	return -EINVAL;
 
-    if( (err = gpio_read(gpio, ~0x0, 0, GPIO_ISR_OFFSET , ret)) < 0 )
+    if( (err = gpio_read(gpio, mask, 0, GPIO_ISR_OFFSET , ret)) < 0 )
 	return err; 
 
-    return gpio_write(gpio, ~0x0, 0, GPIO_IER_OFFSET , *ret);    
+    if( *ret == 0 )
+	return 0;
+
+    return gpio_write(gpio, ~0x0, 0, GPIO_ISR_OFFSET , *ret);    
+}
+
+/**
+* @brief Subscribes a handler to edges on a set of input bits
+*
+* @param gpio Initialized GPIO device 
+* @param n Channel number (1,2)
+* @param mask Bits of interest
+* @param edges GPIO_EDGE_RISING / GPIO_EDGE_FALLING / GPIO_EDGE_BOTH
+* @param handler Called once per matching edge from the dispatcher task
+* @param arg Passed to the handler
+* @return 0 on success. Otherwise error. 
+*
+* @note This function is \b thread-safe.
+* @note This function is \b blocking. 
+*/
+
+int gpio_subscribe_channel(GPIO* gpio, int n, unsigned mask, unsigned edges, gpio_handler handler, void* arg)
+{
+    int err, ret = 0; 
+    GPIO_SUBSCRIBER* sub;
+
+    if( handler == NULL || mask == 0 || (edges & GPIO_EDGE_BOTH) == 0 )
+	return -EINVAL;
+
+    if( n != 1 && !(n == 2 && gpio->num_of_channels == 2) )
+	return -EINVAL;
+
+    UTIL_MUTEX_ACQUIRE("GPIO",&(gpio->mutex), TM_INFINITE);
+
+    if( gpio->num_subs == GPIO_MAX_SUBSCRIBERS ){
+	util_pdbg(DBG_WARN, "GPIO: No room for more event subscribers\n");
+	ret = -ENOSPC;
+    }else{
+	sub = &(gpio->subs[gpio->num_subs]);
+	sub->channel = n;
+	sub->mask = mask;
+	sub->edges = edges;
+	sub->handler = handler;
+	sub->arg = arg;
+	gpio->num_subs++;
+    }
+
+    UTIL_MUTEX_RELEASE("GPIO",&(gpio->mutex));
+
+    return ret;
+}
+
+/**
+* @brief Removes every subscription of a handler/argument pair
+*
+* @param gpio Initialized GPIO device 
+* @param handler Handler given to gpio_subscribe()
+* @param arg Argument given to gpio_subscribe()
+* @return 0 on success. -ENOENT if there was no such subscription
+*
+* @note The handler can still be running in the dispatcher when this function returns
+* @note This function is \b thread-safe.
+* @note This function is \b blocking. 
+*/
+
+int gpio_unsubscribe(GPIO* gpio, gpio_handler handler, void* arg)
+{
+    int err, ret; 
+    unsigned i, j;
+
+    UTIL_MUTEX_ACQUIRE("GPIO",&(gpio->mutex), TM_INFINITE);
+
+    for( i = 0, j = 0 ; i < gpio->num_subs ; i++ ){
+	if( gpio->subs[i].handler == handler && gpio->subs[i].arg == arg )
+	    continue;
+	gpio->subs[j++] = gpio->subs[i];
+    }
+
+    ret = (j == gpio->num_subs) ? -ENOENT : 0;
+    gpio->num_subs = j;
+
+    UTIL_MUTEX_RELEASE("GPIO",&(gpio->mutex));
+
+    return ret;
+}
+
+/**
+* @brief Sets the debounce time of a set of input bits
+*
+* @param gpio Initialized GPIO device 
+* @param n Channel number (1,2)
+* @param mask Bits to configure
+* @param debounce_ns Time after a reported edge during which further changes of the bit are held back
+* @return 0 on success. Otherwise error. 
+*
+* The first edge is reported straight away. Bounces inside the debounce time are dropped and the bit is
+* sampled again once it has elapsed, so a level that settled differently is still reported.
+*
+* @note This function is \b thread-safe.
+* @note This function is \b blocking. 
+*/
+
+int gpio_set_debounce_channel(GPIO* gpio, int n, unsigned mask, unsigned debounce_ns)
+{
+    int err; 
+    unsigned bit;
+
+    if( n != 1 && !(n == 2 && gpio->num_of_channels == 2) )
+	return -EINVAL;
+
+    UTIL_MUTEX_ACQUIRE("GPIO",&(gpio->mutex), TM_INFINITE);
+
+    for( bit = 0 ; bit < GPIO_MAX_BITS ; bit++ )
+	if( mask & (1u << bit) )
+	    gpio->debounce_ns[n-1][bit] = debounce_ns;
+
+    UTIL_MUTEX_RELEASE("GPIO",&(gpio->mutex));
+
+    return 0;
+}
+
+/**
+* @brief Samples the input register and delivers the debounced edges to the subscribers
+*
+* @param gpio Initialized GPIO device 
+* @param wait_ns Returns the time until the earliest held back bit can be sampled again, 0 if none. Can be NULL
+* @return Number of events delivered. Otherwise error. 
+*
+* Called by gpio_dispatch_isr() on every interrupt. Can be called from a periodic sampler task instead 
+* on GPIOs without interrupt line. Both channels are sampled on dual channel cores.
+*
+* @note This function is \b NOT thread-safe. There must be one single dispatcher per GPIO
+* @note This function is \b blocking. 
+*/
+
+int gpio_dispatch_poll(GPIO* gpio, RTIME* wait_ns)
+{
+    int err, events = 0; 
+    GPIO_SUBSCRIBER subs[GPIO_MAX_SUBSCRIBERS];
+    GPIO_EVENT ev;
+    RTIME now, settle, wait = 0;
+    unsigned raw, changed, bit, i, ch, num_subs;
+
+    // handlers run without the lock so they can write to this same GPIO
+    UTIL_MUTEX_ACQUIRE("GPIO",&(gpio->mutex), TM_INFINITE);
+    num_subs = gpio->num_subs;
+    memcpy(subs, gpio->subs, num_subs * sizeof(GPIO_SUBSCRIBER));
+    UTIL_MUTEX_RELEASE("GPIO",&(gpio->mutex));
+
+    now = rt_timer_read();
+
+    for( ch = 0 ; ch < gpio->num_of_channels ; ch++ ){
+	raw = busio_read(gpio->vadd, GPIO_DATA(ch+1));
+	changed = raw ^ gpio->input[ch];
+	gpio->pending[ch] = 0;
+
+	for( bit = 0 ; changed != 0 ; bit++, changed >>= 1 ){
+	    if( !(changed & 0x1) )
+		continue;
+
+	    settle = gpio->last_edge_ns[ch][bit] + gpio->debounce_ns[ch][bit];
+
+	    if( now < settle ){ // still bouncing, look again once it settles
+		gpio->pending[ch] |= 1u << bit;
+		if( wait == 0 || settle - now < wait )
+		    wait = settle - now;
+		continue;
+	    }
+
+	    gpio->input[ch] ^= 1u << bit;
+	    gpio->last_edge_ns[ch][bit] = now;
+
+	    ev.channel = ch + 1;
+	    ev.bit = bit;
+	    ev.edge = (raw & (1u << bit)) ? GPIO_EDGE_RISING : GPIO_EDGE_FALLING;
+	    ev.value = gpio->input[ch];
+	    ev.time_ns = now;
+
+	    for( i = 0 ; i < num_subs ; i++ )
+		if( subs[i].channel == ev.channel && (subs[i].mask & (1u << bit)) && (subs[i].edges & ev.edge) )
+		    subs[i].handler(gpio, &ev, subs[i].arg);
+
+	    events++;
+	}
+    }
+
+    if( wait_ns != NULL )
+	*wait_ns = wait;
+
+    return events;
+}
+
+/**
+* @brief Interrupt task that dispatches input edges to the subscribers
+*
+* @param cookie Interrupt descriptor of the GPIO, as passed by gpio_init()
+*
+* Pass it as 'fisr' to gpio_init() to get interrupt driven events. Each interrupt is acknowledged in the 
+* device before sampling, so an edge arriving meanwhile raises a new interrupt. While some bit is held back 
+* by its debounce time the wait times out to sample it again. The task ends when the interrupt is deleted
+* in gpio_clean().
+*/
+
+void gpio_dispatch_isr(void* cookie)
+{
+    RT_INTR* intr_desc = (RT_INTR*)cookie;
+    GPIO* gpio = container_of(intr_desc, GPIO, intr_desc);
+    RTIME wait = 0;
+    RTIME timeout;
+    unsigned isr;
+    int err;
+
+    for(;;){
+	timeout = wait ? rt_timer_ns2ticks(wait) : TM_INFINITE;
+	if( wait && timeout == TM_INFINITE ) // less than a tick left
+	    timeout = 1;
+
+	err = rt_intr_wait(intr_desc, timeout);
+
+	if( err == -ETIMEDOUT ){
+	    gpio_dispatch_poll(gpio, &wait);
+	    continue;
+	}
+
+	if( err < 0 ){
+	    util_pdbg(DBG_DEBG, "GPIO: Dispatcher leaving. rt_intr_wait=%d\n", err);
+	    return;
+	}
+
+	gpio_irq_isr_checkandtoggle_channel(gpio, 1, &isr);
+	if( gpio->num_of_channels == 2 )
+	    gpio_irq_isr_checkandtoggle_channel(gpio, 2, &isr);
+
+	gpio_dispatch_poll(gpio, &wait);
+	rt_intr_enable(intr_desc);
+    }
 }
 
 /**
@@ -286,7 +804,7 @@ int gpio_irq_isr_checkandtoggle_channel(GPIO* gpio,int n, unsigned* ret )
 * @param gpio GPIO device to init
 * @param base_add Physical base IO address of peripheral
 * @param end_add Physical final IO address of peripheral
-* @param num_of_channels Number of channels (1,2). 
+* @param num_of_channels Number of channels (1,2). Must match the configuration of the core
 * @param flags Flags for I/O and IRQs 
 * @param irqno IRQ number. In PPC this is a virtual IRQ number. 
 * @param fisr Pointer to ISR
@@ -295,7 +813,6 @@ int gpio_irq_isr_checkandtoggle_channel(GPIO* gpio,int n, unsigned* ret )
 *
 * Maps IO region, set channels, flags for IO and set a isr in case IRQs are active. 
 *
-* @note Currently only 1 channel is supported
 * @note This function is \b NOT thread-safe. The user should guarantee somewhere else that is not called in several instances
 *       for the same resource. 
 *
@@ -328,6 +845,23 @@ int gpio_init(GPIO* gpio,
 
     UTIL_MUTEX_CREATE("GPIO",&(gpio->mutex), NULL);
 
+    // shadow registers start from what the device holds
+    gpio->value[0] = busio_read(gpio->vadd, GPIO_DATA(1));
+    gpio->tristate[0] = busio_read(gpio->vadd, GPIO_TRISTATE(1));
+    gpio->value[1] = gpio->tristate[1] = 0;
+    if( gpio->num_of_channels == 2 ){
+	gpio->value[1] = busio_read(gpio->vadd, GPIO_DATA(2));
+	gpio->tristate[1] = busio_read(gpio->vadd, GPIO_TRISTATE(2));
+    }
+
+    // event dispatcher starts with no subscribers and the current input as reference
+    gpio->num_subs = 0;
+    gpio->pending[0] = gpio->pending[1] = 0;
+    gpio->input[0] = gpio->value[0];
+    gpio->input[1] = gpio->value[1];
+    memset(gpio->debounce_ns, 0, sizeof(gpio->debounce_ns));
+    memset(gpio->last_edge_ns, 0, sizeof(gpio->last_edge_ns));
+
 //NOTE: This should go somewhere else
 //     // tri-state 
 //     if( (err =  gpio_write(gpio, ~0x0,0, GPIO_TRISTATE_OFFSET, tristate)) < 0){
@@ -403,22 +937,27 @@ int gpio_init(GPIO* gpio,
 int gpio_clean(GPIO* gpio)
 {
     int err; 
-    // unmap
     util_pdbg(DBG_DEBG, "GPIO: Cleaning GPIO...\n");
-    if ( (err = unmapio_region(&(gpio->vadd), gpio->base_add, gpio->end_add)) < 0 ){
-	util_pdbg(DBG_WARN, "GPIO: GPIO couldn't be unmapped at virtual= 0x%x . Error : %d \n", &(gpio->vadd), err);
-	return err; 
-    }
-
-    UTIL_MUTEX_DELETE("GPIO",&(gpio->mutex));
 
+    // The ISR task may still touch the registers: stop it before unmapping
     // TODO: check in another way
     if(gpio->isr != NULL){
 	if( ( err = rt_intr_delete(&(gpio->intr_desc))) < 0 ){
 	    util_pdbg(DBG_WARN, "GPIO: Cannot delete IRQ\n");
 	    return err; 
 	}
+	rt_task_delete(&(gpio->interrupt_task)); // it may have left already on the deleted IRQ
+	gpio->isr = NULL;
     }
+
+    // unmap
+    if ( (err = unmapio_region(&(gpio->vadd), gpio->base_add, gpio->end_add)) < 0 ){
+	util_pdbg(DBG_WARN, "GPIO: GPIO couldn't be unmapped at virtual= 0x%x . Error : %d \n", &(gpio->vadd), err);
+	return err; 
+    }
+
+    UTIL_MUTEX_DELETE("GPIO",&(gpio->mutex));
+
     return 0; 
 }
 
@@ -12,6 +12,8 @@
 #ifndef __GPIO_H__
 #define __GPIO_H__
 
+#include <stdint.h>
+
 #include <native/mutex.h>
 #include <native/task.h>
 #include <native/intr.h>
@@ -22,6 +24,9 @@
 #define GPIO_CHANNEL2 0x02 /*! Offset of channel IO from base */
 #define GPIO_DATA_OFFSET 0     /*! Offset for data */
 #define GPIO_TRISTATE_OFFSET 1 /*! Offset from any channel */
+#define GPIO_CHANNEL_OFFSET(n) ((n) == 2 ? GPIO_CHANNEL2 : GPIO_CHANNEL1) /*! Offset of channel n (1,2) */
+#define GPIO_DATA(n) (GPIO_CHANNEL_OFFSET(n) + GPIO_DATA_OFFSET) /*! Data register of channel n */
+#define GPIO_TRISTATE(n) (GPIO_CHANNEL_OFFSET(n) + GPIO_TRISTATE_OFFSET) /*! Tri-state register of channel n */
 
 #define GPIO_GIE_OFFSET (0x11c>>2) /*! Global Interrupt Enable Register */
 #define GPIO_GIE_MASK 0x80000000
@@ -45,6 +50,44 @@
 #define GPIO_IRQ_CHANNEL1 0x04  /*! Driver parameters */
 #define GPIO_IRQ_CHANNEL2 0x08  /*! Driver parameters */
 
+/* Event dispatcher ( see gpio_dispatch_isr() ) */
+#define GPIO_MAX_BITS 32 /*! Width of a channel */
+#define GPIO_MAX_SUBSCRIBERS 8 /*! Event subscribers per device */
+#define GPIO_EDGE_RISING 0x01 /*! Bit went 0 -> 1 */
+#define GPIO_EDGE_FALLING 0x02 /*! Bit went 1 -> 0 */
+#define GPIO_EDGE_BOTH (GPIO_EDGE_RISING|GPIO_EDGE_FALLING)
+
+/* Data/tri-state accesses without the device mutex ( atomics on the shadow registers ). The pins are eventually 
+   consistent: a preempted writer may drive a superseded value for a while before rewriting the latest one. 
+   Build with -DGPIO_NO_LOCKFREE to serialize every access through the mutex */
+#ifndef GPIO_NO_LOCKFREE
+#define GPIO_LOCKFREE
+#endif
+
+struct struct_gpio;
+
+/*! Debounced edge on one input bit */
+typedef struct
+{
+	unsigned channel; ///< Channel number (1,2)
+	unsigned bit; ///< Bit number in the data register
+	unsigned edge; ///< GPIO_EDGE_RISING / GPIO_EDGE_FALLING
+	unsigned value; ///< Debounced data register right after the edge
+	RTIME time_ns; ///< Time the edge was sampled
+} GPIO_EVENT;
+
+/*! Event handler. Runs in the dispatcher task, so it should be short and never block on the same GPIO IRQ */
+typedef void (*gpio_handler)(struct struct_gpio* gpio, const GPIO_EVENT* ev, void* arg);
+
+typedef struct
+{
+	unsigned channel; ///< Channel number (1,2)
+	unsigned mask; ///< Bits of interest
+	unsigned edges; ///< GPIO_EDGE_RISING / GPIO_EDGE_FALLING / GPIO_EDGE_BOTH
+	gpio_handler handler; ///< Called once per matching event
+	void* arg; ///< Passed to the handler
+} GPIO_SUBSCRIBER;
+
 typedef struct struct_gpio
 {	
 	unsigned long base_add; ///< Physical memory address where to map the device  (beginning)
@@ -52,14 +95,29 @@ typedef struct struct_gpio
 	volatile int* vadd; ///< virtual address where device is mapped
 	char flags; ///< IO/Allow Interrupt
 	unsigned num_of_channels; ///< Number of activated channels ( either 1 or 2 )
-	unsigned tristate[GPIO_MAX_CHANNELS]; ///< Previously assigned value (for muxed IO)
-	unsigned value[GPIO_MAX_CHANNELS]; ///< Previously assigned value (for muxed IO)
+	unsigned tristate[GPIO_MAX_CHANNELS]; ///< Shadow of the tri-state registers (for muxed IO)
+	unsigned value[GPIO_MAX_CHANNELS]; ///< Shadow of the data registers (for muxed IO)
 	RT_MUTEX mutex; ///< Mutex for accessing IO
 	RT_TASK interrupt_task; ///< Task from which the ISR is spawned
 	RT_INTR intr_desc; ///< Interrupt pointer
 	void (*isr)(void*); ///< ISR for both channels
+	GPIO_SUBSCRIBER subs[GPIO_MAX_SUBSCRIBERS]; ///< Event subscribers
+	unsigned num_subs; ///< Number of event subscribers
+	unsigned input[GPIO_MAX_CHANNELS]; ///< Debounced input state last reported to the subscribers
+	unsigned pending[GPIO_MAX_CHANNELS]; ///< Bits that changed while still inside their debounce time
+	unsigned debounce_ns[GPIO_MAX_CHANNELS][GPIO_MAX_BITS]; ///< Per-bit debounce time
+	RTIME last_edge_ns[GPIO_MAX_CHANNELS][GPIO_MAX_BITS]; ///< Time of the last reported edge per bit
 } GPIO;
 
+/*! Set of field updates to one register of a muxed GPIO, committed as a single write */
+typedef struct
+{
+	GPIO* gpio; ///< Device the transaction applies to
+	unsigned offset; ///< Register offset. Typically 0 - Data 1 - Tri-state
+	unsigned mask; ///< Union of the masks of all added fields
+	unsigned value; ///< Field values, already shifted into place
+} GPIO_TXN;
+
 int gpio_fast_write(GPIO* gpio, unsigned offset, unsigned value);
 
 int gpio_fast_read(GPIO* gpio, unsigned offset, unsigned* ret);
@@ -68,6 +126,22 @@ int gpio_write(GPIO* gpio, unsigned mask, unsigned shift, unsigned offset, unsig
 
 int gpio_read(GPIO* gpio, unsigned mask, unsigned shift, unsigned offset, unsigned* ret);
 
+int gpio_write_locked(GPIO* gpio, unsigned mask, unsigned shift, unsigned offset, unsigned value);
+
+int gpio_read_locked(GPIO* gpio, unsigned mask, unsigned shift, unsigned offset, unsigned* ret);
+
+/* Both channels at once. Channel 1 in the low word, channel 2 in the high word */
+int gpio_write_both(GPIO* gpio, uint64_t mask, uint64_t value);
+
+int gpio_read_both(GPIO* gpio, uint64_t* ret);
+
+/* Transactions: several (mask, shift, value) fields in one register write */
+void gpio_txn_begin(GPIO_TXN* txn, GPIO* gpio, unsigned offset);
+
+void gpio_txn_add(GPIO_TXN* txn, unsigned mask, unsigned shift, unsigned value);
+
+int gpio_txn_commit(GPIO_TXN* txn);
+
 /* Some quick macros */
 
 /*! Write/Read from the DATA register */
@@ -80,6 +154,16 @@ int gpio_read(GPIO* gpio, unsigned mask, unsigned shift, unsigned offset, unsign
 #define gpio_read_data(gpio,mask,shift,ret) \
 	gpio_read(gpio, mask, shift, GPIO_DATA_OFFSET, ret)
 
+/*! Write/Read from the DATA register of channel n (1,2) */
+
+#define gpio_write_channel(gpio,n,mask,shift,value) \
+	gpio_write(gpio, mask, shift, GPIO_DATA(n), value)
+
+/*! Write/Read from the DATA register of channel n (1,2) */
+
+#define gpio_read_channel(gpio,n,mask,shift,ret) \
+	gpio_read(gpio, mask, shift, GPIO_DATA(n), ret)
+
 /*! Write/Read from the TRISTATE register ( for bidirectional GPIOs) */
 
 #define gpio_set_dir(gpio,mask,shift,value) \
@@ -106,15 +190,33 @@ int gpio_irq_enable_global(GPIO* gpio);
 
 int gpio_irq_disable_global(GPIO* gpio);
 
-/* By default assumes n = 1 */
 int gpio_irq_enable_channel(GPIO* gpio,int n);
 
-/* By default assumes n = 1 */
 int gpio_irq_disble_channel(GPIO* gpio,int n);
 
 int gpio_irq_isr_checkandtoggle_channel(GPIO* gpio,int n, unsigned* ret );
 
-/* TODO:So far only for 1channel GPIO cores */
+/* Event dispatcher */
+int gpio_subscribe_channel(GPIO* gpio, int n, unsigned mask, unsigned edges, gpio_handler handler, void* arg);
+
+int gpio_unsubscribe(GPIO* gpio, gpio_handler handler, void* arg);
+
+int gpio_set_debounce_channel(GPIO* gpio, int n, unsigned mask, unsigned debounce_ns);
+
+/*! Subscribe/debounce on channel 1 */
+
+#define gpio_subscribe(gpio,mask,edges,handler,arg) \
+	gpio_subscribe_channel(gpio, 1, mask, edges, handler, arg)
+
+/*! Subscribe/debounce on channel 1 */
+
+#define gpio_set_debounce(gpio,mask,debounce_ns) \
+	gpio_set_debounce_channel(gpio, 1, mask, debounce_ns)
+
+int gpio_dispatch_poll(GPIO* gpio, RTIME* wait_ns);
+
+void gpio_dispatch_isr(void* cookie);
+
 int gpio_init(GPIO* gpio, 
 	      long unsigned int base_add, 
 	      long unsigned int end_add, 
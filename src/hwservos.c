@@ -39,13 +39,76 @@
 #include <sys/mman.h>
 #include <linux/types.h>
 #include <time.h>
+#include <errno.h>
+#include <string.h>
 //Xenomai
 #include <native/mutex.h>
+#include <native/task.h>
+#include <native/timer.h>
 //--
 #include "busio.h"
+#include "platform_core.h"
 #include "util.h"
+#include "fixedpt.h"
 #include "hwservos.h"
 
+/* Table steps per degree in Q8.24: the lookup multiplies instead of dividing */
+#define HWSERVOS_LUT_SCALE ((int64_t)(HWSERVOS_LUT_STEPS * 16777216.0 / 180.0 + 0.5))
+
+/**
+* @brief Pulse width for a physical angle, in 1/16 us
+*
+* Straight from the calibration. Used to build the tables only: it divides.
+*/
+
+static int hwservos_calib_eval(const HWSERVOS_CALIB* c, fix16_t angle)
+{
+    const int64_t one = 1 << HWSERVOS_LUT_FRAC;
+    int64_t p, lo = c->min_us * one, hi = c->max_us * one;
+    unsigned k;
+
+    if( c->num_points >= 2 ){
+	// Segment holding the angle. The end segments extrapolate
+	for( k = 0 ; k + 2 < c->num_points && angle > c->point_angle[k + 1] ; k++ )
+	    ;
+	p = c->point_us[k] * one + ((int64_t)(angle - c->point_angle[k]) * ((int64_t)c->point_us[k + 1] - c->point_us[k]) * one) 
+	    / (c->point_angle[k + 1] - c->point_angle[k]);
+    }else if( angle >= 0 )
+	p = c->center_us * one + ((int64_t)angle * ((int64_t)c->max_us - c->center_us) * one) / HWSERVOS_ANGLE_MAX;
+    else
+	p = c->center_us * one + ((int64_t)angle * ((int64_t)c->center_us - c->min_us) * one) / HWSERVOS_ANGLE_MAX;
+
+    return (int)( p < lo ? lo : ( p > hi ? hi : p ) );
+}
+
+/**
+* @brief Builds the angle-to-pulse table of a servo
+*/
+
+static void hwservos_build_lut(const HWSERVOS_CALIB* c, int* lut)
+{
+    fix16_t angle;
+    unsigned j;
+
+    for( j = 0 ; j <= HWSERVOS_LUT_STEPS ; j++ ){
+	angle = -HWSERVOS_ANGLE_MAX + (fix16_t)(j * (2 * HWSERVOS_ANGLE_MAX / HWSERVOS_LUT_STEPS));
+	lut[j] = hwservos_calib_eval(c, c->dir < 0 ? -angle : angle);
+    }
+}
+
+/**
+* @brief Default calibration: HWSERVOS_TIME_*_ANGLE, linear
+*/
+
+static void hwservos_default_calib(HWSERVOS_CALIB* c)
+{
+    memset(c, 0, sizeof(HWSERVOS_CALIB));
+    c->min_us = HWSERVOS_TIME_MIN_ANGLE;
+    c->center_us = HWSERVOS_TIME_MID_ANGLE;
+    c->max_us = HWSERVOS_TIME_MAX_ANGLE;
+    c->dir = 1;
+}
+
 /**
 * @brief Initialization for Servo IP Core device data structure. 
 *
@@ -84,6 +147,15 @@ int hwservos_init(HWSERVOS* servo, unsigned long base_add, unsigned long end_add
     
     for( i = 0; i < num_of ; i++ )
 	servo->values[i] = 0;
+
+    memset(servo->moves, 0, sizeof(servo->moves));
+    servo->rate_hz = HWSERVOS_FRAME_RATE_HZ;
+
+    for( i = 0; i < num_of ; i++ ){
+	hwservos_default_calib(&(servo->calib[i]));
+	hwservos_build_lut(&(servo->calib[i]), servo->lut[i]);
+    }
+    servo->running = 0;
     
     UTIL_MUTEX_CREATE("HWSERVOS",&(servo->mutex),NULL);
 
@@ -109,6 +181,9 @@ int hwservos_clean(HWSERVOS* servo)
     int err,i;
 
     util_pdbg(DBG_DEBG, "HWSERVOS: Cleaning HWSERVOS...\n");
+
+    if( servo->running )
+	hwservos_engine_stop(servo);
     
     //Disable servos before unmapping
     for( i = 0 ; i < servo->num_of ; i++ )
@@ -137,10 +212,10 @@ int hwservos_clean(HWSERVOS* servo)
 * @param value Time in us that will be applied to the servos
 * @return 0 on success. Otherwise error. 
 *
-* Control stays active if no other order is performed. 
+* Control stays active if no other order is performed. Cancels the move in progress on this servo, if any.
 *
-* @note There is a hard and a soft sanity check over the value. If time in us is over or under the thresholds the servo can be 
-* 	physically damaged. 
+* @note The value is clamped to the calibrated range of the servo ( hwservos_set_calib() ). If time in us is over or under 
+* 	the thresholds the servo can be physically damaged. 
 * @note This function is \b thread-safe.
 * @note This function is \b blocking. 
 *
@@ -151,16 +226,20 @@ int hwservos_set_pos(HWSERVOS* servo, unsigned num, unsigned value)
 {
     int err; 
 
-    // Sanity check
-    if(value < HWSERVOS_TIME_MIN_ANGLE ) 
-	value = HWSERVOS_TIME_MIN_ANGLE ; 
-    else if (value > HWSERVOS_TIME_MAX_ANGLE ) 
-	    value = HWSERVOS_TIME_MAX_ANGLE ; 
+    if( num >= servo->num_of )
+	return -EINVAL;
     
     UTIL_MUTEX_ACQUIRE("HWSERVOS",&(servo->mutex),TM_INFINITE);
+
+    // Sanity check
+    if( value < servo->calib[num].min_us ) 
+	value = servo->calib[num].min_us; 
+    else if( value > servo->calib[num].max_us ) 
+	value = servo->calib[num].max_us; 
  
-    *(servo->vadd + num) = value | HWSERVOS_EN_MASK ; 
+    busio_write(servo->vadd, num, value | HWSERVOS_EN_MASK); 
     servo->values[num] =value;
+    servo->moves[num].active = 0;
     
     UTIL_MUTEX_RELEASE("HWSERVOS",&(servo->mutex));
     
@@ -187,7 +266,7 @@ int hwservos_get_pos(HWSERVOS* servo, unsigned num, unsigned* ret)
    
     UTIL_MUTEX_ACQUIRE("HWSERVOS",&(servo->mutex),TM_INFINITE);
  
-    *ret = *(servo->vadd + num) & ~(HWSERVOS_EN_MASK) ; // Remove the enable mask
+    *ret = core_get_hwservos_pulse(servo->vadd, num);
 
     UTIL_MUTEX_RELEASE("HWSERVOS",&(servo->mutex));
     
@@ -214,7 +293,7 @@ int hwservos_enable(HWSERVOS* servo, unsigned num)
     
     UTIL_MUTEX_ACQUIRE("HWSERVOS",&(servo->mutex),TM_INFINITE);
     
-    *(servo->vadd + num) |= HWSERVOS_EN_MASK ;
+    core_set_hwservos_en(servo->vadd, num, 1);
 
     UTIL_MUTEX_RELEASE("HWSERVOS",&(servo->mutex));
     
@@ -229,7 +308,7 @@ int hwservos_enable(HWSERVOS* servo, unsigned num)
 * @return 0 on success. Otherwise error. 
 *
 * Control stays active if no other order is performed. By disabling it, no internal force will be applied to the servo to find 
-* the set point.
+* the set point. A move in progress on the servo is cancelled.
 *
 * @note This function is \b thread-safe.
 * @note This function is \b blocking. 
@@ -240,11 +319,442 @@ int hwservos_disable(HWSERVOS* servo, unsigned num)
 {
     int err; 
     
+    if( num >= servo->num_of )
+	return -EINVAL;
+
     UTIL_MUTEX_ACQUIRE("HWSERVOS",&(servo->mutex),TM_INFINITE);
     
-    *(servo->vadd + num) &= ~(HWSERVOS_EN_MASK) ;
+    core_set_hwservos_en(servo->vadd, num, 0);
+    servo->moves[num].active = 0; // the engine would enable it again on its next step
+
+    UTIL_MUTEX_RELEASE("HWSERVOS",&(servo->mutex));
+
+    return 0;
+}
+
+/**
+* @brief Clamps a pulse width to the calibrated range of a servo. Called with the mutex held
+*/
+
+static unsigned hwservos_clamp(HWSERVOS* servo, unsigned num, unsigned value)
+{
+    if( value < servo->calib[num].min_us ) 
+	return servo->calib[num].min_us; 
+    if( value > servo->calib[num].max_us ) 
+	return servo->calib[num].max_us; 
+
+    return value;
+}
+
+/**
+* @brief Starts timed moves of several servos that finish together
+*
+* @param servo Servo IP core peripheral
+* @param mask Bit n set: servo n moves
+* @param values Target pulse widths in us, indexed by servo. Only the entries in mask are read
+* @param duration_ms Duration of the moves. Rounded up to engine periods. 0 to reach the targets on the next period
+* @param ease Easing curve, HWSERVOS_EASE_*
+* @return 0 on success. Otherwise error. 
+*
+* Each move starts from the pulse width latched now, so a move in progress is redirected without a jump. A servo 
+* that was never positioned goes straight to its target. All the moves start on the same engine period and take 
+* the same number of periods. Targets are clamped as in hwservos_set_pos(). Convert angles with hwservos_angle_to_us().
+*
+* @note This function is \b thread-safe.
+* @note This function is \b blocking. 
+*
+*/
+
+int hwservos_move_group(HWSERVOS* servo, unsigned mask, const unsigned* values, unsigned duration_ms, int ease)
+{
+    unsigned steps, i;
+    HWSERVOS_MOVE* m;
+    int err; 
+
+    if( mask == 0 || (mask >> servo->num_of) != 0 )
+	return -EINVAL;
+
+    if( ease != HWSERVOS_EASE_LINEAR && ease != HWSERVOS_EASE_SMOOTH && ease != HWSERVOS_EASE_MINJERK )
+	return -EINVAL;
+
+    steps = (unsigned)(((uint64_t)duration_ms * servo->rate_hz + 999) / 1000);
+    if( steps == 0 )
+	steps = 1;
+
+    UTIL_MUTEX_ACQUIRE("HWSERVOS",&(servo->mutex),TM_INFINITE);
+
+    for( i = 0 ; i < servo->num_of ; i++ ){
+	if( !(mask & (1 << i)) )
+	    continue;
+
+	m = &(servo->moves[i]);
+	m->to = hwservos_clamp(servo, i, values[i]);
+	m->from = servo->values[i] != 0 ? servo->values[i] : m->to;
+	m->step = 0;
+	m->steps = steps;
+	m->ease = ease;
+	m->active = 1;
+    }
+
+    UTIL_MUTEX_RELEASE("HWSERVOS",&(servo->mutex));
+
+    return 0;
+}
+
+/**
+* @brief Starts a timed move of one servo
+*
+* @param servo Servo IP core peripheral
+* @param num Servo to move
+* @param value Target pulse width in us
+* @param duration_ms Duration of the move. 0 to reach the target on the next period
+* @param ease Easing curve, HWSERVOS_EASE_*
+* @return 0 on success. Otherwise error. 
+*
+* See hwservos_move_group().
+*
+* @note This function is \b thread-safe.
+* @note This function is \b blocking. 
+*
+*/
+
+int hwservos_move(HWSERVOS* servo, unsigned num, unsigned value, unsigned duration_ms, int ease)
+{
+    unsigned values[HWSERVOS_MAX_NUM_OF];
+
+    if( num >= servo->num_of )
+	return -EINVAL;
+
+    values[num] = value;
+
+    return hwservos_move_group(servo, 1 << num, values, duration_ms, ease);
+}
+
+/**
+* @brief Stops moves in progress where they are
+*
+* @param servo Servo IP core peripheral
+* @param mask Bit n set: servo n stops
+* @return 0 on success. Otherwise error. 
+*
+* @note This function is \b thread-safe.
+* @note This function is \b blocking. 
+*
+*/
+
+int hwservos_move_stop(HWSERVOS* servo, unsigned mask)
+{
+    unsigned i;
+    int err; 
+
+    UTIL_MUTEX_ACQUIRE("HWSERVOS",&(servo->mutex),TM_INFINITE);
+
+    for( i = 0 ; i < servo->num_of ; i++ )
+	if( mask & (1 << i) )
+	    servo->moves[i].active = 0;
 
     UTIL_MUTEX_RELEASE("HWSERVOS",&(servo->mutex));
 
     return 0;
 }
+
+/**
+* @brief Checks whether moves have finished
+*
+* @param servo Servo IP core peripheral
+* @param mask Bit n set: servo n is checked
+* @return 1 if none of the servos in mask is moving, 0 otherwise
+*
+* @note This function is \b thread-safe.
+* @note This function is \b non-blocking. 
+*
+*/
+
+int hwservos_move_done(HWSERVOS* servo, unsigned mask)
+{
+    unsigned i;
+
+    for( i = 0 ; i < servo->num_of ; i++ )
+	if( (mask & (1 << i)) && servo->moves[i].active )
+	    return 0;
+
+    return 1;
+}
+
+/**
+* @brief Position along a move, Q16.16 from 0 to 1
+*/
+
+static int64_t hwservos_ease(int ease, unsigned step, unsigned steps)
+{
+    int64_t u = ((int64_t)step << 16) / steps;
+    int64_t u2 = (u * u) >> 16;
+
+    switch( ease ){
+	case HWSERVOS_EASE_SMOOTH: 
+	    return (u2 * ((3 << 16) - 2 * u)) >> 16;
+	case HWSERVOS_EASE_MINJERK: 
+	    return (((u2 * u) >> 16) * ((10 << 16) - 15 * u + 6 * u2)) >> 16;
+	default:
+	    return u;
+    }
+}
+
+/**
+* @brief Interpolation engine task
+*
+* Once per period and under a single acquisition of the mutex: advances every move in progress and writes the 
+* pulse widths that changed.
+*/
+
+static void hwservos_engine(void* cookie)
+{
+    HWSERVOS* servo = (HWSERVOS*)cookie;
+    HWSERVOS_MOVE* m;
+    unsigned long overrun;
+    unsigned i, value;
+    int err;
+
+    if( (err = rt_task_set_periodic(NULL, TM_NOW, rt_timer_ns2ticks(1000000000llu / servo->rate_hz))) < 0 ){
+	util_pdbg(DBG_WARN, "HWSERVOS: Engine cannot be made periodic. Error:%d\n", err);
+	return;
+    }
+
+    while( servo->running ){
+	if( (err = rt_task_wait_period(&overrun)) < 0 && err != -ETIMEDOUT ){
+	    util_pdbg(DBG_WARN, "HWSERVOS: Engine rt_task_wait_period. Error:%d\n", err);
+	    return;
+	}
+
+	if( (err = rt_mutex_acquire(&(servo->mutex), TM_INFINITE)) < 0 ){
+	    util_pdbg(DBG_WARN, "HWSERVOS: Engine cannot acquire the mutex. Error:%d\n", err);
+	    return;
+	}
+
+	for( i = 0 ; i < servo->num_of ; i++ ){
+	    m = &(servo->moves[i]);
+	    if( !m->active )
+		continue;
+
+	    // Overruns are caught up: the move keeps its duration
+	    m->step += 1 + overrun;
+	    if( m->step >= m->steps ){
+		m->step = m->steps;
+		m->active = 0;
+	    }
+
+	    value = m->from + (int)((((int64_t)m->to - m->from) * hwservos_ease(m->ease, m->step, m->steps)) >> 16);
+
+	    if( value != servo->values[i] ){
+		busio_write(servo->vadd, i, value | HWSERVOS_EN_MASK); 
+		servo->values[i] = value;
+	    }
+	}
+
+	rt_mutex_release(&(servo->mutex));
+    }
+}
+
+/**
+* @brief Starts the interpolation engine
+*
+* @param servo Servo IP core peripheral
+* @param rate_hz Evaluation rate. HWSERVOS_FRAME_RATE_HZ for standard servos, up to HWSERVOS_ENGINE_MAX_RATE_HZ
+* @param prio Priority of the engine task
+* @return 0 on success. Otherwise error. 
+*
+* Move durations are converted to periods of this rate when the moves are commanded: start the engine first.
+*
+* @note This function is \b NOT thread-safe.
+*
+*/
+
+int hwservos_engine_start(HWSERVOS* servo, unsigned rate_hz, int prio)
+{
+    int err; 
+
+    if( rate_hz == 0 || rate_hz > HWSERVOS_ENGINE_MAX_RATE_HZ )
+	return -EINVAL;
+
+    if( servo->running )
+	return -EBUSY;
+
+    servo->rate_hz = rate_hz;
+    servo->running = 1;
+
+    if( (err = rt_task_spawn(&(servo->task), "HWServos engine", 0, prio, T_JOINABLE, hwservos_engine, servo)) < 0 ){
+	util_pdbg(DBG_WARN, "HWSERVOS: Engine cannot be spawned. Error:%d\n", err);
+	servo->running = 0;
+	return err;
+    }
+
+    return 0;
+}
+
+/**
+* @brief Stops the interpolation engine
+*
+* @param servo Servo IP core peripheral
+* @return 0 on success. Otherwise error. 
+*
+* Moves in progress freeze where they are and resume if the engine is started again.
+*
+* @note This function is \b NOT thread-safe.
+* @note This function is \b blocking. Waits for the current period to finish
+*
+*/
+
+int hwservos_engine_stop(HWSERVOS* servo)
+{
+    if( !servo->running )
+	return -EINVAL;
+
+    servo->running = 0;
+
+    return rt_task_join(&(servo->task));
+}
+
+/**
+* @brief Sets the calibration of a servo and rebuilds its angle-to-pulse table
+*
+* @param servo Servo IP core peripheral
+* @param num Servo to calibrate
+* @param calib Calibration. See HWSERVOS_CALIB
+* @return 0 on success. -EINVAL if the calibration is inconsistent
+*
+* Pulses must lie within HWSERVOS_EXT_TIME_MIN_ANGLE and HWSERVOS_EXT_TIME_MAX_ANGLE, with min_us < center_us < max_us. 
+* Correction points, when given, replace the linear map: the pulse is interpolated between them, extrapolated past 
+* the first and last, and always clamped to min_us - max_us. A move in progress keeps its pulse targets.
+*
+* @note This function is \b thread-safe.
+* @note This function is \b blocking. 
+*
+*/
+
+int hwservos_set_calib(HWSERVOS* servo, unsigned num, const HWSERVOS_CALIB* calib)
+{
+    int lut[HWSERVOS_LUT_STEPS + 1];
+    unsigned k;
+    int err; 
+
+    if( num >= servo->num_of )
+	return -EINVAL;
+
+    if( calib->min_us < HWSERVOS_EXT_TIME_MIN_ANGLE || calib->max_us > HWSERVOS_EXT_TIME_MAX_ANGLE ||
+	calib->min_us >= calib->center_us || calib->center_us >= calib->max_us ||
+	(calib->dir != 1 && calib->dir != -1) || calib->num_points > HWSERVOS_CALIB_MAX_POINTS )
+	return -EINVAL;
+
+    for( k = 0 ; k < calib->num_points ; k++ ){
+	if( calib->point_angle[k] < -HWSERVOS_ANGLE_MAX || calib->point_angle[k] > HWSERVOS_ANGLE_MAX ||
+	    calib->point_us[k] < calib->min_us || calib->point_us[k] > calib->max_us )
+	    return -EINVAL;
+	if( k > 0 && calib->point_angle[k] <= calib->point_angle[k - 1] )
+	    return -EINVAL;
+    }
+
+    // Built outside the mutex: the engine is not held up by the divisions
+    hwservos_build_lut(calib, lut);
+
+    UTIL_MUTEX_ACQUIRE("HWSERVOS",&(servo->mutex),TM_INFINITE);
+
+    servo->calib[num] = *calib;
+    memcpy(servo->lut[num], lut, sizeof(lut));
+
+    UTIL_MUTEX_RELEASE("HWSERVOS",&(servo->mutex));
+
+    return 0;
+}
+
+/**
+* @brief Reads the calibration of a servo
+*
+* @param servo Servo IP core peripheral
+* @param num Servo
+* @param calib Copy of the calibration
+* @return 0 on success. Otherwise error. 
+*
+* @note This function is \b thread-safe.
+* @note This function is \b blocking. 
+*
+*/
+
+int hwservos_get_calib(HWSERVOS* servo, unsigned num, HWSERVOS_CALIB* calib)
+{
+    int err; 
+
+    if( num >= servo->num_of )
+	return -EINVAL;
+
+    UTIL_MUTEX_ACQUIRE("HWSERVOS",&(servo->mutex),TM_INFINITE);
+
+    *calib = servo->calib[num];
+
+    UTIL_MUTEX_RELEASE("HWSERVOS",&(servo->mutex));
+
+    return 0;
+}
+
+/**
+* @brief Pulse width for an angle
+*
+* @param servo Servo IP core peripheral
+* @param num Servo. Must be valid
+* @param angle Angle in degrees, Q16.16. Clamped to +-HWSERVOS_ANGLE_MAX
+* @return Pulse width in us, within the calibrated range
+*
+* One table lookup and one interpolation: a multiply and shifts, no division.
+*
+* @note This function is \b thread-safe, but reads the table without the mutex: against a concurrent 
+*       hwservos_set_calib() it may interpolate between an old and a new entry once.
+* @note This function is \b non-blocking. 
+*
+*/
+
+unsigned hwservos_angle_to_us(HWSERVOS* servo, unsigned num, fix16_t angle)
+{
+    const int* lut = servo->lut[num];
+    int64_t pos;
+    unsigned idx, frac;
+    int p;
+
+    if( angle > HWSERVOS_ANGLE_MAX )
+	angle = HWSERVOS_ANGLE_MAX;
+    else if( angle < -HWSERVOS_ANGLE_MAX )
+	angle = -HWSERVOS_ANGLE_MAX;
+
+    // Table position in Q16.16
+    pos = ((int64_t)(angle + HWSERVOS_ANGLE_MAX) * HWSERVOS_LUT_SCALE) >> 24;
+    idx = (unsigned)(pos >> 16);
+    frac = (unsigned)(pos & 0xffff);
+
+    if( idx >= HWSERVOS_LUT_STEPS )
+	p = lut[HWSERVOS_LUT_STEPS];
+    else
+	p = lut[idx] + (int)(((int64_t)(lut[idx + 1] - lut[idx]) * frac) >> 16);
+
+    return (unsigned)(p + (1 << (HWSERVOS_LUT_FRAC - 1))) >> HWSERVOS_LUT_FRAC;
+}
+
+/**
+* @brief Sets a servo to an angle
+*
+* @param servo Servo IP core peripheral
+* @param num Servo
+* @param angle Angle in degrees, Q16.16
+* @return 0 on success. Otherwise error. 
+*
+* hwservos_set_pos() through the angle-to-pulse table of the servo.
+*
+* @note This function is \b thread-safe.
+* @note This function is \b blocking. 
+*
+*/
+
+int hwservos_set_angle(HWSERVOS* servo, unsigned num, fix16_t angle)
+{
+    if( num >= servo->num_of )
+	return -EINVAL;
+
+    return hwservos_set_pos(servo, num, hwservos_angle_to_us(servo, num, angle));
+}
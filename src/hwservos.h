@@ -13,7 +13,44 @@
 #define __HWSERVOS__H__
 
 #include "dev_mmaps_parms.h"
+#include "fixedpt.h"
 #include <native/mutex.h>
+#include <native/task.h>
+
+/* Calibration */
+#define HWSERVOS_ANGLE_MAX FIX16(90) /*! Commanded angles span +-90 degrees */
+#define HWSERVOS_CALIB_MAX_POINTS 8 /*! Correction points per servo */
+#define HWSERVOS_LUT_STEPS 128 /*! Angle-to-pulse table resolution ( 1.4 degrees per step ). Power of 2 */
+#define HWSERVOS_LUT_FRAC 4 /*! Table entries are pulse widths in 1/16 us */
+
+/* Interpolation engine */
+#define HWSERVOS_ENGINE_MAX_RATE_HZ 500 /*! Maximum evaluation rate, for extended cores */
+
+/* Easing curves of a move */
+#define HWSERVOS_EASE_LINEAR 0 /*! Constant speed. Jumps in speed at both ends */
+#define HWSERVOS_EASE_SMOOTH 1 /*! Cubic 3u^2 - 2u^3: zero speed at both ends */
+#define HWSERVOS_EASE_MINJERK 2 /*! Quintic minimum jerk: zero speed and acceleration at both ends */
+
+/*! Calibration of one servo */
+typedef struct{
+    unsigned min_us; ///< Shortest pulse the servo accepts. Every command is clamped to it
+    unsigned center_us; ///< Pulse at 0 degrees
+    unsigned max_us; ///< Longest pulse the servo accepts. Every command is clamped to it
+    int dir; ///< 1: positive angles lengthen the pulse. -1: mounted the other way round
+    unsigned num_points; ///< Correction points. Below 2 the map is linear: -90 min_us, 0 center_us, 90 max_us
+    fix16_t point_angle[HWSERVOS_CALIB_MAX_POINTS]; ///< Measured angles in degrees, increasing
+    unsigned point_us[HWSERVOS_CALIB_MAX_POINTS]; ///< Pulse that gives each angle
+} HWSERVOS_CALIB; 
+
+/*! Timed move of one servo, in engine periods */
+typedef struct{
+    int active; ///< Being interpolated
+    unsigned from; ///< Pulse width at the start of the move in us
+    unsigned to; ///< Target pulse width in us
+    unsigned step; ///< Periods elapsed
+    unsigned steps; ///< Periods of the whole move
+    int ease; ///< HWSERVOS_EASE_*
+} HWSERVOS_MOVE; 
 
 typedef struct{
     unsigned long base_add; 	///< Physical memory address where to map the device  (beginning)
@@ -22,6 +59,12 @@ typedef struct{
     unsigned* values;		///< Latched values of the Servos. Allocated during initialization
     unsigned num_of; 		///< Number of servos in device
     RT_MUTEX mutex; 
+    HWSERVOS_MOVE moves[HWSERVOS_MAX_NUM_OF]; ///< Moves in progress. Protected by the mutex
+    HWSERVOS_CALIB calib[HWSERVOS_MAX_NUM_OF]; ///< Calibrations. Protected by the mutex
+    int lut[HWSERVOS_MAX_NUM_OF][HWSERVOS_LUT_STEPS + 1]; ///< Angle-to-pulse tables built from the calibrations
+    unsigned rate_hz; ///< Evaluation rate of the engine
+    RT_TASK task; ///< Interpolation engine task
+    volatile int running; ///< Engine running
 } HWSERVOS; 
 
 int hwservos_init(HWSERVOS* servo, unsigned long base_add, unsigned long end_add, unsigned num_of);
@@ -34,4 +77,20 @@ int hwservos_get_pos(HWSERVOS* servo, unsigned num, unsigned* ret);
 int hwservos_enable(HWSERVOS* servo, unsigned num);
 int hwservos_disable(HWSERVOS* servo, unsigned num);
 
+/* Calibration and angles */
+int hwservos_set_calib(HWSERVOS* servo, unsigned num, const HWSERVOS_CALIB* calib);
+int hwservos_get_calib(HWSERVOS* servo, unsigned num, HWSERVOS_CALIB* calib);
+
+unsigned hwservos_angle_to_us(HWSERVOS* servo, unsigned num, fix16_t angle);
+int hwservos_set_angle(HWSERVOS* servo, unsigned num, fix16_t angle);
+
+/* Interpolated moves. Evaluated by the engine task at servo->rate_hz */
+int hwservos_move(HWSERVOS* servo, unsigned num, unsigned value, unsigned duration_ms, int ease);
+int hwservos_move_group(HWSERVOS* servo, unsigned mask, const unsigned* values, unsigned duration_ms, int ease);
+int hwservos_move_stop(HWSERVOS* servo, unsigned mask);
+int hwservos_move_done(HWSERVOS* servo, unsigned mask);
+
+int hwservos_engine_start(HWSERVOS* servo, unsigned rate_hz, int prio);
+int hwservos_engine_stop(HWSERVOS* servo);
+
 #endif
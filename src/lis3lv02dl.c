@@ -239,6 +239,43 @@ int lis3lv02dl_calib(LIS3LV02DL* acc)
     return 0;
 }
 
+/**
+* @brief Calibrated acceleration of the last sample in g
+*
+* @param acc LIS3LV02DL accelerometer
+* @param g_per_count Scale of the configured range, LIS3_G_PER_COUNT_* ( Q0.32 )
+* @param x Acceleration in X, Q16.16 g
+* @param y Acceleration in Y, Q16.16 g
+* @param z Acceleration in Z, Q16.16 g
+* @return 0 on success. Otherwise error. 
+*
+* Fixed point version of ( acc - cal ) / SCALE_FACTOR_*: one integer multiply per axis.
+*
+* @note This function is \b thread-safe.
+* @note This function is \b blocking. 
+*
+*/
+
+int lis3lv02dl_get_g(LIS3LV02DL* acc, uint32_t g_per_count, fix16_t* x, fix16_t* y, fix16_t* z)
+{
+    int err, dx, dy, dz;
+
+    UTIL_MUTEX_ACQUIRE("LIS3LV02DL",&(acc->mutex),TM_INFINITE);
+
+    dx = acc->xacc - acc->xcal;
+    dy = acc->yacc - acc->ycal;
+    dz = acc->zacc - acc->zcal;
+
+    UTIL_MUTEX_RELEASE("LIS3LV02DL",&(acc->mutex));
+
+    // Counts are integers: count * Q0.32 is Q32.32
+    *x = fix16_sat(((int64_t)dx * g_per_count) >> 16);
+    *y = fix16_sat(((int64_t)dy * g_per_count) >> 16);
+    *z = fix16_sat(((int64_t)dz * g_per_count) >> 16);
+
+    return 0;
+}
+
 /**
 * @brief Initialized the LIS3LV02DL in 3-axis mode
 *
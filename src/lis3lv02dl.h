@@ -121,10 +121,18 @@
 
 #define SCALE_FACTOR_6G_12bit 341.3
 #define SCALE_FACTOR_2G_12bit 2048
+
+/* g per count in Q0.32 for lis3lv02dl_get_g() ( Q16.16 would keep 2 significant digits ). Folded by the compiler */
+#define LIS3_G_PER_COUNT(SCALE) ((uint32_t)(4294967296.0 / (SCALE) + 0.5))
+#define LIS3_G_PER_COUNT_6G_16bit LIS3_G_PER_COUNT(SCALE_FACTOR_6G_16bit)
+#define LIS3_G_PER_COUNT_2G_16bit LIS3_G_PER_COUNT(SCALE_FACTOR_2G_16bit)
+#define LIS3_G_PER_COUNT_6G_12bit LIS3_G_PER_COUNT(SCALE_FACTOR_6G_12bit)
+#define LIS3_G_PER_COUNT_2G_12bit LIS3_G_PER_COUNT(SCALE_FACTOR_2G_12bit)
 //---------------------------------------------------------------------------------------------------------------------
 
 #include <native/mutex.h> 
 #include "i2ctools.h"
+#include "fixedpt.h"
 
 typedef struct{
     //Driver
@@ -155,6 +163,8 @@ int lis3lv02dl_read(LIS3LV02DL* acc);
 
 int lis3lv02dl_calib(LIS3LV02DL* acc);
 
+int lis3lv02dl_get_g(LIS3LV02DL* acc, uint32_t g_per_count, fix16_t* x, fix16_t* y, fix16_t* z);
+
 int lis3lv02dl_init_3axis(LIS3LV02DL* acc);
 
 #endif
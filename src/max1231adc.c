@@ -33,12 +33,16 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <linux/types.h>
 #include <sys/ioctl.h>
 #include <linux/spi/spidev.h>
 //Xenomai
 #include <native/mutex.h>
+#include <native/task.h>
+#include <native/timer.h>
 
 #include "max1231adc.h"
 #include "xspidev.h"
@@ -61,7 +65,8 @@ int dtable[] = { 0 , 10, 19, 28 , 38 , 47 , 57 ,
 * @param spi Already initialized SPIDEV device to use
 * @return 0 on success. Otherwise error. 
 *
-* Initizializes the structure and creates corresponding mutex 
+* Initizializes the structure and creates corresponding mutex. Takes a transfer slot from the SPI device and builds 
+* the conversion batch over it, reused by every read
 *
 * @note This function is \b NOT thread-safe. The user should guarantee somewhere else that is not called in several instances
 *       for the same resource. 
@@ -83,9 +88,29 @@ int max1231_init(MAX1231* adc, XSPIDEV* spi)
     //TODO: configure the pairs for later on calling max1231_config
     //--
 
-    UTIL_MUTEX_CREATE("MAX1231",&(adc->mutex), NULL);
+    if( (err = spi_pool_get(spi, &(adc->xfer))) < 0 ){
+	util_pdbg(DBG_WARN, "MAX1231: No transfer slot in %s\n", spi->device);
+	return err;
+    }
+
+    // Conversion byte, then the results. Delay and length are set per read
+    spi_batch_init(&(adc->xfer->batch));
+    spi_batch_add(&(adc->xfer->batch), adc->xfer->tx, NULL, 1, 0, 1);
+    spi_batch_add(&(adc->xfer->batch), NULL, adc->xfer->rx, 2, 0, 0);
+
+    adc->streaming = 0;
+    adc->stream_head = 0;
+    memset(adc->ring, 0, sizeof(adc->ring));
+
+    UTIL_MUTEX_CREATE_TAG("MAX1231",&(adc->mutex), NULL, slot_put);
 
     return 0; 
+
+slot_put:
+    spi_pool_put(spi, adc->xfer);
+    adc->xfer = NULL;
+
+    return err;
 }
 
 /**
@@ -106,10 +131,15 @@ int max1231_clean(MAX1231* adc)
     int err; 
 
     util_pdbg(DBG_INFO, "Cleaning the MAX1231 ADC...\n");
-    
-    adc->xspi = NULL;
+
+    if( adc->streaming )
+	max1231_stream_stop(adc);
     
     UTIL_MUTEX_DELETE("MAX1231", &(adc->mutex));
+
+    spi_pool_put(adc->xspi, adc->xfer);
+    adc->xfer = NULL;
+    adc->xspi = NULL;
     
     return err; 
 
@@ -121,17 +151,16 @@ int max1231_clean(MAX1231* adc)
 * @param adc MAX1231 device to clena
 * @return 0 on success. Otherwise error. 
 *
-* @note This function is \b NOT thread-safe. The user should guarantee somewhere else that is not called in several instances
-*       for the same resource. 
+* @note This function is \b thread-safe.
+* @note This function is \b blocking. 
 *
 */
 
 int max1231_config(MAX1231* adc)
 {
-    int err,i; 
+    int err, ret, i; 
     // sanity check? 
     uint8_t tx[8] = {0, }; // clock config + unipolar config + 16 SCK clocks + clock config + bipolar config + 16 SCK clocks
-    uint8_t rx[ARRAY_SIZE(tx)] = {0, };  
     tx[0] = adc->clock | MAX1231_SETUP_UNIDIFF; 
     tx[4] = adc->clock | MAX1231_SETUP_BIPDIFF; 
 
@@ -142,11 +171,18 @@ int max1231_config(MAX1231* adc)
       if((adc->pairs[i] & MAX1231_CONF_UNIDIFF_MASK) != 0 ) // By Spec, Unipolar take predecence over bipolar, there is no need of sanity check here
 	  tx[1] = adc->pairs[i] >> 1 ; //i/2
      }
+
+    UTIL_MUTEX_ACQUIRE("MAX1231",&(adc->mutex),TM_INFINITE);
+
+    memcpy(adc->xfer->tx, tx, sizeof(tx));
+    ret = spi_full_transfer(adc->xspi, adc->xfer->tx, adc->xfer->rx, ARRAY_SIZE(tx));
+
+    UTIL_MUTEX_RELEASE("MAX1231",&(adc->mutex));
      
-    if( (err = spi_full_transfer(adc->xspi, tx, rx, ARRAY_SIZE(tx))) < 0 )
+    if( ret < 0 )
     {
-	util_pdbg(DBG_WARN, "MAX1231: Can't config MAX1231");
-	return err; 
+	util_pdbg(DBG_WARN, "MAX1231: Can't config MAX1231\n");
+	return ret; 
     }
 	
     return 0; 
@@ -169,15 +205,15 @@ int max1231_config(MAX1231* adc)
 
 int adc_ll_write8(MAX1231* adc, uint8_t tx, int sleep) 
 {
-    int err;
+    int err, ret;
 
     UTIL_MUTEX_ACQUIRE("MAX1231",&(adc->mutex),TM_INFINITE);
     
-    err = spi_half_transfer(adc->xspi, &tx , 1 );
+    ret = spi_half_transfer(adc->xspi, &tx , 1 );
 			     
     UTIL_MUTEX_RELEASE("MAX1231",&(adc->mutex));
 
-    if ( err < 0 ){
+    if ( ret < 0 ){
 	util_pdbg(DBG_WARN, "MAX1231: Error writing to device %s\n",(adc->xspi)->device); 
 	return -EIO;
     }
@@ -197,7 +233,9 @@ int adc_ll_write8(MAX1231* adc, uint8_t tx, int sleep)
 * @param len Length of dest_array
 * @return 0 on success. Otherwise error. 
 *
-* Reads an array of 'len' bytes to 'dest_array'
+* Reads an array of 'len' bytes to 'dest_array'. The conversion byte, the conversion time and the read go to the 
+* SPI driver as one batch: a single syscall, with CS released between the command and the results as before.
+* The batch and its buffers are the pool slot of the ADC, only the delay and the length change between reads.
 *
 * @note This function is \b thread-safe.
 * @note This function is \b blocking. 
@@ -206,31 +244,41 @@ int adc_ll_write8(MAX1231* adc, uint8_t tx, int sleep)
 
 int adc_read(MAX1231* adc,uint8_t convbyte,uint8_t* dest_array, int len)
 {
-    int err,err2;
+    SPI_BATCH* batch = &(adc->xfer->batch);
+    uint16_t delay;
+    int err, ret;
     #ifdef DBG_LL_SPI
     int i ; 
     #endif
 
-    UTIL_MUTEX_ACQUIRE("MAX1231",&(adc->mutex),TM_INFINITE);
+    if( len <= 0 || len > SPI_POOL_BUFFER_SIZE )
+	return -EINVAL;
 
-    err = spi_half_transfer(adc->xspi, &convbyte , 1 );
-    
     //Check times in a look-up table according to len 
-    if( convbyte & MAX1231_CONV_TEMP )
-	__usleep( dtable[(len>>1)] + MAX1231_DELAY_TEMP );
+    if( convbyte & MAX1231_CONV_TEMP & ~MAX1231_CONV ) // 0x81 carries the conversion bit
+	delay = dtable[(len>>1)] + MAX1231_DELAY_TEMP;
     else 
-	__usleep( dtable[(len>>1)] );
+	delay = dtable[(len>>1)];
 
     // -- !!!!TODO: REMOVE!
-    __usleep(200); // should be less 
+    delay += 200; // should be less 
     // -- 
-    
-    err2 = spi_half_read(adc->xspi , dest_array, len);
+
+    UTIL_MUTEX_ACQUIRE("MAX1231",&(adc->mutex),TM_INFINITE);
+
+    adc->xfer->tx[0] = convbyte;
+    batch->seg[0].delay_usecs = delay;
+    batch->seg[1].len = len;
+
+    ret = spi_batch_transfer(adc->xspi, batch);
+
+    if( ret == 0 )
+	memcpy(dest_array, adc->xfer->rx, len);
 
     UTIL_MUTEX_RELEASE("MAX1231",&(adc->mutex));
     
-    if ( err2 < 0 || err < 0 ){
-	util_pdbg(DBG_WARN,"MAX1231: Error reading/writing from/to device %s. Read:%d Write:%d\n",(adc->xspi)->device,err2,err); 
+    if ( ret < 0 ){
+	util_pdbg(DBG_WARN,"MAX1231: Error reading/writing from/to device %s. Error:%d\n",(adc->xspi)->device,ret); 
 	return -EIO;
     }
 
@@ -343,3 +391,362 @@ int adc_get_temperature(MAX1231* adc, int* ret)
     return 0;
 }
 
+/**
+* @brief Sign extends a two's complement conversion result ( temperature ). Done on the unsigned value: no shift
+*        into the sign bit
+*/
+
+static inline int max1231_sext(unsigned raw)
+{
+    raw &= (1 << MAX1231_RESOLUTION_BITS) - 1;
+
+    return (int)raw - (int)((raw & (1 << (MAX1231_RESOLUTION_BITS - 1))) << 1);
+}
+
+/**
+* @brief Reads the temperature from the MAX1231 in fixed point
+*
+* @param adc MAX1231 device
+* @param ret Temperature in degrees, Q16.16
+* @return 0 on success. Otherwise error. 
+*
+* Fixed point version of adc_get_temperature() / 8. The 12-bit two's complement result is sign extended, so 
+* temperatures below zero come out right.
+*
+* @note This function is \b thread-safe.
+* @note This function is \b blocking. 
+*
+*/
+
+int adc_get_temperature_fix16(MAX1231* adc, fix16_t* ret)
+{
+    int err, raw;
+
+    if( (err = adc_get_temperature(adc, &raw)) < 0 )
+	return err;
+
+    *ret = max1231_sext(raw) * (1 << (16 - MAX1231_TEMP_FRAC_BITS));
+
+    return 0;
+}
+
+/**
+* @brief Converts a unipolar conversion result to volts
+*
+* @param raw Conversion result as returned by adc_read_one_once()
+* @param vref Reference voltage in volts, Q16.16. E.g. FIX16(2.5)
+* @return Input voltage in volts, Q16.16
+*
+* @note This function is \b thread-safe.
+*
+*/
+
+fix16_t adc_raw_to_volts(int raw, fix16_t vref)
+{
+    raw &= (1 << MAX1231_RESOLUTION_BITS) - 1;
+
+    return (fix16_t)(((int64_t)raw * vref) >> MAX1231_RESOLUTION_BITS);
+}
+
+/**
+* @brief Results of a conversion command
+*
+* @param conv Conversion register
+* @param average Averaging / repeat register
+* @param channel Channel of each result, in FIFO order
+* @return Number of results
+*/
+
+static unsigned max1231_plan_results(uint8_t conv, uint8_t average, uint8_t* channel)
+{
+    unsigned n = (conv >> 3) & 0x0f;
+    unsigned mode = conv & MAX1231_ACTION_MASK & ~(MAX1231_CONV_TEMP & ~MAX1231_CONV); // MAX1231_CONV_SCAN_* / SINGLE_*
+    unsigned first = n, count = 1, num_of = 0, i;
+
+    switch( mode ){
+	case MAX1231_CONV_SCAN_00_N: first = 0; count = n + 1; break;
+	case MAX1231_CONV_SCAN_N_15: count = 16 - n; break;
+	case MAX1231_CONV_SINGLE_REPEAT: count = 4 * ((average & 0x03) + 1); break;
+	default: break; // N once
+    }
+
+    if( conv & MAX1231_CONV_TEMP & ~MAX1231_CONV )
+	channel[num_of++] = MAX1231_STREAM_TEMP;
+
+    for( i = 0 ; i < count ; i++ )
+	channel[num_of++] = mode == MAX1231_CONV_SINGLE_REPEAT ? n : first + i;
+
+    return num_of;
+}
+
+/**
+* @brief Acquisition engine task
+*
+* Once per period and under a single acquisition of the mutex: commands the scan, waits the conversion time and 
+* decodes the FIFO into the next ring slot. The slot is marked as being written first, so readers copying it 
+* concurrently see the change and drop the copy.
+*/
+
+static void max1231_stream_task(void* cookie)
+{
+    MAX1231* adc = (MAX1231*)cookie;
+    SPI_BATCH* batch = &(adc->xfer->batch);
+    const uint8_t* rx = adc->xfer->rx;
+    MAX1231_SLOT* slot;
+    unsigned long overrun, head;
+    unsigned i;
+    RTIME t;
+    int err, raw;
+
+    if( (err = rt_task_set_periodic(NULL, TM_NOW, rt_timer_ns2ticks(1000000000llu / adc->plan.rate_hz))) < 0 ){
+	util_pdbg(DBG_WARN, "MAX1231: Engine cannot be made periodic. Error:%d\n", err);
+	return;
+    }
+
+    while( adc->streaming ){
+	if( (err = rt_task_wait_period(&overrun)) < 0 && err != -ETIMEDOUT ){
+	    util_pdbg(DBG_WARN, "MAX1231: Engine rt_task_wait_period. Error:%d\n", err);
+	    return;
+	}
+	adc->stream_overruns += overrun;
+
+	if( (err = rt_mutex_acquire(&(adc->mutex), TM_INFINITE)) < 0 ){
+	    util_pdbg(DBG_WARN, "MAX1231: Engine cannot acquire the mutex. Error:%d\n", err);
+	    return;
+	}
+
+	adc->xfer->tx[0] = adc->plan.conv;
+	batch->seg[0].delay_usecs = adc->stream_delay;
+	batch->seg[1].len = adc->stream_results << 1;
+
+	t = rt_timer_read();
+
+	if( (err = spi_batch_transfer(adc->xspi, batch)) == 0 ){
+	    head = adc->stream_head;
+	    slot = &(adc->ring[head & (MAX1231_STREAM_RING - 1)]);
+
+	    slot->seq = (head << 1) + 1;
+	    util_wmb();
+
+	    slot->frame.time_ns = t;
+	    slot->frame.seq = head;
+	    slot->frame.num_of = adc->stream_results;
+	    for( i = 0 ; i < adc->stream_results ; i++ ){
+		raw = (rx[i << 1] << 8) | rx[(i << 1) + 1];
+		if( adc->stream_channel[i] == MAX1231_STREAM_TEMP )
+		    raw = max1231_sext(raw);
+		else
+		    raw &= (1 << MAX1231_RESOLUTION_BITS) - 1;
+		slot->frame.value[i] = (int16_t)raw;
+	    }
+
+	    util_wmb();
+	    slot->seq = (head << 1) + 2;
+	    util_wmb();
+	    adc->stream_head = head + 1;
+	}else
+	    adc->stream_errors++;
+
+	rt_mutex_release(&(adc->mutex));
+    }
+}
+
+/**
+* @brief Starts the acquisition engine
+*
+* @param adc MAX1231 device
+* @param plan Scan plan. Copied
+* @param prio Priority of the engine task
+* @return 0 on success. Otherwise error. 
+*
+* Writes the averaging / repeat register and spawns a task that runs the plan at plan->rate_hz. The conversion time 
+* is computed from the plan ( dtable[] per conversion, averaging included, plus the temperature ) instead of the fixed 
+* margin of adc_read(). A plan that does not fit its period at the current SPI speed is refused. 
+*
+* On-demand reads keep working meanwhile and are interleaved between scans, but must not change the averaging 
+* register.
+*
+* @note This function is \b NOT thread-safe.
+*
+*/
+
+int max1231_stream_start(MAX1231* adc, const MAX1231_PLAN* plan, int prio)
+{
+    uint8_t average = plan->average ? plan->average : MAX1231_AVERAGE_POR;
+    unsigned navg = (average & 0x10) ? 4 << ((average >> 2) & 0x03) : 1;
+    unsigned samples, temp;
+    uint64_t scan_ns;
+    int err;
+
+    if( plan->rate_hz == 0 || plan->rate_hz > MAX1231_STREAM_MAX_RATE_HZ || !(plan->conv & MAX1231_CONV) )
+	return -EINVAL;
+
+    if( (average & 0xE0) != MAX1231_AVERAGE_POR ) // not an averaging register ( 001xxxxx )
+	return -EINVAL;
+
+    if( adc->streaming )
+	return -EBUSY;
+
+    adc->plan = *plan;
+    adc->stream_results = max1231_plan_results(plan->conv, average, adc->stream_channel);
+
+    temp = adc->stream_channel[0] == MAX1231_STREAM_TEMP;
+    samples = (adc->stream_results - temp) * navg;
+    adc->stream_delay = samples < ARRAY_SIZE(dtable) ? dtable[samples] : (samples * dtable[32] + 31) / 32;
+    if( temp )
+	adc->stream_delay += MAX1231_DELAY_TEMP;
+
+    // Command byte, conversion time and the results on the wire
+    scan_ns = 8000000000llu * (1 + (adc->stream_results << 1)) / (adc->xspi->speed ? adc->xspi->speed : SPI_DEFAULT_SPEED) 
+	      + (uint64_t)adc->stream_delay * 1000;
+    if( scan_ns >= 1000000000llu / plan->rate_hz ){
+	util_pdbg(DBG_WARN, "MAX1231: A scan takes %lu us, over the period\n", (unsigned long)(scan_ns / 1000));
+	return -EINVAL;
+    }
+
+    if( (err = adc_ll_write8(adc, average, 0)) < 0 )
+	return err;
+
+    adc->stream_errors = 0;
+    adc->stream_overruns = 0;
+    adc->streaming = 1;
+
+    if( (err = rt_task_spawn(&(adc->stream_task), "MAX1231 engine", 0, prio, T_JOINABLE, max1231_stream_task, adc)) < 0 ){
+	util_pdbg(DBG_WARN, "MAX1231: Engine cannot be spawned. Error:%d\n", err);
+	adc->streaming = 0;
+	return err;
+    }
+
+    return 0;
+}
+
+/**
+* @brief Stops the acquisition engine
+*
+* @param adc MAX1231 device
+* @return 0 on success. Otherwise error. 
+*
+* The ring keeps its frames: readers can still drain them. Frame numbers go on if the engine is started again.
+*
+* @note This function is \b NOT thread-safe.
+* @note This function is \b blocking. Waits for the current scan to finish
+*
+*/
+
+int max1231_stream_stop(MAX1231* adc)
+{
+    if( !adc->streaming )
+	return -EINVAL;
+
+    adc->streaming = 0;
+
+    return rt_task_join(&(adc->stream_task));
+}
+
+/**
+* @brief Copies a frame out of the ring
+*
+* @return 0 on success. -EAGAIN if the slot does not hold that frame, -ESTALE if it was overwritten during the copy
+*/
+
+static int max1231_ring_read(MAX1231* adc, unsigned long n, MAX1231_FRAME* frame)
+{
+    MAX1231_SLOT* slot = &(adc->ring[n & (MAX1231_STREAM_RING - 1)]);
+    unsigned long tag = (n << 1) + 2;
+
+    if( slot->seq != tag )
+	return -EAGAIN;
+
+    util_rmb();
+    *frame = slot->frame;
+    util_rmb();
+
+    return slot->seq == tag ? 0 : -ESTALE;
+}
+
+/**
+* @brief Reads the latest frame
+*
+* @param adc MAX1231 device
+* @param frame Copy of the frame
+* @return 0 on success. -EAGAIN if no frame was published yet
+*
+* Constant time. Retries only if the engine laps the whole ring during the copy.
+*
+* @note This function is \b thread-safe.
+* @note This function is \b non-blocking. Never takes a lock
+*
+*/
+
+int max1231_stream_latest(MAX1231* adc, MAX1231_FRAME* frame)
+{
+    unsigned long head;
+
+    do{
+	if( (head = adc->stream_head) == 0 )
+	    return -EAGAIN;
+	util_rmb();
+    }while( max1231_ring_read(adc, head - 1, frame) < 0 );
+
+    return 0;
+}
+
+/**
+* @brief Initializes a reader of every frame
+*
+* @param adc MAX1231 device
+* @param reader Reader. Starts at the next frame to be published
+*
+* @note This function is \b thread-safe.
+*
+*/
+
+void max1231_stream_reader_init(MAX1231* adc, MAX1231_READER* reader)
+{
+    reader->next = adc->stream_head;
+    reader->lost = 0;
+}
+
+/**
+* @brief Reads the next frame of a reader
+*
+* @param adc MAX1231 device
+* @param reader Reader, owned by the calling task
+* @param frame Copy of the frame
+* @return 0 on success. -EAGAIN if the reader is up to date
+*
+* Frames are returned in order. A reader that falls more than MAX1231_STREAM_RING frames behind skips to the oldest 
+* frame still in the ring and counts the skipped ones in reader->lost. Poll at least every MAX1231_STREAM_RING / 2 
+* periods to keep every frame.
+*
+* @note This function is \b thread-safe. Each reader is used by one task
+* @note This function is \b non-blocking. Never takes a lock
+*
+*/
+
+int max1231_stream_next(MAX1231* adc, MAX1231_READER* reader, MAX1231_FRAME* frame)
+{
+    unsigned long head;
+
+    for(;;){
+	head = adc->stream_head;
+	util_rmb();
+
+	if( reader->next == head )
+	    return -EAGAIN;
+
+	if( head - reader->next > MAX1231_STREAM_RING ){
+	    reader->lost += head - MAX1231_STREAM_RING - reader->next;
+	    reader->next = head - MAX1231_STREAM_RING;
+	}
+
+	if( max1231_ring_read(adc, reader->next, frame) == 0 ){
+	    reader->next++;
+	    return 0;
+	}
+
+	// Overwritten under the reader
+	reader->lost++;
+	reader->next++;
+    }
+}
@@ -160,14 +160,65 @@
 #define MAX1231_CONF_BIPDIFF_MASK 0x02 
 
 #include <native/mutex.h>
+#include <native/task.h>
+#include <native/timer.h>
 #include "xspidev.h"
+#include "fixedpt.h"
+
+#define MAX1231_RESOLUTION_BITS 12 /*! Conversion result width */
+#define MAX1231_TEMP_FRAC_BITS 3 /*! Temperature LSB is 1/8 degree */
+
+/* Streaming acquisition */
+#define MAX1231_STREAM_TEMP 16 /*! Channel number of the temperature result */
+#define MAX1231_STREAM_RESULTS 17 /*! Most results in a scan: 16 repeats + temperature */
+#define MAX1231_STREAM_RING 64 /*! Frames kept for the readers. Power of two */
+#define MAX1231_STREAM_MAX_RATE_HZ 10000 /*! Fastest scan rate */
+
+/*! Scan plan of the acquisition engine */
+typedef struct{
+  uint8_t conv; ///< Conversion register: MAX1231_CONV_AINxx | scan mode ( MAX1231_CONV_SCAN_* / MAX1231_CONV_SINGLE_* ), bit 0 for the temperature
+  uint8_t average; ///< Averaging / repeat register written at start ( MAX1231_AVERAGE_* | MAX1231_REPEAT_* ). 0 for power-on
+  unsigned rate_hz; ///< Scans per second
+} MAX1231_PLAN;
+
+/*! One scan, decoded */
+typedef struct{
+  RTIME time_ns; ///< Time the conversion was commanded
+  unsigned long seq; ///< Frame number since max1231_init(). Gaps are frames lost by the reader
+  unsigned num_of; ///< Results in value[]
+  int16_t value[MAX1231_STREAM_RESULTS]; ///< Results in FIFO order ( see stream_channel ). 12 bits, temperature sign extended in 1/8 degree
+} MAX1231_FRAME;
+
+/*! Ring slot */
+typedef struct{
+  volatile unsigned long seq; ///< 2 * frame + 1 while written, 2 * frame + 2 once published
+  MAX1231_FRAME frame; ///< Frame
+} MAX1231_SLOT;
+
+/*! Consumer of every frame. One per reader task */
+typedef struct{
+  unsigned long next; ///< Next frame to read
+  unsigned long lost; ///< Frames overwritten before they were read
+} MAX1231_READER;
 
 typedef struct{
   XSPIDEV* xspi; ///< SPI device where the max1231 is connected to
   RT_MUTEX mutex; ///< Xenomai Mutex
+  SPI_XFER* xfer; ///< Pool slot of the conversions: command, conversion time and read, built once. Protected by the mutex
 //   uint8_t dest[34]; // 2*NumOfChannels + 2(temp)
   uint8_t pairs[8];  ///< CH0/1 - CH2/3 - CH4/5 - CH6/7 - CH8/9 - CH10/11 - CH12/13 - CH14/15
   uint8_t clock; ///< Clock and reference configuration
+  /* Streaming ( max1231_stream_* ) */
+  MAX1231_PLAN plan; ///< Running scan plan
+  uint8_t stream_channel[MAX1231_STREAM_RESULTS]; ///< Channel of each frame result, MAX1231_STREAM_TEMP for the temperature
+  unsigned stream_results; ///< Results per scan
+  unsigned stream_delay; ///< Conversion time of the scan in us
+  RT_TASK stream_task; ///< Acquisition engine task
+  volatile int streaming; ///< Engine running
+  volatile unsigned long stream_head; ///< Frames published
+  unsigned long stream_errors; ///< Failed scans
+  unsigned long stream_overruns; ///< Periods missed by the engine
+  MAX1231_SLOT ring[MAX1231_STREAM_RING]; ///< Published frames. Single writer: the engine
 } MAX1231; 
 
 int max1231_init(MAX1231* adc, XSPIDEV* spi);
@@ -194,6 +245,24 @@ int adc_read_scan_0_N(MAX1231* adc, uint8_t* dest, uint8_t n);
 // Needs to divide by 8 afterwards
 int adc_get_temperature(MAX1231* adc, int* ret);
 
+/* Temperature in degrees, Q16.16 */
+int adc_get_temperature_fix16(MAX1231* adc, fix16_t* ret);
+
+/* Unipolar conversion result to volts, Q16.16 */
+fix16_t adc_raw_to_volts(int raw, fix16_t vref);
+
+/* Acquisition engine. Scans at a fixed rate into a ring of timestamped frames */
+int max1231_stream_start(MAX1231* adc, const MAX1231_PLAN* plan, int prio);
+
+int max1231_stream_stop(MAX1231* adc);
+
+/* Consumers. Lock-free, never block */
+int max1231_stream_latest(MAX1231* adc, MAX1231_FRAME* frame);
+
+void max1231_stream_reader_init(MAX1231* adc, MAX1231_READER* reader);
+
+int max1231_stream_next(MAX1231* adc, MAX1231_READER* reader, MAX1231_FRAME* frame);
+
 /* TODO: Take it out from here */
 #define CMD_ALL_SINGLE_TX 0x64
 #define CMD_ALL_DIFF_TX 0x64
@@ -25,7 +25,7 @@
     along with this program; if not, write to the Free Software
     Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
     
-    @note PID functions not implemented yet
+    @note PID control runs in software ( motors_pid_start() ), in Q16.16 fixed point. There is no FPU in the PPC405
 
     @version 0.4-Xenomai       
     
@@ -40,14 +40,25 @@
 #include <unistd.h>
 #include <sys/mman.h>
 #include <linux/types.h>
+#include <errno.h>
+#include <string.h>
 //Xenomai
 #include <native/mutex.h>
+#include <native/task.h>
+#include <native/timer.h>
 //--
 #include "busio.h"
+#include "platform_core.h"
 #include "motors.h"
 #include "util.h"
 #include "dev_mmaps_parms.h"
 
+/*! Word offset of a register of a loop in the PID core */
+static inline unsigned motors_pid_reg(unsigned pidnum, unsigned reg)
+{
+    return pidnum * PID_REG_STRIDE + reg;
+}
+
 /**
 * @brief Init MOTORS device structure 
 *
@@ -58,12 +69,13 @@
 * @param qadd_base Base address for the memory mapped Quadrature Encoder peripheral
 * @param qadd_end End address for the memory mapped Quadrature Encoder peripheral
 * @param num_of_motors Number of encoders attached to the Quadrature Encoder peripheral
-* @param padd_base Base address for the memory mapped PID peripheral( Not implemented yet... )
-* @param padd_end End address for the memory mapped PID peripheral( Not implemented yet... )
-* @param num_of_motors Number of PIDs attached to the PID peripheral( Not implemented yet... )
+* @param padd_base Base address for the memory mapped PID core
+* @param padd_end End address for the memory mapped PID core
+* @param num_of_pids Number of loops in the PID core. 0 to run without it, as when the core cannot be mapped
 * @return 0 on success. Otherwise error. 
 *
 * Initializes all the peripherals unifying their control under the MOTOR device structure. 
+* Every motor starts in MOTORS_MODE_OPENLOOP, with the loops of the PID core disabled.
 *
 * @note This function is \b NOT thread-safe. The user should guarantee somewhere else that is not called in several instances
 *       for the same resource. 
@@ -77,9 +89,16 @@ int motors_init_motor(MOTOR* motor,
 {
     int im= 0;
     int iq= 0; 
-//     int ip= 0; 
+    int ip= 0; 
+    int ic; 
     int err; 
 
+    motor->pids = NULL;
+    motor->pid_running = 0;
+    motor->num_of_encs = 0;
+    motor->padd = NULL;
+    motor->num_of_pids = 0;
+
     /* PWM instances */
     if( num_of_motors > 0 && num_of_motors <= MOTORS_MAX_NUM_OF_CORES){
 	util_pdbg(DBG_INFO, "MOTORS: Mapping motors... \n");
@@ -104,8 +123,27 @@ int motors_init_motor(MOTOR* motor,
 		    goto pwm_clean_mutex;
 	    }
 	}
-	/* Set default parameters */
-	//TODO:
+	/* Software PID controllers, one per motor */
+	if( (motor->pids = calloc(num_of_motors, sizeof(PID))) == NULL ){
+	    util_pdbg(DBG_WARN, "\t-> MOTORS: Cannot allocate memory" );
+	    err = -ENOMEM;
+	    goto pwm_clean_mutex;
+	}
+	for( ip = 0 ; ip < num_of_motors ; ip++ ){
+	    if( (err = rt_mutex_create(&(motor->pids[ip].mutex), 0)) < 0 ){
+		    util_pdbg(DBG_WARN, "\t-> MOTORS: Error rt_mutex_create: %d\n", err);
+		    goto pid_clean_mutex;
+	    }
+	    motor->pids[ip].d_alpha = FIX16_ONE;
+	    motor->pwms[ip].freq_div = ~0u; // unknown until written
+	}
+	/* Setpoint channel. Both slots start with every motor disabled */
+	if( (err = rt_mutex_create(&(motor->sp_mutex), 0)) < 0 ){
+		util_pdbg(DBG_WARN, "\t-> MOTORS: Error rt_mutex_create: %d\n", err);
+		goto pid_clean_mutex;
+	}
+	memset(motor->sp_slot, 0, sizeof(motor->sp_slot));
+	motor->sp_seq = 0;
     }
 
     /* Quadrature encoders instances */
@@ -147,20 +185,27 @@ int motors_init_motor(MOTOR* motor,
 
     }
 
-   //TODO:No PID instances implemented yet
-
-//     /* PID Instances */
-//     if( num_of_pids > 0 && num_of_pids <= PIDS_MAX_NUM_OF_CORES){
-// 	//TODO:No PID instances implemented yet
-//     }
+    /* PID core instances. One loop per motor, all of them released to the bus */
+    if( num_of_pids > 0 && num_of_pids <= PIDS_MAX_NUM_OF_CORES && motor->pids != NULL ){
+	util_pdbg(DBG_INFO, "\t-> MOTORS: Mapping PID core... \n");
+
+	// The core is optional: without it the motors keep open loop and software PID control
+	if( (err = mapio_region(&(motor->padd), padd_base, padd_end)) < 0 ){
+	    util_pdbg(DBG_WARN, "\t-> MOTORS: Couldn't map PID: %d. Continuing without it\n", err);
+	    motor->padd = NULL;
+	    motor->num_of_pids = 0;
+	}else{
+	    motor->padd_base = padd_base; 
+	    motor->padd_end = padd_end; 
+	    motor->num_of_pids = num_of_pids < motor->num_of_motors ? num_of_pids : motor->num_of_motors;
+
+	    for( ic = 0 ; ic < motor->num_of_pids ; ic++ )
+		busio_write(motor->padd, motors_pid_reg(ic, PID_REG_CTRL), 0);
+	}
+    }
 
     return 0; 
 
-// pid_clean_mutex: 
-// pid_deallocate: 
-// pid_nothing:
-
-
 qenc_clean_mutex: 
     if( iq != 0 ) 
 	for( iq -= 1 ;iq >= 0; iq-- ) 
@@ -171,6 +216,14 @@ qenc_unmap:
     if ( unmapio_region(&(motor->qadd), qadd_base, qadd_end) < 0 )
 	util_pdbg(DBG_WARN, "MOTORS: QENC couldn't be unmapped at virtual= %ld\n", &(motor->qadd));
 qenc_nothing:
+    if( motor->pids != NULL )
+	UTIL_MUTEX_DELETE("MOTOR",&(motor->sp_mutex));
+pid_clean_mutex: 
+    if( ip != 0 ) 
+	for( ip -= 1 ;ip >= 0; ip-- ) 
+	    UTIL_MUTEX_DELETE("MOTOR",&(motor->pids[ip].mutex));
+
+    free(motor->pids);
 pwm_clean_mutex: 
     if( im != 0 ) 
 	for( im -= 1 ;im >= 0; im-- ) 
@@ -203,6 +256,25 @@ int motors_clean_motor(MOTOR* motor)
 
     util_pdbg(DBG_INFO, "MOTORS: Cleaning motor driver\n");
 
+    if( motor->pid_running )
+	motors_pid_stop(motor);
+
+    /* Hand the PWMs back to the bus before stopping them */
+    if( motor->padd != NULL ){
+	util_pdbg(DBG_DEBG, "\t-> MOTORS: Releasing PID core\n");
+
+	for( i = 0 ; i < motor->num_of_pids ; i++ )
+	    busio_write(motor->padd, motors_pid_reg(i, PID_REG_CTRL), 0);
+
+	if ( (err = unmapio_region(&(motor->padd), motor->padd_base, motor->padd_end)) < 0 ){
+	    util_pdbg(DBG_WARN, "-> MOTORS: PID couldn't be unmapped at virtual= %ld . Error : %d \n", &(motor->padd), err);
+	    return err; 
+	}
+
+	motor->padd = NULL;
+	motor->num_of_pids = 0;
+    }
+
     /* Set Speed in each motor */
     for( i = 0 ;i < motor->num_of_motors; i++ )
     {
@@ -224,10 +296,16 @@ int motors_clean_motor(MOTOR* motor)
 
     util_pdbg(DBG_DEBG, "\t-> MOTORS: Cleaning pwms\n");
 
-    for( i = 0 ;i < motor->num_of_motors; i++ ) 
+    for( i = 0 ;i < motor->num_of_motors; i++ ){
 	UTIL_MUTEX_DELETE("\t-> MOTOR",&(motor->pwms[i].mutex));
+	UTIL_MUTEX_DELETE("\t-> MOTOR",&(motor->pids[i].mutex));
+    }
+
+    if( motor->pids != NULL )
+	UTIL_MUTEX_DELETE("\t-> MOTOR",&(motor->sp_mutex));
 
     free(motor->pwms);
+    free(motor->pids);
 
     if ( (err = unmapio_region(&(motor->madd), motor->madd_base, motor->madd_end)) < 0 ){
 	util_pdbg(DBG_WARN, "-> MOTORS: PWM couldn't be unmapped at virtual= %ld . Error : %d \n", &(motor->madd), err);
@@ -267,7 +345,7 @@ int motors_pwm_set_freq_div(MOTOR* motor, unsigned motnum, int value)
 
     UTIL_MUTEX_ACQUIRE("MOTORS",&(motor->pwms[motnum].mutex),TM_INFINITE);
 
-    *(motor->madd + (motnum<<1) + 1) = value ; 
+    core_set_motors_freq_div(motor->madd, motnum, value); 
     motor->pwms[motnum].freq_div = value; 
 
     UTIL_MUTEX_RELEASE("MOTORS",&(motor->pwms[motnum].mutex));
@@ -334,7 +412,7 @@ int motors_pwm_set_speed(MOTOR* motor, int motnum, int value)
 
     UTIL_MUTEX_ACQUIRE("MOTORS",&(motor->pwms[motnum].mutex),TM_INFINITE);
 
-    *(motor->madd + (motnum<<1)) = value ; 
+    core_set_motors_duty(motor->madd, motnum, value); 
     motor->pwms[motnum].speed = value; 
 
     UTIL_MUTEX_RELEASE("MOTORS",&(motor->pwms[motnum].mutex));
@@ -398,8 +476,8 @@ int motors_qenc_setzero(MOTOR* motor, unsigned qencnum )
     UTIL_MUTEX_ACQUIRE("MOTORS",&(motor->encoders[qencnum].mutex),TM_INFINITE);
 
     // A glitch here will reset the counter
-    *(motor->qadd + qencnum) = 1; 
-    *(motor->qadd + qencnum) = 0; 
+    core_set_qenc_reset(motor->qadd, qencnum, 1); 
+    core_set_qenc_reset(motor->qadd, qencnum, 0); 
 
     motor->encoders[qencnum].qenc_value = 0; 
     motor->encoders[qencnum].qenc_prev_value = 0; 
@@ -434,7 +512,7 @@ int motors_qenc_read_enc(MOTOR* motor, unsigned qencnum, int* value, int* prev_v
     UTIL_MUTEX_ACQUIRE("MOTORS",&(motor->encoders[qencnum].mutex),TM_INFINITE);
 
     motor->encoders[qencnum].qenc_prev_value = motor->encoders[qencnum].qenc_value;
-    motor->encoders[qencnum].qenc_value = *(motor->qadd + qencnum); 
+    motor->encoders[qencnum].qenc_value = core_get_qenc_count(motor->qadd, qencnum); 
     
     *value = motor->encoders[qencnum].qenc_value;
     *prev_value = motor->encoders[qencnum].qenc_prev_value;
@@ -444,50 +522,808 @@ int motors_qenc_read_enc(MOTOR* motor, unsigned qencnum, int* value, int* prev_v
     return 0; 
 }
 
-//TODO: To be implemented
+/**
+* @brief Latches all the quadrature decoder counters at once
+*
+* @param motor MOTOR device structure
+* @param snap Snapshot. The current values move to prev_value/prev_time_ns before the new latch
+* @return 0 on success. Otherwise error. 
+*
+* The counters are read back to back from the bus, without taking the per-encoder mutexes, and stamped with the 
+* midpoint of the reads. The state kept by motors_qenc_read_enc() is not touched: every caller keeps its own snapshot.
+* Zero snap->time_ns before the first call ( or the structure ) so the first delta is not taken against garbage.
+*
+* @note This function is \b thread-safe with respect to other readers. Concurrent calls on the same snapshot are not.
+* @note This function is \b non-blocking. 
+*
+*/
+
+int motors_qenc_read_all(MOTOR* motor, QENC_SNAPSHOT* snap)
+{
+    RTIME start;
+    unsigned i;
+
+    if( motor->num_of_encs == 0 || motor->num_of_encs > QENC_MAX_NUM_OF_CORES )
+	return -EINVAL;
+
+    for( i = 0 ; i < motor->num_of_encs ; i++ )
+	snap->prev_value[i] = snap->value[i];
+    snap->prev_time_ns = snap->time_ns;
+    snap->num_of = motor->num_of_encs;
+
+    start = rt_timer_read();
+
+    for( i = 0 ; i < motor->num_of_encs ; i++ )
+	snap->value[i] = core_get_qenc_count(motor->qadd, i);
+
+    snap->time_ns = start + (rt_timer_read() - start) / 2;
+
+    return 0; 
+}
+
+/**
+* @brief Publishes a full setpoint vector for the control task
+*
+* @param motor MOTOR device structure
+* @param sp Setpoint vector. Speeds and dividers are clamped to the PWM ranges
+* @return 0 on success. Otherwise error. 
+*
+* The vector becomes visible to motors_setpoint_fetch() as a whole: the control task never sees half of an update.
+* Writers are serialized among themselves only, a writer preempted at any point never delays the control task.
+*
+* @note This function is \b thread-safe.
+* @note This function is \b blocking, only against other writers. 
+*
+*/
+
+int motors_setpoint_publish(MOTOR* motor, const MOTORS_SETPOINT* sp)
+{
+    MOTORS_SETPOINT* slot;
+    unsigned i; 
+    int err; 
+
+    if( motor->pids == NULL )
+	return -EINVAL;
+
+    UTIL_MUTEX_ACQUIRE("MOTORS",&(motor->sp_mutex),TM_INFINITE);
+
+    slot = &(motor->sp_slot[util_seq_write_begin(&(motor->sp_seq))]);
+
+    slot->enable = sp->enable & ((1u << motor->num_of_motors) - 1);
+    for( i = 0 ; i < motor->num_of_motors ; i++ ){
+	slot->speed[i] = sp->speed[i] > MOTORS_MAX_SPEED ? MOTORS_MAX_SPEED : 
+			( sp->speed[i] < -MOTORS_MAX_SPEED ? -MOTORS_MAX_SPEED : sp->speed[i] );
+	slot->freq_div[i] = sp->freq_div[i] > MOTORS_MAX_FREQ_DIV ? MOTORS_MAX_FREQ_DIV : sp->freq_div[i];
+    }
+
+    util_seq_write_end(&(motor->sp_seq));
+
+    UTIL_MUTEX_RELEASE("MOTORS",&(motor->sp_mutex));
+
+    return 0; 
+}
+
+/**
+* @brief Takes the latest consistent setpoint vector
+*
+* @param motor MOTOR device structure
+* @param sp Vector of the caller. Overwritten only when a newer consistent vector is available
+* @param seq Sequence of the vector in 'sp', kept by the caller between calls. Start with both zeroed ( all motors disabled )
+* @return 1 if 'sp' was updated, 0 if it is still the latest. Otherwise error. 
+*
+* Meant for the start of every control cycle. If a writer completes an update during the copy, the copy is discarded 
+* and 'sp' keeps the previous vector: the new one is picked up on the next cycle.
+*
+* @note This function is \b thread-safe for one reader per 'sp'/'seq' pair.
+* @note This function is \b non-blocking and \b wait-free. 
+*
+*/
+
+int motors_setpoint_fetch(MOTOR* motor, MOTORS_SETPOINT* sp, unsigned* seq)
+{
+    MOTORS_SETPOINT copy;
+    unsigned start, slot; 
+
+    if( motor->pids == NULL )
+	return -EINVAL;
+
+    start = util_seq_read_begin(&(motor->sp_seq), &slot);
+
+    if( (start | 1) == (*seq | 1) ) // same published vector, a write may be in progress on the other slot
+	return 0;
+
+    copy = motor->sp_slot[slot];
+
+    if( util_seq_read_retry(&(motor->sp_seq), start) )
+	return 0;
+
+    *sp = copy;
+    *seq = start;
+
+    return 1; 
+}
+
+/**
+* @brief Writes a setpoint vector to the PWMs
+*
+* @param motor MOTOR device structure
+* @param sp Setpoint vector, usually from motors_setpoint_fetch()
+* @return 0 on success. Otherwise error. 
+*
+* Only registers whose value changes are written. Motors under PID control ( motors_pid_enable() ) are skipped.
+*
+* @note This function is \b NOT thread-safe. The control task owns the PWMs: do not mix it with motors_pwm_set_speed()
+* @note This function is \b non-blocking. 
+*
+*/
+
+int motors_setpoint_apply(MOTOR* motor, const MOTORS_SETPOINT* sp)
+{
+    unsigned i; 
+    int speed; 
+
+    if( motor->pids == NULL )
+	return -EINVAL;
+
+    for( i = 0 ; i < motor->num_of_motors ; i++ ){
+	if( motor->pids[i].enabled )
+	    continue;
+
+	if( motor->pwms[i].freq_div != sp->freq_div[i] ){
+	    core_set_motors_freq_div(motor->madd, i, sp->freq_div[i]); 
+	    motor->pwms[i].freq_div = sp->freq_div[i];
+	}
+
+	speed = (sp->enable & (1u << i)) ? sp->speed[i] : 0;
+	if( (int)motor->pwms[i].speed != speed ){
+	    core_set_motors_duty(motor->madd, i, speed); 
+	    motor->pwms[i].speed = speed;
+	}
+    }
+
+    return 0; 
+}
+
+/**
+* @brief Starts position/velocity estimators from a snapshot
+*
+* @param est Array of snap->num_of estimators
+* @param snap Snapshot the positions start from
+*
+* Call it again after motors_qenc_setzero(), otherwise the reset is taken as a jump of the position.
+*/
+
+void motors_qenc_estimator_init(QENC_ESTIMATOR* est, const QENC_SNAPSHOT* snap)
+{
+    unsigned i;
+
+    for( i = 0 ; i < snap->num_of ; i++ ){
+	est[i].pos = (int)((unsigned)snap->value[i] << (32 - QENC_COUNTER_BITS)) >> (32 - QENC_COUNTER_BITS);
+	est[i].vel = 0;
+	est[i].method = QENC_VEL_1T;
+	est[i].last_raw = snap->value[i];
+	est[i].last_time = snap->time_ns;
+	est[i].edge_pos = est[i].pos;
+	est[i].edge_time = snap->time_ns;
+	est[i].edge_dpos = 0;
+	est[i].edge_dt = 0;
+    }
+}
 
 /**
-* @brief Dummy skeleton for the PID functions.
+* @brief Ticks over a time as a rate in ticks/s Q16.16, without overflowing 64 bits
+*/
+
+static int64_t motors_qenc_rate(int64_t dpos, RTIME dt_ns)
+{
+    int64_t q, r;
+
+    if( dt_ns == 0 )
+	return 0;
+
+    if( dt_ns > QENC_VEL_TIMEOUT_NS << 4 ) // also keeps the remainder below 2^47
+	return 0;
+
+    q = dpos * 1000000000ll; // |dpos| < 2^32
+    r = q % (int64_t)dt_ns;
+
+    // dpos can be negative: scale by multiplying, a left shift of a negative value is undefined
+    return (q / (int64_t)dt_ns) * (1 << 16) + r * (1 << 16) / (int64_t)dt_ns;
+}
+
+/**
+* @brief Updates position and velocity estimators with a new snapshot
+*
+* @param est Array of snap->num_of estimators, started with motors_qenc_estimator_init()
+* @param snap New snapshot from motors_qenc_read_all()
+*
+* Positions: counter deltas are sign-extended from QENC_COUNTER_BITS and accumulated in 64 bits, so wraparounds of the 
+* hardware counters are transparent as long as they move less than half their range between two snapshots.
 *
-* @note To be implemented
+* Velocity: above QENC_VEL_MT_MIN_TICKS per sample, ticks counted over the sample period ( M/T ). At low speed that 
+* count is 0 or 1 and too coarse, so the time between the samples that saw the counter move is used instead ( 1/T ). 
+* While no tick arrives the 1/T estimate decays as 1/( time since the last move ), and drops to 0 after 
+* QENC_VEL_TIMEOUT_NS. Switching uses hysteresis to avoid chattering at the boundary.
 *
+* @note This function is \b non-blocking. Pure computation, suitable for the control loop
 */
 
-void motors_pid_set_params(MOTOR* motor, unsigned pidnum, int kp, int ki, int kd)
+void motors_qenc_estimate(QENC_ESTIMATOR* est, const QENC_SNAPSHOT* snap)
 {
+    QENC_ESTIMATOR* e;
+    int64_t d, bound;
+    RTIME dt, idle;
+    unsigned i;
+
+    for( i = 0 ; i < snap->num_of ; i++ ){
+	e = &est[i];
+
+	d = (int)(((unsigned)snap->value[i] - (unsigned)e->last_raw) << (32 - QENC_COUNTER_BITS)) >> (32 - QENC_COUNTER_BITS);
+	dt = snap->time_ns - e->last_time;
+	e->pos += d;
+	e->last_raw = snap->value[i];
+	e->last_time = snap->time_ns;
+
+	if( d != 0 ){
+	    e->edge_dpos = e->pos - e->edge_pos;
+	    e->edge_dt = snap->time_ns - e->edge_time;
+	    e->edge_pos = e->pos;
+	    e->edge_time = snap->time_ns;
+	}
+
+	if( d >= QENC_VEL_MT_MIN_TICKS || d <= -QENC_VEL_MT_MIN_TICKS )
+	    e->method = QENC_VEL_MT;
+	else if( d < QENC_VEL_MT_MIN_TICKS/2 && d > -QENC_VEL_MT_MIN_TICKS/2 )
+	    e->method = QENC_VEL_1T;
+
+	if( e->method == QENC_VEL_MT ){
+	    e->vel = motors_qenc_rate(d, dt);
+	    continue;
+	}
+
+	if( d != 0 ){
+	    e->vel = motors_qenc_rate(e->edge_dpos, e->edge_dt);
+	    continue;
+	}
+
+	// No tick: the speed is at most one tick over the time since the last one
+	idle = snap->time_ns - e->edge_time;
+	if( idle > QENC_VEL_TIMEOUT_NS ){
+	    e->vel = 0;
+	}else if( idle > e->edge_dt ){
+	    bound = motors_qenc_rate(1, idle);
+	    if( e->vel > bound )
+		e->vel = bound;
+	    else if( e->vel < -bound )
+		e->vel = -bound;
+	}
+    }
 }
 
 /**
-* @brief Dummy skeleton for the PID functions.
+* @brief Sets the gains of a PID controller
+*
+* @param motor MOTOR device structure
+* @param pidnum Number of the motor
+* @param kp Proportional gain ( Q16.16 duty cycle per tick/s of error )
+* @param ki Integral gain ( Q16.16, applied once per control period )
+* @param kd Derivative gain ( Q16.16, applied once per control period )
+* @return 0 on success. Otherwise error. 
 *
-* @note To be implemented
+* The engine picks the new gains up on its next period. Use FIX16() for constants. 
+* With a PID core the gains are written to it as well: KI and KD apply once per PID_CORE_RATE_HZ period there.
+*
+* @note This function is \b thread-safe.
+* @note This function is \b blocking. 
 *
 */
+
+int motors_pid_set_params(MOTOR* motor, unsigned pidnum, int kp, int ki, int kd)
+{
+    int err; 
+
+    if( motor->pids == NULL || pidnum >= motor->num_of_motors )
+	return -EINVAL;
+
+    UTIL_MUTEX_ACQUIRE("MOTORS",&(motor->pids[pidnum].mutex),TM_INFINITE);
+
+    motor->pids[pidnum].kp = kp;
+    motor->pids[pidnum].ki = ki;
+    motor->pids[pidnum].kd = kd;
+    motor->pids[pidnum].gen++;
+
+    if( pidnum < motor->num_of_pids ){
+	busio_write(motor->padd, motors_pid_reg(pidnum, PID_REG_KP), kp); 
+	busio_write(motor->padd, motors_pid_reg(pidnum, PID_REG_KI), ki); 
+	busio_write(motor->padd, motors_pid_reg(pidnum, PID_REG_KD), kd); 
+    }
+
+    UTIL_MUTEX_RELEASE("MOTORS",&(motor->pids[pidnum].mutex));
+
+    return 0; 
+}
+
+/**
+* @brief Sets the low-pass filter applied to the derivative term
+*
+* @param motor MOTOR device structure
+* @param pidnum Number of the motor
+* @param d_alpha Filter coefficient in Q16.16 ( 0 < d_alpha <= FIX16_ONE ). FIX16_ONE disables the filter
+* @return 0 on success. Otherwise error. 
+*
+* d = d + d_alpha * ( d_new - d ) every control period. Software engine only: the PID core has no filter.
+*
+* @note This function is \b thread-safe.
+* @note This function is \b blocking. 
+*
+*/
+
+int motors_pid_set_dfilter(MOTOR* motor, unsigned pidnum, int d_alpha)
+{
+    int err; 
+
+    if( motor->pids == NULL || pidnum >= motor->num_of_motors || d_alpha <= 0 || d_alpha > FIX16_ONE )
+	return -EINVAL;
+
+    UTIL_MUTEX_ACQUIRE("MOTORS",&(motor->pids[pidnum].mutex),TM_INFINITE);
+
+    motor->pids[pidnum].d_alpha = d_alpha;
+    motor->pids[pidnum].gen++;
+
+    UTIL_MUTEX_RELEASE("MOTORS",&(motor->pids[pidnum].mutex));
+
+    return 0; 
+}
+
+/**
+* @brief Reads a gain of a PID controller
+*
+* @param motor MOTOR device structure
+* @param pidnum Number of the motor
+* @param gain Offset of the gain in the PID structure
+* @param reg Register of the gain in the PID core
+* @param ret Read value ( Q16.16 )
+* @return 0 on success. Otherwise error. 
+*
+* Read back from the PID core when there is one.
+*/
+
+static int motors_pid_read_gain(MOTOR* motor, unsigned pidnum, int* gain, unsigned reg, int* ret)
+{
+    int err; 
+
+    UTIL_MUTEX_ACQUIRE("MOTORS",&(motor->pids[pidnum].mutex),TM_INFINITE);
+
+    if( pidnum < motor->num_of_pids )
+	*ret = busio_read(motor->padd, motors_pid_reg(pidnum, reg));
+    else
+	*ret = *gain;
+
+    UTIL_MUTEX_RELEASE("MOTORS",&(motor->pids[pidnum].mutex));
+
+    return 0; 
+}
+
+/**
+* @brief Reads the proportional gain of a PID controller
+*
+* @param motor MOTOR device structure
+* @param pidnum Number of the motor
+* @param ret Read value ( Q16.16 )
+* @return 0 on success. Otherwise error. 
+*
+* @note This function is \b thread-safe.
+* @note This function is \b blocking. 
+*
+*/
+
 int motors_pwm_read_kp(MOTOR* motor, unsigned pidnum, int* ret)
 {   
-    return 0; 
+    if( motor->pids == NULL || pidnum >= motor->num_of_motors )
+	return -EINVAL;
+
+    return motors_pid_read_gain(motor, pidnum, &(motor->pids[pidnum].kp), PID_REG_KP, ret);
 }
 
 /**
-* @brief Dummy skeleton for the PID functions.
+* @brief Reads the integral gain of a PID controller
 *
-* @note To be implemented
+* @param motor MOTOR device structure
+* @param pidnum Number of the motor
+* @param ret Read value ( Q16.16 )
+* @return 0 on success. Otherwise error. 
+*
+* @note This function is \b thread-safe.
+* @note This function is \b blocking. 
 *
 */
 
 int motors_pwm_read_ki(MOTOR* motor, unsigned pidnum, int* ret)
 {    
-    return 0;
+    if( motor->pids == NULL || pidnum >= motor->num_of_motors )
+	return -EINVAL;
+
+    return motors_pid_read_gain(motor, pidnum, &(motor->pids[pidnum].ki), PID_REG_KI, ret);
 }
 
 /**
-* @brief Dummy skeleton for the PID functions.
+* @brief Reads the derivative gain of a PID controller
+*
+* @param motor MOTOR device structure
+* @param pidnum Number of the motor
+* @param ret Read value ( Q16.16 )
+* @return 0 on success. Otherwise error. 
 *
-* @note To be implemented
+* @note This function is \b thread-safe.
+* @note This function is \b blocking. 
 *
 */
 
 int motors_pwm_read_kd(MOTOR* motor, unsigned pidnum, int* ret)
 {
-    return 0;
+    if( motor->pids == NULL || pidnum >= motor->num_of_motors )
+	return -EINVAL;
+
+    return motors_pid_read_gain(motor, pidnum, &(motor->pids[pidnum].kd), PID_REG_KD, ret);
+}
+
+/**
+* @brief Sets the target speed of a PID controlled motor
+*
+* @param motor MOTOR device structure
+* @param pidnum Number of the motor
+* @param ticks_per_sec Target speed in encoder ticks per second
+* @return 0 on success. Otherwise error. 
+*
+* @note This function is \b thread-safe.
+* @note This function is \b non-blocking. 
+*
+*/
+
+int motors_pid_set_speed(MOTOR* motor, unsigned pidnum, int ticks_per_sec)
+{
+    if( motor->pids == NULL || pidnum >= motor->num_of_motors )
+	return -EINVAL;
+
+    motor->pids[pidnum].setpoint = ticks_per_sec;
+
+    if( pidnum < motor->num_of_pids )
+	busio_write(motor->padd, motors_pid_reg(pidnum, PID_REG_SETPOINT), ticks_per_sec); 
+
+    return 0; 
+}
+
+/**
+* @brief Changes whether the PID engine drives a PWM
+*
+* Done under the mutex of the PWM, as the engine writes it: once this returns, the engine does not write a
+* released PWM again.
+*/
+
+static int motors_pid_drive(MOTOR* motor, unsigned motnum, int enabled)
+{
+    int err; 
+
+    UTIL_MUTEX_ACQUIRE("MOTORS",&(motor->pwms[motnum].mutex),TM_INFINITE);
+    motor->pids[motnum].enabled = enabled;
+    UTIL_MUTEX_RELEASE("MOTORS",&(motor->pwms[motnum].mutex));
+
+    return 0; 
+}
+
+/**
+* @brief Hands a motor to the PID engine or takes it back
+*
+* @param motor MOTOR device structure
+* @param pidnum Number of the motor
+* @param enable 1 - the engine drives the PWM of the motor. 0 - released, the PWM keeps its last duty cycle
+* @return 0 on success. Otherwise error. 
+*
+* Same as motors_set_mode() with MOTORS_MODE_SWPID / MOTORS_MODE_OPENLOOP.
+* The controller starts from a clean state ( no integral, no derivative history ) every time it is enabled.
+* While enabled, motors_pwm_set_speed() on this motor is overridden on the next control period.
+*
+* @note This function is \b thread-safe.
+* @note This function is \b blocking. 
+*
+*/
+
+int motors_pid_enable(MOTOR* motor, unsigned pidnum, int enable)
+{
+    return motors_set_mode(motor, pidnum, enable ? MOTORS_MODE_SWPID : MOTORS_MODE_OPENLOOP);
+}
+
+/**
+* @brief Selects who drives the duty cycle of a motor
+*
+* @param motor MOTOR device structure
+* @param motnum Number of the motor
+* @param mode MOTORS_MODE_OPENLOOP, MOTORS_MODE_SWPID or MOTORS_MODE_HWPID
+* @return 0 on success. -ENODEV for MOTORS_MODE_HWPID without a loop in the PID core. Otherwise error. 
+*
+* Entering MOTORS_MODE_HWPID loads the gains and the setpoint into the core and starts its loop from a clean state. 
+* Leaving it writes the last output of the core to the PWM, so the motor does not jump. While the core owns the 
+* PWM, its duty cycle register ignores bus writes.
+*
+* @note This function is \b thread-safe.
+* @note This function is \b blocking. 
+*
+*/
+
+int motors_set_mode(MOTOR* motor, unsigned motnum, int mode)
+{
+    PID* pid;
+    int err, ret = 0, duty; 
+
+    if( motor->pids == NULL || motnum >= motor->num_of_motors )
+	return -EINVAL;
+
+    if( mode == MOTORS_MODE_SWPID && motnum >= motor->num_of_encs )
+	return -EINVAL;
+
+    if( mode == MOTORS_MODE_HWPID && motnum >= motor->num_of_pids )
+	return -ENODEV;
+
+    if( mode != MOTORS_MODE_OPENLOOP && mode != MOTORS_MODE_SWPID && mode != MOTORS_MODE_HWPID )
+	return -EINVAL;
+
+    pid = &(motor->pids[motnum]);
+
+    UTIL_MUTEX_ACQUIRE("MOTORS",&(pid->mutex),TM_INFINITE);
+
+    if( mode == MOTORS_MODE_HWPID ){
+	if( (ret = motors_pid_drive(motor, motnum, 0)) < 0 ) // the engine lets go of the PWM before the core takes it
+	    goto unlock;
+	if( !pid->hw ){
+	    busio_write(motor->padd, motors_pid_reg(motnum, PID_REG_KP), pid->kp); 
+	    busio_write(motor->padd, motors_pid_reg(motnum, PID_REG_KI), pid->ki); 
+	    busio_write(motor->padd, motors_pid_reg(motnum, PID_REG_KD), pid->kd); 
+	    busio_write(motor->padd, motors_pid_reg(motnum, PID_REG_SETPOINT), pid->setpoint); 
+	    busio_write(motor->padd, motors_pid_reg(motnum, PID_REG_CTRL), PID_CTRL_ENABLE | PID_CTRL_RESET); 
+	    pid->hw = 1;
+	}
+    }else{
+	if( pid->hw ){
+	    duty = busio_read(motor->padd, motors_pid_reg(motnum, PID_REG_OUTPUT));
+	    busio_write(motor->padd, motors_pid_reg(motnum, PID_REG_CTRL), 0); 
+	    pid->hw = 0;
+	    motors_pwm_set_speed(motor, motnum, duty);
+	}
+	ret = motors_pid_drive(motor, motnum, mode == MOTORS_MODE_SWPID);
+    }
+
+unlock:
+    UTIL_MUTEX_RELEASE("MOTORS",&(pid->mutex));
+
+    return ret; 
+}
+
+/**
+* @brief Reads the control mode of a motor
+*
+* @param motor MOTOR device structure
+* @param motnum Number of the motor
+* @param mode MOTORS_MODE_*
+* @return 0 on success. Otherwise error. 
+*
+* @note This function is \b thread-safe.
+* @note This function is \b non-blocking. 
+*
+*/
+
+int motors_get_mode(MOTOR* motor, unsigned motnum, int* mode)
+{
+    if( motor->pids == NULL || motnum >= motor->num_of_motors )
+	return -EINVAL;
+
+    if( motor->pids[motnum].hw )
+	*mode = MOTORS_MODE_HWPID;
+    else if( motor->pids[motnum].enabled )
+	*mode = MOTORS_MODE_SWPID;
+    else
+	*mode = MOTORS_MODE_OPENLOOP;
+
+    return 0; 
+}
+
+/**
+* @brief Reads the state of a loop of the PID core
+*
+* @param motor MOTOR device structure
+* @param pidnum Number of the motor
+* @param speed Speed measured by the core in ticks/s. NULL if not needed
+* @param duty Duty cycle the core applies. NULL if not needed
+* @return 0 on success. Otherwise error. 
+*
+* @note This function is \b thread-safe.
+* @note This function is \b non-blocking. 
+*
+*/
+
+int motors_pid_read_core(MOTOR* motor, unsigned pidnum, int* speed, int* duty)
+{
+    if( pidnum >= motor->num_of_pids )
+	return -ENODEV;
+
+    if( speed != NULL )
+	*speed = busio_read(motor->padd, motors_pid_reg(pidnum, PID_REG_SPEED));
+    if( duty != NULL )
+	*duty = busio_read(motor->padd, motors_pid_reg(pidnum, PID_REG_OUTPUT));
+
+    return 0; 
+}
+
+/**
+* @brief One period of a PID controller
+*
+* @param pid Controller
+* @param meas Measured speed in ticks/s
+* @return Duty cycle to apply, within +-MOTORS_MAX_SPEED
+*
+* Derivative on the measurement, so setpoint steps do not kick. Anti-windup by conditional integration: 
+* the integral does not grow while the output is saturated in the direction of the error.
+*/
+
+static int motors_pid_step(PID* pid, int meas)
+{
+    int error = pid->setpoint - meas;
+    int64_t p, d, i, out;
+    const int64_t max = (int64_t)MOTORS_MAX_SPEED << 16;
+
+    if( !pid->active ){ // fresh start: no history
+	pid->integ = 0;
+	pid->d_filt = 0;
+	pid->prev_meas = meas;
+	pid->active = 1;
+    }
+
+    p = (int64_t)pid->c_kp * error;
+
+    pid->d_filt += (((int64_t)(pid->prev_meas - meas) * (1 << 16) - pid->d_filt) * pid->c_alpha) >> 16;
+    pid->prev_meas = meas;
+    d = (pid->d_filt * pid->c_kd) >> 16;
+
+    out = p + pid->integ + d;
+
+    if( !((out > max && error > 0) || (out < -max && error < 0)) ){ // saturated: hold the integral
+	i = pid->integ + (int64_t)pid->c_ki * error;
+	pid->integ = i > max ? max : (i < -max ? -max : i);
+    }
+
+    out = p + pid->integ + d;
+    out = out > max ? max : (out < -max ? -max : out);
+
+    return (int)(out >> 16);
+}
+
+/**
+* @brief PID engine task
+*
+* Once per period: latches all encoders back to back, runs the enabled controllers and writes their PWMs.
+* The PWMs are written under their mutex, so they are not mixed with motors_pwm_set_speed().
+* Parameters are refreshed only when they changed, and never waiting for the mutex of a busy writer.
+*/
+
+static void motors_pid_engine(void* cookie)
+{
+    MOTOR* motor = (MOTOR*)cookie;
+    QENC_SNAPSHOT snap;
+    QENC_ESTIMATOR est[QENC_MAX_NUM_OF_CORES];
+    int out[MOTORS_MAX_NUM_OF_CORES];
+    int driven[MOTORS_MAX_NUM_OF_CORES];
+    unsigned n = motor->num_of_motors < motor->num_of_encs ? motor->num_of_motors : motor->num_of_encs;
+    unsigned i;
+    unsigned long overrun;
+    PID* pid;
+    int err, meas;
+
+    if( (err = rt_task_set_periodic(NULL, TM_NOW, rt_timer_ns2ticks(1000000000llu / motor->pid_rate_hz))) < 0 ){
+	util_pdbg(DBG_WARN, "MOTORS: PID engine cannot be made periodic. Error:%d\n", err);
+	return;
+    }
+
+    snap.time_ns = 0;
+    motors_qenc_read_all(motor, &snap);
+    motors_qenc_estimator_init(est, &snap);
+
+    while( motor->pid_running ){
+	if( (err = rt_task_wait_period(&overrun)) < 0 && err != -ETIMEDOUT ){
+	    util_pdbg(DBG_WARN, "MOTORS: PID engine rt_task_wait_period. Error:%d\n", err);
+	    return;
+	}
+
+	motors_qenc_read_all(motor, &snap);
+	motors_qenc_estimate(est, &snap);
+
+	for( i = 0 ; i < n ; i++ ){
+	    pid = &(motor->pids[i]);
+	    meas = (int)(est[i].vel >> 16);
+
+	    if( !(driven[i] = pid->enabled) ){
+		pid->active = 0;
+		continue;
+	    }
+
+	    if( pid->c_gen != pid->gen && rt_mutex_acquire(&(pid->mutex), TM_NONBLOCK) == 0 ){
+		pid->c_kp = pid->kp;
+		pid->c_ki = pid->ki;
+		pid->c_kd = pid->kd;
+		pid->c_alpha = pid->d_alpha;
+		pid->c_gen = pid->gen;
+		rt_mutex_release(&(pid->mutex));
+	    }
+
+	    out[i] = motors_pid_step(pid, meas);
+	}
+
+	for( i = 0 ; i < n ; i++ ){
+	    if( !driven[i] || rt_mutex_acquire(&(motor->pwms[i].mutex), TM_INFINITE) < 0 )
+		continue;
+	    if( motor->pids[i].enabled ){ // not released while out[i] was computed
+		core_set_motors_duty(motor->madd, i, out[i]); 
+		motor->pwms[i].speed = out[i];
+	    }
+	    rt_mutex_release(&(motor->pwms[i].mutex));
+	}
+    }
+}
+
+/**
+* @brief Starts the software PID engine
+*
+* @param motor MOTOR device structure, with PWMs and encoders
+* @param rate_hz Control rate ( 1 - MOTORS_PID_MAX_RATE_HZ )
+* @param prio Priority of the engine task
+* @return 0 on success. Otherwise error. 
+*
+* Only motors enabled with motors_pid_enable() are driven. Resetting an encoder ( motors_qenc_setzero() ) while 
+* its motor is under PID control shows as a speed spike for one period.
+*
+* @note This function is \b NOT thread-safe.
+*
+*/
+
+int motors_pid_start(MOTOR* motor, unsigned rate_hz, int prio)
+{
+    int err; 
+
+    if( motor->pids == NULL || motor->num_of_encs == 0 || rate_hz == 0 || rate_hz > MOTORS_PID_MAX_RATE_HZ )
+	return -EINVAL;
+
+    if( motor->pid_running )
+	return -EBUSY;
+
+    motor->pid_rate_hz = rate_hz;
+    motor->pid_running = 1;
+
+    if( (err = rt_task_spawn(&(motor->pid_task), "Motors PID", 0, prio, T_JOINABLE, motors_pid_engine, motor)) < 0 ){
+	util_pdbg(DBG_WARN, "MOTORS: PID engine cannot be spawned. Error:%d\n", err);
+	motor->pid_running = 0;
+	return err;
+    }
+
+    return 0; 
+}
+
+/**
+* @brief Stops the software PID engine
+*
+* @param motor MOTOR device structure
+* @return 0 on success. Otherwise error. 
+*
+* The PWMs keep their last duty cycle.
+*
+* @note This function is \b NOT thread-safe.
+* @note This function is \b blocking. Waits for the current period to finish
+*
+*/
+
+int motors_pid_stop(MOTOR* motor)
+{
+    if( !motor->pid_running )
+	return -EINVAL;
+
+    motor->pid_running = 0;
+
+    return rt_task_join(&(motor->pid_task));
 }
@@ -12,6 +12,30 @@
 #ifndef __OPENLOOP_MOTORS__H__
 #define __OPENLOOP_MOTORS__H__
 
+#include <stdint.h>
+
+//Xenomai
+#include <native/task.h>
+#include <native/mutex.h>
+//--
+
+#include "dev_mmaps_parms.h"
+#include "fixedpt.h"
+
+/* Software PID engine */
+#define MOTORS_PID_MAX_RATE_HZ 5000 /*! Maximum rate of the PID engine */
+
+/* Control modes of a motor */
+#define MOTORS_MODE_OPENLOOP 0 /*! Duty cycle set through motors_pwm_set_speed() */
+#define MOTORS_MODE_SWPID 1 /*! Speed loop closed by the software PID engine ( motors_pid_start() ) */
+#define MOTORS_MODE_HWPID 2 /*! Speed loop closed by the FPGA PID core at PID_CORE_RATE_HZ */
+
+/* Velocity estimator */
+#define QENC_VEL_MT_MIN_TICKS 4 /*! Ticks per sample from which the M/T method is used. 1/T below half of it */
+#define QENC_VEL_TIMEOUT_NS 100000000llu /*! Without edges for this long the speed is 0 */
+#define QENC_VEL_MT 1 /*! Count over the sample period */
+#define QENC_VEL_1T 0 /*! Time between count changes */
+
 typedef struct{
     unsigned freq_div; ///< Current divider applied to the carrier signal
     unsigned speed; ///< Current duty cycle applied
@@ -24,11 +48,54 @@ typedef struct{
     RT_MUTEX mutex; ///< Xenomai Mutex
 } QENC; 
 
+/*! All encoders latched at once. Owned by the caller, the previous snapshot is kept for deltas */
+typedef struct{
+    unsigned num_of; ///< Number of valid entries
+    RTIME time_ns; ///< Time of the latch ( midpoint of the bus reads )
+    RTIME prev_time_ns; ///< Time of the previous latch. 0 on the first one
+    int value[QENC_MAX_NUM_OF_CORES]; ///< Counters in T
+    int prev_value[QENC_MAX_NUM_OF_CORES]; ///< Counters in T-1
+} QENC_SNAPSHOT; 
+
+/*! Position and velocity of one encoder. Fed from snapshots, owned by the caller */
+typedef struct{
+    int64_t pos; ///< Position in ticks, free of counter wraparounds
+    int64_t vel; ///< Velocity in ticks/s, Q16.16
+    int method; ///< QENC_VEL_MT / QENC_VEL_1T
+    int last_raw; ///< Hardware counter at the last sample
+    RTIME last_time; ///< Time of the last sample
+    int64_t edge_pos; ///< Position at the last sample that saw the counter move
+    RTIME edge_time; ///< Time of that sample
+    int64_t edge_dpos; ///< Ticks between the last two moves
+    RTIME edge_dt; ///< Time between the last two moves. 0 until two moves are seen
+} QENC_ESTIMATOR; 
+
+/*! Setpoint vector for all the PWMs, published by a planner and applied by the control task */
+typedef struct{
+    unsigned enable; ///< Bit n set: motor n is driven. Cleared motors get duty cycle 0
+    int speed[MOTORS_MAX_NUM_OF_CORES]; ///< Duty cycles
+    unsigned freq_div[MOTORS_MAX_NUM_OF_CORES]; ///< Carrier dividers
+} MOTORS_SETPOINT; 
+
+/*! Speed controller of one motor. Gains are Q16.16, error in encoder ticks/s, output in duty cycle */
 typedef struct{    
-    int kp;
-    int ki; 
-    int kd; 
-    RT_MUTEX mutex;
+    int kp; ///< Proportional gain
+    int ki; ///< Integral gain, applied once per control period
+    int kd; ///< Derivative gain, applied once per control period
+    int d_alpha; ///< Derivative low-pass coefficient ( FIX16_ONE = unfiltered )
+    volatile int setpoint; ///< Target speed in encoder ticks/s
+    volatile int enabled; ///< The PID engine drives this motor
+    int hw; ///< The PID core drives this motor ( MOTORS_MODE_HWPID )
+    volatile unsigned gen; ///< Bumped on every parameter change
+    RT_MUTEX mutex; ///< Xenomai Mutex for the parameters
+
+    /* Owned by the PID engine task */
+    int c_kp, c_ki, c_kd, c_alpha; ///< Parameters in use
+    unsigned c_gen; ///< Generation of the parameters in use
+    int active; ///< State below is valid
+    int64_t integ; ///< Integral term in Q16.16 duty cycle
+    int64_t d_filt; ///< Filtered derivative of the measurement in Q16.16 ticks/s
+    int prev_meas; ///< Previous measured speed
 } PID; 
 
 typedef struct{
@@ -43,10 +110,16 @@ typedef struct{
     volatile int* padd; ///< Virtual mapped address     
     unsigned long padd_base; ///< Base physical address
     unsigned long padd_end; ///< End physical address
-    unsigned num_of_pids; ///< End physical address    
+    unsigned num_of_pids; ///< Number of loops in the PID core. 0 if not mapped
     PWM* pwms; ///< Array of PWM device structures
     QENC* encoders; ///< Array of QENC device structures
-    PID* pids; ///< Array of PID device structures
+    PID* pids; ///< Array of PID controllers, one per motor
+    RT_TASK pid_task; ///< Software PID engine task
+    volatile int pid_running; ///< PID engine running
+    unsigned pid_rate_hz; ///< Control rate of the PID engine
+    volatile unsigned sp_seq; ///< Sequence of the setpoint channel ( util_seq_* )
+    MOTORS_SETPOINT sp_slot[2]; ///< Setpoint channel double buffer
+    RT_MUTEX sp_mutex; ///< Serializes setpoint writers. Never taken by the control task
 } MOTOR; 
 
 
@@ -80,12 +153,33 @@ int motors_qenc_setzero(MOTOR* motor, unsigned qencnum );
 // Read the number of pulses read during the movement by the quadrature decoder (signed integer)
 int motors_qenc_read_enc(MOTOR* motor, unsigned qencnum, int* value, int* prev_value );
 
+// Latch all the counters back to back with a single timestamp
+int motors_qenc_read_all(MOTOR* motor, QENC_SNAPSHOT* snap);
+
+// 64-bit positions and velocities from snapshots. No bus access
+void motors_qenc_estimator_init(QENC_ESTIMATOR* est, const QENC_SNAPSHOT* snap);
+
+void motors_qenc_estimate(QENC_ESTIMATOR* est, const QENC_SNAPSHOT* snap);
+
+
+/* Setpoint channel */
+
+// Publish a full setpoint vector ( planner side )
+int motors_setpoint_publish(MOTOR* motor, const MOTORS_SETPOINT* sp);
+
+// Latest consistent setpoint vector ( control side, wait-free )
+int motors_setpoint_fetch(MOTOR* motor, MOTORS_SETPOINT* sp, unsigned* seq);
+
+// Write a setpoint vector to the PWMs ( control side )
+int motors_setpoint_apply(MOTOR* motor, const MOTORS_SETPOINT* sp);
 
 /* PID */
 
-//TODO: To be implemented
-// Set params
-void motors_pid_set_params(MOTOR* motor, unsigned pidnum, int kp, int ki, int kd);
+// Set params ( Q16.16 )
+int motors_pid_set_params(MOTOR* motor, unsigned pidnum, int kp, int ki, int kd);
+
+// Derivative low-pass filter coefficient ( Q16.16 )
+int motors_pid_set_dfilter(MOTOR* motor, unsigned pidnum, int d_alpha);
 
 // Read params
 int motors_pwm_read_kp(MOTOR* motor, unsigned pidnum, int* ret);
@@ -93,5 +187,23 @@ int motors_pwm_read_kp(MOTOR* motor, unsigned pidnum, int* ret);
 int motors_pwm_read_ki(MOTOR* motor, unsigned pidnum, int* ret);
 
 int motors_pwm_read_kd(MOTOR* motor, unsigned pidnum, int* ret);
+
+// Target speed in encoder ticks/s
+int motors_pid_set_speed(MOTOR* motor, unsigned pidnum, int ticks_per_sec);
+
+int motors_pid_enable(MOTOR* motor, unsigned pidnum, int enable);
+
+// Open loop, software PID or PID core ( MOTORS_MODE_* )
+int motors_set_mode(MOTOR* motor, unsigned motnum, int mode);
+
+int motors_get_mode(MOTOR* motor, unsigned motnum, int* mode);
+
+// Measured speed and applied duty cycle of a PID core loop
+int motors_pid_read_core(MOTOR* motor, unsigned pidnum, int* speed, int* duty);
+
+// Engine task: reads all encoders and writes all PWMs once per period
+int motors_pid_start(MOTOR* motor, unsigned rate_hz, int prio);
+
+int motors_pid_stop(MOTOR* motor);
  
 #endif
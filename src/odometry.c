@@ -0,0 +1,282 @@
+/**
+    @file odometry.c
+    
+    @section DESCRIPTION    
+    
+    Robotics library for the Autonomous Robotics Development Platform  
+    
+    @brief Differential drive odometry from the quadrature encoders, in fixed point
+    
+    @author Jorge Sánchez de Nova jssdn (mail)_(at) kth.se
+ 
+    @section LICENSE 
+    
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+    
+    @note Called from the motor control tick with the encoder estimators ( motors_qenc_estimate() ). Midpoint 
+          integration of the wheel travel with table based trigonometry, no FPU in the PPC405. The pose and its 
+          covariance are published through a double-buffered sequence lock: consumers never take a lock and never 
+          delay the control tick
+
+    @version 0.4-Xenomai       
+    
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "odometry.h"
+#include "motors.h"
+#include "fixedpt.h"
+#include "util.h"
+
+/**
+* @brief Q16.16 product
+*/
+
+static inline int64_t odo_mul(int64_t a, int64_t b)
+{
+    return (a * b) >> 16;
+}
+
+/**
+* @brief Fixed point product ( a * b ) >> shift, splitting a so the intermediates stay in 64 bits
+*/
+
+static inline int64_t odo_mulq(int64_t a, int64_t b, int shift)
+{
+    return (((a >> 16) * b) >> (shift - 16)) + (((a & 0xffff) * b) >> shift);
+}
+
+/**
+* @brief Inits the odometry of a differential drive
+*
+* @param odo ODOMETRY structure
+* @param left Encoder of the left wheel
+* @param right Encoder of the right wheel
+* @param flags ODO_LEFT_INVERT | ODO_RIGHT_INVERT for encoders counting backwards
+* @param wheel_base_um Distance between the wheels in um
+* @param wheel_radius_um Wheel radius in um
+* @param ticks_per_rev Encoder ticks per wheel revolution
+* @return 0 on success. Otherwise error. 
+*
+* The pose starts at the origin heading along x, without uncertainty and without wheel noise ( odo_set_noise() ).
+*
+* @note This function is \b NOT thread-safe.
+*
+*/
+
+int odo_init(ODOMETRY* odo, unsigned left, unsigned right, int flags, 
+	     unsigned wheel_base_um, unsigned wheel_radius_um, unsigned ticks_per_rev)
+{
+    if( left >= QENC_MAX_NUM_OF_CORES || right >= QENC_MAX_NUM_OF_CORES || left == right )
+	return -EINVAL;
+
+    if( wheel_base_um == 0 || wheel_radius_um == 0 || ticks_per_rev == 0 )
+	return -EINVAL;
+
+    memset(odo, 0, sizeof(ODOMETRY));
+
+    odo->left = left;
+    odo->right = right;
+    odo->flags = flags;
+
+    // 2 pi r / ticks, Q32.32 mm ( the 2 pi in Q16.16 times the radius in mm as Q16.16 )
+    odo->mm_per_tick = ((int64_t)FIX16_2PI * wheel_radius_um << 16) / 1000 / ticks_per_rev;
+    odo->base = ((int64_t)wheel_base_um << 16) / 1000;
+    // 2^32 per turn of the robot, which is 2 pi base mm of wheel difference
+    odo->brad_per_mm = (1ll << 48) / ((int64_t)FIX16_2PI * wheel_base_um / 1000);
+
+    return 0;
+}
+
+/**
+* @brief Sets the wheel noise used to grow the covariance
+*
+* @param odo ODOMETRY structure
+* @param noise Variance of the travel of a wheel per mm travelled, Q16.16 mm^2 / mm
+* @return 0 on success. Otherwise error. 
+*
+* @note This function is \b NOT thread-safe. Call it before the control tick starts
+*
+*/
+
+int odo_set_noise(ODOMETRY* odo, int noise)
+{
+    if( noise < 0 )
+	return -EINVAL;
+
+    odo->noise = noise;
+
+    return 0;
+}
+
+/**
+* @brief Publishes the working pose
+*/
+
+static void odo_publish(ODOMETRY* odo)
+{
+    odo->slot[util_seq_write_begin(&(odo->seq))] = odo->pose;
+    util_seq_write_end(&(odo->seq));
+}
+
+/**
+* @brief Sets the pose
+*
+* @param odo ODOMETRY structure
+* @param x Position in mm, Q16.16
+* @param y Position in mm, Q16.16
+* @param theta Heading, binary angle
+*
+* The covariance is cleared: the new pose is taken as exact.
+*
+* @note This function is \b NOT thread-safe. Call it from the control tick, or while it is stopped
+*
+*/
+
+void odo_reset(ODOMETRY* odo, int64_t x, int64_t y, uint32_t theta)
+{
+    odo->pose.x = x;
+    odo->pose.y = y;
+    odo->pose.theta = theta;
+    memset(odo->pose.cov, 0, sizeof(odo->pose.cov));
+
+    odo_publish(odo);
+}
+
+/**
+* @brief Integrates the wheel travel since the last update and publishes the pose
+*
+* @param odo ODOMETRY structure
+* @param est Encoder estimators, updated this tick with motors_qenc_estimate()
+*
+* The first call only latches the wheel positions. The covariance follows the usual differential drive model: 
+* each wheel adds noise * |travel| of variance, propagated through the midpoint motion model.
+*
+* @note This function is \b NOT thread-safe. One control tick owns the ODOMETRY structure
+* @note This function is \b non-blocking. 
+*
+*/
+
+void odo_update(ODOMETRY* odo, const QENC_ESTIMATOR* est)
+{
+    ODO_POSE* p = &(odo->pose);
+    int64_t l = est[odo->left].pos, r = est[odo->right].pos;
+    int64_t vl = est[odo->left].vel, vr = est[odo->right].vel;
+    int64_t dl, dr, ds, inv_b, s, c, a, b, ql, qr, k;
+    int64_t gl[3], gr[3];
+    int64_t* cov = p->cov;
+    uint32_t dth, mid;
+    int i, j, n;
+
+    if( odo->flags & ODO_LEFT_INVERT ){
+	l = -l;
+	vl = -vl;
+    }
+    if( odo->flags & ODO_RIGHT_INVERT ){
+	r = -r;
+	vr = -vr;
+    }
+
+    p->time_ns = est[odo->left].last_time;
+    p->v = odo_mulq(vl + vr, odo->mm_per_tick, 32) / 2;
+    p->w = odo_mulq(vr - vl, odo->mm_per_tick, 32) * FIX16_ONE / odo->base;
+
+    if( !odo->primed ){
+	odo->prev_left = l;
+	odo->prev_right = r;
+	odo->primed = 1;
+	odo_publish(odo);
+	return;
+    }
+
+    // Wheel travel in mm, Q16.16
+    dl = odo_mulq((l - odo->prev_left) * FIX16_ONE, odo->mm_per_tick, 32);
+    dr = odo_mulq((r - odo->prev_right) * FIX16_ONE, odo->mm_per_tick, 32);
+    odo->prev_left = l;
+    odo->prev_right = r;
+
+    ds = (dl + dr) / 2;
+    dth = (uint32_t)((dr - dl) * odo->brad_per_mm >> 16);
+    mid = p->theta + (uint32_t)((int32_t)dth / 2);
+    s = fix16_sin(mid);
+    c = fix16_cos(mid);
+
+    p->x += odo_mul(ds, c);
+    p->y += odo_mul(ds, s);
+    p->theta += dth;
+
+    if( odo->noise == 0 ){
+	odo_publish(odo);
+	return;
+    }
+
+    // Motion Jacobian: identity plus the heading column ( a, b ). Covariance in Q32.32
+    a = -odo_mul(ds, s);
+    b = odo_mul(ds, c);
+    cov[ODO_COV_XX] += 2 * odo_mulq(a, cov[ODO_COV_XT], 16) + odo_mulq(odo_mul(a, a), cov[ODO_COV_TT], 16);
+    cov[ODO_COV_XY] += odo_mulq(a, cov[ODO_COV_YT], 16) + odo_mulq(b, cov[ODO_COV_XT], 16) 
+	+ odo_mulq(odo_mul(a, b), cov[ODO_COV_TT], 16);
+    cov[ODO_COV_YY] += 2 * odo_mulq(b, cov[ODO_COV_YT], 16) + odo_mulq(odo_mul(b, b), cov[ODO_COV_TT], 16);
+    cov[ODO_COV_XT] += odo_mulq(a, cov[ODO_COV_TT], 16);
+    cov[ODO_COV_YT] += odo_mulq(b, cov[ODO_COV_TT], 16);
+
+    // Wheel Jacobians ( x, y, theta ) in Q32.32 and wheel variances in Q32.32 mm^2
+    inv_b = (1ll << 48) / odo->base;
+    k = odo_mulq(odo_mul(ds, s), inv_b, 16);
+    gl[0] = (c * FIX16_ONE + k) / 2;
+    gr[0] = (c * FIX16_ONE - k) / 2;
+    k = odo_mulq(odo_mul(ds, c), inv_b, 16);
+    gl[1] = (s * FIX16_ONE - k) / 2;
+    gr[1] = (s * FIX16_ONE + k) / 2;
+    gl[2] = -inv_b;
+    gr[2] = inv_b;
+    ql = odo->noise * ( dl < 0 ? -dl : dl );
+    qr = odo->noise * ( dr < 0 ? -dr : dr );
+
+    for( i = 0, n = 0 ; i < 3 ; i++ )
+	for( j = i ; j < 3 ; j++, n++ )
+	    cov[n] += odo_mulq(ql, odo_mulq(gl[i], gl[j], 32), 32) + odo_mulq(qr, odo_mulq(gr[i], gr[j], 32), 32);
+
+    odo_publish(odo);
+}
+
+/**
+* @brief Reads the latest published pose
+*
+* @param odo ODOMETRY structure
+* @param pose Copy of the pose
+*
+* Retries only if the control tick published twice during the copy, which a consumer running below the control tick 
+* priority on a single CPU cannot observe more than once per tick.
+*
+* @note This function is \b thread-safe.
+* @note This function is \b non-blocking. Never takes a lock
+*
+*/
+
+void odo_get_pose(ODOMETRY* odo, ODO_POSE* pose)
+{
+    unsigned start, slot;
+
+    do{
+	start = util_seq_read_begin(&(odo->seq), &slot);
+	*pose = odo->slot[slot];
+    }while( util_seq_read_retry(&(odo->seq), start) );
+}
@@ -0,0 +1,79 @@
+/**
+    @file odometry.h
+    
+    @section DESCRIPTION    
+    
+    Robotics library for the Autonomous Robotics Development Platform  
+    
+    @brief [HEADER] Differential drive odometry from the quadrature encoders, in fixed point
+    
+*/
+
+#ifndef __ODOMETRY_H__
+#define __ODOMETRY_H__
+
+#include <stdint.h>
+
+//Xenomai
+#include <native/timer.h>
+//--
+
+#include "motors.h"
+#include "fixedpt.h"
+
+/* Flags */
+#define ODO_LEFT_INVERT 0x01 /*! Left encoder counts backwards when the robot moves forward */
+#define ODO_RIGHT_INVERT 0x02 /*! Right encoder counts backwards when the robot moves forward */
+
+/* Covariance entries ( symmetric 3x3 over x, y, theta ) */
+#define ODO_COV_XX 0
+#define ODO_COV_XY 1
+#define ODO_COV_XT 2
+#define ODO_COV_YY 3
+#define ODO_COV_YT 4
+#define ODO_COV_TT 5
+
+/*! Pose as published to consumers */
+typedef struct{
+    int64_t x; ///< Position in mm, Q16.16
+    int64_t y; ///< Position in mm, Q16.16
+    uint32_t theta; ///< Heading, binary angle ( 2^32 = one turn )
+    int64_t v; ///< Linear velocity in mm/s, Q16.16
+    int64_t w; ///< Angular velocity in rad/s, Q16.16
+    int64_t cov[6]; ///< Covariance, Q32.32 mm^2 / mm rad / rad^2. See ODO_COV_*
+    RTIME time_ns; ///< Time of the encoder snapshot
+} ODO_POSE; 
+
+typedef struct{
+    /* Configuration */
+    unsigned left; ///< Encoder of the left wheel
+    unsigned right; ///< Encoder of the right wheel
+    int flags; ///< ODO_*_INVERT
+    int64_t mm_per_tick; ///< Wheel travel per encoder tick, Q32.32 mm
+    int64_t base; ///< Wheel base in mm, Q16.16
+    int64_t brad_per_mm; ///< Heading change per mm of wheel difference, binary angle
+    int64_t noise; ///< Wheel variance per mm travelled, Q16.16 mm^2 / mm
+    /* Owned by the control tick */
+    int64_t prev_left; ///< Left position at the last update
+    int64_t prev_right; ///< Right position at the last update
+    int primed; ///< prev_* are valid
+    ODO_POSE pose; ///< Working pose
+    /* Publication */
+    volatile unsigned seq; ///< Sequence of the published pose ( util_seq_* )
+    ODO_POSE slot[2]; ///< Published pose double buffer
+} ODOMETRY; 
+
+int odo_init(ODOMETRY* odo, unsigned left, unsigned right, int flags, 
+	     unsigned wheel_base_um, unsigned wheel_radius_um, unsigned ticks_per_rev);
+
+int odo_set_noise(ODOMETRY* odo, int noise);
+
+void odo_reset(ODOMETRY* odo, int64_t x, int64_t y, uint32_t theta);
+
+/* Control tick */
+void odo_update(ODOMETRY* odo, const QENC_ESTIMATOR* est);
+
+/* Consumers */
+void odo_get_pose(ODOMETRY* odo, ODO_POSE* pose);
+
+#endif
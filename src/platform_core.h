@@ -0,0 +1,65 @@
+/**
+    @file platform_core.h
+
+    @section DESCRIPTION
+
+    Robotics library for the Autonomous Robotics Development Platform
+
+    @brief [HEADER] Accessors for every register field of the IP cores. Instance n of a register is at word
+           WORD + n * STRIDE of the mapping of its core. Offsets, masks and shifts fold into the bus access
+
+    @note GENERATED from platform.map by tools/mkplatform.awk ( make platform ). Do not edit
+
+*/
+
+#ifndef __PLATFORM_CORE_H__
+#define __PLATFORM_CORE_H__
+
+#include "busio.h"
+#include "platform_map.h"
+
+static inline void core_set_motors_duty(volatile int* vadd, unsigned n, unsigned value)
+{
+    busio_write(vadd, MOTORS_DUTY_WORD + n * MOTORS_DUTY_STRIDE, (value << MOTORS_DUTY_SHIFT) & MOTORS_DUTY_MASK);
+}
+
+static inline void core_set_motors_freq_div(volatile int* vadd, unsigned n, unsigned value)
+{
+    busio_write(vadd, MOTORS_FREQ_DIV_WORD + n * MOTORS_FREQ_DIV_STRIDE, (value << MOTORS_FREQ_DIV_SHIFT) & MOTORS_FREQ_DIV_MASK);
+}
+
+static inline unsigned core_get_qenc_count(volatile int* vadd, unsigned n)
+{
+    return ((unsigned)busio_read(vadd, QENC_COUNT_WORD + n * QENC_COUNT_STRIDE) & QENC_COUNT_MASK) >> QENC_COUNT_SHIFT;
+}
+
+static inline void core_set_qenc_reset(volatile int* vadd, unsigned n, unsigned value)
+{
+    busio_write(vadd, QENC_RESET_WORD + n * QENC_RESET_STRIDE, (value << QENC_RESET_SHIFT) & QENC_RESET_MASK);
+}
+
+static inline unsigned core_get_hwservos_pulse(volatile int* vadd, unsigned n)
+{
+    return ((unsigned)busio_read(vadd, HWSERVOS_PULSE_WORD + n * HWSERVOS_PULSE_STRIDE) & HWSERVOS_PULSE_MASK) >> HWSERVOS_PULSE_SHIFT;
+}
+
+static inline void core_set_hwservos_pulse(volatile int* vadd, unsigned n, unsigned value)
+{
+    unsigned off = HWSERVOS_PULSE_WORD + n * HWSERVOS_PULSE_STRIDE;
+
+    busio_write(vadd, off, ((unsigned)busio_read(vadd, off) & ~HWSERVOS_PULSE_MASK) | ((value << HWSERVOS_PULSE_SHIFT) & HWSERVOS_PULSE_MASK));
+}
+
+static inline unsigned core_get_hwservos_en(volatile int* vadd, unsigned n)
+{
+    return ((unsigned)busio_read(vadd, HWSERVOS_EN_WORD + n * HWSERVOS_EN_STRIDE) & HWSERVOS_EN_MASK) >> HWSERVOS_EN_SHIFT;
+}
+
+static inline void core_set_hwservos_en(volatile int* vadd, unsigned n, unsigned value)
+{
+    unsigned off = HWSERVOS_EN_WORD + n * HWSERVOS_EN_STRIDE;
+
+    busio_write(vadd, off, ((unsigned)busio_read(vadd, off) & ~HWSERVOS_EN_MASK) | ((value << HWSERVOS_EN_SHIFT) & HWSERVOS_EN_MASK));
+}
+
+#endif
@@ -25,7 +25,7 @@
     along with this program; if not, write to the Free Software
     Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
     
-    @note Interrupts not operational due to limitations in gpio.c
+    @note Pass gpio_dispatch_isr to pio_init_geninputs() to get debounced input events instead of polling
 
     @version 0.4-Xenomai       
     
@@ -42,6 +42,11 @@
 #include <linux/types.h>
 #include <errno.h>
 
+//Xenomai
+#include <native/task.h>
+#include <native/timer.h>
+//--
+
 #include "platform_io.h"
 #include "dev_mmaps_parms.h"
 #include "gpio.h"
@@ -51,13 +56,29 @@ GPIO pio_geninputs; // Buttons / BUMPERS / ADC EOC / ACC_INT
 GPIO pio_genoutputs; // LEDS4 / LEDs_Position
 GPIO pio_fpgagpio; // 8 general purpouse bidirectional signals
 
+/* Input change queue. Single producer ( the General Inputs dispatcher ), single consumer */
+static PIO_INPUT_EVENT pio_inq[PIO_INPUT_QUEUE_SIZE];
+static volatile unsigned pio_inq_head = 0; // written by the producer only
+static volatile unsigned pio_inq_tail = 0; // written by the consumer only
+static volatile unsigned pio_inq_overruns = 0;
+
+/* LED pattern engine */
+static volatile unsigned pio_led_patterns[PIO_LED_NUM_OF];
+static volatile unsigned pio_led_once[PIO_LED_NUM_OF]; // tick a run-once pattern started at. 0 - repeated
+static RT_TASK pio_leds_task;
+static volatile int pio_leds_running = 0;
+
+static RT_TASK pio_sampler_task;
+static RTIME pio_sampler_period;
+static volatile int pio_sampler_running = 0;
+
 /**
 * @brief Wrapper for General Inputs GPIO initialization
 *
-* @param fisr Pointer to the Interrupt Service Routine (NULL if no interrupt support)
+* @param fisr Pointer to the Interrupt Service Routine (NULL if no interrupt support). gpio_dispatch_isr for input events
 * @return 0 on success. Otherwise error. 
 *
-* Initializes the General Inputs GPIO peripheral
+* Initializes the General Inputs GPIO peripheral. Buttons and bumpers are debounced for GENERAL_INPUTS_DEBOUNCE_NS
 *
 * @note This function is \b NOT thread-safe. The user should guarantee somewhere else that is not called in several instances
 *       for the same resource. 
@@ -72,9 +93,13 @@ int pio_init_geninputs(void (*fisr)(void*))
 		    GENERAL_INPUTS_NUM_OF_CHAN , GPIO_FLAGS_INPUT | GPIO_IRQ_CHANNEL1, GENERAL_INPUTS_IRQ_NO, 
 		    fisr, GENERAL_INPUTS_IRQ_PRIO); 
 		    
+    if( err < 0 )
+	return err;
+
     gpio_set_dir(&pio_geninputs,~0,0,~0); // all inputs
-    
-    return err; 
+
+    return gpio_set_debounce(&pio_geninputs, GENERAL_INPUTS_PUSHBUT_MASK | GENERAL_INPUTS_BUMPERS_MASK, 
+			     GENERAL_INPUTS_DEBOUNCE_NS); 
 }
 
 /**
@@ -94,7 +119,7 @@ int pio_init_genoutputs()
     int err; 
     
     err = gpio_init(&pio_genoutputs, GENERAL_OUTPUTS_BASE, GENERAL_OUTPUTS_END, 
-		    GENERAL_INPUTS_NUM_OF_CHAN, GPIO_FLAGS_OUTPUT, 0, 
+		    GENERAL_OUTPUTS_NUM_OF_CHAN, GPIO_FLAGS_OUTPUT, 0, 
 		    0, 0 );     
 		    
     gpio_set_dir(&pio_genoutputs,~0,0,0); // all outputs
@@ -184,6 +209,12 @@ uninit_any:
 int pio_clean_all()
 {
     int res; 
+
+    if( pio_sampler_running )
+	pio_input_sampler_stop();
+
+    if( pio_leds_running )
+	pio_leds_stop();
     
     if( (res = gpio_clean(&pio_geninputs)) <0 )
 	    goto uncleaned_all;
@@ -217,9 +248,9 @@ uncleaned_gout:
 *
 */
 
-inline int pio_write_leds4(unsigned value)
+int pio_write_leds4(unsigned value)
 {
-     return gpio_write(&pio_genoutputs, GENERAL_OUTPUTS_LED4_MASK, GENERAL_OUTPUTS_LED4_SHIFT, 0, value);
+    return pio_set_general_outputs_led4(value);
 }
 
 /**
@@ -235,9 +266,35 @@ inline int pio_write_leds4(unsigned value)
 *
 */
 
-inline int pio_write_ledspos(unsigned value)
+int pio_write_ledspos(unsigned value)
 {
-    return gpio_write(&pio_genoutputs, GENERAL_OUTPUTS_LEDPOS_MASK, GENERAL_OUTPUTS_LEDPOS_SHIFT, 0, value);
+    return pio_set_general_outputs_ledpos(value);
+}
+
+/**
+* @brief Write to the 4 led bar and the arrow positions leds at once
+* 
+* @param leds4 Value for the led bar ( 0x0 - 0xf )
+* @param ledspos Value for the arrow positions leds ( 0x0 - 0x1f )
+* @return 0 on success. Otherwise error. 
+*
+* Both groups share the General Outputs register. Updating them together costs one bus write 
+* and never shows one group updated and the other not.
+*
+* @note This function is \b thread-safe.
+* @note This function is \b blocking. 
+*
+*/
+
+int pio_write_leds(unsigned leds4, unsigned ledspos)
+{
+    GPIO_TXN txn;
+
+    gpio_txn_begin(&txn, &pio_genoutputs, GPIO_DATA_OFFSET);
+    gpio_txn_add(&txn, GENERAL_OUTPUTS_LED4_MASK, GENERAL_OUTPUTS_LED4_SHIFT, leds4);
+    gpio_txn_add(&txn, GENERAL_OUTPUTS_LEDPOS_MASK, GENERAL_OUTPUTS_LEDPOS_SHIFT, ledspos);
+
+    return gpio_txn_commit(&txn);
 }
 
 /**
@@ -253,9 +310,9 @@ inline int pio_write_ledspos(unsigned value)
 *
 */
 
-inline int pio_read_buttons(unsigned* ret)
+int pio_read_buttons(unsigned* ret)
 {
-    return gpio_read(&pio_geninputs, GENERAL_INPUTS_PUSHBUT_MASK,GENERAL_INPUTS_PUSHBUT_SHIFT, 0, ret);        
+    return pio_get_general_inputs_pushbut(ret);
 }
 
 /**
@@ -269,15 +326,18 @@ inline int pio_read_buttons(unsigned* ret)
 *
 */
 
-inline int pio_read_bumpers(unsigned* ret)
+int pio_read_bumpers(unsigned* ret)
 {
-    return gpio_read(&pio_geninputs, GENERAL_INPUTS_BUMPERS_MASK,GENERAL_INPUTS_BUMPERS_SHIFT, 0, ret);        
+    return pio_get_general_inputs_bumpers(ret);
 }
 
 /**
-* @brief Read from the FPGA-GPIO port
+* @brief Subscribe to edges on the General Inputs
 * 
-* @param ret Read value
+* @param mask Bits of interest ( GENERAL_INPUTS_*_MASK )
+* @param edges GPIO_EDGE_RISING / GPIO_EDGE_FALLING / GPIO_EDGE_BOTH
+* @param handler Called from the dispatcher task once per edge
+* @param arg Passed to the handler
 * @return 0 on success. Otherwise error. 
 *
 * @note This function is \b thread-safe.
@@ -285,35 +345,490 @@ inline int pio_read_bumpers(unsigned* ret)
 *
 */
 
-inline int pio_read_fpgagpio(unsigned* ret)
+int pio_subscribe_inputs(unsigned mask, unsigned edges, gpio_handler handler, void* arg)
 {
-//     return gpio_read(&pio_fpgagpio, FPGA_GPIO8_MASK,0, 0, ret);
-    return 0;
+    return gpio_subscribe(&pio_geninputs, mask, edges, handler, arg);
 }
 
 /**
-* @brief Write to the FPGA-GPIO port
+* @brief Unsubscribe from edges on the General Inputs
+* 
+* @param handler Handler given to pio_subscribe_inputs()
+* @param arg Argument given to pio_subscribe_inputs()
+* @return 0 on success. Otherwise error. 
+*
+* @note This function is \b thread-safe.
+* @note This function is \b blocking. 
+*
+*/
+
+int pio_unsubscribe_inputs(gpio_handler handler, void* arg)
+{
+    return gpio_unsubscribe(&pio_geninputs, handler, arg);
+}
+
+/**
+* @brief Producer side of the input change queue
+*
+* Subscribed to the General Inputs. Runs in the dispatcher task, which is the single producer.
+*/
+
+static void pio_input_enqueue(GPIO* gpio, const GPIO_EVENT* ev, void* arg)
+{
+    unsigned head = pio_inq_head;
+    PIO_INPUT_EVENT* e;
+
+    if( head - pio_inq_tail == PIO_INPUT_QUEUE_SIZE ){ // full: keep the oldest, count the loss
+	pio_inq_overruns++;
+	return;
+    }
+
+    e = &pio_inq[head & (PIO_INPUT_QUEUE_SIZE - 1)];
+    e->old_value = ev->value ^ (1u << ev->bit);
+    e->new_value = ev->value;
+    e->time_ns = ev->time_ns;
+
+    util_wmb(); // entry visible before the index
+    pio_inq_head = head + 1;
+}
+
+/**
+* @brief Starts queueing changes of a set of General Inputs
+* 
+* @param mask Inputs to watch ( GENERAL_INPUTS_*_MASK )
+* @return 0 on success. Otherwise error. 
+*
+* Every debounced edge on the masked inputs is queued with the register value before and after it and its
+* timestamp, until drained with pio_input_events_drain(). The queue is fed by the General Inputs IRQ 
+* ( pio_init_geninputs(gpio_dispatch_isr) ) or, without IRQ, by pio_input_sampler_start().
+*
+* @note This function is \b thread-safe.
+* @note This function is \b blocking. 
+*
+*/
+
+int pio_input_queue_enable(unsigned mask)
+{
+    return gpio_subscribe(&pio_geninputs, mask, GPIO_EDGE_BOTH, pio_input_enqueue, NULL);
+}
+
+/**
+* @brief Stops queueing changes of the General Inputs
 * 
-* @param value Data to write into the port
 * @return 0 on success. Otherwise error. 
 *
+* Events already queued can still be drained.
+*
 * @note This function is \b thread-safe.
 * @note This function is \b blocking. 
 *
 */
 
-inline int pio_write_fpgagpio(unsigned value)
+int pio_input_queue_disable()
 {
-//     return gpio_write(&pio_fpgagpio, FPGA_GPIO8_MASK,0, 0, value);
+    return gpio_unsubscribe(&pio_geninputs, pio_input_enqueue, NULL);
+}
+
+/**
+* @brief Periodic sampler for the General Inputs when no IRQ is used
+*/
+
+static void pio_input_sampler(void* cookie)
+{
+    int err; 
+    unsigned long overrun;
+
+    if( (err = rt_task_set_periodic(NULL, TM_NOW, rt_timer_ns2ticks(pio_sampler_period))) < 0 ){
+	util_pdbg(DBG_WARN, "PIO: Sampler cannot be made periodic. Error:%d\n", err);
+	return;
+    }
+
+    while( pio_sampler_running ){
+	if( (err = rt_task_wait_period(&overrun)) < 0 && err != -ETIMEDOUT ){
+	    util_pdbg(DBG_WARN, "PIO: Sampler rt_task_wait_period. Error:%d\n", err);
+	    return;
+	}
+
+	gpio_dispatch_poll(&pio_geninputs, NULL);
+    }
+}
+
+/**
+* @brief Starts a task that samples the General Inputs for events
+* 
+* @param period_ns Sampling period. Bumper contacts shorter than this can be missed
+* @param prio Task priority
+* @return 0 on success. Otherwise error. 
+*
+* Use it instead of the IRQ: there must be a single dispatcher, so it fails with -EBUSY if the General 
+* Inputs were initialized with an ISR. 
+*
+* @note This function is \b NOT thread-safe.
+*
+*/
+
+int pio_input_sampler_start(RTIME period_ns, int prio)
+{
+    int err; 
+
+    if( pio_geninputs.isr != NULL || pio_sampler_running )
+	return -EBUSY;
+
+    pio_sampler_period = period_ns;
+    pio_sampler_running = 1;
+
+    if( (err = rt_task_spawn(&pio_sampler_task, "PIO sampler", 0, prio, T_JOINABLE, pio_input_sampler, NULL)) < 0 ){
+	util_pdbg(DBG_WARN, "PIO: Sampler task cannot be spawned. Error:%d\n", err);
+	pio_sampler_running = 0;
+	return err;
+    }
+
     return 0;
 }
 
-inline int pio_write_fpgagpio_tristate(unsigned value)
+/**
+* @brief Stops the General Inputs sampler task
+* 
+* @return 0 on success. Otherwise error. 
+*
+* @note This function is \b NOT thread-safe.
+* @note This function is \b blocking. Waits for the last sample to finish
+*
+*/
+
+int pio_input_sampler_stop()
+{
+    if( !pio_sampler_running )
+	return -EINVAL;
+
+    pio_sampler_running = 0;
+
+    return rt_task_join(&pio_sampler_task);
+}
+
+/**
+* @brief Takes a batch of events out of the input change queue
+* 
+* @param events Buffer for the events, oldest first
+* @param max Room in the buffer
+* @return Number of events copied. 0 if the queue is empty
+*
+* @note This function is \b NOT thread-safe. There must be one single consumer
+* @note This function is \b non-blocking. 
+*
+*/
+
+int pio_input_events_drain(PIO_INPUT_EVENT* events, unsigned max)
 {
-//     return gpio_write(&pio_fpgagpio, FPGA_GPIO8_MASK,0, GPIO_TRISTATE_OFFSET, value);
+    unsigned tail = pio_inq_tail;
+    unsigned n = pio_inq_head - tail;
+    unsigned i;
+
+    util_rmb(); // index read before the entries
+
+    if( n > max )
+	n = max;
+
+    for( i = 0 ; i < n ; i++ )
+	events[i] = pio_inq[(tail + i) & (PIO_INPUT_QUEUE_SIZE - 1)];
+
+    util_mb(); // entries read before handing the slots back
+    pio_inq_tail = tail + n;
+
+    return n;
+}
+
+/**
+* @brief Number of events dropped because the input change queue was full
+* 
+* @return Dropped events since start
+*
+*/
+
+unsigned pio_input_events_overruns()
+{
+    return pio_inq_overruns;
+}
+
+/**
+* @brief LED pattern engine task
+*
+* Every tick evaluates the pattern of each LED against the absolute time, so patterns with related steps stay
+* in phase, and writes the driven LEDs in one masked write only when some of them changed.
+*/
+
+static void pio_leds_engine(void* cookie)
+{
+    int err; 
+    unsigned long overrun;
+    unsigned led, pattern, len, step, idx, start, mask, value, last_mask = 0, last_value = 0;
+    unsigned tick;
+
+    if( (err = rt_task_set_periodic(NULL, TM_NOW, rt_timer_ns2ticks(PIO_LED_TICK_MS * 1000000llu))) < 0 ){
+	util_pdbg(DBG_WARN, "PIO: LED engine cannot be made periodic. Error:%d\n", err);
+	return;
+    }
+
+    while( pio_leds_running ){
+	if( (err = rt_task_wait_period(&overrun)) < 0 && err != -ETIMEDOUT ){
+	    util_pdbg(DBG_WARN, "PIO: LED engine rt_task_wait_period. Error:%d\n", err);
+	    return;
+	}
+
+	tick = (unsigned)(rt_timer_read() / (PIO_LED_TICK_MS * 1000000llu));
+	mask = value = 0;
+
+	for( led = 0 ; led < PIO_LED_NUM_OF ; led++ ){
+	    if( (pattern = pio_led_patterns[led]) == PIO_LED_NONE )
+		continue;
+
+	    len = ((pattern >> 16) & 0xf) + 1;
+	    step = (pattern >> 20) ? (pattern >> 20) : 1;
+	    mask |= 1u << led;
+
+	    if( (start = pio_led_once[led]) != 0 ){ // run once, then hold the last step
+		idx = (tick - start) / step;
+		idx = idx < len ? idx : len - 1;
+	    }else
+		idx = (tick / step) % len;
+
+	    if( (pattern >> idx) & 0x1 )
+		value |= 1u << led;
+	}
+
+	if( mask == last_mask && value == last_value )
+	    continue;
+
+	if( mask != 0 )
+	    gpio_write(&pio_genoutputs, mask, 0, GPIO_DATA_OFFSET, value);
+
+	last_mask = mask;
+	last_value = value;
+    }
+}
+
+/**
+* @brief Starts the LED pattern engine
+* 
+* @param prio Priority of the engine task. Should be low
+* @return 0 on success. Otherwise error. 
+*
+* Only the LEDs given a pattern are driven by the engine. The others can still be written directly.
+*
+* @note This function is \b NOT thread-safe.
+*
+*/
+
+int pio_leds_start(int prio)
+{
+    int err; 
+
+    if( pio_leds_running )
+	return -EBUSY;
+
+    pio_leds_running = 1;
+
+    if( (err = rt_task_spawn(&pio_leds_task, "PIO LEDs", 0, prio, T_JOINABLE, pio_leds_engine, NULL)) < 0 ){
+	util_pdbg(DBG_WARN, "PIO: LED engine cannot be spawned. Error:%d\n", err);
+	pio_leds_running = 0;
+	return err;
+    }
+
+    return 0;
+}
+
+/**
+* @brief Stops the LED pattern engine
+* 
+* @return 0 on success. Otherwise error. 
+*
+* The LEDs keep their last state. Patterns are kept for the next pio_leds_start().
+*
+* @note This function is \b NOT thread-safe.
+* @note This function is \b blocking. Waits for the current tick to finish
+*
+*/
+
+int pio_leds_stop()
+{
+    if( !pio_leds_running )
+	return -EINVAL;
+
+    pio_leds_running = 0;
+
+    return rt_task_join(&pio_leds_task);
+}
+
+/**
+* @brief Sets the pattern of one LED
+* 
+* @param led PIO_LED_BAR(n) / PIO_LED_POS(n)
+* @param pattern PIO_LED_* pattern. PIO_LED_NONE gives the LED back to direct writes
+* @return 0 on success. Otherwise error. 
+*
+* Takes effect on the next tick of the engine.
+*
+* @note This function is \b thread-safe.
+* @note This function is \b non-blocking. 
+*
+*/
+
+int pio_led_set(unsigned led, unsigned pattern)
+{
+    if( led >= PIO_LED_NUM_OF )
+	return -EINVAL;
+
+    pio_led_once[led] = 0;
+    pio_led_patterns[led] = pattern;
+
     return 0;
 }
 
+/**
+* @brief Sets the same pattern on several LEDs
+* 
+* @param mask LEDs as bits of the General Outputs ( e.g. value << GENERAL_OUTPUTS_LEDPOS_SHIFT )
+* @param pattern PIO_LED_* pattern
+* @return 0 on success. Otherwise error. 
+*
+* @note This function is \b thread-safe.
+* @note This function is \b non-blocking. 
+*
+*/
+
+int pio_led_set_mask(unsigned mask, unsigned pattern)
+{
+    unsigned led;
+
+    if( mask >> PIO_LED_NUM_OF )
+	return -EINVAL;
+
+    for( led = 0 ; led < PIO_LED_NUM_OF ; led++ )
+	if( mask & (1u << led) ){
+	    pio_led_once[led] = 0;
+	    pio_led_patterns[led] = pattern;
+	}
+
+    return 0;
+}
+
+/**
+* @brief Runs a pattern once on several LEDs
+* 
+* @param mask LEDs as bits of the General Outputs ( e.g. value << GENERAL_OUTPUTS_LEDPOS_SHIFT )
+* @param pattern PIO_LED_* pattern
+* @return 0 on success. Otherwise error. 
+*
+* The pattern starts now, on the time base of the engine, and its last step is held afterwards, e.g. 
+* PIO_LED_PATTERN(0x5, 3, ms) flashes the LEDs and leaves them on.
+*
+* @note This function is \b thread-safe.
+* @note This function is \b non-blocking. 
+*
+*/
+
+int pio_led_set_mask_once(unsigned mask, unsigned pattern)
+{
+    unsigned led, start;
+
+    if( mask >> PIO_LED_NUM_OF )
+	return -EINVAL;
+
+    start = (unsigned)(rt_timer_read() / (PIO_LED_TICK_MS * 1000000llu));
+    start = start ? start : 1; // 0 marks a repeated pattern
+
+    for( led = 0 ; led < PIO_LED_NUM_OF ; led++ )
+	if( mask & (1u << led) ){
+	    pio_led_once[led] = start;
+	    util_wmb(); // never the new pattern with the old start
+	    pio_led_patterns[led] = pattern;
+	}
+
+    return 0;
+}
+
+/**
+* @brief Runs a binary counter in the LED bar
+* 
+* @param step_ms Time between counts
+* @return 0 on success. Otherwise error. 
+*
+* LED n blinks with a period of 2^(n+1) counts. The engine evaluates all of them on the same time base.
+*
+* @note This function is \b thread-safe.
+* @note This function is \b non-blocking. 
+*
+*/
+
+int pio_leds_counter(unsigned step_ms)
+{
+    unsigned n;
+
+    for( n = 0 ; n < GENERAL_OUTPUTS_LED4_WIDTH ; n++ ){
+	pio_led_once[PIO_LED_BAR(n)] = 0;
+	pio_led_patterns[PIO_LED_BAR(n)] = PIO_LED_PATTERN(0x2, 2, step_ms << n);
+    }
+
+    return 0;
+}
+
+/**
+* @brief Read from the FPGA-GPIO port
+* 
+* @param ret Read value
+* @return 0 on success. -ENODEV if the port was not initialized ( pio_init_fpgagpio() ). Otherwise error. 
+*
+* @note This function is \b thread-safe.
+* @note This function is \b blocking. 
+*
+*/
+
+int pio_read_fpgagpio(unsigned* ret)
+{
+    if( pio_fpgagpio.vadd == NULL )
+	return -ENODEV;
+
+    return pio_get_fpga_gpio8_data(ret);
+}
+
+/**
+* @brief Write to the FPGA-GPIO port
+* 
+* @param value Data to write into the port
+* @return 0 on success. -ENODEV if the port was not initialized ( pio_init_fpgagpio() ). Otherwise error. 
+*
+* @note This function is \b thread-safe.
+* @note This function is \b blocking. 
+*
+*/
+
+int pio_write_fpgagpio(unsigned value)
+{
+    if( pio_fpgagpio.vadd == NULL )
+	return -ENODEV;
+
+    return pio_set_fpga_gpio8_data(value);
+}
+
+/**
+* @brief Set the direction of the FPGA-GPIO port pins
+* 
+* @param value Tri-state bits. 1 - input 0 - output
+* @return 0 on success. -ENODEV if the port was not initialized ( pio_init_fpgagpio() ). Otherwise error. 
+*
+* @note This function is \b thread-safe.
+* @note This function is \b blocking. 
+*
+*/
+
+int pio_write_fpgagpio_tristate(unsigned value)
+{
+    if( pio_fpgagpio.vadd == NULL )
+	return -ENODEV;
+
+    return pio_setdir_fpga_gpio8_data(value);
+}
+
 /**
 * @brief Unsafe access functions for muxed IO
 * 
@@ -321,7 +836,7 @@ inline int pio_write_fpgagpio_tristate(unsigned value)
 *
 */ 
 
-inline int pio_write_go_all(unsigned value,unsigned off)
+int pio_write_go_all(unsigned value,unsigned off)
 {
     return gpio_write(&pio_genoutputs, ~0,0, off, value);
 }
@@ -333,7 +848,7 @@ inline int pio_write_go_all(unsigned value,unsigned off)
 *
 */ 
 
-inline int pio_read_gi_all(unsigned *ret,unsigned off)
+int pio_read_gi_all(unsigned *ret,unsigned off)
 {
     return gpio_fast_read(&pio_geninputs, off, ret);
 }
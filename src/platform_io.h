@@ -23,6 +23,36 @@
 #include <linux/types.h>
 #include <errno.h> 
 
+#include "gpio.h"
+#include "platform_pio.h" /* Generated field accessors ( pio_get_<gpio>_<field>() / pio_set_... ) */
+
+#define PIO_INPUT_QUEUE_SIZE 256 /*! Input change events kept until drained. Must be a power of 2 */
+
+/* LED pattern engine. LEDs are numbered by their bit in the General Outputs */
+#define PIO_LED_TICK_MS 10 /*! Period of the engine task */
+#define PIO_LED_NUM_OF (GENERAL_OUTPUTS_LEDPOS_SHIFT + GENERAL_OUTPUTS_LEDPOS_WIDTH) /*! LED bar + position LEDs */
+#define PIO_LED_BAR(n) (GENERAL_OUTPUTS_LED4_SHIFT + (n)) /*! LED n ( 0 - GENERAL_OUTPUTS_LED4_WIDTH-1 ) of the bar */
+#define PIO_LED_POS(n) (GENERAL_OUTPUTS_LEDPOS_SHIFT + (n)) /*! Position LED n ( 0 - GENERAL_OUTPUTS_LEDPOS_WIDTH-1 ) */
+
+/*! Pattern: up to 16 on/off steps of 'step_ms' each, repeated ( or run once ). Packed in one word so it is set atomically */
+#define PIO_LED_STEPS(ms) ((ms) < PIO_LED_TICK_MS ? 1 : (ms) / PIO_LED_TICK_MS)
+#define PIO_LED_PATTERN(seq, len, step_ms) \
+	( ((seq) & 0xffff) | ((((len) - 1) & 0xf) << 16) | ((PIO_LED_STEPS(step_ms) & 0xfff) << 20) )
+
+#define PIO_LED_NONE 0 /*! LED not driven by the engine */
+#define PIO_LED_OFF PIO_LED_PATTERN(0x0, 1, PIO_LED_TICK_MS)
+#define PIO_LED_ON PIO_LED_PATTERN(0x1, 1, PIO_LED_TICK_MS)
+#define PIO_LED_BLINK(period_ms) PIO_LED_PATTERN(0x1, 2, (period_ms) / 2) /*! 50% duty */
+#define PIO_LED_PULSE(period_ms) PIO_LED_PATTERN(0x1, 8, (period_ms) / 8) /*! Short flash every period */
+#define PIO_LED_CODE(n, step_ms) PIO_LED_PATTERN(0x5555 & ((1 << (2*(n))) - 1), 2*(n) + 4, step_ms) /*! n (1-6) flashes and a pause */
+
+/*! Change of the General Inputs register */
+typedef struct{
+    unsigned old_value; ///< Debounced inputs before the change
+    unsigned new_value; ///< Debounced inputs after the change
+    RTIME time_ns; ///< Time the change was sampled
+} PIO_INPUT_EVENT;
+
 /* Separate initializations for the devices */
 int pio_init_geninputs(void (*fisr)(void*));
 
@@ -38,27 +68,61 @@ int pio_clean_all();
 /* Helpful easy-to-read high-level functions for gpio device read */
 
 /* LED BAR 4 bits */
-inline int pio_write_leds4(unsigned value);
+int pio_write_leds4(unsigned value);
 
 /* ARROW POSITION LEDS */
-inline int pio_write_ledspos(unsigned value);
+int pio_write_ledspos(unsigned value);
+
+/* LED BAR + ARROW POSITION LEDS in one register write */
+int pio_write_leds(unsigned leds4, unsigned ledspos);
 
 /* ARROW POSITION BUTTONS */
-inline int pio_read_buttons(unsigned* ret);
+int pio_read_buttons(unsigned* ret);
+
+int pio_read_bumpers(unsigned* ret);
+
+/* Edge events on the General Inputs. pio_init_geninputs() must be given gpio_dispatch_isr */
+int pio_subscribe_inputs(unsigned mask, unsigned edges, gpio_handler handler, void* arg);
+
+int pio_unsubscribe_inputs(gpio_handler handler, void* arg);
+
+/* Queue of timestamped input changes, fed by the General Inputs IRQ or by a sampler task */
+int pio_input_queue_enable(unsigned mask);
+
+int pio_input_queue_disable();
+
+int pio_input_sampler_start(RTIME period_ns, int prio);
+
+int pio_input_sampler_stop();
+
+int pio_input_events_drain(PIO_INPUT_EVENT* events, unsigned max);
+
+unsigned pio_input_events_overruns();
+
+/* LED pattern engine */
+int pio_leds_start(int prio);
+
+int pio_leds_stop();
+
+int pio_led_set(unsigned led, unsigned pattern);
+
+int pio_led_set_mask(unsigned mask, unsigned pattern);
+
+int pio_led_set_mask_once(unsigned mask, unsigned pattern);
 
-inline int pio_read_bumpers(unsigned* ret);
+int pio_leds_counter(unsigned step_ms);
 
 /* FPGA_GPIO8 */
-inline int pio_read_fpgagpio(unsigned* ret);
+int pio_read_fpgagpio(unsigned* ret);
 
-inline int pio_write_fpgagpio(unsigned value);
+int pio_write_fpgagpio(unsigned value);
 
-inline int pio_write_fpgagpio_tristate(unsigned value);
+int pio_write_fpgagpio_tristate(unsigned value);
 
 // TODO: Remove. Unsafe functions
 
-inline int pio_write_go_all(unsigned value,unsigned off);
+int pio_write_go_all(unsigned value,unsigned off);
 
-inline int pio_read_gi_all(unsigned *ret,unsigned off);
+int pio_read_gi_all(unsigned *ret,unsigned off);
 
 #endif
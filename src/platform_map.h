@@ -0,0 +1,126 @@
+/**
+    @file platform_map.h
+
+    @section DESCRIPTION
+
+    Robotics library for the Autonomous Robotics Development Platform
+
+    @brief [HEADER] Addresses and masks of the platform peripherals
+
+    @note GENERATED from platform.map by tools/mkplatform.awk ( make platform ). Do not edit
+
+*/
+
+#ifndef __PLATFORM_MAP_H__
+#define __PLATFORM_MAP_H__
+
+/** Bus windows **/
+
+#define BUSIO_WINDOW_GPIO_BASE           0x81400000
+#define BUSIO_WINDOW_GPIO_END            0x814fffff
+
+/** GPIOs **/
+
+#define GENERAL_OUTPUTS_BASE             0x814a0000
+#define GENERAL_OUTPUTS_END              0x814affff
+#define GENERAL_OUTPUTS_NUM_OF_CHAN      1
+#define GENERAL_OUTPUTS_NUM_OF_GPIO      17
+#define GENERAL_OUTPUTS_LED4_MASK        0x0000f
+#define GENERAL_OUTPUTS_LED4_SHIFT       0
+#define GENERAL_OUTPUTS_LED4_WIDTH       4
+#define GENERAL_OUTPUTS_LED4_CHAN        1
+#define GENERAL_OUTPUTS_LEDPOS_MASK      0x001f0
+#define GENERAL_OUTPUTS_LEDPOS_SHIFT     4
+#define GENERAL_OUTPUTS_LEDPOS_WIDTH     5
+#define GENERAL_OUTPUTS_LEDPOS_CHAN      1
+
+#define GENERAL_INPUTS_BASE              0x81420000
+#define GENERAL_INPUTS_END               0x8142ffff
+#define GENERAL_INPUTS_NUM_OF_CHAN       1
+#define GENERAL_INPUTS_NUM_OF_GPIO       10
+#define GENERAL_INPUTS_IRQ_NO            7
+#define GENERAL_INPUTS_PUSHBUT_MASK      0x0001f
+#define GENERAL_INPUTS_PUSHBUT_SHIFT     0
+#define GENERAL_INPUTS_PUSHBUT_WIDTH     5
+#define GENERAL_INPUTS_PUSHBUT_CHAN      1
+#define GENERAL_INPUTS_BUMPERS_MASK      0x001e0
+#define GENERAL_INPUTS_BUMPERS_SHIFT     5
+#define GENERAL_INPUTS_BUMPERS_WIDTH     4
+#define GENERAL_INPUTS_BUMPERS_CHAN      1
+#define GENERAL_INPUTS_ACC_RDY_MASK      0x00200
+#define GENERAL_INPUTS_ACC_RDY_SHIFT     9
+#define GENERAL_INPUTS_ACC_RDY_WIDTH     1
+#define GENERAL_INPUTS_ACC_RDY_CHAN      1
+#define GENERAL_INPUTS_ADC_EOC_MASK      0x00400
+#define GENERAL_INPUTS_ADC_EOC_SHIFT     10
+#define GENERAL_INPUTS_ADC_EOC_WIDTH     1
+#define GENERAL_INPUTS_ADC_EOC_CHAN      1
+
+#define LCD16X2_BASE                     0x81460000
+#define LCD16X2_END                      0x8146ffff
+#define LCD16X2_NUM_OF_CHAN              1
+#define LCD16X2_NUM_OF_GPIO              7
+#define LCD16X2_LCD_MASK                 0x0007f
+#define LCD16X2_LCD_SHIFT                0
+#define LCD16X2_LCD_WIDTH                7
+#define LCD16X2_LCD_CHAN                 1
+
+#define FPGA_GPIO8_BASE                  0x81480000
+#define FPGA_GPIO8_END                   0x8148ffff
+#define FPGA_GPIO8_NUM_OF_CHAN           1
+#define FPGA_GPIO8_NUM_OF_GPIO           8
+#define FPGA_GPIO8_IRQ_NO                8
+#define FPGA_GPIO8_DATA_MASK             0x000ff
+#define FPGA_GPIO8_DATA_SHIFT            0
+#define FPGA_GPIO8_DATA_WIDTH            8
+#define FPGA_GPIO8_DATA_CHAN             1
+
+/** IP cores **/
+
+#define MOTORS_BASE                      0xca400000
+#define MOTORS_END                       0xca40ffff
+#define MOTORS_NUM_OF                    4
+#define MOTORS_DUTY_WORD                 0
+#define MOTORS_DUTY_STRIDE               2
+#define MOTORS_DUTY_MASK                 0x007ff
+#define MOTORS_DUTY_SHIFT                0
+#define MOTORS_DUTY_WIDTH                11
+#define MOTORS_FREQ_DIV_WORD             1
+#define MOTORS_FREQ_DIV_STRIDE           2
+#define MOTORS_FREQ_DIV_MASK             0x000ff
+#define MOTORS_FREQ_DIV_SHIFT            0
+#define MOTORS_FREQ_DIV_WIDTH            8
+
+#define QENC_BASE                        0xc4600000
+#define QENC_END                         0xc460ffff
+#define QENC_NUM_OF                      4
+#define QENC_COUNT_WORD                  0
+#define QENC_COUNT_STRIDE                1
+#define QENC_COUNT_MASK                  0xffffffff
+#define QENC_COUNT_SHIFT                 0
+#define QENC_COUNT_WIDTH                 32
+#define QENC_RESET_WORD                  0
+#define QENC_RESET_STRIDE                1
+#define QENC_RESET_MASK                  0x00001
+#define QENC_RESET_SHIFT                 0
+#define QENC_RESET_WIDTH                 1
+
+#define HWSERVOS_BASE                    0xc5600000
+#define HWSERVOS_END                     0xc560ffff
+#define HWSERVOS_NUM_OF                  4
+#define HWSERVOS_PULSE_WORD              0
+#define HWSERVOS_PULSE_STRIDE            1
+#define HWSERVOS_PULSE_MASK              0x7fffffff
+#define HWSERVOS_PULSE_SHIFT             0
+#define HWSERVOS_PULSE_WIDTH             31
+#define HWSERVOS_EN_WORD                 0
+#define HWSERVOS_EN_STRIDE               1
+#define HWSERVOS_EN_MASK                 0x80000000
+#define HWSERVOS_EN_SHIFT                31
+#define HWSERVOS_EN_WIDTH                1
+
+#define PID_BASE                         0x75020000
+#define PID_END                          0x7502ffff
+#define PID_NUM_OF                       4
+
+#endif
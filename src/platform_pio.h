@@ -0,0 +1,69 @@
+/**
+    @file platform_pio.h
+
+    @section DESCRIPTION
+
+    Robotics library for the Autonomous Robotics Development Platform
+
+    @brief [HEADER] Accessors for every GPIO field of the platform. Masks and shifts fold into the calls
+
+    @note GENERATED from platform.map by tools/mkplatform.awk ( make platform ). Do not edit
+
+*/
+
+#ifndef __PLATFORM_PIO_H__
+#define __PLATFORM_PIO_H__
+
+#include "gpio.h"
+#include "platform_map.h"
+
+extern GPIO pio_genoutputs; ///< GENERAL_OUTPUTS
+extern GPIO pio_geninputs; ///< GENERAL_INPUTS
+extern GPIO pio_fpgagpio; ///< FPGA_GPIO8
+
+static inline int pio_set_general_outputs_led4(unsigned value)
+{
+    return gpio_write(&pio_genoutputs, GENERAL_OUTPUTS_LED4_MASK, GENERAL_OUTPUTS_LED4_SHIFT, GPIO_DATA(GENERAL_OUTPUTS_LED4_CHAN), value);
+}
+
+static inline int pio_set_general_outputs_ledpos(unsigned value)
+{
+    return gpio_write(&pio_genoutputs, GENERAL_OUTPUTS_LEDPOS_MASK, GENERAL_OUTPUTS_LEDPOS_SHIFT, GPIO_DATA(GENERAL_OUTPUTS_LEDPOS_CHAN), value);
+}
+
+static inline int pio_get_general_inputs_pushbut(unsigned* ret)
+{
+    return gpio_read(&pio_geninputs, GENERAL_INPUTS_PUSHBUT_MASK, GENERAL_INPUTS_PUSHBUT_SHIFT, GPIO_DATA(GENERAL_INPUTS_PUSHBUT_CHAN), ret);
+}
+
+static inline int pio_get_general_inputs_bumpers(unsigned* ret)
+{
+    return gpio_read(&pio_geninputs, GENERAL_INPUTS_BUMPERS_MASK, GENERAL_INPUTS_BUMPERS_SHIFT, GPIO_DATA(GENERAL_INPUTS_BUMPERS_CHAN), ret);
+}
+
+static inline int pio_get_general_inputs_acc_rdy(unsigned* ret)
+{
+    return gpio_read(&pio_geninputs, GENERAL_INPUTS_ACC_RDY_MASK, GENERAL_INPUTS_ACC_RDY_SHIFT, GPIO_DATA(GENERAL_INPUTS_ACC_RDY_CHAN), ret);
+}
+
+static inline int pio_get_general_inputs_adc_eoc(unsigned* ret)
+{
+    return gpio_read(&pio_geninputs, GENERAL_INPUTS_ADC_EOC_MASK, GENERAL_INPUTS_ADC_EOC_SHIFT, GPIO_DATA(GENERAL_INPUTS_ADC_EOC_CHAN), ret);
+}
+
+static inline int pio_get_fpga_gpio8_data(unsigned* ret)
+{
+    return gpio_read(&pio_fpgagpio, FPGA_GPIO8_DATA_MASK, FPGA_GPIO8_DATA_SHIFT, GPIO_DATA(FPGA_GPIO8_DATA_CHAN), ret);
+}
+
+static inline int pio_set_fpga_gpio8_data(unsigned value)
+{
+    return gpio_write(&pio_fpgagpio, FPGA_GPIO8_DATA_MASK, FPGA_GPIO8_DATA_SHIFT, GPIO_DATA(FPGA_GPIO8_DATA_CHAN), value);
+}
+
+static inline int pio_setdir_fpga_gpio8_data(unsigned value)
+{
+    return gpio_write(&pio_fpgagpio, FPGA_GPIO8_DATA_MASK, FPGA_GPIO8_DATA_SHIFT, GPIO_TRISTATE(FPGA_GPIO8_DATA_CHAN), value);
+}
+
+#endif
@@ -0,0 +1,540 @@
+/**
+    @file trajectory.c
+    
+    @section DESCRIPTION    
+    
+    Robotics library for the Autonomous Robotics Development Platform  
+    
+    @brief Trapezoidal and S-curve motion profiles for the DC motors, evaluated per control tick
+    
+    @author Jorge Sánchez de Nova jssdn (mail)_(at) kth.se
+ 
+    @section LICENSE 
+    
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+    
+    @note Profiles are not precomputed: every traj_step() advances a trapezoid one control period, towards a velocity 
+          target ( TRAJ_VELOCITY ) or the highest velocity that still stops on the goal ( TRAJ_POSITION ), so goals 
+          can change at any tick. The S-curve is that trapezoid through a moving average of amax / jmax seconds: 
+          acceleration steps become ramps of slope jmax, and the final position is kept exactly. All in Q16.16, 
+          there is no FPU in the PPC405
+
+    @version 0.4-Xenomai       
+    
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "trajectory.h"
+#include "motors.h"
+#include "util.h"
+
+/**
+* @brief Clamps 'x' to +-lim
+*/
+
+static inline int64_t traj_clamp(int64_t x, int64_t lim)
+{
+    return x > lim ? lim : ( x < -lim ? -lim : x );
+}
+
+/**
+* @brief Scales 'x' by 'scale' in Q2.30 without overflowing 64 bits
+*/
+
+static inline int64_t traj_scale(int64_t x, int64_t scale)
+{
+    return (((x >> 16) * scale) >> 14) + (((x & 0xffff) * scale) >> 30);
+}
+
+/**
+* @brief Integer square root
+*/
+
+static uint64_t traj_isqrt(uint64_t x)
+{
+    uint64_t res = 0;
+    uint64_t bit = 1ull << 62;
+
+    while( bit > x )
+	bit >>= 2;
+
+    while( bit != 0 ){
+	if( x >= res + bit ){
+	    x -= res + bit;
+	    res = (res >> 1) + bit;
+	}else{
+	    res >>= 1;
+	}
+	bit >>= 2;
+    }
+
+    return res;
+}
+
+/**
+* @brief Highest velocity from which the trapezoid still stops within 'dist'
+*
+* v = sqrt(c^2 + 2 a d) - c, c = a / 2 rate: the velocity changes in steps of a / rate. The operands lose only the 
+* low bits needed to keep the products within 64 bits, so short moves keep their precision.
+*/
+
+static int64_t traj_stop_vel(TRAJ* traj, TRAJ_AXIS* ax, int64_t dist)
+{
+    uint64_t c = ax->amax / (2 * traj->rate_hz);
+    uint64_t a2 = 2 * ax->amax;
+    uint64_t d = dist;
+    unsigned shift = 0;
+
+    while( (c && c > (1ull << 62) / c) || (a2 && d > (1ull << 62) / a2) ){
+	c >>= 1; a2 >>= 1; d >>= 1;
+	shift++;
+    }
+
+    return ((int64_t)traj_isqrt(c * c + a2 * d) - (int64_t)c) << shift;
+}
+
+/**
+* @brief Advances the trapezoid velocity of an axis one period towards 'vt'
+*/
+
+static void traj_velocity_step(TRAJ* traj, TRAJ_AXIS* ax, int64_t vt)
+{
+    int64_t dv = traj_clamp(vt - ax->rvel, ax->amax / traj->rate_hz);
+
+    ax->rvel = ( ax->rvel + dv == vt ) ? vt : ax->rvel + dv;
+}
+
+/**
+* @brief Pushes the trapezoid state through the smoothing window and updates the profile
+*/
+
+static void traj_smooth(TRAJ* traj, TRAJ_AXIS* ax)
+{
+    int64_t vel;
+
+    if( traj->taps == 1 ){
+	vel = ax->rvel;
+	ax->pos = ax->rpos;
+    }else{
+	ax->pos_sum += ax->rpos - ax->taps[traj->tap];
+	ax->vel_sum += ax->rvel - ax->vtaps[traj->tap];
+	ax->taps[traj->tap] = ax->rpos;
+	ax->vtaps[traj->tap] = ax->rvel;
+	ax->pos = ax->pos_sum / (int64_t)traj->taps;
+	vel = ax->vel_sum / (int64_t)traj->taps;
+    }
+
+    ax->acc = (vel - ax->vel) * (int64_t)traj->rate_hz;
+    ax->vel = vel;
+}
+
+/**
+* @brief Inits a trajectory generator 
+*
+* @param traj TRAJ structure
+* @param num_of Number of axes ( motors )
+* @param rate_hz Rate traj_step() will be called at
+* @param profile TRAJ_PROFILE_TRAPEZOID / TRAJ_PROFILE_SCURVE
+* @param vmax Velocity limit in ticks/s
+* @param amax Acceleration limit in ticks/s^2
+* @param jmax Jerk limit in ticks/s^3 ( TRAJ_PROFILE_SCURVE ). amax / jmax * rate_hz must be below TRAJ_MAX_TAPS
+* @return 0 on success. Otherwise error. 
+*
+* All the axes start idle at position 0, without output.
+*
+* @note This function is \b NOT thread-safe.
+*
+*/
+
+int traj_init(TRAJ* traj, unsigned num_of, unsigned rate_hz, int profile, int vmax, int amax, int jmax)
+{
+    unsigned i, taps = 1;
+
+    if( num_of == 0 || num_of > TRAJ_MAX_AXES || rate_hz == 0 || vmax <= 0 || amax <= 0 )
+	return -EINVAL;
+
+    if( profile == TRAJ_PROFILE_SCURVE ){
+	if( jmax <= 0 )
+	    return -EINVAL;
+	taps = ((uint64_t)amax * rate_hz + jmax / 2) / jmax;
+	taps = taps == 0 ? 1 : taps;
+    }else if( profile != TRAJ_PROFILE_TRAPEZOID ){
+	return -EINVAL;
+    }
+
+    if( taps > TRAJ_MAX_TAPS )
+	return -EINVAL;
+
+    memset(traj, 0, sizeof(TRAJ));
+
+    if( taps > 1 && (traj->fir = calloc(2 * num_of * taps, sizeof(int64_t))) == NULL ){
+	util_pdbg(DBG_WARN, "TRAJ: Cannot allocate memory\n");
+	return -ENOMEM;
+    }
+
+    traj->num_of = num_of;
+    traj->rate_hz = rate_hz;
+    traj->profile = profile;
+    traj->vmax = vmax * TRAJ_ONE;
+    traj->amax = amax * TRAJ_ONE;
+    traj->taps = taps;
+
+    for( i = 0 ; i < num_of ; i++ ){
+	traj->axes[i].vmax = traj->vmax;
+	traj->axes[i].amax = traj->amax;
+	if( taps > 1 ){
+	    traj->axes[i].taps = traj->fir + 2 * i * taps;
+	    traj->axes[i].vtaps = traj->axes[i].taps + taps;
+	}
+    }
+
+    return 0;
+}
+
+/**
+* @brief Releases a trajectory generator 
+*
+* @param traj TRAJ structure
+*
+* @note This function is \b NOT thread-safe.
+*
+*/
+
+void traj_clean(TRAJ* traj)
+{
+    free(traj->fir);
+    traj->fir = NULL;
+    traj->num_of = 0;
+}
+
+/**
+* @brief Selects where traj_feed() sends the velocity of an axis
+*
+* @param traj TRAJ structure
+* @param axis Axis number
+* @param output TRAJ_OUT_NONE / TRAJ_OUT_PID / TRAJ_OUT_PWM
+* @param duty_scale TRAJ_OUT_PWM: duty cycle per tick/s in Q16.16, e.g. FIX16(1023.0 / ticks_per_sec_at_full_duty)
+* @return 0 on success. Otherwise error. 
+*
+* @note This function is \b NOT thread-safe.
+*
+*/
+
+int traj_set_output(TRAJ* traj, unsigned axis, int output, int duty_scale)
+{
+    if( axis >= traj->num_of || output < TRAJ_OUT_NONE || output > TRAJ_OUT_PWM )
+	return -EINVAL;
+
+    traj->axes[axis].output = output;
+    traj->axes[axis].duty_scale = duty_scale;
+
+    return 0;
+}
+
+/**
+* @brief Sets the profile position of an axis at rest
+*
+* @param traj TRAJ structure
+* @param axis Axis number
+* @param ticks Position in ticks, e.g. QENC_ESTIMATOR pos so position moves are relative to the wheel
+* @return 0 on success. Otherwise error. 
+*
+* @note This function is \b NOT thread-safe.
+*
+*/
+
+int traj_set_position(TRAJ* traj, unsigned axis, int64_t ticks)
+{
+    TRAJ_AXIS* ax;
+    unsigned i;
+
+    if( axis >= traj->num_of )
+	return -EINVAL;
+
+    ax = &(traj->axes[axis]);
+
+    if( ax->mode != TRAJ_IDLE || ax->vel != 0 )
+	return -EBUSY;
+
+    ax->rpos = ax->pos = ticks * TRAJ_ONE;
+
+    if( traj->taps > 1 ){
+	for( i = 0 ; i < traj->taps ; i++ )
+	    ax->taps[i] = ax->rpos;
+	ax->pos_sum = ax->rpos * (int64_t)traj->taps;
+    }
+
+    return 0;
+}
+
+/**
+* @brief Ramps an axis to a velocity and holds it
+*
+* @param traj TRAJ structure
+* @param axis Axis number
+* @param ticks_per_sec Target velocity. Clamped to the velocity limit
+* @return 0 on success. Otherwise error. 
+*
+* Can be called at any time, also during a move: the profile continues from the current state.
+*
+* @note This function is \b NOT thread-safe.
+*
+*/
+
+int traj_move_velocity(TRAJ* traj, unsigned axis, int ticks_per_sec)
+{
+    TRAJ_AXIS* ax;
+
+    if( axis >= traj->num_of )
+	return -EINVAL;
+
+    ax = &(traj->axes[axis]);
+    ax->vmax = traj->vmax;
+    ax->amax = traj->amax;
+    ax->vtarget = traj_clamp(ticks_per_sec * TRAJ_ONE, traj->vmax);
+    ax->mode = TRAJ_VELOCITY;
+
+    return 0;
+}
+
+/**
+* @brief Moves an axis to a position
+*
+* @param traj TRAJ structure
+* @param axis Axis number
+* @param ticks Absolute goal in ticks
+* @return 0 on success. Otherwise error. 
+*
+* @note This function is \b NOT thread-safe.
+*
+*/
+
+int traj_move_position(TRAJ* traj, unsigned axis, int64_t ticks)
+{
+    TRAJ_AXIS* ax;
+
+    if( axis >= traj->num_of )
+	return -EINVAL;
+
+    ax = &(traj->axes[axis]);
+    ax->vmax = traj->vmax;
+    ax->amax = traj->amax;
+    ax->goal = ticks * TRAJ_ONE;
+    ax->mode = TRAJ_POSITION;
+
+    return 0;
+}
+
+/**
+* @brief Moves all the axes to their positions so that they finish together
+*
+* @param traj TRAJ structure
+* @param ticks Array of traj->num_of absolute goals in ticks
+* @return 0 on success. Otherwise error. 
+*
+* The axis with the longest distance moves at the limits. The others get their limits scaled by their distance over 
+* the longest one, which makes their trapezoids time-scaled copies of it. The smoothing window is the same for all 
+* the axes, so the S-curves stay in step too. Exact when all the axes start at rest.
+*
+* @note This function is \b NOT thread-safe.
+*
+*/
+
+int traj_move_sync(TRAJ* traj, const int64_t* ticks)
+{
+    int64_t dist[TRAJ_MAX_AXES];
+    int64_t dmax = 0, scale;
+    unsigned i, shift = 0;
+    TRAJ_AXIS* ax;
+
+    for( i = 0 ; i < traj->num_of ; i++ ){
+	dist[i] = ticks[i] * TRAJ_ONE - traj->axes[i].rpos;
+	dist[i] = dist[i] < 0 ? -dist[i] : dist[i];
+	dmax = dist[i] > dmax ? dist[i] : dmax;
+    }
+
+    while( (dmax >> shift) >= (1ll << 32) ) // keeps (dist << 30) in 64 bits
+	shift++;
+
+    for( i = 0 ; i < traj->num_of ; i++ ){
+	ax = &(traj->axes[i]);
+	scale = dmax == 0 ? (1 << 30) : ((dist[i] >> shift) << 30) / (dmax >> shift);
+	ax->vmax = traj_scale(traj->vmax, scale);
+	ax->amax = traj_scale(traj->amax, scale);
+	if( ax->vmax == 0 || ax->amax == 0 ) // negligible distance
+	    ax->vmax = ax->amax = 1;
+	ax->goal = ticks[i] * TRAJ_ONE;
+	ax->mode = TRAJ_POSITION;
+    }
+
+    return 0;
+}
+
+/**
+* @brief Brings an axis to rest with the current limits
+*
+* @param traj TRAJ structure
+* @param axis Axis number
+* @return 0 on success. Otherwise error. 
+*
+* @note This function is \b NOT thread-safe.
+*
+*/
+
+int traj_stop(TRAJ* traj, unsigned axis)
+{
+    if( axis >= traj->num_of )
+	return -EINVAL;
+
+    traj->axes[axis].vtarget = 0;
+    traj->axes[axis].mode = TRAJ_VELOCITY;
+
+    return 0;
+}
+
+/**
+* @brief Checks if an axis finished its move
+*
+* @param traj TRAJ structure
+* @param axis Axis number
+* @return 1 if the axis is at rest or holding its target velocity, 0 if still moving. Otherwise error. 
+*/
+
+int traj_done(TRAJ* traj, unsigned axis)
+{
+    TRAJ_AXIS* ax;
+
+    if( axis >= traj->num_of )
+	return -EINVAL;
+
+    ax = &(traj->axes[axis]);
+
+    if( ax->mode == TRAJ_IDLE )
+	return ax->pos == ax->rpos && ax->vel == 0;
+
+    return ax->mode == TRAJ_VELOCITY && ax->rvel == ax->vtarget && ax->vel == ax->vtarget && ax->acc == 0;
+}
+
+/**
+* @brief Advances all the axes one control period 
+*
+* @param traj TRAJ structure
+* @return Number of axes still moving
+*
+* Call it once per period of the control task, at traj->rate_hz, then traj_feed().
+*
+* @note This function is \b NOT thread-safe.
+* @note This function is \b non-blocking. 
+*
+*/
+
+int traj_step(TRAJ* traj)
+{
+    int64_t rate = traj->rate_hz;
+    int64_t rem, dist, vt, speed;
+    TRAJ_AXIS* ax;
+    unsigned i;
+    int moving = 0;
+
+    for( i = 0 ; i < traj->num_of ; i++ ){
+	ax = &(traj->axes[i]);
+
+	switch( ax->mode ){
+	    case TRAJ_VELOCITY:
+		traj_velocity_step(traj, ax, ax->vtarget);
+		if( ax->vtarget == 0 && ax->rvel == 0 )
+		    ax->mode = TRAJ_IDLE;
+		break;
+
+	    case TRAJ_POSITION:
+		rem = ax->goal - ax->rpos;
+		dist = rem < 0 ? -rem : rem;
+		speed = ax->rvel < 0 ? -ax->rvel : ax->rvel;
+
+		// Arrived: within tolerance and slow enough to stop in one period ( or too slow to move at all in Q16.16 )
+		if( dist <= TRAJ_POS_TOL + speed / rate && (speed <= ax->amax / rate || speed < rate) ){
+		    ax->rpos = ax->goal;
+		    ax->rvel = 0;
+		    ax->mode = TRAJ_IDLE;
+		    break;
+		}
+
+		vt = traj_stop_vel(traj, ax, dist);
+		vt = vt > ax->vmax ? ax->vmax : vt;
+		traj_velocity_step(traj, ax, rem < 0 ? -vt : vt);
+		break;
+
+	    default:
+		break;
+	}
+
+	ax->rpos += ax->rvel / rate;
+
+	traj_smooth(traj, ax);
+
+	if( ax->mode != TRAJ_IDLE || !traj_done(traj, i) )
+	    moving++;
+    }
+
+    if( traj->taps > 1 )
+	traj->tap = (traj->tap + 1) % traj->taps;
+
+    return moving;
+}
+
+/**
+* @brief Sends the profile velocities to the motors
+*
+* @param traj TRAJ structure
+* @param motor MOTOR device structure. Axis n drives motor n
+* @return 0 on success. Otherwise error. 
+*
+* TRAJ_OUT_PID axes set the software PID setpoint ( motors_pid_set_speed() ), TRAJ_OUT_PWM axes the duty cycle 
+* ( motors_pwm_set_speed() ).
+*
+* @note This function is \b thread-safe.
+* @note This function is \b blocking. TRAJ_OUT_PWM takes the PWM mutex
+*
+*/
+
+int traj_feed(TRAJ* traj, MOTOR* motor)
+{
+    TRAJ_AXIS* ax;
+    unsigned i;
+    int err;
+
+    for( i = 0 ; i < traj->num_of && i < motor->num_of_motors ; i++ ){
+	ax = &(traj->axes[i]);
+
+	if( ax->output == TRAJ_OUT_PID )
+	    err = motors_pid_set_speed(motor, i, (int)(ax->vel >> 16));
+	else if( ax->output == TRAJ_OUT_PWM )
+	    err = motors_pwm_set_speed(motor, i, (int)traj_clamp((ax->vel * ax->duty_scale) >> 32, MOTORS_MAX_SPEED));
+	else
+	    continue;
+
+	if( err < 0 ){
+	    util_pdbg(DBG_WARN, "TRAJ: Axis %d cannot be fed. Error:%d\n", i, err);
+	    return err;
+	}
+    }
+
+    return 0;
+}
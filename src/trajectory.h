@@ -0,0 +1,96 @@
+/**
+    @file trajectory.h
+    
+    @section DESCRIPTION    
+    
+    Robotics library for the Autonomous Robotics Development Platform  
+    
+    @brief [HEADER] Trapezoidal and S-curve motion profiles for the DC motors, evaluated per control tick
+    
+*/
+
+#ifndef __TRAJECTORY_H__
+#define __TRAJECTORY_H__
+
+#include <stdint.h>
+
+#include "motors.h"
+#include "dev_mmaps_parms.h"
+
+#define TRAJ_MAX_AXES MOTORS_MAX_NUM_OF_CORES /*! Maximum number of axes in a trajectory */
+#define TRAJ_MAX_TAPS 1024 /*! Longest S-curve smoothing window, in control periods ( amax / jmax * rate ) */
+
+/* Profiles */
+#define TRAJ_PROFILE_TRAPEZOID 0 /*! Acceleration limited */
+#define TRAJ_PROFILE_SCURVE 1 /*! Acceleration and jerk limited: the trapezoid smoothed over amax / jmax seconds */
+
+/* Axis modes */
+#define TRAJ_IDLE 0 /*! At rest */
+#define TRAJ_VELOCITY 1 /*! Ramping to a velocity, then holding it */
+#define TRAJ_POSITION 2 /*! Moving to a position */
+
+/* Axis outputs for traj_feed() */
+#define TRAJ_OUT_NONE 0 /*! Not fed to the motors */
+#define TRAJ_OUT_PID 1 /*! Velocity to the software PID setpoint */
+#define TRAJ_OUT_PWM 2 /*! Velocity scaled to a PWM duty cycle */
+
+#define TRAJ_ONE ((int64_t)1 << 16) /*! One tick ( Q16.16 ). Positions and speeds can be negative: scale by it, do not shift */
+#define TRAJ_POS_TOL (1 << 15) /*! Position reached within half a tick ( Q16.16 ) */
+
+/*! One axis. Position, velocity, acceleration and limits in Q16.16 ticks, ticks/s, ticks/s^2 */
+typedef struct{
+    int64_t pos; ///< Profile position
+    int64_t vel; ///< Profile velocity
+    int64_t acc; ///< Profile acceleration
+    int64_t rpos; ///< Trapezoid position, before smoothing
+    int64_t rvel; ///< Trapezoid velocity, before smoothing
+    int64_t* taps; ///< Last traj->taps trapezoid positions ( S-curve )
+    int64_t* vtaps; ///< Last traj->taps trapezoid velocities ( S-curve )
+    int64_t pos_sum; ///< Sum of taps
+    int64_t vel_sum; ///< Sum of vtaps
+    int mode; ///< TRAJ_IDLE / TRAJ_VELOCITY / TRAJ_POSITION ( of the trapezoid )
+    int64_t goal; ///< Target position ( TRAJ_POSITION )
+    int64_t vtarget; ///< Target velocity ( TRAJ_VELOCITY )
+    int64_t vmax; ///< Velocity limit of the current move
+    int64_t amax; ///< Acceleration limit of the current move
+    int output; ///< TRAJ_OUT_*
+    int duty_scale; ///< TRAJ_OUT_PWM: duty cycle per tick/s, Q16.16
+} TRAJ_AXIS; 
+
+typedef struct{
+    unsigned num_of; ///< Number of axes. Axis n drives motor n
+    unsigned rate_hz; ///< Rate traj_step() is called at
+    int profile; ///< TRAJ_PROFILE_*
+    int64_t vmax; ///< Velocity limit ( Q16.16 ticks/s )
+    int64_t amax; ///< Acceleration limit ( Q16.16 ticks/s^2 )
+    unsigned taps; ///< Length of the smoothing window in periods. 1 for TRAJ_PROFILE_TRAPEZOID
+    unsigned tap; ///< Oldest tap
+    int64_t* fir; ///< Storage of all the taps
+    TRAJ_AXIS axes[TRAJ_MAX_AXES]; ///< Axes
+} TRAJ; 
+
+int traj_init(TRAJ* traj, unsigned num_of, unsigned rate_hz, int profile, int vmax, int amax, int jmax);
+
+void traj_clean(TRAJ* traj);
+
+int traj_set_output(TRAJ* traj, unsigned axis, int output, int duty_scale);
+
+int traj_set_position(TRAJ* traj, unsigned axis, int64_t ticks);
+
+/* Moves */
+int traj_move_velocity(TRAJ* traj, unsigned axis, int ticks_per_sec);
+
+int traj_move_position(TRAJ* traj, unsigned axis, int64_t ticks);
+
+int traj_move_sync(TRAJ* traj, const int64_t* ticks);
+
+int traj_stop(TRAJ* traj, unsigned axis);
+
+int traj_done(TRAJ* traj, unsigned axis);
+
+/* Control tick */
+int traj_step(TRAJ* traj);
+
+int traj_feed(TRAJ* traj, MOTOR* motor);
+
+#endif
@@ -59,7 +59,7 @@ inline void util_pdbg(int msg, char *fmt, ...)
 
   if ( msg <= DBG_LEVEL ) {  
       va_start(args_ptr,fmt);
-      vsprintf(buf, fmt, args_ptr);
+      vsnprintf(buf, DBG_MSG_LENGTH, fmt, args_ptr);
 //       strcat(buf, "\n");
       va_end(args_ptr);
 /*      printf("%s",buf);*/
@@ -21,6 +21,73 @@
 
 #define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
 
+/*! Pointer to the structure that embeds 'member' at 'ptr' */
+#define container_of(ptr, type, member) ((type*)((char*)(ptr) - offsetof(type, member)))
+
+/* Memory barriers for the lock-free paths */
+#ifdef __PPC__
+#define util_mb()  __asm__ __volatile__("sync" : : : "memory")   /*! Full barrier */
+#define util_wmb() __asm__ __volatile__("eieio" : : : "memory")  /*! Orders stores ( also to IO ) */
+#define util_rmb() __asm__ __volatile__("sync" : : : "memory")   /*! Orders loads */
+#elif defined(__i386__) || defined(__x86_64__)
+#define util_mb()  __sync_synchronize()
+#define util_wmb() __asm__ __volatile__("" : : : "memory") /* x86 does not reorder stores with stores */
+#define util_rmb() __asm__ __volatile__("" : : : "memory") /* nor loads with loads */
+#else
+#define util_mb()  __sync_synchronize()
+#define util_wmb() __sync_synchronize()
+#define util_rmb() __sync_synchronize()
+#endif
+
+/* 
+    Double-buffered sequence lock: one writer at a time ( serialize writers outside ), any number of readers that never 
+    wait. The sequence is odd while a writer fills the slot that is NOT published, so a reader copying the published 
+    slot only has to retry if a whole write completed meanwhile. A reader with higher priority than the writers on 
+    a single CPU never retries.
+
+	Writer:					Reader:
+	slot = util_seq_write_begin(&seq);	s = util_seq_read_begin(&seq, &slot);
+	buf[slot] = ...;			copy = buf[slot];
+	util_seq_write_end(&seq);		if( util_seq_read_retry(&seq, s) ) ...
+*/
+
+/*! Starts a write. Returns the slot to fill */
+static inline unsigned util_seq_write_begin(volatile unsigned* seq)
+{
+    unsigned s = *seq;
+
+    *seq = s + 1;
+    util_wmb();
+
+    return ((s >> 1) + 1) & 1;
+}
+
+/*! Publishes the slot filled since util_seq_write_begin() */
+static inline void util_seq_write_end(volatile unsigned* seq)
+{
+    util_wmb();
+    *seq = *seq + 1;
+}
+
+/*! Starts a read. Returns the sequence to check with util_seq_read_retry(), '*slot' is the published slot */
+static inline unsigned util_seq_read_begin(volatile unsigned* seq, unsigned* slot)
+{
+    unsigned s = *seq;
+
+    util_rmb();
+    *slot = (s >> 1) & 1;
+
+    return s;
+}
+
+/*! Non-zero if the slot read since util_seq_read_begin() may have been overwritten */
+static inline int util_seq_read_retry(volatile unsigned* seq, unsigned start)
+{
+    util_rmb();
+
+    return (*seq - start) >= 2;
+}
+
 /*   
      --- Debug Loglevel ---
      DBG_NONE 0     silent 
@@ -40,10 +40,46 @@
 #include <sys/ioctl.h>
 #include <linux/types.h>
 #include <linux/spi/spidev.h>
+//Xenomai
+#include <native/task.h>
+#include <native/sem.h>
+#include <native/timer.h>
+//--
 
 #include "xspidev.h"
+#include "xspidev_sim.h"
 #include "util.h" 
 
+static const SPI_TRANSPORT* spi_transport = NULL; ///< Transport of the next spi_init(). Chosen on the first one if not set
+
+/* --- spidev transport --- */
+
+/**
+* @brief Opens the spidev device file
+*/
+
+static int spidev_open(XSPIDEV* xspi)
+{
+    if ( ( xspi->fd = open(xspi->device, O_RDWR) ) < 0 ) 
+        return -EBUSY; //can't open fd
+
+    return 0;
+}
+
+/**
+* @brief Closes the spidev device file
+*/
+
+static int spidev_close(XSPIDEV* xspi)
+{
+    if( xspi->fd >= 0 && close(xspi->fd) < 0 )
+	return -EIO;
+
+    xspi->fd = -1;
+
+    return 0;
+}
+
 /**
 * @brief Applies given config to the SPI device
 *
@@ -57,12 +93,10 @@
 *
 */
 
-static int spi_set_config(XSPIDEV* xspi)
+static int spidev_config(XSPIDEV* xspi)
 {
     int err; 
    
-    if ( ( xspi->fd = open(xspi->device, O_RDWR) ) < 0 ) 
-        return -EBUSY; //can't open fd
     /*
      * spi mode
      */
@@ -88,13 +122,183 @@ static int spi_set_config(XSPIDEV* xspi)
     if( (err = ioctl(xspi->fd, SPI_IOC_RD_MAX_SPEED_HZ, &xspi->speed)) < 0 )
         return -EIO; // can't get max speed hz
 
+    return 0;
+}
+
+/**
+* @brief One SPI_IOC_MESSAGE
+*/
+
+static int spidev_message(XSPIDEV* xspi, struct spi_ioc_transfer* seg, unsigned num_of)
+{
+    int ret;
+
+    if( (ret = ioctl(xspi->fd, SPI_IOC_MESSAGE(num_of), seg)) < 0 )
+	return -errno;
+
+    return ret;
+}
+
+/**
+* @brief Half duplex write
+*/
+
+static int spidev_write(XSPIDEV* xspi, const uint8_t* data, unsigned len)
+{
+    int ret;
+
+    if( (ret = write(xspi->fd, data, len)) < 0 )
+	return -errno;
+
+    return ret;
+}
+
+/**
+* @brief Half duplex read
+*/
+
+static int spidev_read(XSPIDEV* xspi, uint8_t* data, unsigned len)
+{
+    int ret;
+
+    if( (ret = read(xspi->fd, data, len)) < 0 )
+	return -errno;
+
+    return ret;
+}
+
+const SPI_TRANSPORT spi_transport_spidev = {
+    .name = "spidev",
+    .open = spidev_open,
+    .close = spidev_close,
+    .config = spidev_config,
+    .message = spidev_message,
+    .write = spidev_write,
+    .read = spidev_read,
+};
+
+/* --- Transport selection --- */
+
+/**
+* @brief Selects the transport of the devices initialized from now on
+*
+* @param transport Transport to use ( e.g. spi_transport_spidev, spi_transport_sim )
+* @return 0 on success. Otherwise error. 
+*
+* Devices already initialized keep theirs. If none is selected, the first spi_init() picks: the replay transport 
+* when ROBOTLIB_SPIREPLAY=<file> is set, the simulated one when ROBOTLIB_SPISIM is set and spidev otherwise, 
+* recorded into ROBOTLIB_SPIREC=<file> when that is set ( see xspidev_sim.h ).
+*
+* @note This function is \b NOT thread-safe. The user should guarantee somewhere else that is not called in several instances
+*       for the same resource. 
+*
+*/
+
+int spi_set_transport(const SPI_TRANSPORT* transport)
+{
+    if( transport == NULL )
+	return -EINVAL;
+
+    spi_transport = transport;
+
+    return 0;
+}
+
+/**
+* @brief Returns the selected transport ( NULL if none has been selected yet )
+*/
+
+const SPI_TRANSPORT* spi_get_transport()
+{
+    return spi_transport;
+}
+
+/**
+* @brief Chooses the default transport from the environment
+*/
+
+static int spi_default_transport()
+{
+    const SPI_TRANSPORT* inner;
+    const char* env;
+    int err;
+
+    if( (env = getenv("ROBOTLIB_SPIREPLAY")) != NULL )
+	return spi_replay_start(env);
+
+    inner = getenv("ROBOTLIB_SPISIM") != NULL ? &spi_transport_sim : &spi_transport_spidev;
+
+    if( (env = getenv("ROBOTLIB_SPIREC")) != NULL ){
+	if( (err = spi_record_start(env, inner)) < 0 )
+	    return err;
+	return 0;
+    }
+
+    spi_transport = inner;
+
+    return 0;
+}
+
+/**
+* @brief Writes the configuration through the transport
+*
+* @note Called with the mutex held, or before it exists
+*/
+
+static int spi_write_config(XSPIDEV* xspi)
+{
+    int err;
+
+    if( (err = xspi->transport->config(xspi)) < 0 )
+	return err;
+
     util_pdbg(DBG_DEBG, "SPI: mode: %d\n", xspi->mode);
     util_pdbg(DBG_DEBG, "SPI: bits per word: %d\n", xspi->bits);
     util_pdbg(DBG_DEBG, "SPI: max speed: %d Hz (%d KHz)\n", xspi->speed, xspi->speed/1000);
+
+    xspi->applied_gen = xspi->config_gen;
     
     return 0;
 }
 
+/**
+* @brief Opens the SPI device and applies its config
+*
+* @param spi SPI device to use ( with SPIDEV support ) 
+* @return 0 on success. Otherwise error. 
+*
+* @note This function is \b NOT thread-safe. The user should guarantee somewhere else that is not called in several instances
+*       for the same resource. 
+*
+*/
+
+static int spi_set_config(XSPIDEV* xspi)
+{
+    int err;
+
+    if( (err = xspi->transport->open(xspi)) < 0 ) 
+        return err;
+
+    if( (err = spi_write_config(xspi)) < 0 ){
+	xspi->transport->close(xspi);
+	return err;
+    }
+
+    return 0;
+}
+
+/**
+* @brief Writes the configuration if it changed since it was last applied. Called with the mutex held
+*/
+
+static inline int spi_sync_config(XSPIDEV* xspi)
+{
+    if( xspi->applied_gen == xspi->config_gen )
+	return 0;
+
+    return spi_write_config(xspi);
+}
+
 /**
 * @brief Initializes a SPI Device
 *
@@ -137,9 +341,15 @@ int spi_init(	XSPIDEV* xspi, // STRUCT TO CONFIGURE
         return -ENODEV; 
 
     strncpy(xspi->device, devname, DEVBUFFERSIZE) ;
-    
-    if( (xspi->fd = open(xspi->device, O_RDWR)) == 0) 
-        return -EBUSY; //cannot open device
+
+    if( spi_transport == NULL && (err = spi_default_transport()) < 0 )
+	return err;
+
+    xspi->transport = spi_transport;
+    xspi->priv = NULL;
+    xspi->fd = -1;
+    xspi->mode = 0;
+    memset(&(xspi->tr), 0, sizeof(xspi->tr)); // fields the transfers leave alone stay 0 ( cs_change, nbits, pad )
 
     xspi->speed = speed ? speed : SPI_DEFAULT_SPEED ;
     xspi->delay = delay ? delay : SPI_DEFAULT_DELAY ;
@@ -158,9 +368,30 @@ int spi_init(	XSPIDEV* xspi, // STRUCT TO CONFIGURE
     if( spi_3wire > 0 ) 
         xspi->mode |= SPI_3WIRE ;
 
-    UTIL_MUTEX_CREATE("SPI",&(xspi->mutex), NULL);
+    // Transfer pool. Touched once here, so acquisition never faults it in
+    if( posix_memalign((void**)&(xspi->pool), SPI_CACHE_LINE, SPI_POOL_SLOTS * sizeof(SPI_XFER)) != 0 ){
+	util_pdbg(DBG_WARN, "SPI: Cannot allocate the transfer pool of %s\n", xspi->device);
+	return -ENOMEM;
+    }
+    memset(xspi->pool, 0, SPI_POOL_SLOTS * sizeof(SPI_XFER));
+    xspi->pool_used = 0;
+    xspi->config_gen = xspi->applied_gen = 0;
+    xspi->bus = NULL;
+
+    UTIL_MUTEX_CREATE_TAG("SPI",&(xspi->mutex), NULL, pool_free);
+
+    if( (err = spi_set_config(xspi)) < 0 )
+	goto mutex_delete;
+
+    return 0;     
 
-    return spi_set_config(xspi);     
+mutex_delete:
+    rt_mutex_delete(&(xspi->mutex));
+pool_free:
+    free(xspi->pool);
+    xspi->pool = NULL;
+
+    return err;
 }
 
 /**
@@ -180,11 +411,40 @@ int spi_clean(XSPIDEV* xspi)
 {
     int err; 
     
+    if( xspi->pool_used != 0 )
+	util_pdbg(DBG_WARN, "SPI: %s cleaned with transfer slots in use\n", xspi->device);
+
     UTIL_MUTEX_DELETE("SPI", &(xspi->mutex));
+
+    xspi->transport->close(xspi);
+
+    free(xspi->pool);
+    xspi->pool = NULL;
     
     return 0; 
 }
 
+/**
+* @brief Runs a single transfer through the bus arbiter of the device
+*
+* @return Bytes transferred. Otherwise error
+*/
+
+static int spi_bus_single(XSPIDEV* xspi, const uint8_t* tx, uint8_t* rx, int len, uint16_t delay_us)
+{
+    SPI_BATCH batch;
+    int ret;
+
+    batch.num_of = 0;
+    if( (ret = spi_batch_add(&batch, tx, rx, len, delay_us, 0)) < 0 )
+	return ret;
+
+    if( (ret = spi_bus_transfer(xspi, &batch, xspi->bus_prio, 0)) < 0 )
+	return ret;
+
+    return len;
+}
+
 /**
 * @brief Full duplex transfer for SPI Device
 *
@@ -194,7 +454,8 @@ int spi_clean(XSPIDEV* xspi)
 * @param len Length of the arrays
 * @return 0 on success. Otherwise error. 
 *
-* Full duplex tx/rx
+* Full duplex tx/rx. The descriptor lives in the device: nothing is built on the stack. On a device attached to a 
+* bus arbiter the transfer is queued there like a batch, at the priority of the device.
 *
 * @note No sanity check over the arrays. Should be checked externally.
 *
@@ -205,26 +466,33 @@ int spi_clean(XSPIDEV* xspi)
 
 int spi_full_transfer(XSPIDEV* xspi, uint8_t* tx, uint8_t* rx, int len)
 {
-    int err;
+    int err, ret;
+
+    if( xspi->bus != NULL ){
+	if( (ret = spi_bus_single(xspi, tx, rx, len, xspi->delay)) < 0 ){
+	    util_pdbg(DBG_WARN,"SPI: Can't send spi message. Error %d\n", ret);
+	    return -EIO; 
+	}
+	return 0;
+    }
 
-    struct spi_ioc_transfer tr = {
-	.tx_buf = (unsigned long)tx,
-	.rx_buf = (unsigned long)rx,
-	//.len = ARRAY_SIZE(tx),
-	.len = len,
-	.delay_usecs = xspi->delay,
-	.speed_hz = xspi->speed,
-	.bits_per_word = xspi->bits,
-    };	
-    
     UTIL_MUTEX_ACQUIRE("SPI",&(xspi->mutex),TM_INFINITE);
+
+    xspi->tr.tx_buf = (unsigned long)tx;
+    xspi->tr.rx_buf = (unsigned long)rx;
+    xspi->tr.len = len;
+    xspi->tr.delay_usecs = xspi->delay;
     
-    err = ioctl(xspi->fd, SPI_IOC_MESSAGE(1), &tr);
+    if( (ret = spi_sync_config(xspi)) == 0 ){
+	xspi->tr.speed_hz = xspi->speed;
+	xspi->tr.bits_per_word = xspi->bits;
+	ret = xspi->transport->message(xspi, &(xspi->tr), 1);
+    }
        
     UTIL_MUTEX_RELEASE("SPI",&(xspi->mutex));
     
-    if ( err == 1){
-	util_pdbg(DBG_WARN,"SPI: Can't send spi message. Error %d", err);
+    if ( ret < 0 ){
+	util_pdbg(DBG_WARN,"SPI: Can't send spi message. Error %d\n", ret);
 	return -EIO; 
     }
     
@@ -249,7 +517,7 @@ int spi_full_transfer(XSPIDEV* xspi, uint8_t* tx, uint8_t* rx, int len)
 *
 * @note No sanity check over the arrays. Should be checked externally.
 *
-* Half dupplex transfer
+* Half dupplex transfer. On a device attached to a bus arbiter it is queued there as a message without reception
 *
 * @note This function is \b thread-safe.
 * @note This function is \b blocking.
@@ -258,20 +526,25 @@ int spi_full_transfer(XSPIDEV* xspi, uint8_t* tx, uint8_t* rx, int len)
 
 int spi_half_transfer( XSPIDEV* xspi, uint8_t* data, int len ) 
 {
-    int err; 
+    int err, ret; 
     
-    UTIL_MUTEX_ACQUIRE("SPI",&(xspi->mutex),TM_INFINITE);
+    if( xspi->bus != NULL )
+	ret = spi_bus_single(xspi, data, NULL, len, 0);
+    else{
+	UTIL_MUTEX_ACQUIRE("SPI",&(xspi->mutex),TM_INFINITE);
     
-    err = write( xspi->fd, data , len );
+	if( (ret = spi_sync_config(xspi)) == 0 )
+	    ret = xspi->transport->write(xspi, data, len);
     
-    UTIL_MUTEX_RELEASE("SPI",&(xspi->mutex));
+	UTIL_MUTEX_RELEASE("SPI",&(xspi->mutex));
+    }
     
-    if( err < 0 ){
+    if( ret < 0 ){
 	util_pdbg(DBG_WARN, "SPI: Error writing to device %s\n",xspi->device); 
 	return -EIO;
     }
     
-    return err; // written bytes
+    return ret; // written bytes
 }
 
 /**
@@ -284,7 +557,7 @@ int spi_half_transfer( XSPIDEV* xspi, uint8_t* data, int len )
 *
 * @note No sanity check over the size of the array. Should be checked externally.
 *
-* Half dupplex reception
+* Half dupplex reception. On a device attached to a bus arbiter it is queued there as a message sending zeros
 *
 * @note This function is \b thread-safe.
 * @note This function is \b blocking.
@@ -293,18 +566,710 @@ int spi_half_transfer( XSPIDEV* xspi, uint8_t* data, int len )
 
 int spi_half_read( XSPIDEV* xspi , uint8_t* data, int len ) 
 {
-    int err; 
+    int err, ret; 
     
-    UTIL_MUTEX_ACQUIRE("SPI",&(xspi->mutex),TM_INFINITE);
+    if( xspi->bus != NULL )
+	ret = spi_bus_single(xspi, NULL, data, len, 0);
+    else{
+	UTIL_MUTEX_ACQUIRE("SPI",&(xspi->mutex),TM_INFINITE);
     
-    err = read( xspi->fd, data , len ); 
+	if( (ret = spi_sync_config(xspi)) == 0 )
+	    ret = xspi->transport->read(xspi, data, len); 
     
-    UTIL_MUTEX_RELEASE("SPI",&(xspi->mutex));
+	UTIL_MUTEX_RELEASE("SPI",&(xspi->mutex));
+    }
     
-    if ( err < 0 ){
+    if ( ret < 0 ){
 	util_pdbg(DBG_WARN, "SPI: Error reading from %s\n",xspi->device); 
 	return -EIO;
     }    
     
-    return err; // read bytes
+    return ret; // read bytes
+}
+
+/**
+* @brief Empties a transfer batch
+*
+* @param batch Batch to reset
+*
+* @note This function is \b NOT thread-safe. Batches are owned by their caller
+*
+*/
+
+void spi_batch_init(SPI_BATCH* batch)
+{
+    memset(batch, 0, sizeof(SPI_BATCH));
+}
+
+/**
+* @brief Appends a segment to a transfer batch
+*
+* @param batch Batch to append to
+* @param tx Bytes to send, len long. NULL clocks out zeros
+* @param rx Buffer for the received bytes, len long. NULL discards them
+* @param len Length of the segment in bytes
+* @param delay_us Delay after the segment, before the next one starts or CS changes
+* @param cs_change Deselect the chip after this segment ( before the next one ). On the last segment, leave it selected
+* @return 0 on success. -ENOSPC if the batch is full. -EINVAL on an empty segment
+*
+* The delay is a busy wait in the SPI driver: meant for conversion times of some us, not for sleeping.
+*
+* @note This function is \b NOT thread-safe. Batches are owned by their caller
+*
+*/
+
+int spi_batch_add(SPI_BATCH* batch, const uint8_t* tx, uint8_t* rx, unsigned len, uint16_t delay_us, int cs_change)
+{
+    struct spi_ioc_transfer* tr;
+
+    if( len == 0 )
+	return -EINVAL;
+
+    if( batch->num_of >= SPI_BATCH_MAX_SEGMENTS )
+	return -ENOSPC;
+
+    tr = &(batch->seg[batch->num_of++]);
+    memset(tr, 0, sizeof(struct spi_ioc_transfer));
+    tr->tx_buf = (unsigned long)tx;
+    tr->rx_buf = (unsigned long)rx;
+    tr->len = len;
+    tr->delay_usecs = delay_us;
+    tr->cs_change = cs_change ? 1 : 0;
+
+    return 0;
+}
+
+/**
+* @brief Writes pending configuration changes and runs a batch on the device
+*
+* @note This function is \b thread-safe.
+* @note This function is \b blocking.
+*
+*/
+
+static int spi_batch_submit(XSPIDEV* xspi, SPI_BATCH* batch)
+{
+    unsigned i;
+    int err, ret;
+
+    UTIL_MUTEX_ACQUIRE("SPI",&(xspi->mutex),TM_INFINITE);
+
+    if( (ret = spi_sync_config(xspi)) < 0 ){
+	UTIL_MUTEX_RELEASE("SPI",&(xspi->mutex));
+	util_pdbg(DBG_WARN,"SPI: Can't reconfigure %s. Error %d\n", xspi->device, ret);
+	return ret;
+    }
+
+    for( i = 0 ; i < batch->num_of ; i++ ){
+	batch->seg[i].speed_hz = xspi->speed;
+	batch->seg[i].bits_per_word = xspi->bits;
+    }
+    
+    ret = xspi->transport->message(xspi, batch->seg, batch->num_of);
+       
+    UTIL_MUTEX_RELEASE("SPI",&(xspi->mutex));
+    
+    if( ret < 0 ){
+	util_pdbg(DBG_WARN,"SPI: Can't send %u segment message to %s. Error %d\n", batch->num_of, xspi->device, ret);
+	return -EIO; 
+    }
+
+    return 0;
+}
+
+/**
+* @brief Submits a transfer batch
+*
+* @param xspi SPI device
+* @param batch Segments to transfer
+* @return 0 on success. Otherwise error. 
+*
+* All the segments go to the kernel in a single SPI_IOC_MESSAGE(n) ioctl, with the speed and word size of the device:
+* one syscall and no wake-ups between them. The batch is left as it is and can be submitted again.
+*
+* If the device is attached to a bus arbiter ( spi_bus_attach() ) the batch is queued there at the priority of the 
+* device and this call waits for its turn.
+*
+* @note No sanity check over the buffers. Should be checked externally.
+*
+* @note This function is \b thread-safe.
+* @note This function is \b blocking.
+*
+*/
+
+int spi_batch_transfer(XSPIDEV* xspi, SPI_BATCH* batch)
+{
+    if( batch->num_of == 0 )
+	return -EINVAL;
+
+    if( xspi->bus != NULL )
+	return spi_bus_transfer(xspi, batch, xspi->bus_prio, 0);
+
+    return spi_batch_submit(xspi, batch);
+}
+
+/**
+* @brief Takes a transfer slot from the pool of the device
+*
+* @param xspi SPI device
+* @param xfer Slot handed out. Its buffers are cache aligned and SPI_POOL_BUFFER_SIZE long
+* @return 0 on success. -EBUSY if every slot is taken
+*
+* Slots are meant to be taken once, when a driver is initialized, and kept: a transfer built over the slot
+* buffers can be submitted every cycle with stable addresses and no allocation. The slot keeps its contents.
+*
+* @note This function is \b thread-safe.
+* @note This function is \b blocking.
+*
+*/
+
+int spi_pool_get(XSPIDEV* xspi, SPI_XFER** xfer)
+{
+    unsigned i;
+    int err;
+
+    UTIL_MUTEX_ACQUIRE("SPI",&(xspi->mutex),TM_INFINITE);
+
+    for( i = 0 ; i < SPI_POOL_SLOTS && (xspi->pool_used & (1 << i)) ; i++ )
+	;
+
+    if( i < SPI_POOL_SLOTS )
+	xspi->pool_used |= 1 << i;
+
+    UTIL_MUTEX_RELEASE("SPI",&(xspi->mutex));
+
+    if( i == SPI_POOL_SLOTS ){
+	util_pdbg(DBG_WARN, "SPI: No free transfer slots in %s\n", xspi->device);
+	return -EBUSY;
+    }
+
+    *xfer = &(xspi->pool[i]);
+
+    return 0;
+}
+
+/**
+* @brief Returns a transfer slot to the pool of the device
+*
+* @param xspi SPI device
+* @param xfer Slot taken with spi_pool_get()
+* @return 0 on success. -EINVAL if the slot does not belong to the device
+*
+* @note This function is \b thread-safe.
+* @note This function is \b blocking.
+*
+*/
+
+int spi_pool_put(XSPIDEV* xspi, SPI_XFER* xfer)
+{
+    unsigned i = xfer - xspi->pool;
+    int err;
+
+    if( xfer < xspi->pool || i >= SPI_POOL_SLOTS )
+	return -EINVAL;
+
+    UTIL_MUTEX_ACQUIRE("SPI",&(xspi->mutex),TM_INFINITE);
+
+    xspi->pool_used &= ~(1 << i);
+
+    UTIL_MUTEX_RELEASE("SPI",&(xspi->mutex));
+
+    return 0;
+}
+
+/**
+* @brief Changes the SPI mode of a device
+*
+* @param xspi SPI device
+* @param mode SPI_MODE_* / SPI_CS_HIGH / ... flags as in linux/spi/spidev.h
+* @return 0 on success. Otherwise error. 
+*
+* The mode is written to the driver right before the next transfer of the device, so a change never delays 
+* a transfer of another device on the same bus.
+*
+* @note This function is \b thread-safe.
+* @note This function is \b blocking.
+*
+*/
+
+int spi_set_mode(XSPIDEV* xspi, uint8_t mode)
+{
+    int err;
+
+    UTIL_MUTEX_ACQUIRE("SPI",&(xspi->mutex),TM_INFINITE);
+
+    if( xspi->mode != mode ){
+	xspi->mode = mode;
+	xspi->config_gen++;
+    }
+
+    UTIL_MUTEX_RELEASE("SPI",&(xspi->mutex));
+
+    return 0;
+}
+
+/**
+* @brief Changes the clock of a device
+*
+* @param xspi SPI device
+* @param speed Clock in Hz. 0 for SPI_DEFAULT_SPEED
+* @return 0 on success. Otherwise error. 
+*
+* As spi_set_mode(): applied before the next transfer of the device.
+*
+* @note This function is \b thread-safe.
+* @note This function is \b blocking.
+*
+*/
+
+int spi_set_speed(XSPIDEV* xspi, uint32_t speed)
+{
+    int err;
+
+    if( speed == 0 )
+	speed = SPI_DEFAULT_SPEED;
+
+    UTIL_MUTEX_ACQUIRE("SPI",&(xspi->mutex),TM_INFINITE);
+
+    if( xspi->speed != speed ){
+	xspi->speed = speed;
+	xspi->config_gen++;
+    }
+
+    UTIL_MUTEX_RELEASE("SPI",&(xspi->mutex));
+
+    return 0;
+}
+
+/**
+* @brief Next request to run: highest priority, then earliest deadline, then first come. Called with the bus mutex held
+*/
+
+static SPI_BUS_REQ* spi_bus_pick(SPI_BUS* bus)
+{
+    SPI_BUS_REQ *r, *best = NULL;
+    unsigned i;
+
+    for( i = 0 ; i < SPI_BUS_QUEUE_LEN ; i++ ){
+	r = &(bus->queue[i]);
+	if( r->state != SPI_BUS_REQ_PENDING )
+	    continue;
+
+	if( best == NULL || r->prio > best->prio )
+	    best = r;
+	else if( r->prio == best->prio ){
+	    if( r->deadline != best->deadline ){
+		// No deadline goes last
+		if( best->deadline == 0 || (r->deadline != 0 && r->deadline < best->deadline) )
+		    best = r;
+	    }else if( r->seq < best->seq )
+		best = r;
+	}
+    }
+
+    return best;
+}
+
+/**
+* @brief Bus owner task. Runs the queued requests one at a time
+*/
+
+static void spi_bus_task(void* cookie)
+{
+    SPI_BUS* bus = (SPI_BUS*)cookie;
+    SPI_BUS_REQ* req;
+    SPI_BUS_STATS* st;
+    RTIME now, wait, start, busy;
+    int err, ret;
+
+    for(;;){
+	if( (err = rt_sem_p(&(bus->work), TM_INFINITE)) < 0 ){
+	    util_pdbg(DBG_WARN, "SPI: Bus task cannot wait for work. Error:%d\n", err);
+	    return;
+	}
+
+	if( (err = rt_mutex_acquire(&(bus->mutex), TM_INFINITE)) < 0 ){
+	    util_pdbg(DBG_WARN, "SPI: Bus task cannot acquire the mutex. Error:%d\n", err);
+	    return;
+	}
+
+	if( !bus->running ){
+	    rt_mutex_release(&(bus->mutex));
+	    return;
+	}
+
+	if( (req = spi_bus_pick(bus)) == NULL ){
+	    rt_mutex_release(&(bus->mutex));
+	    continue;
+	}
+
+	st = &(req->xspi->bus_stats);
+	now = rt_timer_read();
+
+	if( req->deadline != 0 && now > req->deadline ){
+	    // Too late to be of any use: the bus goes to the next one
+	    st->missed++;
+	    req->result = -ETIMEDOUT;
+	}else{
+	    req->state = SPI_BUS_REQ_RUNNING;
+	    if( bus->owner != req->xspi ){
+		st->switches++;
+		bus->owner = req->xspi;
+	    }
+
+	    rt_mutex_release(&(bus->mutex));
+
+	    start = rt_timer_tsc();
+	    ret = spi_batch_submit(req->xspi, req->batch);
+	    busy = rt_timer_tsc2ns(rt_timer_tsc() - start);
+
+	    if( (err = rt_mutex_acquire(&(bus->mutex), TM_INFINITE)) < 0 ){
+		util_pdbg(DBG_WARN, "SPI: Bus task cannot acquire the mutex. Error:%d\n", err);
+		req->result = ret;
+		req->state = SPI_BUS_REQ_DONE;
+		rt_sem_v(&(req->done));
+		return;
+	    }
+
+	    wait = now - req->queued;
+	    st->transfers++;
+	    st->busy_ns += busy;
+	    st->wait_ns += wait;
+	    if( wait > st->max_wait_ns )
+		st->max_wait_ns = wait;
+	    req->result = ret;
+	}
+
+	req->state = SPI_BUS_REQ_DONE;
+
+	rt_mutex_release(&(bus->mutex));
+
+	rt_sem_v(&(req->done));
+    }
+}
+
+/**
+* @brief Takes back a request whose caller stopped waiting for it
+*
+* @param bus Arbiter
+* @param req Queued request
+* @return 0 once the bus task no longer uses the entry. Otherwise error and the entry must not be reused
+*
+* A pending request is cancelled. A running or finished one still gets its done signal from the bus task ( or from
+* spi_bus_clean() ), which is consumed here so that it does not wake the next user of the entry.
+*/
+
+static int spi_bus_withdraw(SPI_BUS* bus, SPI_BUS_REQ* req)
+{
+    int err;
+
+    if( (err = rt_mutex_acquire(&(bus->mutex), TM_INFINITE)) < 0 )
+	return err;
+
+    if( req->state == SPI_BUS_REQ_PENDING ){
+	req->state = SPI_BUS_REQ_FREE;
+	rt_mutex_release(&(bus->mutex));
+	return 0;
+    }
+
+    rt_mutex_release(&(bus->mutex));
+
+    while( (err = rt_sem_p(&(req->done), TM_INFINITE)) == -EINTR )
+	;
+
+    return err;
+}
+
+/**
+* @brief Initializes a bus arbiter
+*
+* @param bus Arbiter for one SPI controller
+* @param prio Priority of the bus owner task. At least the one of the highest priority client
+* @return 0 on success. Otherwise error. 
+*
+* Devices ( chip selects ) of the controller are then attached with spi_bus_attach(). Their transfers are queued and 
+* executed one at a time by the owner task, highest priority first: a long transfer of a low priority device delays 
+* a high priority one by at most that transfer, never by its whole queue.
+*
+* @note This function is \b NOT thread-safe. The user should guarantee somewhere else that is not called in several instances
+*       for the same resource. 
+*
+*/
+
+int spi_bus_init(SPI_BUS* bus, int prio)
+{
+    int err, i = 0;
+
+    memset(bus, 0, sizeof(SPI_BUS));
+
+    UTIL_MUTEX_CREATE("SPI",&(bus->mutex), NULL);
+
+    if( (err = rt_sem_create(&(bus->work), NULL, 0, S_PRIO)) < 0 ){
+	util_pdbg(DBG_WARN, "SPI: Error rt_sem_create: %d\n", err);
+	goto mutex_delete;
+    }
+
+    if( (err = rt_sem_create(&(bus->slots), NULL, SPI_BUS_QUEUE_LEN, S_PRIO)) < 0 ){
+	util_pdbg(DBG_WARN, "SPI: Error rt_sem_create: %d\n", err);
+	goto work_delete;
+    }
+
+    for( i = 0 ; i < SPI_BUS_QUEUE_LEN ; i++ )
+	if( (err = rt_sem_create(&(bus->queue[i].done), NULL, 0, S_FIFO)) < 0 ){
+	    util_pdbg(DBG_WARN, "SPI: Error rt_sem_create: %d\n", err);
+	    goto done_delete;
+	}
+
+    bus->running = 1;
+
+    if( (err = rt_task_spawn(&(bus->task), "SPIBUS", SPI_BUS_STACK_SIZE, prio, T_JOINABLE, &spi_bus_task, bus)) < 0 ){
+	util_pdbg(DBG_WARN, "SPI: Cannot spawn the bus task. Error:%d\n", err);
+	bus->running = 0;
+	goto done_delete;
+    }
+
+    return 0;
+
+done_delete:
+    while( i-- > 0 )
+	rt_sem_delete(&(bus->queue[i].done));
+    rt_sem_delete(&(bus->slots));
+work_delete:
+    rt_sem_delete(&(bus->work));
+mutex_delete:
+    rt_mutex_delete(&(bus->mutex));
+
+    return err;
+}
+
+/**
+* @brief Stops a bus arbiter
+*
+* @param bus Arbiter
+* @return 0 on success. Otherwise error. 
+*
+* Requests still queued complete with -EPIPE. Devices are left attached: detach them, or stop their users, first.
+*
+* @note This function is \b NOT thread-safe. The user should guarantee somewhere else that is not called in several instances
+*       for the same resource. 
+*
+*/
+
+int spi_bus_clean(SPI_BUS* bus)
+{
+    unsigned i;
+    int err;
+
+    UTIL_MUTEX_ACQUIRE("SPI",&(bus->mutex),TM_INFINITE);
+    bus->running = 0;
+    UTIL_MUTEX_RELEASE("SPI",&(bus->mutex));
+
+    rt_sem_v(&(bus->work));
+    rt_task_join(&(bus->task));
+
+    UTIL_MUTEX_ACQUIRE("SPI",&(bus->mutex),TM_INFINITE);
+
+    for( i = 0 ; i < SPI_BUS_QUEUE_LEN ; i++ )
+	if( bus->queue[i].state == SPI_BUS_REQ_PENDING ){
+	    bus->queue[i].result = -EPIPE;
+	    bus->queue[i].state = SPI_BUS_REQ_DONE;
+	    rt_sem_v(&(bus->queue[i].done));
+	}
+
+    UTIL_MUTEX_RELEASE("SPI",&(bus->mutex));
+
+    for( i = 0 ; i < SPI_BUS_QUEUE_LEN ; i++ )
+	rt_sem_delete(&(bus->queue[i].done));
+    rt_sem_delete(&(bus->slots));
+    rt_sem_delete(&(bus->work));
+
+    UTIL_MUTEX_DELETE("SPI",&(bus->mutex));
+
+    return 0;
+}
+
+/**
+* @brief Attaches a device to a bus arbiter
+*
+* @param bus Arbiter of the controller of the device
+* @param prio Priority of its transfers ( spi_batch_transfer(), spi_full_transfer(), spi_half_*() ). Higher first
+* @param prio Priority of its spi_batch_transfer() calls. Higher first
+* @return 0 on success. Otherwise error. 
+*
+* Resets the bus statistics of the device.
+*
+* @note This function is \b thread-safe.
+* @note This function is \b blocking.
+*
+*/
+
+int spi_bus_attach(SPI_BUS* bus, XSPIDEV* xspi, int prio)
+{
+    int err;
+
+    UTIL_MUTEX_ACQUIRE("SPI",&(bus->mutex),TM_INFINITE);
+
+    memset(&(xspi->bus_stats), 0, sizeof(SPI_BUS_STATS));
+    xspi->bus_stats.since_ns = rt_timer_read();
+    xspi->bus_prio = prio;
+    xspi->bus = bus;
+
+    UTIL_MUTEX_RELEASE("SPI",&(bus->mutex));
+
+    return 0;
+}
+
+/**
+* @brief Detaches a device from its bus arbiter
+*
+* @param xspi SPI device
+* @return 0 on success. Otherwise error. 
+*
+* Transfers of the device go straight to the driver again. The caller must not have transfers in flight.
+*
+* @note This function is \b thread-safe.
+* @note This function is \b blocking.
+*
+*/
+
+int spi_bus_detach(XSPIDEV* xspi)
+{
+    SPI_BUS* bus = xspi->bus;
+    int err;
+
+    if( bus == NULL )
+	return 0;
+
+    UTIL_MUTEX_ACQUIRE("SPI",&(bus->mutex),TM_INFINITE);
+
+    if( bus->owner == xspi )
+	bus->owner = NULL;
+    xspi->bus = NULL;
+
+    UTIL_MUTEX_RELEASE("SPI",&(bus->mutex));
+
+    return 0;
+}
+
+/**
+* @brief Queues a batch on the bus of a device and waits for it
+*
+* @param xspi SPI device, attached to a bus
+* @param batch Segments to transfer. Must stay valid until the call returns
+* @param prio Priority of this request. Higher first
+* @param deadline_ns Time from now after which the transfer is useless and dropped. 0 for none
+* @return 0 on success. -ETIMEDOUT if dropped at its deadline. -ENODEV if the device is not attached. Otherwise error
+*
+* Requests of the same priority run earliest deadline first, then in arrival order. The transfer itself is not 
+* preempted: the wait of a request is bounded by the longest transfer already on the bus plus the ones ahead of it.
+* If the wait fails ( e.g. rt_task_unblock() ) a request still queued is cancelled and one already on the bus is
+* waited for, then the error is returned.
+*
+* @note This function is \b thread-safe.
+* @note This function is \b blocking.
+*
+*/
+
+int spi_bus_transfer(XSPIDEV* xspi, SPI_BATCH* batch, int prio, RTIME deadline_ns)
+{
+    SPI_BUS* bus = xspi->bus;
+    SPI_BUS_REQ* req = NULL;
+    unsigned i;
+    int err, ret;
+
+    if( bus == NULL )
+	return -ENODEV;
+
+    if( batch->num_of == 0 )
+	return -EINVAL;
+
+    if( (err = rt_sem_p(&(bus->slots), TM_INFINITE)) < 0 )
+	return err;
+
+    if( (err = rt_mutex_acquire(&(bus->mutex), TM_INFINITE)) < 0 ){
+	rt_sem_v(&(bus->slots));
+	return err;
+    }
+
+    if( !bus->running ){
+	rt_mutex_release(&(bus->mutex));
+	rt_sem_v(&(bus->slots));
+	return -EPIPE;
+    }
+
+    // There is a free entry: one was counted for us
+    for( i = 0 ; i < SPI_BUS_QUEUE_LEN ; i++ )
+	if( bus->queue[i].state == SPI_BUS_REQ_FREE ){
+	    req = &(bus->queue[i]);
+	    break;
+	}
+
+    req->xspi = xspi;
+    req->batch = batch;
+    req->prio = prio;
+    req->queued = rt_timer_read();
+    req->deadline = deadline_ns ? req->queued + deadline_ns : 0;
+    req->seq = bus->seq++;
+    req->result = 0;
+    req->state = SPI_BUS_REQ_PENDING;
+
+    rt_mutex_release(&(bus->mutex));
+
+    rt_sem_v(&(bus->work));
+
+    if( (err = rt_sem_p(&(req->done), TM_INFINITE)) == 0 )
+	err = req->result;
+    else if( (ret = spi_bus_withdraw(bus, req)) < 0 ){
+	util_pdbg(DBG_WARN, "SPI: Bus entry lost. Error:%d\n", ret);
+	return err;
+    }
+
+    if( rt_mutex_acquire(&(bus->mutex), TM_INFINITE) == 0 ){
+	req->state = SPI_BUS_REQ_FREE;
+	rt_mutex_release(&(bus->mutex));
+    }
+
+    rt_sem_v(&(bus->slots));
+
+    return err;
+}
+
+/**
+* @brief Bus statistics of a device
+*
+* @param xspi SPI device, attached to a bus
+* @param stats Copy of the statistics, with the occupancy over the window computed
+* @param reset Start a new window after reading
+* @return 0 on success. -ENODEV if the device is not attached. Otherwise error
+*
+* @note This function is \b thread-safe.
+* @note This function is \b blocking.
+*
+*/
+
+int spi_bus_get_stats(XSPIDEV* xspi, SPI_BUS_STATS* stats, int reset)
+{
+    SPI_BUS* bus = xspi->bus;
+    RTIME now, window;
+    int err;
+
+    if( bus == NULL )
+	return -ENODEV;
+
+    UTIL_MUTEX_ACQUIRE("SPI",&(bus->mutex),TM_INFINITE);
+
+    now = rt_timer_read();
+    *stats = xspi->bus_stats;
+
+    if( reset ){
+	memset(&(xspi->bus_stats), 0, sizeof(SPI_BUS_STATS));
+	xspi->bus_stats.since_ns = now;
+    }
+
+    UTIL_MUTEX_RELEASE("SPI",&(bus->mutex));
+
+    window = now - stats->since_ns;
+    stats->occupancy = window ? (unsigned)((stats->busy_ns * 1000) / window) : 0;
+
+    return 0;
 }
@@ -12,7 +12,11 @@
 #ifndef __SPIDEV_H__
 #define __SPIDEV_H__
 
+#include <stdint.h>
+#include <linux/spi/spidev.h>
 #include <native/mutex.h>
+#include <native/sem.h>
+#include <native/task.h>
 
 #define SPI_DEFAULT_SPEED 500000
 //TODO: IS THIS DELAY CORRECT?
@@ -21,16 +25,111 @@
 
 #define DEVBUFFERSIZE 25
 
+#define SPI_BATCH_MAX_SEGMENTS 8 /*! Segments in one SPI_IOC_MESSAGE */
+
+/* Transfer pool */
+#define SPI_CACHE_LINE 32 /*! PPC405 data cache line */
+#define SPI_POOL_SLOTS 4 /*! Preallocated transfer slots per device */
+#define SPI_POOL_BUFFER_SIZE 64 /*! Bytes per tx/rx buffer. Multiple of SPI_CACHE_LINE */
+
+/* Bus arbiter */
+#define SPI_BUS_QUEUE_LEN 16 /*! Requests queued at once on a bus */
+#define SPI_BUS_STACK_SIZE 8192 /*! Stack of the bus owner task */
+#define SPI_BUS_REQ_FREE 0 /*! Queue entry unused */
+#define SPI_BUS_REQ_PENDING 1 /*! Waiting for the bus */
+#define SPI_BUS_REQ_RUNNING 2 /*! On the bus */
+#define SPI_BUS_REQ_DONE 3 /*! Finished. result is valid */
+
+/*! Batch of transfer segments submitted in a single ioctl. CS stays asserted between segments unless cs_change is set */
+typedef struct {
+    struct spi_ioc_transfer seg[SPI_BATCH_MAX_SEGMENTS]; ///< Segments, in spidev format
+    unsigned num_of; ///< Segments in use
+} SPI_BATCH;
+
+/*! Pool slot: cache aligned buffers and a batch over them, kept by its owner across cycles */
+typedef struct {
+    uint8_t tx[SPI_POOL_BUFFER_SIZE] __attribute__((aligned(SPI_CACHE_LINE))); ///< Transmission buffer
+    uint8_t rx[SPI_POOL_BUFFER_SIZE] __attribute__((aligned(SPI_CACHE_LINE))); ///< Reception buffer
+    SPI_BATCH batch; ///< Descriptors. Usually built once over tx/rx and resubmitted
+} SPI_XFER;
+
+/*! Bus occupancy of one device */
+typedef struct {
+    unsigned long transfers; ///< Batches executed
+    unsigned long missed; ///< Requests dropped past their deadline
+    unsigned long switches; ///< Times the bus was handed over to this device from another one
+    RTIME busy_ns; ///< Time on the bus
+    RTIME wait_ns; ///< Time queued, summed over the transfers
+    RTIME max_wait_ns; ///< Longest time queued
+    RTIME since_ns; ///< Start of the statistics window
+    unsigned occupancy; ///< busy_ns over the window, per mille. Computed by spi_bus_get_stats()
+} SPI_BUS_STATS;
+
+struct spi_bus;
+struct spi_transport;
+
 typedef struct {
     char device[DEVBUFFERSIZE]; ///< File name of the device
+    const struct spi_transport* transport; ///< Where the transfers go. See SPI_TRANSPORT
+    void* priv; ///< Transport private data
     int fd; ///< File descriptor
     uint8_t mode; ///< SPI Mode
     uint8_t bits; ///< Number of bits at a time
     uint32_t speed; ///< SPI frequency speed
     uint16_t delay; ///< Communication delay
     RT_MUTEX mutex; ///< Xenomai Mutex
+    struct spi_ioc_transfer tr; ///< Descriptor of spi_full_transfer(). Protected by the mutex
+    SPI_XFER* pool; ///< Transfer slots, allocated once by spi_init()
+    unsigned pool_used; ///< Bitmap of the slots handed out. Protected by the mutex
+    unsigned config_gen; ///< Bumped by spi_set_mode() / spi_set_speed()
+    unsigned applied_gen; ///< Configuration generation written to the driver
+    struct spi_bus* bus; ///< Arbiter the batches go through. NULL for direct access
+    int bus_prio; ///< Priority of the transfers of the device on the bus
+    SPI_BUS_STATS bus_stats; ///< Occupancy. Protected by the bus mutex
 } XSPIDEV;
 
+/*! SPI transport. Every transfer of a device goes through the transport it was initialized with */
+typedef struct spi_transport {
+    const char* name; ///< Transport name (debugging)
+    int (*open)(XSPIDEV* xspi); ///< Opens xspi->device
+    int (*close)(XSPIDEV* xspi); ///< Releases what open() took
+    int (*config)(XSPIDEV* xspi); ///< Applies mode, bits and speed. May round them to what the device takes
+    int (*message)(XSPIDEV* xspi, struct spi_ioc_transfer* seg, unsigned num_of); ///< Full duplex segments. Bytes or <0
+    int (*write)(XSPIDEV* xspi, const uint8_t* data, unsigned len); ///< Half duplex write. Bytes or <0
+    int (*read)(XSPIDEV* xspi, uint8_t* data, unsigned len); ///< Half duplex read. Bytes or <0
+} SPI_TRANSPORT;
+
+extern const SPI_TRANSPORT spi_transport_spidev; ///< Real devices through spidev
+
+/*! Queued batch */
+typedef struct {
+    XSPIDEV* xspi; ///< Device to transfer with
+    SPI_BATCH* batch; ///< Segments
+    int prio; ///< Higher first
+    RTIME deadline; ///< Absolute time in ns after which the request is dropped. 0 for none
+    RTIME queued; ///< Time it was queued
+    unsigned long seq; ///< Arrival order, for requests of the same priority and deadline
+    int state; ///< SPI_BUS_REQ_*
+    int result; ///< Result of the transfer
+    RT_SEM done; ///< Signalled when state becomes SPI_BUS_REQ_DONE
+} SPI_BUS_REQ;
+
+/*! Arbiter for the devices ( chip selects ) of one SPI controller. A single task owns the bus and runs the queue */
+typedef struct spi_bus {
+    RT_MUTEX mutex; ///< Protects the queue and the statistics
+    RT_SEM work; ///< Counts pending requests
+    RT_SEM slots; ///< Counts free queue entries
+    RT_TASK task; ///< Bus owner
+    volatile int running; ///< Owner task running
+    SPI_BUS_REQ queue[SPI_BUS_QUEUE_LEN]; ///< Requests
+    unsigned long seq; ///< Next arrival number
+    XSPIDEV* owner; ///< Device of the last transfer
+} SPI_BUS;
+
+int spi_set_transport(const SPI_TRANSPORT* transport);
+
+const SPI_TRANSPORT* spi_get_transport();
+
 int spi_init(	XSPIDEV* xspi, 
 		const char* devname, // DEVICE NAME 
 		uint32_t speed, // SPEED IN HZ
@@ -51,4 +150,25 @@ int spi_half_transfer(XSPIDEV* xspi, uint8_t* data, int len);
 //read read only
 int spi_half_read(XSPIDEV* xspi , uint8_t* data, int len);
 
+/* Batched transfers: the segments are built once and can be resubmitted as they are */
+void spi_batch_init(SPI_BATCH* batch);
+int spi_batch_add(SPI_BATCH* batch, const uint8_t* tx, uint8_t* rx, unsigned len, uint16_t delay_us, int cs_change);
+int spi_batch_transfer(XSPIDEV* xspi, SPI_BATCH* batch);
+
+/* Transfer pool: slots are taken at driver init and reused, nothing is allocated while acquiring */
+int spi_pool_get(XSPIDEV* xspi, SPI_XFER** xfer);
+int spi_pool_put(XSPIDEV* xspi, SPI_XFER* xfer);
+
+/* Configuration changes. Written to the driver before the next transfer of the device */
+int spi_set_mode(XSPIDEV* xspi, uint8_t mode);
+int spi_set_speed(XSPIDEV* xspi, uint32_t speed);
+
+/* Bus arbiter: with a device attached, spi_batch_transfer() is queued on the bus at the device priority */
+int spi_bus_init(SPI_BUS* bus, int prio);
+int spi_bus_clean(SPI_BUS* bus);
+int spi_bus_attach(SPI_BUS* bus, XSPIDEV* xspi, int prio);
+int spi_bus_detach(XSPIDEV* xspi);
+int spi_bus_transfer(XSPIDEV* xspi, SPI_BATCH* batch, int prio, RTIME deadline_ns);
+int spi_bus_get_stats(XSPIDEV* xspi, SPI_BUS_STATS* stats, int reset);
+
 #endif
@@ -0,0 +1,897 @@
+/**
+    @file xspidev_sim.c
+
+    @section DESCRIPTION
+
+    Robotics library for the Autonomous Robotics Development Platform
+
+    @brief Simulated SPI devices and record/replay transports for running the SPI drivers off-board
+
+    @author Jorge Sánchez de Nova jssdn (mail)_(at) kth.se
+
+    @section LICENSE
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+    @version 0.4-Xenomai
+
+    @note The simulated transport runs the bytes of every transfer through the model attached to the device file.
+	  Time on the simulated bus ( bytes at the device clock and segment delays ) is virtual: nothing sleeps, so
+	  the software path can be measured on its own. The transports are selected with spi_set_transport() or from
+	  the environment: ROBOTLIB_SPISIM, ROBOTLIB_SPIREC=<file>, ROBOTLIB_SPIREPLAY=<file> ( see spi_set_transport() ).
+    @note Recording writes through stdio in the transfer path: it perturbs the timing it captures.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "xspidev.h"
+#include "xspidev_sim.h"
+#include "max1231adc.h"
+#include "util.h"
+
+static SPI_SIM_DEVICE* sim_devices = NULL; ///< Attached device models
+static uint64_t sim_clock_ns = 0; ///< Simulated bus time. Never behind the real clock
+static pthread_mutex_t sim_lock = PTHREAD_MUTEX_INITIALIZER; ///< Serializes the models and the clock
+
+/**
+* @brief Monotonic time in ns
+*/
+
+static uint64_t sim_now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000llu + ts.tv_nsec;
+}
+
+/* --- Simulated transport --- */
+
+/**
+* @brief Finds the model answering a device file
+*
+* @note Must be called with sim_lock held
+*/
+
+static SPI_SIM_DEVICE* sim_find_device(const char* device)
+{
+    SPI_SIM_DEVICE* d;
+
+    for( d = sim_devices ; d != NULL ; d = d->next )
+	if( strncmp(d->device, device, DEVBUFFERSIZE) == 0 )
+	    return d;
+
+    return NULL;
+}
+
+/**
+* @brief Transport open: binds the device to its model
+*/
+
+static int sim_open(XSPIDEV* xspi)
+{
+    pthread_mutex_lock(&sim_lock);
+    xspi->priv = sim_find_device(xspi->device);
+    pthread_mutex_unlock(&sim_lock);
+
+    if( xspi->priv == NULL ){
+	util_pdbg(DBG_WARN, "SPI_SIM: No model attached as %s\n", xspi->device);
+	return -ENODEV;
+    }
+
+    return 0;
+}
+
+static int sim_close(XSPIDEV* xspi)
+{
+    xspi->priv = NULL;
+
+    return 0;
+}
+
+/* Models take any configuration */
+static int sim_config(XSPIDEV* xspi)
+{
+    return 0;
+}
+
+/**
+* @brief Runs one segment through the model
+*
+* @note Must be called with sim_lock held
+*/
+
+static void sim_segment(SPI_SIM_DEVICE* dev, const uint8_t* tx, uint8_t* rx, unsigned len, uint32_t speed,
+			unsigned delay_us, int deselect)
+{
+    uint64_t byte_ns = 8000000000llu / (speed ? speed : SPI_DEFAULT_SPEED);
+    uint64_t start = sim_clock_ns;
+    uint8_t in;
+    unsigned i;
+
+    for( i = 0 ; i < len ; i++ ){
+	sim_clock_ns += byte_ns;
+	in = dev->exchange(dev, tx != NULL ? tx[i] : 0, sim_clock_ns);
+	if( rx != NULL )
+	    rx[i] = in;
+    }
+
+    sim_clock_ns += (uint64_t)delay_us * 1000;
+
+    if( deselect && dev->deselect != NULL )
+	dev->deselect(dev, sim_clock_ns);
+
+    dev->bus_ns += sim_clock_ns - start;
+}
+
+/**
+* @brief Brings the simulated clock up to the real one: the bus was idle meanwhile
+*
+* @note Must be called with sim_lock held
+*/
+
+static void sim_sync_clock()
+{
+    uint64_t now = sim_now_ns();
+
+    if( now > sim_clock_ns )
+	sim_clock_ns = now;
+}
+
+static int sim_message(XSPIDEV* xspi, struct spi_ioc_transfer* seg, unsigned num_of)
+{
+    SPI_SIM_DEVICE* dev = (SPI_SIM_DEVICE*)xspi->priv;
+    unsigned i, bytes = 0;
+
+    pthread_mutex_lock(&sim_lock);
+    sim_sync_clock();
+    for( i = 0 ; i < num_of ; i++ ){
+	sim_segment(dev, (const uint8_t*)(unsigned long)seg[i].tx_buf, (uint8_t*)(unsigned long)seg[i].rx_buf, seg[i].len,
+		    seg[i].speed_hz, seg[i].delay_usecs, seg[i].cs_change || i == num_of - 1);
+	bytes += seg[i].len;
+    }
+    pthread_mutex_unlock(&sim_lock);
+
+    return bytes;
+}
+
+static int sim_write(XSPIDEV* xspi, const uint8_t* data, unsigned len)
+{
+    pthread_mutex_lock(&sim_lock);
+    sim_sync_clock();
+    sim_segment((SPI_SIM_DEVICE*)xspi->priv, data, NULL, len, xspi->speed, 0, 1);
+    pthread_mutex_unlock(&sim_lock);
+
+    return len;
+}
+
+static int sim_read(XSPIDEV* xspi, uint8_t* data, unsigned len)
+{
+    pthread_mutex_lock(&sim_lock);
+    sim_sync_clock();
+    sim_segment((SPI_SIM_DEVICE*)xspi->priv, NULL, data, len, xspi->speed, 0, 1);
+    pthread_mutex_unlock(&sim_lock);
+
+    return len;
+}
+
+const SPI_TRANSPORT spi_transport_sim = {
+    .name = "sim",
+    .open = sim_open,
+    .close = sim_close,
+    .config = sim_config,
+    .message = sim_message,
+    .write = sim_write,
+    .read = sim_read,
+};
+
+/**
+* @brief Attaches a device model
+*
+* @param dev Model to attach, with its device file set. Must stay allocated until it is removed
+* @return 0 on success. Otherwise error.
+*
+* Devices opened on that file with the simulated transport are served by the model.
+*
+* @note This function is \b thread-safe.
+*/
+
+int spi_sim_add_device(SPI_SIM_DEVICE* dev)
+{
+    if( dev == NULL || dev->exchange == NULL || dev->device[0] == '\0' )
+	return -EINVAL;
+
+    pthread_mutex_lock(&sim_lock);
+    dev->next = sim_devices;
+    sim_devices = dev;
+    pthread_mutex_unlock(&sim_lock);
+
+    util_pdbg(DBG_DEBG, "SPI_SIM: Model %s as %s\n", dev->name, dev->device);
+
+    return 0;
+}
+
+/**
+* @brief Detaches a device model
+*
+* @param dev Model to detach. Devices bound to it must be cleaned first
+* @return 0 on success. -ENOENT if the model was not attached
+*
+* @note This function is \b thread-safe.
+*/
+
+int spi_sim_del_device(SPI_SIM_DEVICE* dev)
+{
+    SPI_SIM_DEVICE** d;
+    int err = -ENOENT;
+
+    pthread_mutex_lock(&sim_lock);
+    for( d = &sim_devices ; *d != NULL ; d = &((*d)->next) ){
+	if( *d == dev ){
+	    *d = dev->next;
+	    err = 0;
+	    break;
+	}
+    }
+    pthread_mutex_unlock(&sim_lock);
+
+    return err;
+}
+
+/* --- MAX1231 model --- */
+
+/**
+* @brief One sample of a channel: input plus noise, averaged as the averaging register says
+*/
+
+static uint16_t sim_max1231_sample(SPI_SIM_MAX1231* sim, unsigned ch, unsigned navg)
+{
+    int sum = 0, v;
+    unsigned k;
+
+    for( k = 0 ; k < navg ; k++ ){
+	v = sim->ain[ch];
+	if( sim->noise ){
+	    // xorshift32
+	    sim->seed ^= sim->seed << 13;
+	    sim->seed ^= sim->seed >> 17;
+	    sim->seed ^= sim->seed << 5;
+	    v += (int)(sim->seed % (2 * sim->noise + 1)) - (int)sim->noise;
+	}
+	sum += v < 0 ? 0 : ( v > 0xfff ? 0xfff : v );
+    }
+
+    return (uint16_t)(sum / navg);
+}
+
+/**
+* @brief Conversion register write: fills the FIFO and starts the conversion time
+*/
+
+static void sim_max1231_convert(SPI_SIM_MAX1231* sim, uint8_t cmd, uint64_t t_ns)
+{
+    unsigned ch = (cmd >> 3) & 0x0f;
+    unsigned navg = (sim->avg & 0x10) ? 4 << ((sim->avg >> 2) & 0x03) : 1;
+    unsigned first = ch, count = 1, i;
+    uint64_t conv = 0;
+
+    switch( (cmd >> 1) & 0x03 ){
+	case 0: first = 0; count = ch + 1; break; // 0 to N
+	case 1: count = SPI_SIM_MAX1231_CHANNELS - ch; break; // N to 15
+	case 2: count = 4 * ((sim->avg & 0x03) + 1); break; // N repeatedly
+	default: break; // N once
+    }
+
+    sim->fifo_len = 0;
+    sim->fifo_pos = 0;
+
+    if( cmd & MAX1231_CONV_TEMP & ~MAX1231_CONV ){ // 0x81 carries the conversion bit
+	sim->fifo[sim->fifo_len++] = (uint16_t)(sim->temp & 0xfff);
+	conv += SPI_SIM_MAX1231_TEMP_NS;
+    }
+
+    for( i = 0 ; i < count && sim->fifo_len < SPI_SIM_MAX1231_FIFO ; i++ )
+	sim->fifo[sim->fifo_len++] = sim_max1231_sample(sim, ((cmd >> 1) & 0x03) == 2 ? ch : first + i, navg);
+
+    conv += (uint64_t)count * navg * SPI_SIM_MAX1231_CONV_NS;
+    sim->ready_ns = t_ns + conv;
+    sim->conversions++;
+}
+
+/**
+* @brief Power-on state
+*/
+
+static void sim_max1231_por(SPI_SIM_MAX1231* sim)
+{
+    sim->setup = MAX1231_SETUP_POR;
+    sim->avg = MAX1231_AVERAGE_POR;
+    sim->unidiff = MAX1231_SETUP_UNIDIF_POR;
+    sim->bipdiff = MAX1231_SETUP_BIPDIF_POR;
+    sim->expect = 0;
+    sim->fifo_len = 0;
+    sim->fifo_pos = 0;
+}
+
+/* Commands decoded by their leading one. Zero bytes clock the FIFO out, MSB first */
+static uint8_t sim_max1231_exchange(SPI_SIM_DEVICE* dev, uint8_t tx, uint64_t t_ns)
+{
+    SPI_SIM_MAX1231* sim = (SPI_SIM_MAX1231*)dev->priv;
+    uint16_t r;
+
+    if( sim->expect ){
+	if( sim->expect == 1 )
+	    sim->unidiff = tx;
+	else
+	    sim->bipdiff = tx;
+	sim->expect = 0;
+	return 0;
+    }
+
+    if( tx & MAX1231_CONV ){
+	sim_max1231_convert(sim, tx, t_ns);
+	return 0;
+    }
+
+    if( tx & MAX1231_SETUP ){
+	sim->setup = tx;
+	if( (tx & 0x03) == (MAX1231_SETUP_UNIDIFF & 0x03) )
+	    sim->expect = 1;
+	else if( (tx & 0x03) == (MAX1231_SETUP_BIPDIFF & 0x03) )
+	    sim->expect = 2;
+	return 0;
+    }
+
+    if( tx & MAX1231_AVERAGE_POR ){
+	sim->avg = tx;
+	return 0;
+    }
+
+    if( tx & MAX1231_RESET_ALL ){
+	if( (tx & MAX1231_RESET_FIFO) == MAX1231_RESET_FIFO ){
+	    sim->fifo_len = 0;
+	    sim->fifo_pos = 0;
+	}else
+	    sim_max1231_por(sim);
+	return 0;
+    }
+
+    if( sim->fifo_pos >= 2 * sim->fifo_len )
+	return 0;
+
+    if( t_ns < sim->ready_ns ){
+	sim->early++;
+	sim->fifo_pos++;
+	return 0;
+    }
+
+    r = sim->fifo[sim->fifo_pos >> 1];
+
+    return (sim->fifo_pos++ & 1) ? (uint8_t)(r & 0xff) : (uint8_t)(r >> 8);
+}
+
+/**
+* @brief Attaches a MAX1231 model
+*
+* @param sim Model structure. Must stay allocated while attached
+* @param device Device file the ADC answers to ( e.g. /dev/spi0 )
+* @return 0 on success. Otherwise error.
+*
+* The model starts at its power-on state with every input at 0, no noise and 25 degrees. Set ain[], noise and
+* temp afterwards. Scans ( 0-N, N-15, repeat, single ), the temperature result, averaging and the FIFO behave as in
+* the datasheet; results clocked out before the conversion time are read as 0 and counted in 'early'.
+*
+* @note This function is \b thread-safe.
+*/
+
+int spi_sim_model_max1231(SPI_SIM_MAX1231* sim, const char* device)
+{
+    if( device == NULL || strlen(device) >= DEVBUFFERSIZE )
+	return -EINVAL;
+
+    memset(sim, 0, sizeof(SPI_SIM_MAX1231));
+    sim_max1231_por(sim);
+    sim->temp = 25 << MAX1231_TEMP_FRAC_BITS;
+    sim->seed = 0x1231;
+
+    sim->dev.name = "MAX1231";
+    strncpy(sim->dev.device, device, DEVBUFFERSIZE - 1);
+    sim->dev.device[DEVBUFFERSIZE - 1] = '\0';
+    sim->dev.exchange = sim_max1231_exchange;
+    sim->dev.priv = sim;
+
+    return spi_sim_add_device(&(sim->dev));
+}
+
+/* --- Record file format: big-endian on any host --- */
+
+static void rec_put32(uint8_t* p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static uint32_t rec_get32(const uint8_t* p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void rec_pack(uint8_t* p, const SPI_REC_RECORD* r)
+{
+    rec_put32(p, (uint32_t)(r->time_ns >> 32));
+    rec_put32(p + 4, (uint32_t)r->time_ns);
+    memcpy(p + 8, r->device, SPI_REC_DEVICE_SIZE);
+    p += 8 + SPI_REC_DEVICE_SIZE;
+    rec_put32(p, r->flags);
+    rec_put32(p + 4, r->len);
+    rec_put32(p + 8, r->delay_us);
+    rec_put32(p + 12, r->speed_hz);
+}
+
+static void rec_unpack(SPI_REC_RECORD* r, const uint8_t* p)
+{
+    r->time_ns = ((uint64_t)rec_get32(p) << 32) | rec_get32(p + 4);
+    memcpy(r->device, p + 8, SPI_REC_DEVICE_SIZE);
+    p += 8 + SPI_REC_DEVICE_SIZE;
+    r->flags = rec_get32(p);
+    r->len = rec_get32(p + 4);
+    r->delay_us = rec_get32(p + 8);
+    r->speed_hz = rec_get32(p + 12);
+}
+
+/* --- Record transport --- */
+
+static FILE* rec_file = NULL; ///< Record file. NULL when not recording
+static const SPI_TRANSPORT* rec_inner = NULL; ///< Transport doing the transfers
+static unsigned rec_records = 0; ///< Segments recorded
+static pthread_mutex_t rec_lock = PTHREAD_MUTEX_INITIALIZER; ///< Keeps the records of a message together
+
+/**
+* @brief Writes one segment
+*
+* @note Must be called with rec_lock held
+*/
+
+static void rec_segment(XSPIDEV* xspi, uint64_t t_ns, uint32_t flags, const uint8_t* tx, const uint8_t* rx,
+			unsigned len, unsigned delay_us, uint32_t speed)
+{
+    SPI_REC_RECORD r;
+    uint8_t buf[SPI_REC_RECORD_SIZE];
+    unsigned i;
+
+    memset(&r, 0, sizeof(r));
+    r.time_ns = t_ns;
+    strncpy(r.device, xspi->device, SPI_REC_DEVICE_SIZE - 1);
+    r.flags = flags;
+    r.len = len;
+    r.delay_us = delay_us;
+    r.speed_hz = speed ? speed : xspi->speed;
+
+    rec_pack(buf, &r);
+    fwrite(buf, 1, SPI_REC_RECORD_SIZE, rec_file);
+
+    // Missing buffers are recorded as the zeros that went over the wire
+    if( tx != NULL )
+	fwrite(tx, 1, len, rec_file);
+    else
+	for( i = 0 ; i < len ; i++ )
+	    fputc(0, rec_file);
+
+    if( rx != NULL )
+	fwrite(rx, 1, len, rec_file);
+    else
+	for( i = 0 ; i < len ; i++ )
+	    fputc(0, rec_file);
+
+    rec_records++;
+}
+
+static int rec_open(XSPIDEV* xspi)
+{
+    return rec_inner->open(xspi);
+}
+
+static int rec_close(XSPIDEV* xspi)
+{
+    return rec_inner->close(xspi);
+}
+
+static int rec_config(XSPIDEV* xspi)
+{
+    return rec_inner->config(xspi);
+}
+
+static int rec_message(XSPIDEV* xspi, struct spi_ioc_transfer* seg, unsigned num_of)
+{
+    uint64_t t = sim_now_ns();
+    unsigned i;
+    int ret;
+
+    if( (ret = rec_inner->message(xspi, seg, num_of)) < 0 )
+	return ret;
+
+    pthread_mutex_lock(&rec_lock);
+    if( rec_file != NULL )
+	for( i = 0 ; i < num_of ; i++ )
+	    rec_segment(xspi, t, SPI_REC_MESSAGE | (i == num_of - 1 ? SPI_REC_LAST : 0) | (seg[i].cs_change ? SPI_REC_CS_CHANGE : 0),
+			(const uint8_t*)(unsigned long)seg[i].tx_buf, (const uint8_t*)(unsigned long)seg[i].rx_buf,
+			seg[i].len, seg[i].delay_usecs, seg[i].speed_hz);
+    pthread_mutex_unlock(&rec_lock);
+
+    return ret;
+}
+
+static int rec_write(XSPIDEV* xspi, const uint8_t* data, unsigned len)
+{
+    uint64_t t = sim_now_ns();
+    int ret;
+
+    if( (ret = rec_inner->write(xspi, data, len)) < 0 )
+	return ret;
+
+    pthread_mutex_lock(&rec_lock);
+    if( rec_file != NULL )
+	rec_segment(xspi, t, SPI_REC_WRITE | SPI_REC_LAST, data, NULL, ret, 0, 0);
+    pthread_mutex_unlock(&rec_lock);
+
+    return ret;
+}
+
+static int rec_read(XSPIDEV* xspi, uint8_t* data, unsigned len)
+{
+    uint64_t t = sim_now_ns();
+    int ret;
+
+    if( (ret = rec_inner->read(xspi, data, len)) < 0 )
+	return ret;
+
+    pthread_mutex_lock(&rec_lock);
+    if( rec_file != NULL )
+	rec_segment(xspi, t, SPI_REC_READ | SPI_REC_LAST, NULL, data, ret, 0, 0);
+    pthread_mutex_unlock(&rec_lock);
+
+    return ret;
+}
+
+const SPI_TRANSPORT spi_transport_record = {
+    .name = "record",
+    .open = rec_open,
+    .close = rec_close,
+    .config = rec_config,
+    .message = rec_message,
+    .write = rec_write,
+    .read = rec_read,
+};
+
+/**
+* @brief Starts recording the SPI traffic
+*
+* @param filename File to write
+* @param inner Transport that does the transfers. NULL for spi_transport_spidev
+* @return 0 on success. Otherwise error.
+*
+* Selects spi_transport_record for the devices initialized from now on. Every segment is written with its start time,
+* device, flags, tx and rx bytes ( SPI_REC_RECORD ), ready for spi_replay_start(). The file is big-endian, so a
+* record made on the board replays on any host.
+*
+* @note This function is \b NOT thread-safe. The user should guarantee somewhere else that is not called in several instances
+*       for the same resource.
+*/
+
+int spi_record_start(const char* filename, const SPI_TRANSPORT* inner)
+{
+    uint8_t h[SPI_REC_HEADER_SIZE];
+
+    if( rec_file != NULL )
+	return -EBUSY;
+
+    if( (rec_file = fopen(filename, "wb")) == NULL ){
+	util_pdbg(DBG_WARN, "SPI_SIM: Can't open record file %s\n", filename);
+	return -ENOENT;
+    }
+
+    rec_put32(h, SPI_REC_MAGIC);
+    rec_put32(h + 4, SPI_REC_RECORD_SIZE);
+    fwrite(h, 1, SPI_REC_HEADER_SIZE, rec_file);
+
+    rec_inner = inner != NULL ? inner : &spi_transport_spidev;
+    rec_records = 0;
+
+    util_pdbg(DBG_INFO, "SPI_SIM: Recording %s traffic into %s\n", rec_inner->name, filename);
+
+    return spi_set_transport(&spi_transport_record);
+}
+
+/**
+* @brief Stops recording
+*
+* @return 0 on success. Otherwise error.
+*
+* Devices initialized while recording keep transferring through the inner transport, unrecorded.
+*
+* @note This function is \b thread-safe.
+*/
+
+int spi_record_stop()
+{
+    pthread_mutex_lock(&rec_lock);
+
+    if( rec_file == NULL ){
+	pthread_mutex_unlock(&rec_lock);
+	return -EINVAL;
+    }
+
+    fclose(rec_file);
+    rec_file = NULL;
+
+    pthread_mutex_unlock(&rec_lock);
+
+    util_pdbg(DBG_INFO, "SPI_SIM: Recording stopped. %u segments\n", rec_records);
+
+    return 0;
+}
+
+/* --- Replay transport --- */
+
+static uint8_t* rep_data = NULL; ///< Whole record file
+static size_t rep_size = 0; ///< Its size
+static unsigned rep_replayed = 0; ///< Segments answered
+static unsigned rep_mismatched = 0; ///< Transfers that did not match the record
+static pthread_mutex_t rep_lock = PTHREAD_MUTEX_INITIALIZER; ///< Protects the cursors and counters
+
+/**
+* @brief Next record of the device, from its cursor on
+*
+* @param xspi Device
+* @param r Decoded record
+* @return Its tx bytes, followed by its rx bytes. NULL if there are no more records of the device
+*
+* @note Must be called with rep_lock held
+*/
+
+static const uint8_t* rep_next(XSPIDEV* xspi, SPI_REC_RECORD* r)
+{
+    size_t* cursor = (size_t*)xspi->priv;
+    const uint8_t* p;
+
+    while( *cursor + SPI_REC_RECORD_SIZE <= rep_size ){
+	p = rep_data + *cursor;
+	rec_unpack(r, p); // records are not aligned after odd tx/rx lengths
+	if( 2 * (size_t)r->len > rep_size - *cursor - SPI_REC_RECORD_SIZE )
+	    break;
+	*cursor += SPI_REC_RECORD_SIZE + 2 * (size_t)r->len;
+	if( strncmp(r->device, xspi->device, SPI_REC_DEVICE_SIZE) == 0 )
+	    return p + SPI_REC_RECORD_SIZE;
+    }
+
+    return NULL;
+}
+
+/**
+* @brief Answers one segment from the record
+*
+* @note Must be called with rep_lock held
+*/
+
+static int rep_segment(XSPIDEV* xspi, uint32_t type, const uint8_t* tx, uint8_t* rx, unsigned len)
+{
+    SPI_REC_RECORD r;
+    const uint8_t* rtx;
+    unsigned i;
+
+    if( (rtx = rep_next(xspi, &r)) == NULL ){
+	util_pdbg(DBG_WARN, "SPI_SIM: Replay of %s exhausted\n", xspi->device);
+	return -ENODATA;
+    }
+
+    if( (r.flags & type) == 0 || r.len != len ){
+	util_pdbg(DBG_WARN, "SPI_SIM: %s: recorded 0x%x/%u, asked 0x%x/%u\n", xspi->device, r.flags, r.len, type, len);
+	rep_mismatched++;
+	return -EIO;
+    }
+
+    for( i = 0 ; i < len ; i++ )
+	if( rtx[i] != (tx != NULL ? tx[i] : 0) ){
+	    util_pdbg(DBG_WARN, "SPI_SIM: %s: byte %u is 0x%x, recorded 0x%x\n", xspi->device, i, tx != NULL ? tx[i] : 0, rtx[i]);
+	    rep_mismatched++;
+	    return -EIO;
+	}
+
+    if( rx != NULL )
+	memcpy(rx, rtx + len, len);
+
+    rep_replayed++;
+
+    return len;
+}
+
+static int rep_open(XSPIDEV* xspi)
+{
+    if( (xspi->priv = malloc(sizeof(size_t))) == NULL )
+	return -ENOMEM;
+
+    *(size_t*)xspi->priv = SPI_REC_HEADER_SIZE;
+
+    return 0;
+}
+
+static int rep_close(XSPIDEV* xspi)
+{
+    free(xspi->priv);
+    xspi->priv = NULL;
+
+    return 0;
+}
+
+/* The record holds what the device answered with its configuration */
+static int rep_config(XSPIDEV* xspi)
+{
+    return 0;
+}
+
+static int rep_message(XSPIDEV* xspi, struct spi_ioc_transfer* seg, unsigned num_of)
+{
+    unsigned i;
+    int ret = 0, bytes = 0;
+
+    pthread_mutex_lock(&rep_lock);
+    for( i = 0 ; i < num_of && ret >= 0 ; i++ ){
+	ret = rep_segment(xspi, SPI_REC_MESSAGE, (const uint8_t*)(unsigned long)seg[i].tx_buf,
+			  (uint8_t*)(unsigned long)seg[i].rx_buf, seg[i].len);
+	bytes += ret;
+    }
+    pthread_mutex_unlock(&rep_lock);
+
+    return ret < 0 ? ret : bytes;
+}
+
+static int rep_write(XSPIDEV* xspi, const uint8_t* data, unsigned len)
+{
+    int ret;
+
+    pthread_mutex_lock(&rep_lock);
+    ret = rep_segment(xspi, SPI_REC_WRITE, data, NULL, len);
+    pthread_mutex_unlock(&rep_lock);
+
+    return ret;
+}
+
+static int rep_read(XSPIDEV* xspi, uint8_t* data, unsigned len)
+{
+    int ret;
+
+    pthread_mutex_lock(&rep_lock);
+    ret = rep_segment(xspi, SPI_REC_READ, NULL, data, len);
+    pthread_mutex_unlock(&rep_lock);
+
+    return ret;
+}
+
+const SPI_TRANSPORT spi_transport_replay = {
+    .name = "replay",
+    .open = rep_open,
+    .close = rep_close,
+    .config = rep_config,
+    .message = rep_message,
+    .write = rep_write,
+    .read = rep_read,
+};
+
+/**
+* @brief Starts replaying a record
+*
+* @param filename File written by spi_record_start()
+* @return 0 on success. Otherwise error.
+*
+* Selects spi_transport_replay for the devices initialized from now on. Each device walks the records of its
+* device file in order: what it sends must match what was recorded ( -EIO otherwise ) and it receives the recorded
+* answer. The recorded times are not reproduced.
+*
+* @note This function is \b NOT thread-safe. The user should guarantee somewhere else that is not called in several instances
+*       for the same resource.
+*/
+
+int spi_replay_start(const char* filename)
+{
+    FILE* f;
+    long size;
+
+    if( rep_data != NULL )
+	return -EBUSY;
+
+    if( (f = fopen(filename, "rb")) == NULL ){
+	util_pdbg(DBG_WARN, "SPI_SIM: Can't open record file %s\n", filename);
+	return -ENOENT;
+    }
+
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    if( size < SPI_REC_HEADER_SIZE || (rep_data = malloc(size)) == NULL || fread(rep_data, 1, size, f) != (size_t)size ){
+	util_pdbg(DBG_WARN, "SPI_SIM: Can't read record file %s\n", filename);
+	free(rep_data);
+	rep_data = NULL;
+	fclose(f);
+	return -EIO;
+    }
+
+    fclose(f);
+
+    if( rec_get32(rep_data) != SPI_REC_MAGIC || rec_get32(rep_data + 4) != SPI_REC_RECORD_SIZE ){
+	util_pdbg(DBG_WARN, "SPI_SIM: %s is not a record file of this version\n", filename);
+	free(rep_data);
+	rep_data = NULL;
+	return -EINVAL;
+    }
+
+    rep_size = size;
+    rep_replayed = 0;
+    rep_mismatched = 0;
+
+    util_pdbg(DBG_INFO, "SPI_SIM: Replaying %s\n", filename);
+
+    return spi_set_transport(&spi_transport_replay);
+}
+
+/**
+* @brief Stops replaying and frees the record
+*
+* @return 0 on success. Otherwise error.
+*
+* @note Devices using the replay transport must be cleaned first.
+*
+* @note This function is \b NOT thread-safe. The user should guarantee somewhere else that is not called in several instances
+*       for the same resource.
+*/
+
+int spi_replay_stop()
+{
+    if( rep_data == NULL )
+	return -EINVAL;
+
+    free(rep_data);
+    rep_data = NULL;
+    rep_size = 0;
+
+    util_pdbg(DBG_INFO, "SPI_SIM: Replay stopped. %u segments, %u mismatches\n", rep_replayed, rep_mismatched);
+
+    return 0;
+}
+
+/**
+* @brief Replay counters
+*
+* @param replayed Segments answered from the record
+* @param mismatched Transfers that did not match it
+*
+* @note This function is \b thread-safe.
+*/
+
+void spi_replay_stats(unsigned* replayed, unsigned* mismatched)
+{
+    pthread_mutex_lock(&rep_lock);
+    *replayed = rep_replayed;
+    *mismatched = rep_mismatched;
+    pthread_mutex_unlock(&rep_lock);
+}
@@ -0,0 +1,105 @@
+/**
+    @file xspidev_sim.h
+
+    @section DESCRIPTION
+
+    Robotics library for the Autonomous Robotics Development Platform
+
+    @brief [HEADER] Simulated SPI devices and record/replay transports for running the SPI drivers off-board
+
+*/
+
+#ifndef __XSPIDEV_SIM_H__
+#define __XSPIDEV_SIM_H__
+
+#include <stdint.h>
+#include "xspidev.h"
+
+extern const SPI_TRANSPORT spi_transport_sim; ///< In-process device models
+extern const SPI_TRANSPORT spi_transport_record; ///< Another transport, with its traffic written to a file
+extern const SPI_TRANSPORT spi_transport_replay; ///< Answers from a recorded file
+
+/*! SPI device model. Answers the transfers to the device file it is attached as */
+typedef struct spi_sim_device{
+    const char* name; ///< Model name (debugging)
+    char device[DEVBUFFERSIZE]; ///< Device file it answers to ( e.g. /dev/spi0 )
+    uint8_t (*exchange)(struct spi_sim_device* dev, uint8_t tx, uint64_t t_ns); ///< One byte in, one byte out, at simulated time t_ns
+    void (*deselect)(struct spi_sim_device* dev, uint64_t t_ns); ///< CS released. NULL if not needed
+    void* priv; ///< Model private data
+    uint64_t bus_ns; ///< Simulated bus time spent on the device: bytes and delays
+    struct spi_sim_device* next; ///< Next model in the list
+} SPI_SIM_DEVICE;
+
+/* MAX1231 model */
+#define SPI_SIM_MAX1231_CHANNELS 16 /*! Analog inputs */
+#define SPI_SIM_MAX1231_FIFO (SPI_SIM_MAX1231_CHANNELS + 1) /*! Results + temperature */
+#define SPI_SIM_MAX1231_CONV_NS 8600 /*! One conversion, internal clock */
+#define SPI_SIM_MAX1231_TEMP_NS 55000 /*! Temperature conversion, reference wake-up included */
+
+/*! MAX1231 ADC model: scan modes, averaging, repeat and the result FIFO, with conversion times */
+typedef struct{
+    SPI_SIM_DEVICE dev; ///< Model over the device file
+    uint16_t ain[SPI_SIM_MAX1231_CHANNELS]; ///< Input of each channel, in LSB
+    unsigned noise; ///< Peak uniform noise added to each sample, in LSB. Averaging reduces it
+    int temp; ///< Die temperature in 1/8 degree
+    uint8_t setup; ///< Setup register
+    uint8_t avg; ///< Averaging register
+    uint8_t unidiff; ///< Unipolar differential pairs. Stored only: conversions are single-ended
+    uint8_t bipdiff; ///< Bipolar differential pairs. Stored only
+    int expect; ///< Next byte is a differential configuration: 1 unipolar, 2 bipolar
+    uint16_t fifo[SPI_SIM_MAX1231_FIFO]; ///< Results, 12 bits right justified
+    unsigned fifo_len; ///< Results in the FIFO
+    unsigned fifo_pos; ///< Next byte to clock out
+    uint64_t ready_ns; ///< End of the running conversion
+    uint32_t seed; ///< Noise generator state
+    unsigned long conversions; ///< Conversion commands
+    unsigned long early; ///< Bytes clocked out before the conversion was done ( read as 0 )
+} SPI_SIM_MAX1231;
+
+/* Record file */
+#define SPI_REC_MAGIC 0x52535052 /*! "RSPR" File header magic */
+#define SPI_REC_MESSAGE 0x01 /*! Segment of a full duplex message */
+#define SPI_REC_WRITE 0x02 /*! Half duplex write */
+#define SPI_REC_READ 0x04 /*! Half duplex read */
+#define SPI_REC_LAST 0x10 /*! Last segment of its message */
+#define SPI_REC_CS_CHANGE 0x20 /*! cs_change was set */
+#define SPI_REC_DEVICE_SIZE 32 /*! Device name field */
+#define SPI_REC_HEADER_SIZE 8 /*! Header bytes in the file */
+#define SPI_REC_RECORD_SIZE (8 + SPI_REC_DEVICE_SIZE + 4 * 4) /*! Record bytes in the file, without the tx/rx bytes */
+
+/*! One recorded segment. Followed in the file by 'len' tx bytes and 'len' rx bytes. 
+    In the file every field is big-endian and packed, in this order, so records move between hosts */
+typedef struct{
+    uint64_t time_ns; ///< Start of the transfer
+    char device[SPI_REC_DEVICE_SIZE]; ///< Device file
+    uint32_t flags; ///< SPI_REC_*
+    uint32_t len; ///< Bytes in the segment
+    uint32_t delay_us; ///< Delay after the segment
+    uint32_t speed_hz; ///< Clock
+} SPI_REC_RECORD;
+
+/*! Record file header */
+typedef struct{
+    uint32_t magic; ///< SPI_REC_MAGIC
+    uint32_t record_size; ///< SPI_REC_RECORD_SIZE
+} SPI_REC_HEADER;
+
+int spi_sim_add_device(SPI_SIM_DEVICE* dev);
+
+int spi_sim_del_device(SPI_SIM_DEVICE* dev);
+
+/* Built-in models */
+int spi_sim_model_max1231(SPI_SIM_MAX1231* sim, const char* device);
+
+/* Record / replay */
+int spi_record_start(const char* filename, const SPI_TRANSPORT* inner);
+
+int spi_record_stop();
+
+int spi_replay_start(const char* filename);
+
+int spi_replay_stop();
+
+void spi_replay_stats(unsigned* replayed, unsigned* mismatched);
+
+#endif
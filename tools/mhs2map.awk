@@ -0,0 +1,44 @@
+# Bootstraps the core lines of src/platform.map from an EDK .mhs file
+#
+#   awk -f tools/mhs2map.awk system.mhs > platform.map.new
+#
+# xps_gpio instances become "gpio" lines ( IRQ and VAR left as '-' ), every other core with a
+# C_BASEADDR/C_HIGHADDR pair becomes a "core" line. Muxed fields are wiring inside the bitstream and
+# do not appear in the .mhs: carry the "field" lines over from the current platform.map.
+
+function emit(    name)
+{
+    if (base == "" || high == "")
+	return
+    name = toupper(inst)
+    if (ip == "xps_gpio")
+	printf "gpio   %-18s %s %s %d %-2d -  -\n", name, tolower(base), tolower(high), dual ? 2 : 1, width
+    else
+	printf "core   %-18s %s %s 1\n", name, tolower(base), tolower(high)
+}
+
+BEGIN { FS = "[ \t]*=[ \t]*|[ \t]+" }
+
+/^[ \t]*#/ { next }
+
+toupper($1) == "BEGIN" {
+    ip = $2; inst = ""; base = ""; high = ""; width = 32; dual = 0
+    next
+}
+
+toupper($1) == "PARAMETER" || (toupper($1) == "" && toupper($2) == "PARAMETER") {
+    for (i = 1; i < NF; i++) {
+	key = toupper($i)
+	if (key == "INSTANCE") inst = $(i + 1)
+	if (key == "C_BASEADDR") base = $(i + 1)
+	if (key == "C_HIGHADDR") high = $(i + 1)
+	if (key == "C_GPIO_WIDTH") width = $(i + 1)
+	if (key == "C_IS_DUAL") dual = $(i + 1)
+    }
+    next
+}
+
+toupper($1) == "END" || (toupper($1) == "" && toupper($2) == "END") {
+    emit()
+    ip = ""
+}
@@ -0,0 +1,243 @@
+# Generates the platform headers from src/platform.map
+#
+#   awk -v out=map -f tools/mkplatform.awk src/platform.map > src/platform_map.h
+#   awk -v out=pio -f tools/mkplatform.awk src/platform.map > src/platform_pio.h
+#   awk -v out=core -f tools/mkplatform.awk src/platform.map > src/platform_core.h
+#
+# out=map: BASE/END/NUM_OF/MASK/SHIFT/WIDTH defines ( included by dev_mmaps_parms.h )
+# out=pio: static inline accessors for every GPIO field ( included by platform_io.h )
+# out=core: static inline accessors for every register field of the IP cores ( included by the core drivers )
+
+function hex(v,    s, d)
+{
+    s = ""
+    do {
+	d = v % 16
+	s = substr("0123456789abcdef", d + 1, 1) s
+	v = (v - d) / 16
+    } while (v > 0)
+    while (length(s) < 5)
+	s = "0" s
+    return "0x" s
+}
+
+function define(name, value)
+{
+    printf "#define %-32s %s\n", name, value
+}
+
+function accessor(kind, f, reg,    fn)
+{
+    fn = "pio_" kind "_" tolower(fgpio[f]) "_" tolower(fname[f])
+    if (kind == "get") {
+	printf "static inline int %s(unsigned* ret)\n{\n", fn
+	printf "    return gpio_read(&%s, %s_MASK, %s_SHIFT, %s(%s_CHAN), ret);\n}\n\n", gvar[fgpio[f]], f, f, reg, f
+    } else {
+	printf "static inline int %s(unsigned value)\n{\n", fn
+	printf "    return gpio_write(&%s, %s_MASK, %s_SHIFT, %s(%s_CHAN), value);\n}\n\n", gvar[fgpio[f]], f, f, reg, f
+    }
+}
+
+function core_accessor(kind, r,    fn, off)
+{
+    fn = "core_" kind "_" tolower(rcore[r]) "_" tolower(rname[r])
+    off = r "_WORD + n * " r "_STRIDE"
+    if (kind == "get") {
+	printf "static inline unsigned %s(volatile int* vadd, unsigned n)\n{\n", fn
+	printf "    return ((unsigned)busio_read(vadd, %s) & %s_MASK) >> %s_SHIFT;\n}\n\n", off, r, r
+    } else if (rshared[r]) {
+	printf "static inline void %s(volatile int* vadd, unsigned n, unsigned value)\n{\n", fn
+	printf "    unsigned off = %s;\n\n", off
+	printf "    busio_write(vadd, off, ((unsigned)busio_read(vadd, off) & ~%s_MASK) | ((value << %s_SHIFT) & %s_MASK));\n}\n\n", r, r, r
+    } else {
+	printf "static inline void %s(volatile int* vadd, unsigned n, unsigned value)\n{\n", fn
+	printf "    busio_write(vadd, %s, (value << %s_SHIFT) & %s_MASK);\n}\n\n", off, r, r
+    }
+}
+
+/^[ \t]*(#|$)/ { next }
+
+$1 == "window" {
+    nwin++; win[nwin] = $2; wbase[$2] = $3; wend[$2] = $4
+    next
+}
+
+$1 == "gpio" {
+    ngpio++; gpio[ngpio] = $2
+    gbase[$2] = $3; gend[$2] = $4; gchan[$2] = $5; gwidth[$2] = $6; girq[$2] = $7; gvar[$2] = $8
+    next
+}
+
+$1 == "field" {
+    if (!($2 in gbase)) {
+	printf "%s:%d: field of unknown gpio %s\n", FILENAME, FNR, $2 > "/dev/stderr"
+	exit 1
+    }
+    f = $2 "_" $3
+    nfield++; field[nfield] = f
+    fgpio[f] = $2; fname[f] = $3; fchan[f] = $4; fshift[f] = $5; fwidth[f] = $6; fdir[f] = $7
+    fmask[f] = (2 ^ $6 - 1) * 2 ^ $5
+    next
+}
+
+$1 == "core" {
+    ncore++; core[ncore] = $2; cbase[$2] = $3; cend[$2] = $4; cnum[$2] = $5
+    next
+}
+
+$1 == "reg" {
+    if (!($2 in cbase)) {
+	printf "%s:%d: register of unknown core %s\n", FILENAME, FNR, $2 > "/dev/stderr"
+	exit 1
+    }
+    r = $2 "_" $3
+    nreg++; reg[nreg] = r
+    rcore[r] = $2; rname[r] = $3; rword[r] = $4; rstride[r] = $5; rshift[r] = $6; rwidth[r] = $7; rdir[r] = $8
+    rmask[r] = (2 ^ $7 - 1) * 2 ^ $6
+    if ($8 == "out" || $8 == "io")
+	wmask[$2 SUBSEP $4 SUBSEP $5] += rmask[r] # bits written in that register
+    next
+}
+
+{
+    printf "%s:%d: unknown entry '%s'\n", FILENAME, FNR, $1 > "/dev/stderr"
+    exit 1
+}
+
+END {
+    if (out == "map") {
+	print "/**"
+	print "    @file platform_map.h"
+	print ""
+	print "    @section DESCRIPTION"
+	print ""
+	print "    Robotics library for the Autonomous Robotics Development Platform"
+	print ""
+	print "    @brief [HEADER] Addresses and masks of the platform peripherals"
+	print ""
+	print "    @note GENERATED from platform.map by tools/mkplatform.awk ( make platform ). Do not edit"
+	print ""
+	print "*/"
+	print ""
+	print "#ifndef __PLATFORM_MAP_H__"
+	print "#define __PLATFORM_MAP_H__"
+
+	print "\n/** Bus windows **/\n"
+	for (i = 1; i <= nwin; i++) {
+	    define(win[i] "_BASE", wbase[win[i]])
+	    define(win[i] "_END", wend[win[i]])
+	}
+
+	print "\n/** GPIOs **/"
+	for (i = 1; i <= ngpio; i++) {
+	    g = gpio[i]
+	    print ""
+	    define(g "_BASE", gbase[g])
+	    define(g "_END", gend[g])
+	    define(g "_NUM_OF_CHAN", gchan[g])
+	    define(g "_NUM_OF_GPIO", gwidth[g])
+	    if (girq[g] != "-")
+		define(g "_IRQ_NO", girq[g])
+	    for (j = 1; j <= nfield; j++) {
+		f = field[j]
+		if (fgpio[f] != g)
+		    continue
+		define(f "_MASK", hex(fmask[f]))
+		define(f "_SHIFT", fshift[f])
+		define(f "_WIDTH", fwidth[f])
+		define(f "_CHAN", fchan[f])
+	    }
+	}
+
+	print "\n/** IP cores **/"
+	for (i = 1; i <= ncore; i++) {
+	    c = core[i]
+	    print ""
+	    define(c "_BASE", cbase[c])
+	    define(c "_END", cend[c])
+	    define(c "_NUM_OF", cnum[c])
+	    for (j = 1; j <= nreg; j++) {
+		r = reg[j]
+		if (rcore[r] != c)
+		    continue
+		define(r "_WORD", rword[r])
+		define(r "_STRIDE", rstride[r])
+		define(r "_MASK", hex(rmask[r]))
+		define(r "_SHIFT", rshift[r])
+		define(r "_WIDTH", rwidth[r])
+	    }
+	}
+
+	print "\n#endif"
+    }
+
+    if (out == "pio") {
+	print "/**"
+	print "    @file platform_pio.h"
+	print ""
+	print "    @section DESCRIPTION"
+	print ""
+	print "    Robotics library for the Autonomous Robotics Development Platform"
+	print ""
+	print "    @brief [HEADER] Accessors for every GPIO field of the platform. Masks and shifts fold into the calls"
+	print ""
+	print "    @note GENERATED from platform.map by tools/mkplatform.awk ( make platform ). Do not edit"
+	print ""
+	print "*/"
+	print ""
+	print "#ifndef __PLATFORM_PIO_H__"
+	print "#define __PLATFORM_PIO_H__"
+	print ""
+	print "#include \"gpio.h\""
+	print "#include \"platform_map.h\""
+	print ""
+	for (i = 1; i <= ngpio; i++)
+	    if (gvar[gpio[i]] != "-")
+		print "extern GPIO " gvar[gpio[i]] "; ///< " gpio[i]
+	print ""
+	for (j = 1; j <= nfield; j++) {
+	    f = field[j]
+	    if (gvar[fgpio[f]] == "-")
+		continue
+	    if (fdir[f] == "in" || fdir[f] == "io")
+		accessor("get", f, "GPIO_DATA")
+	    if (fdir[f] == "out" || fdir[f] == "io")
+		accessor("set", f, "GPIO_DATA")
+	    if (fdir[f] == "io")
+		accessor("setdir", f, "GPIO_TRISTATE")
+	}
+	print "#endif"
+    }
+
+    if (out == "core") {
+	print "/**"
+	print "    @file platform_core.h"
+	print ""
+	print "    @section DESCRIPTION"
+	print ""
+	print "    Robotics library for the Autonomous Robotics Development Platform"
+	print ""
+	print "    @brief [HEADER] Accessors for every register field of the IP cores. Instance n of a register is at word"
+	print "           WORD + n * STRIDE of the mapping of its core. Offsets, masks and shifts fold into the bus access"
+	print ""
+	print "    @note GENERATED from platform.map by tools/mkplatform.awk ( make platform ). Do not edit"
+	print ""
+	print "*/"
+	print ""
+	print "#ifndef __PLATFORM_CORE_H__"
+	print "#define __PLATFORM_CORE_H__"
+	print ""
+	print "#include \"busio.h\""
+	print "#include \"platform_map.h\""
+	print ""
+	for (j = 1; j <= nreg; j++) {
+	    r = reg[j]
+	    rshared[r] = (wmask[rcore[r] SUBSEP rword[r] SUBSEP rstride[r]] != rmask[r])
+	    if (rdir[r] == "in" || rdir[r] == "io")
+		core_accessor("get", r)
+	    if (rdir[r] == "out" || rdir[r] == "io")
+		core_accessor("set", r)
+	}
+	print "#endif"
+    }
+}